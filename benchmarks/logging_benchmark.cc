@@ -0,0 +1,63 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/logging.h"
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+
+namespace {
+
+// Log a message with a few arguments to /dev/null.  The arguments select
+// async mode and binary mode.
+void BM_Logger(benchmark::State &state) {
+  bool async = state.range(0) != 0;
+  bool binary = state.range(1) != 0;
+  FILE *out = fopen("/dev/null", "w");
+  if (out == nullptr) {
+    state.SkipWithError("can't open /dev/null");
+    return;
+  }
+  {
+    toolbelt::Logger logger("bench");
+    logger.SetOutputStream(out);
+    logger.SetBinary(binary);
+    if (async && !logger.SetAsync(1024, toolbelt::LogOverflowPolicy::kBlock)
+                      .ok()) {
+      state.SkipWithError("can't start async logging");
+      return;
+    }
+    int i = 0;
+    for (auto _ : state) {
+      if (binary) {
+        logger.BinaryLog(toolbelt::LogLevel::kInfo,
+                         "message %d from %s took %f seconds", i++, "bench",
+                         1.5);
+      } else {
+        logger.Log(toolbelt::LogLevel::kInfo,
+                   "message %d from %s took %f seconds", i++, "bench", 1.5);
+      }
+    }
+    // Include the time to drain the queue.
+    logger.Flush();
+  }
+  fclose(out);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Logger)
+    ->ArgNames({"async", "binary"})
+    ->ArgsProduct({{0, 1}, {0, 1}})
+    ->UseRealTime();
+
+// A message below the log level.
+void BM_LoggerDisabled(benchmark::State &state) {
+  toolbelt::Logger logger("bench");
+  logger.SetLogLevel(toolbelt::LogLevel::kError);
+  for (auto _ : state) {
+    TOOLBELT_LOG(logger, toolbelt::LogLevel::kDebug, "message %d", 1);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LoggerDisabled);
+
+} // namespace
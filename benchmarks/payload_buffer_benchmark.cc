@@ -0,0 +1,150 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/payload_buffer.h"
+#include <benchmark/benchmark.h>
+#include <stdlib.h>
+#include <vector>
+
+using PayloadBuffer = toolbelt::PayloadBuffer;
+using BufferOffset = toolbelt::BufferOffset;
+using VectorHeader = toolbelt::VectorHeader;
+
+namespace {
+
+constexpr uint32_t kBufferSize = 4 * 1024 * 1024;
+
+// A resizable buffer on the heap.
+struct Buffer {
+  explicit Buffer(uint32_t size, bool bitmap_allocator = true,
+                  bool binned_free_list = false) {
+    pb = new (malloc(size)) PayloadBuffer(
+        size,
+        [](PayloadBuffer **p, size_t old_size, size_t new_size) {
+          *p = reinterpret_cast<PayloadBuffer *>(realloc(*p, new_size));
+        },
+        bitmap_allocator, binned_free_list);
+  }
+  ~Buffer() {
+    pb->~PayloadBuffer();
+    free(pb);
+  }
+  PayloadBuffer *pb;
+};
+
+// Fill the buffer with blocks of assorted sizes and free every other one
+// so that the free list is long.
+void Fragment(PayloadBuffer **pb, int num_blocks) {
+  std::vector<void *> blocks;
+  for (int i = 0; i < num_blocks; i++) {
+    blocks.push_back(
+        PayloadBuffer::Allocate(pb, 64 + (i % 13) * 24, 8, false, false));
+  }
+  for (int i = 0; i < num_blocks; i += 2) {
+    (*pb)->Free(blocks[i]);
+  }
+}
+
+// Allocate and free a block of state.range(0) bytes in a fragmented buffer.
+// state.range(1) is the number of blocks allocated before half of them are
+// freed.
+void AllocateFree(benchmark::State &state, bool binned) {
+  Buffer buffer(kBufferSize, false, binned);
+  Fragment(&buffer.pb, int(state.range(1)));
+  uint32_t size = uint32_t(state.range(0));
+  for (auto _ : state) {
+    void *p = PayloadBuffer::Allocate(&buffer.pb, size, 8, false, false);
+    benchmark::DoNotOptimize(p);
+    buffer.pb->Free(p);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_FirstFitAllocateFree(benchmark::State &state) {
+  AllocateFree(state, false);
+}
+BENCHMARK(BM_FirstFitAllocateFree)
+    ->ArgsProduct({{64, 256, 4096}, {0, 1000, 10000}});
+
+void BM_BinnedAllocateFree(benchmark::State &state) {
+  AllocateFree(state, true);
+}
+BENCHMARK(BM_BinnedAllocateFree)
+    ->ArgsProduct({{64, 256, 4096}, {0, 1000, 10000}});
+
+// Small blocks from the bitmap allocator compared with the free list.
+void SmallBlocks(benchmark::State &state, bool bitmap) {
+  Buffer buffer(kBufferSize, bitmap);
+  uint32_t size = uint32_t(state.range(0));
+  std::vector<void *> blocks(64);
+  for (auto _ : state) {
+    for (auto &b : blocks) {
+      b = PayloadBuffer::Allocate(&buffer.pb, size, 8, false, bitmap);
+    }
+    for (auto &b : blocks) {
+      buffer.pb->Free(b);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * blocks.size());
+}
+
+void BM_SmallBlockBitmap(benchmark::State &state) { SmallBlocks(state, true); }
+BENCHMARK(BM_SmallBlockBitmap)->Arg(16)->Arg(32)->Arg(64);
+
+void BM_SmallBlockFreeList(benchmark::State &state) {
+  SmallBlocks(state, false);
+}
+BENCHMARK(BM_SmallBlockFreeList)->Arg(16)->Arg(32)->Arg(64);
+
+// Grow a block a bit at a time up to state.range(0) bytes.
+void BM_Realloc(benchmark::State &state) {
+  Buffer buffer(kBufferSize);
+  Fragment(&buffer.pb, 1000);
+  uint32_t limit = uint32_t(state.range(0));
+  for (auto _ : state) {
+    void *p = PayloadBuffer::Allocate(&buffer.pb, 16, 8, false);
+    for (uint32_t size = 32; size <= limit; size += size / 2) {
+      p = PayloadBuffer::Realloc(&buffer.pb, p, size, 8, false);
+    }
+    buffer.pb->Free(p);
+  }
+}
+BENCHMARK(BM_Realloc)->Arg(256)->Arg(4096)->Arg(65536);
+
+// Push state.range(0) integers onto a vector in a new message.
+void BM_VectorPush(benchmark::State &state) {
+  Buffer buffer(4096);
+  int n = int(state.range(0));
+  for (auto _ : state) {
+    buffer.pb->Reset();
+    PayloadBuffer::AllocateMainMessage(&buffer.pb, sizeof(VectorHeader));
+    BufferOffset msg = buffer.pb->message;
+    for (int i = 0; i < n; i++) {
+      PayloadBuffer::VectorPush<uint32_t>(
+          &buffer.pb, buffer.pb->ToAddress<VectorHeader>(msg), i);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.SetBytesProcessed(state.iterations() * n * sizeof(uint32_t));
+}
+BENCHMARK(BM_VectorPush)->Arg(16)->Arg(1000)->Arg(100000);
+
+// Replace a string with one of a different length, freeing the old one.
+void BM_SetString(benchmark::State &state) {
+  Buffer buffer(kBufferSize);
+  PayloadBuffer::AllocateMainMessage(&buffer.pb, 32);
+  BufferOffset msg = buffer.pb->message;
+  std::vector<std::string> strings;
+  for (int i = 0; i < 16; i++) {
+    strings.push_back(std::string(size_t(state.range(0)) + i * 7, 'a' + i));
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    PayloadBuffer::SetString(&buffer.pb, strings[i++ % strings.size()], msg);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SetString)->Arg(8)->Arg(100)->Arg(2000);
+
+} // namespace
@@ -0,0 +1,83 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/pipe.h"
+#include "toolbelt/queue.h"
+#include <benchmark/benchmark.h>
+#include <thread>
+
+namespace {
+
+// Write and read back a shared_ptr in the same thread.
+void BM_SharedPtrPipeHandoff(benchmark::State &state) {
+  absl::StatusOr<toolbelt::SharedPtrPipe<int>> pipe =
+      toolbelt::SharedPtrPipe<int>::Create();
+  if (!pipe.ok()) {
+    state.SkipWithError("pipe create failed");
+    return;
+  }
+  auto p = std::make_shared<int>(42);
+  for (auto _ : state) {
+    if (!pipe->Write(p).ok()) {
+      state.SkipWithError("write failed");
+      break;
+    }
+    absl::StatusOr<std::shared_ptr<int>> r = pipe->Read();
+    benchmark::DoNotOptimize(r);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SharedPtrPipeHandoff);
+
+// Pass a shared_ptr to another thread and wait for it to come back.  This
+// includes waking the reader.
+void BM_SharedPtrPipePingPong(benchmark::State &state) {
+  absl::StatusOr<toolbelt::SharedPtrPipe<int>> ping =
+      toolbelt::SharedPtrPipe<int>::Create();
+  absl::StatusOr<toolbelt::SharedPtrPipe<int>> pong =
+      toolbelt::SharedPtrPipe<int>::Create();
+  if (!ping.ok() || !pong.ok()) {
+    state.SkipWithError("pipe create failed");
+    return;
+  }
+  std::thread echo([&ping, &pong]() {
+    for (;;) {
+      absl::StatusOr<std::shared_ptr<int>> p = ping->Read();
+      if (!p.ok() || *p == nullptr || !pong->Write(*p).ok()) {
+        return;
+      }
+    }
+  });
+  auto p = std::make_shared<int>(42);
+  for (auto _ : state) {
+    if (!ping->Write(p).ok() || !pong->Read().ok()) {
+      state.SkipWithError("write or read failed");
+      break;
+    }
+  }
+  // A null pointer stops the echo thread.
+  (void)ping->Write(nullptr);
+  echo.join();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SharedPtrPipePingPong)->UseRealTime();
+
+// The same handoff through a SharedPtrQueue, for comparison.
+void BM_SharedPtrQueueHandoff(benchmark::State &state) {
+  toolbelt::SharedPtrQueue<int> queue(64);
+  if (!queue.Open().ok()) {
+    state.SkipWithError("queue open failed");
+    return;
+  }
+  auto p = std::make_shared<int>(42);
+  for (auto _ : state) {
+    queue.TryPush(p);
+    std::shared_ptr<int> r = queue.Pop();
+    benchmark::DoNotOptimize(r);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SharedPtrQueueHandoff);
+
+} // namespace
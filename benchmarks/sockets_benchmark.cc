@@ -0,0 +1,88 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/sockets.h"
+#include <benchmark/benchmark.h>
+#include <netinet/tcp.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void SetNoDelay(const toolbelt::Socket &socket) {
+  int one = 1;
+  setsockopt(socket.GetFileDescriptor().Fd(), IPPROTO_TCP, TCP_NODELAY, &one,
+             sizeof(one));
+}
+
+// Send messages back where they came from until the socket is closed.
+void Echo(toolbelt::Socket socket, size_t size) {
+  std::vector<char> buffer(size + sizeof(int32_t));
+  char *data = buffer.data() + sizeof(int32_t);
+  for (;;) {
+    absl::StatusOr<ssize_t> n = socket.ReceiveMessage(data, size);
+    if (!n.ok() || *n == 0) {
+      return;
+    }
+    if (!socket.SendMessage(data, *n).ok()) {
+      return;
+    }
+  }
+}
+
+// Send a message of state.range(0) bytes and wait for it to come back.
+void RoundTrip(benchmark::State &state, toolbelt::Socket &client,
+               toolbelt::Socket server) {
+  size_t size = size_t(state.range(0));
+  std::thread echo(Echo, std::move(server), size);
+  std::vector<char> buffer(size + sizeof(int32_t), 'x');
+  char *data = buffer.data() + sizeof(int32_t);
+  for (auto _ : state) {
+    if (!client.SendMessage(data, size).ok() ||
+        !client.ReceiveMessage(data, size).ok()) {
+      state.SkipWithError("send or receive failed");
+      break;
+    }
+  }
+  client.Close();
+  echo.join();
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * size * 2);
+}
+
+void BM_UnixSocketRoundTrip(benchmark::State &state) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    state.SkipWithError("socketpair failed");
+    return;
+  }
+  toolbelt::UnixSocket client(fds[0], true);
+  RoundTrip(state, client, toolbelt::UnixSocket(fds[1], true));
+}
+BENCHMARK(BM_UnixSocketRoundTrip)->Arg(64)->Arg(4096)->Arg(65536);
+
+void BM_TCPSocketRoundTrip(benchmark::State &state) {
+  toolbelt::TCPSocket listener;
+  if (!listener.Bind(toolbelt::InetAddress("localhost", 0), true).ok()) {
+    state.SkipWithError("bind failed");
+    return;
+  }
+  toolbelt::TCPSocket client;
+  if (!client.Connect(listener.BoundAddress()).ok()) {
+    state.SkipWithError("connect failed");
+    return;
+  }
+  absl::StatusOr<toolbelt::TCPSocket> server = listener.Accept();
+  if (!server.ok()) {
+    state.SkipWithError("accept failed");
+    return;
+  }
+  // Small messages would otherwise wait for Nagle.
+  SetNoDelay(client);
+  SetNoDelay(*server);
+  RoundTrip(state, client, std::move(*server));
+}
+BENCHMARK(BM_TCPSocketRoundTrip)->Arg(64)->Arg(4096)->Arg(65536);
+
+} // namespace
@@ -5,14 +5,61 @@
 #ifndef __TOOLBELT_BITSET_H
 #define __TOOLBELT_BITSET_H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdint>
 
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_format.h"
 namespace toolbelt {
 
-// This is a fixed size bitset.
+namespace internal {
+constexpr int kBitsPerWord = 64;
+
+constexpr int NumWords(int bits) {
+  return (bits + kBitsPerWord - 1) / kBitsPerWord;
+}
+
+// The mask of the bits in word 'word' that are inside a set of 'size' bits.
+constexpr uint64_t ValidBits(int size, int word) {
+  int remaining = size - word * kBitsPerWord;
+  return remaining >= kBitsPerWord ? ~uint64_t(0)
+                                   : (uint64_t(1) << remaining) - 1;
+}
+
+// The mask of bits at or above 'bit' in a word.
+constexpr uint64_t BitsFrom(int bit) { return ~uint64_t(0) << bit; }
+
+// The mask of 'n' bits from 'bit', all in one word.
+constexpr uint64_t BitRange(int bit, int n) {
+  return (n == kBitsPerWord ? ~uint64_t(0) : ((uint64_t(1) << n) - 1)) << bit;
+}
+
+// First bit at or after 'from' that is set in 'words' (which are
+// words[i] ^ flip), or -1.
+template <typename Words>
+int FindNext(const Words &words, int size, int from, uint64_t flip) {
+  if (from >= size) {
+    return -1;
+  }
+  int word = from / kBitsPerWord;
+  uint64_t w = (words[word] ^ flip) & BitsFrom(from % kBitsPerWord);
+  for (;;) {
+    w &= ValidBits(size, word);
+    if (w != 0) {
+      return word * kBitsPerWord + __builtin_ctzll(w);
+    }
+    if (++word >= NumWords(size)) {
+      return -1;
+    }
+    w = words[word] ^ flip;
+  }
+}
+} // namespace internal
+
+// This is a fixed size bitset.  Bits not in use by the caller are clear.
 template <int Size> class BitSet {
 public:
   BitSet() { Init(); }
@@ -23,9 +70,15 @@ public:
   // Allocate the first available bit.
   absl::StatusOr<int> Allocate(const std::string &type);
 
+  // Allocate 'n' consecutive bits, returning the first one.
+  absl::StatusOr<int> AllocateN(int n, const std::string &type);
+
   // Are all bits clear?
   bool IsEmpty() const;
 
+  // Number of bits set.
+  int Count() const;
+
   // Set bit b.
   void Set(int b);
 
@@ -35,39 +88,79 @@ public:
   // Is bit b set.
   bool IsSet(int b) const;
 
+  // The first set (or clear) bit at or after 'from', or -1 if there isn't
+  // one.  To visit all the set bits:
+  //
+  //   for (int b = bits.FindNextSet(0); b != -1; b = bits.FindNextSet(b + 1))
+  int FindNextSet(int from) const {
+    return internal::FindNext(bits_, Size, from, 0);
+  }
+  int FindNextClear(int from) const {
+    return internal::FindNext(bits_, Size, from, ~uint64_t(0));
+  }
+
 private:
-  static constexpr std::size_t kBitsPerWord = sizeof(long long) * 8;
-  static constexpr std::size_t kNumWords = Size / kBitsPerWord;
+  static constexpr int kNumWords = internal::NumWords(Size);
+
+  void SetRange(int b, int n);
 
-  // Note the use of explicit long long type here because
-  // we use ffsll to look for the set bits and that is
-  // explicit in its use of long long.
-  std::array<long long, kNumWords> bits_;
+  std::array<uint64_t, kNumWords> bits_;
 };
 
 template <int Size>
 inline absl::StatusOr<int> BitSet<Size>::Allocate(const std::string &type) {
   for (int i = 0; i < kNumWords; i++) {
-    int bit = ffsll(~bits_[i]);
-    if (bit != 0) {
-      bits_[i] |= (1LL << (bit - 1));
-      return static_cast<int>(i * kBitsPerWord + (bit - 1));
+    uint64_t free = ~bits_[i] & internal::ValidBits(Size, i);
+    if (free != 0) {
+      int bit = __builtin_ctzll(free);
+      bits_[i] |= uint64_t(1) << bit;
+      return i * internal::kBitsPerWord + bit;
     }
   }
   return absl::InternalError(
       absl::StrFormat("No capacity for another %s", type));
 }
 
+template <int Size>
+inline absl::StatusOr<int> BitSet<Size>::AllocateN(int n,
+                                                   const std::string &type) {
+  if (n > 0) {
+    for (int start = FindNextClear(0); start != -1;) {
+      int end = FindNextSet(start);
+      if (end == -1) {
+        end = Size;
+      }
+      if (end - start >= n) {
+        SetRange(start, n);
+        return start;
+      }
+      start = end == Size ? -1 : FindNextClear(end);
+    }
+  }
+  return absl::InternalError(
+      absl::StrFormat("No capacity for %d more %s", n, type));
+}
+
+template <int Size> inline void BitSet<Size>::SetRange(int b, int n) {
+  while (n > 0) {
+    int bit = b % internal::kBitsPerWord;
+    int count = std::min(n, internal::kBitsPerWord - bit);
+    bits_[b / internal::kBitsPerWord] |= internal::BitRange(bit, count);
+    b += count;
+    n -= count;
+  }
+}
+
 template <int Size> inline void BitSet<Size>::Clear(int b) {
-  int word = b / kBitsPerWord;
-  int bit = b % kBitsPerWord;
-  bits_[word] &= ~(1LL << bit);
+  int word = b / internal::kBitsPerWord;
+  int bit = b % internal::kBitsPerWord;
+  bits_[word] &= ~(uint64_t(1) << bit);
 }
 
 template <int Size> inline void BitSet<Size>::Set(int b) {
-  int word = b / kBitsPerWord;
-  int bit = b % kBitsPerWord;
-  bits_[word] |= (1LL << bit);
+  int word = b / internal::kBitsPerWord;
+  int bit = b % internal::kBitsPerWord;
+  bits_[word] |= (uint64_t(1) << bit);
 }
 
 template <int Size> inline bool BitSet<Size>::IsEmpty() const {
@@ -79,12 +172,254 @@ template <int Size> inline bool BitSet<Size>::IsEmpty() const {
   return true;
 }
 
+template <int Size> inline int BitSet<Size>::Count() const {
+  int count = 0;
+  for (int i = 0; i < kNumWords; i++) {
+    count += __builtin_popcountll(bits_[i]);
+  }
+  return count;
+}
+
 template <int Size> inline bool BitSet<Size>::IsSet(int b) const {
-  int word = b / kBitsPerWord;
-  int bit = b % kBitsPerWord;
-  return (bits_[word] & (1LL << bit)) != 0;
+  int word = b / internal::kBitsPerWord;
+  int bit = b % internal::kBitsPerWord;
+  return (bits_[word] & (uint64_t(1) << bit)) != 0;
 }
 
+// A BitSet with a second level of summary words that say which words are
+// full and which are empty, so that finding a free or set bit looks at 64
+// words at a time.  Use this for large sets that are often nearly full.
+template <int Size> class HierarchicalBitSet {
+public:
+  HierarchicalBitSet() { Init(); }
+
+  void Init() {
+    bits_.fill({});
+    full_.fill({});
+    nonempty_.fill({});
+  }
+
+  absl::StatusOr<int> Allocate(const std::string &type);
+  absl::StatusOr<int> AllocateN(int n, const std::string &type);
+
+  bool IsEmpty() const {
+    for (uint64_t w : nonempty_) {
+      if (w != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int Count() const {
+    int count = 0;
+    for (int s = 0; s < kNumSummaryWords; s++) {
+      for (uint64_t w = nonempty_[s]; w != 0; w &= w - 1) {
+        count += __builtin_popcountll(
+            bits_[s * internal::kBitsPerWord + __builtin_ctzll(w)]);
+      }
+    }
+    return count;
+  }
+
+  void Set(int b) {
+    int word = b / internal::kBitsPerWord;
+    bits_[word] |= uint64_t(1) << (b % internal::kBitsPerWord);
+    UpdateSummary(word);
+  }
+
+  void Clear(int b) {
+    int word = b / internal::kBitsPerWord;
+    bits_[word] &= ~(uint64_t(1) << (b % internal::kBitsPerWord));
+    UpdateSummary(word);
+  }
+
+  bool IsSet(int b) const {
+    return (bits_[b / internal::kBitsPerWord] &
+            (uint64_t(1) << (b % internal::kBitsPerWord))) != 0;
+  }
+
+  int FindNextSet(int from) const { return FindNext(from, nonempty_, 0); }
+  int FindNextClear(int from) const {
+    return FindNext(from, full_, ~uint64_t(0));
+  }
+
+private:
+  static constexpr int kNumWords = internal::NumWords(Size);
+  static constexpr int kNumSummaryWords = internal::NumWords(kNumWords);
+
+  void UpdateSummary(int word) {
+    uint64_t bit = uint64_t(1) << (word % internal::kBitsPerWord);
+    int s = word / internal::kBitsPerWord;
+    if (bits_[word] == internal::ValidBits(Size, word)) {
+      full_[s] |= bit;
+    } else {
+      full_[s] &= ~bit;
+    }
+    if (bits_[word] != 0) {
+      nonempty_[s] |= bit;
+    } else {
+      nonempty_[s] &= ~bit;
+    }
+  }
+
+  // Find the next bit at or after 'from' that is set in bits_ ^ flip.
+  // 'summary' has a bit set for each word that might contain one.
+  int FindNext(int from, const std::array<uint64_t, kNumSummaryWords> &summary,
+               uint64_t flip) const {
+    if (from >= Size) {
+      return -1;
+    }
+    // Finish the word 'from' is in.
+    int word = from / internal::kBitsPerWord;
+    uint64_t w = (bits_[word] ^ flip) &
+                 internal::BitsFrom(from % internal::kBitsPerWord) &
+                 internal::ValidBits(Size, word);
+    if (w != 0) {
+      return word * internal::kBitsPerWord + __builtin_ctzll(w);
+    }
+    // Then use the summary to find the next candidate word.  The summary
+    // of full words is inverted to find words that are not full.
+    int next = internal::FindNext(summary, kNumWords, word + 1, flip);
+    if (next == -1) {
+      return -1;
+    }
+    w = (bits_[next] ^ flip) & internal::ValidBits(Size, next);
+    return next * internal::kBitsPerWord + __builtin_ctzll(w);
+  }
+
+  std::array<uint64_t, kNumWords> bits_;
+  std::array<uint64_t, kNumSummaryWords> full_;     // Bit per full word.
+  std::array<uint64_t, kNumSummaryWords> nonempty_; // Bit per nonempty word.
+};
+
+template <int Size>
+inline absl::StatusOr<int>
+HierarchicalBitSet<Size>::Allocate(const std::string &type) {
+  int b = FindNextClear(0);
+  if (b == -1) {
+    return absl::InternalError(
+        absl::StrFormat("No capacity for another %s", type));
+  }
+  Set(b);
+  return b;
+}
+
+template <int Size>
+inline absl::StatusOr<int>
+HierarchicalBitSet<Size>::AllocateN(int n, const std::string &type) {
+  if (n > 0) {
+    for (int start = FindNextClear(0); start != -1;) {
+      int end = FindNextSet(start);
+      if (end == -1) {
+        end = Size;
+      }
+      if (end - start >= n) {
+        for (int b = start; b < start + n; b++) {
+          Set(b);
+        }
+        return start;
+      }
+      start = end == Size ? -1 : FindNextClear(end);
+    }
+  }
+  return absl::InternalError(
+      absl::StrFormat("No capacity for %d more %s", n, type));
+}
+
+// A BitSet that can be used by multiple threads at once without a lock.
+// Allocate claims a bit with a compare and swap so that two threads never
+// get the same bit.  Each Set, Clear and IsSet is atomic, but the
+// operations that look at the whole set (IsEmpty, Count, FindNextSet) see
+// each word at a different time.
+template <int Size> class AtomicBitSet {
+public:
+  AtomicBitSet() { Init(); }
+
+  // Not thread safe.
+  void Init() {
+    for (auto &w : bits_) {
+      w.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  absl::StatusOr<int> Allocate(const std::string &type) {
+    for (int i = 0; i < kNumWords; i++) {
+      uint64_t w = bits_[i].load(std::memory_order_relaxed);
+      for (;;) {
+        uint64_t free = ~w & internal::ValidBits(Size, i);
+        if (free == 0) {
+          break;
+        }
+        uint64_t bit = free & -free;
+        // On failure 'w' is reloaded and we try the next free bit in it.
+        if (bits_[i].compare_exchange_weak(w, w | bit,
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed)) {
+          return i * internal::kBitsPerWord + __builtin_ctzll(bit);
+        }
+      }
+    }
+    return absl::InternalError(
+        absl::StrFormat("No capacity for another %s", type));
+  }
+
+  bool IsEmpty() const {
+    for (auto &w : bits_) {
+      if (w.load(std::memory_order_relaxed) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int Count() const {
+    int count = 0;
+    for (auto &w : bits_) {
+      count += __builtin_popcountll(w.load(std::memory_order_relaxed));
+    }
+    return count;
+  }
+
+  void Set(int b) {
+    bits_[b / internal::kBitsPerWord].fetch_or(
+        uint64_t(1) << (b % internal::kBitsPerWord), std::memory_order_acq_rel);
+  }
+
+  // Release bit b.  Anything written before this is visible to the thread
+  // that allocates it next.
+  void Clear(int b) {
+    bits_[b / internal::kBitsPerWord].fetch_and(
+        ~(uint64_t(1) << (b % internal::kBitsPerWord)),
+        std::memory_order_release);
+  }
+
+  bool IsSet(int b) const {
+    return (bits_[b / internal::kBitsPerWord].load(std::memory_order_acquire) &
+            (uint64_t(1) << (b % internal::kBitsPerWord))) != 0;
+  }
+
+  int FindNextSet(int from) const {
+    return internal::FindNext(Loader{bits_}, Size, from, 0);
+  }
+  int FindNextClear(int from) const {
+    return internal::FindNext(Loader{bits_}, Size, from, ~uint64_t(0));
+  }
+
+private:
+  static constexpr int kNumWords = internal::NumWords(Size);
+
+  // Reads the words for internal::FindNext.
+  struct Loader {
+    const std::array<std::atomic<uint64_t>, kNumWords> &bits;
+    uint64_t operator[](int i) const {
+      return bits[i].load(std::memory_order_acquire);
+    }
+  };
+
+  std::array<std::atomic<uint64_t>, kNumWords> bits_;
+};
+
 } // namespace toolbelt
 
 #endif //  __TOOLBELT_BITSET_H
@@ -0,0 +1,174 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/bitset.h"
+#include <gtest/gtest.h>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// The sizes aren't multiples of 64 so the last word is partly used.
+template <typename B> class BitSetTest : public ::testing::Test {};
+using BitSetTypes =
+    ::testing::Types<toolbelt::BitSet<200>, toolbelt::HierarchicalBitSet<200>,
+                     toolbelt::AtomicBitSet<200>>;
+TYPED_TEST_SUITE(BitSetTest, BitSetTypes);
+
+TYPED_TEST(BitSetTest, Allocate) {
+  TypeParam bits;
+  ASSERT_TRUE(bits.IsEmpty());
+  for (int i = 0; i < 200; i++) {
+    absl::StatusOr<int> b = bits.Allocate("slot");
+    ASSERT_TRUE(b.ok());
+    ASSERT_EQ(i, *b);
+  }
+  // The bits beyond the size are never allocated.
+  absl::StatusOr<int> b = bits.Allocate("slot");
+  ASSERT_FALSE(b.ok());
+  ASSERT_EQ("No capacity for another slot", b.status().message());
+  ASSERT_EQ(200, bits.Count());
+
+  bits.Clear(130);
+  bits.Clear(7);
+  ASSERT_EQ(198, bits.Count());
+  ASSERT_FALSE(bits.IsSet(7));
+  ASSERT_EQ(7, *bits.Allocate("slot"));
+  ASSERT_EQ(130, *bits.Allocate("slot"));
+
+  for (int i = 0; i < 200; i++) {
+    bits.Clear(i);
+  }
+  ASSERT_TRUE(bits.IsEmpty());
+  ASSERT_EQ(0, bits.Count());
+}
+
+TYPED_TEST(BitSetTest, Find) {
+  TypeParam bits;
+  ASSERT_EQ(-1, bits.FindNextSet(0));
+  ASSERT_EQ(0, bits.FindNextClear(0));
+
+  std::vector<int> expected = {0, 5, 63, 64, 127, 128, 199};
+  for (int b : expected) {
+    bits.Set(b);
+  }
+  std::vector<int> found;
+  for (int b = bits.FindNextSet(0); b != -1; b = bits.FindNextSet(b + 1)) {
+    found.push_back(b);
+  }
+  ASSERT_EQ(expected, found);
+  ASSERT_EQ(1, bits.FindNextClear(0));
+  ASSERT_EQ(65, bits.FindNextClear(63));
+  ASSERT_EQ(-1, bits.FindNextClear(199));
+  ASSERT_EQ(-1, bits.FindNextSet(200));
+}
+
+template <typename B> class AllocateNTest : public ::testing::Test {};
+using AllocateNTypes =
+    ::testing::Types<toolbelt::BitSet<300>, toolbelt::HierarchicalBitSet<300>>;
+TYPED_TEST_SUITE(AllocateNTest, AllocateNTypes);
+
+TYPED_TEST(AllocateNTest, AllocateN) {
+  TypeParam bits;
+  ASSERT_EQ(0, *bits.AllocateN(10, "slot"));
+  ASSERT_EQ(10, *bits.AllocateN(100, "slot"));
+  ASSERT_EQ(110, bits.Count());
+  for (int i = 0; i < 110; i++) {
+    ASSERT_TRUE(bits.IsSet(i));
+  }
+
+  // Make a hole of 5 and ask for 6, which doesn't fit in it.
+  for (int i = 20; i < 25; i++) {
+    bits.Clear(i);
+  }
+  ASSERT_EQ(110, *bits.AllocateN(6, "slot"));
+  ASSERT_EQ(20, *bits.AllocateN(5, "slot"));
+
+  // 184 are left at the end.
+  ASSERT_FALSE(bits.AllocateN(185, "slot").ok());
+  ASSERT_EQ(116, *bits.AllocateN(184, "slot"));
+  ASSERT_EQ(300, bits.Count());
+  ASSERT_FALSE(bits.AllocateN(1, "slot").ok());
+}
+
+TEST(HierarchicalBitSetTest, Large) {
+  // Many words, all but a few full.
+  constexpr int kSize = 100000;
+  auto bits = std::make_unique<toolbelt::HierarchicalBitSet<kSize>>();
+  for (int i = 0; i < kSize; i++) {
+    bits->Set(i);
+  }
+  ASSERT_EQ(kSize, bits->Count());
+  ASSERT_FALSE(bits->Allocate("slot").ok());
+
+  for (int b : {99999, 70000, 12345}) {
+    bits->Clear(b);
+  }
+  ASSERT_EQ(12345, *bits->Allocate("slot"));
+  ASSERT_EQ(70000, *bits->Allocate("slot"));
+  ASSERT_EQ(99999, *bits->Allocate("slot"));
+  ASSERT_FALSE(bits->Allocate("slot").ok());
+
+  bits->Init();
+  ASSERT_TRUE(bits->IsEmpty());
+  bits->Set(81234);
+  ASSERT_FALSE(bits->IsEmpty());
+  ASSERT_EQ(81234, bits->FindNextSet(0));
+  ASSERT_EQ(1, bits->Count());
+}
+
+TEST(AtomicBitSetTest, Threads) {
+  constexpr int kNumThreads = 4;
+  constexpr int kSize = 1000;
+  toolbelt::AtomicBitSet<kSize> bits;
+
+  // Every thread allocates until it's full and nobody gets the same bit.
+  std::vector<std::vector<int>> allocated(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&bits, &allocated, t]() {
+      for (;;) {
+        absl::StatusOr<int> b = bits.Allocate("slot");
+        if (!b.ok()) {
+          return;
+        }
+        allocated[t].push_back(*b);
+        if ((*b % 16) == 0) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  std::set<int> all;
+  for (auto &v : allocated) {
+    for (int b : v) {
+      ASSERT_TRUE(all.insert(b).second) << b;
+    }
+  }
+  ASSERT_EQ(kSize, all.size());
+  ASSERT_EQ(kSize, bits.Count());
+
+  // Now allocate and free concurrently.
+  threads.clear();
+  for (int i = 0; i < kSize; i++) {
+    bits.Clear(i);
+  }
+  for (int t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&bits]() {
+      for (int i = 0; i < 10000; i++) {
+        absl::StatusOr<int> b = bits.Allocate("slot");
+        ASSERT_TRUE(b.ok());
+        ASSERT_TRUE(bits.IsSet(*b));
+        bits.Clear(*b);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_TRUE(bits.IsEmpty());
+}
@@ -10,31 +10,42 @@
 #if defined(__APPLE__)
 #include <mach/mach_time.h>
 #endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 namespace toolbelt {
 
 #if defined(__APPLE__)
-namespace {
-mach_timebase_info_data_t timebase;
-bool timebase_set = false;
-uint64_t current_timebase;
-} // namespace
+namespace internal {
+struct MachTimebase {
+  mach_timebase_info_data_t timebase;
+  uint64_t offset; // Realtime at mach time 0.
+};
+
+// There is one of these for the whole program, set up on first use.
+inline const MachTimebase &GetMachTimebase() {
+  static const MachTimebase tb = []() {
+    MachTimebase t;
+    mach_timebase_info(&t.timebase);
+    struct timespec tp;
+    clock_gettime(CLOCK_REALTIME, &tp);
+    t.offset = (static_cast<uint64_t>(tp.tv_sec) * 1000000000LL +
+                static_cast<uint64_t>(tp.tv_nsec)) -
+               mach_absolute_time() * t.timebase.numer / t.timebase.denom;
+    return t;
+  }();
+  return tb;
+}
+} // namespace internal
 #endif
 
 // Current monotonic time in nanoseconds.
 inline uint64_t Now() {
 #if defined(__APPLE__)
-  if (!timebase_set) {
-    mach_timebase_info(&timebase);
-    struct timespec tp;
-    clock_gettime(CLOCK_REALTIME, &tp);
-    current_timebase = (static_cast<uint64_t>(tp.tv_sec) * 1000000000LL +
-                        static_cast<uint64_t>(tp.tv_nsec)) -
-                       mach_absolute_time() * timebase.numer / timebase.denom;
-    timebase_set = true;
-  }
-  return current_timebase +
-         mach_absolute_time() * timebase.numer / timebase.denom;
+  const internal::MachTimebase &tb = internal::GetMachTimebase();
+  return tb.offset +
+         mach_absolute_time() * tb.timebase.numer / tb.timebase.denom;
 #else
   struct timespec tp;
   clock_gettime(CLOCK_MONOTONIC, &tp);
@@ -42,6 +53,84 @@ inline uint64_t Now() {
          static_cast<uint64_t>(tp.tv_nsec);
 #endif
 }
+
+// The CPU's cycle counter: the TSC on x86 and the virtual counter on ARM.
+// This is just a register read, with no system call or vDSO.  It assumes
+// the counter runs at a constant rate and is synchronized across cores,
+// which is true of any recent processor.  Elsewhere it's Now().
+inline uint64_t CycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  return Now();
+#endif
+}
+
+namespace internal {
+// Converts CycleCounter ticks to nanoseconds.
+struct CycleCalibration {
+  uint64_t base_ticks;
+  uint64_t base_ns;    // Now() at base_ticks.
+  uint64_t ns_per_tick; // Fixed point, with 32 fractional bits.
+};
+
+inline CycleCalibration Calibrate() {
+  CycleCalibration c;
+#if defined(__aarch64__)
+  // The frequency of the counter is in a register.
+  uint64_t freq;
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+  c.base_ns = Now();
+  c.base_ticks = CycleCounter();
+  c.ns_per_tick = (uint64_t(1000000000) << 32) / freq;
+#elif defined(__x86_64__) || defined(__i386__)
+  // Time the TSC against Now() for 10ms.
+  c.base_ns = Now();
+  c.base_ticks = CycleCounter();
+  uint64_t end_ns;
+  do {
+    end_ns = Now();
+  } while (end_ns - c.base_ns < 10000000);
+  uint64_t ticks = CycleCounter() - c.base_ticks;
+  c.ns_per_tick = uint64_t(((unsigned __int128)(end_ns - c.base_ns) << 32) /
+                           (ticks == 0 ? 1 : ticks));
+#else
+  c.base_ns = Now();
+  c.base_ticks = c.base_ns;
+  c.ns_per_tick = uint64_t(1) << 32;
+#endif
+  return c;
+}
+
+inline const CycleCalibration &GetCycleCalibration() {
+  static const CycleCalibration c = Calibrate();
+  return c;
+}
+} // namespace internal
+
+// Calibrate the cycle counter against Now().  This takes about 10ms on x86,
+// so call it at startup to keep it out of the first FastNow or
+// CyclesToNanoseconds.
+inline void CalibrateCycleCounter() { (void)internal::GetCycleCalibration(); }
+
+// Convert a difference between two CycleCounter values to nanoseconds.
+inline uint64_t CyclesToNanoseconds(uint64_t cycles) {
+  return uint64_t(((unsigned __int128)cycles *
+                   internal::GetCycleCalibration().ns_per_tick) >>
+                  32);
+}
+
+// The same clock as Now() (to within the calibration error) but read from
+// the cycle counter.  Use it for timing short intervals.
+inline uint64_t FastNow() {
+  const internal::CycleCalibration &c = internal::GetCycleCalibration();
+  return c.base_ns + CyclesToNanoseconds(CycleCounter() - c.base_ticks);
+}
+
 } // namespace toolbelt
 
 #endif //  __CLOCK_H
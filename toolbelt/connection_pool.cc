@@ -0,0 +1,120 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/connection_pool.h"
+#include "toolbelt/clock.h"
+#include "absl/strings/str_format.h"
+#include <poll.h>
+
+namespace toolbelt {
+
+bool ConnectionPool::IsHealthy(const TCPSocket &socket) {
+  if (!socket.Connected() || socket.BufferedBytes() != 0) {
+    return false;
+  }
+  // An idle connection has nothing to read.  If it's readable the peer
+  // has closed it (or sent something we don't expect).
+  struct pollfd p = {.fd = socket.GetFileDescriptor().Fd(), .events = POLLIN};
+  int n;
+  while ((n = ::poll(&p, 1, 0)) == -1 && errno == EINTR) {
+  }
+  return n == 0;
+}
+
+absl::StatusOr<TCPSocket> ConnectionPool::Get(const InetAddress &addr,
+                                              co::Coroutine *c) {
+  for (;;) {
+    Idle idle;
+    {
+      std::unique_lock<std::mutex> l(lock_);
+      auto it = idle_.find(addr);
+      if (it == idle_.end() || it->second.empty()) {
+        break;
+      }
+      // The most recently used is the most likely to still be alive.
+      idle = std::move(it->second.back());
+      it->second.pop_back();
+    }
+    if (options_.max_idle_ns != 0 &&
+        Now() - idle.since > options_.max_idle_ns) {
+      continue;
+    }
+    if (!IsHealthy(idle.socket)) {
+      continue;
+    }
+    num_reused_.fetch_add(1, std::memory_order_relaxed);
+    return std::move(idle.socket);
+  }
+  return Connect(addr, c);
+}
+
+absl::StatusOr<TCPSocket> ConnectionPool::Connect(const InetAddress &addr,
+                                                  co::Coroutine *c) {
+  TCPSocket socket;
+  if (!socket.GetFileDescriptor().Valid()) {
+    return absl::InternalError(
+        absl::StrFormat("Unable to create socket: %s", strerror(errno)));
+  }
+  if (options_.fast_open) {
+    // Not everywhere has it and it's only an optimization.
+    (void)socket.SetFastOpenConnect();
+  }
+  if (absl::Status s = socket.Connect(addr, c, options_.connect_timeout_ns);
+      !s.ok()) {
+    return s;
+  }
+  if (options_.no_delay) {
+    if (absl::Status s = socket.SetNoDelay(); !s.ok()) {
+      return s;
+    }
+  }
+  if (options_.keep_alive) {
+    if (absl::Status s = socket.SetKeepAlive(); !s.ok()) {
+      return s;
+    }
+  }
+  num_connected_.fetch_add(1, std::memory_order_relaxed);
+  return socket;
+}
+
+void ConnectionPool::Put(const InetAddress &addr, TCPSocket socket) {
+  if (!socket.Connected() || socket.BufferedBytes() != 0) {
+    // Unread data means the exchange didn't finish cleanly.
+    return;
+  }
+  // Closed outside the lock.
+  std::deque<Idle> closing;
+  std::unique_lock<std::mutex> l(lock_);
+  std::deque<Idle> &idle = idle_[addr];
+  idle.push_back(Idle{std::move(socket), Now()});
+  while (idle.size() > options_.max_idle_per_address) {
+    closing.push_back(std::move(idle.front()));
+    idle.pop_front();
+  }
+  l.unlock();
+}
+
+size_t ConnectionPool::IdleCount(const InetAddress &addr) const {
+  std::unique_lock<std::mutex> l(lock_);
+  auto it = idle_.find(addr);
+  return it == idle_.end() ? 0 : it->second.size();
+}
+
+size_t ConnectionPool::IdleCount() const {
+  std::unique_lock<std::mutex> l(lock_);
+  size_t n = 0;
+  for (auto & [ addr, idle ] : idle_) {
+    n += idle.size();
+  }
+  return n;
+}
+
+void ConnectionPool::Clear() {
+  absl::flat_hash_map<InetAddress, std::deque<Idle>> closing;
+  std::unique_lock<std::mutex> l(lock_);
+  closing.swap(idle_);
+  l.unlock();
+}
+
+} // namespace toolbelt
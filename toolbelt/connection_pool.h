@@ -0,0 +1,96 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __TOOLBELT_CONNECTION_POOL_H
+#define __TOOLBELT_CONNECTION_POOL_H
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/statusor.h"
+#include "toolbelt/sockets.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace toolbelt {
+
+struct ConnectionPoolOptions {
+  // Idle connections kept for each address.  More than this are closed
+  // when they're put back.
+  size_t max_idle_per_address = 8;
+
+  // Timeout for connecting a new socket.  0 means wait forever.
+  uint64_t connect_timeout_ns = 0;
+
+  // Idle connections older than this aren't reused.  0 means no limit.
+  uint64_t max_idle_ns = 0;
+
+  // Options set on new connections.
+  bool no_delay = true;
+  bool keep_alive = false;
+  bool fast_open = false;
+};
+
+// A pool of connected TCP sockets, kept per address so that a client
+// talking to the same servers repeatedly can skip the connect (and its
+// round trip) most of the time.  Get a connection, use it, and Put it
+// back when the exchange is finished, with nothing left unread.  If the
+// connection went wrong, just let the socket go instead.
+//
+// A connection is checked before being reused: if the peer closed it, or
+// sent anything while it was idle, it's dropped and the next one tried.
+// So a reused connection is very likely, but not certain, to work and
+// the caller still needs to handle a failure on its first request.
+//
+// Thread safe.
+class ConnectionPool {
+public:
+  explicit ConnectionPool(ConnectionPoolOptions options = {})
+      : options_(options) {}
+
+  // Get a connection to 'addr', an idle one if there is one, otherwise a
+  // new one.  The coroutine, if given, waits while connecting.
+  absl::StatusOr<TCPSocket> Get(const InetAddress &addr,
+                                co::Coroutine *c = nullptr);
+
+  // Return a connection to the pool for reuse.
+  void Put(const InetAddress &addr, TCPSocket socket);
+
+  // Number of idle connections for 'addr', or in total.
+  size_t IdleCount(const InetAddress &addr) const;
+  size_t IdleCount() const;
+
+  // Close all the idle connections.
+  void Clear();
+
+  // How many Gets were given an idle connection and how many connected.
+  uint64_t NumReused() const {
+    return num_reused_.load(std::memory_order_relaxed);
+  }
+  uint64_t NumConnected() const {
+    return num_connected_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Idle {
+    TCPSocket socket{-1};
+    uint64_t since = 0; // Now() when it was put back.
+  };
+
+  // Is an idle socket still usable?
+  static bool IsHealthy(const TCPSocket &socket);
+
+  absl::StatusOr<TCPSocket> Connect(const InetAddress &addr,
+                                    co::Coroutine *c);
+
+  ConnectionPoolOptions options_;
+  mutable std::mutex lock_;
+  absl::flat_hash_map<InetAddress, std::deque<Idle>> idle_;
+  std::atomic<uint64_t> num_reused_ = 0;
+  std::atomic<uint64_t> num_connected_ = 0;
+};
+
+} // namespace toolbelt
+
+#endif // __TOOLBELT_CONNECTION_POOL_H
@@ -0,0 +1,86 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/connection_pool.h"
+#include <gtest/gtest.h>
+
+TEST(ConnectionPoolTest, Reuse) {
+  toolbelt::TCPSocket listener;
+  ASSERT_TRUE(listener.Bind(toolbelt::InetAddress("localhost", 0), true).ok());
+  toolbelt::InetAddress addr = listener.BoundAddress();
+
+  toolbelt::ConnectionPool pool(
+      toolbelt::ConnectionPoolOptions{.connect_timeout_ns = 1000000000});
+  absl::StatusOr<toolbelt::TCPSocket> client = pool.Get(addr);
+  ASSERT_TRUE(client.ok()) << client.status();
+  ASSERT_TRUE(client->Connected());
+  absl::StatusOr<toolbelt::TCPSocket> server = listener.Accept();
+  ASSERT_TRUE(server.ok());
+  ASSERT_EQ(1, pool.NumConnected());
+
+  // Put it back and get the same one again.
+  int fd = client->GetFileDescriptor().Fd();
+  pool.Put(addr, std::move(*client));
+  ASSERT_EQ(1, pool.IdleCount(addr));
+  client = pool.Get(addr);
+  ASSERT_TRUE(client.ok());
+  ASSERT_EQ(fd, client->GetFileDescriptor().Fd());
+  ASSERT_EQ(1, pool.NumReused());
+  ASSERT_EQ(0, pool.IdleCount());
+
+  // It still works.
+  char c = 'x';
+  ASSERT_TRUE(client->Send(&c, 1).ok());
+  char r;
+  ASSERT_TRUE(server->Receive(&r, 1).ok());
+  ASSERT_EQ('x', r);
+
+  // The peer closes it while it's idle so it's not reused.
+  pool.Put(addr, std::move(*client));
+  server->Close();
+  client = pool.Get(addr);
+  ASSERT_TRUE(client.ok());
+  ASSERT_EQ(2, pool.NumConnected());
+  ASSERT_EQ(1, pool.NumReused());
+}
+
+TEST(ConnectionPoolTest, MaxIdle) {
+  toolbelt::TCPSocket listener;
+  ASSERT_TRUE(listener.Bind(toolbelt::InetAddress("localhost", 0), true).ok());
+  toolbelt::InetAddress addr = listener.BoundAddress();
+
+  toolbelt::ConnectionPool pool(
+      toolbelt::ConnectionPoolOptions{.max_idle_per_address = 2});
+  std::vector<toolbelt::TCPSocket> clients;
+  std::vector<toolbelt::TCPSocket> servers;
+  for (int i = 0; i < 4; i++) {
+    absl::StatusOr<toolbelt::TCPSocket> client = pool.Get(addr);
+    ASSERT_TRUE(client.ok());
+    clients.push_back(std::move(*client));
+    absl::StatusOr<toolbelt::TCPSocket> server = listener.Accept();
+    ASSERT_TRUE(server.ok());
+    servers.push_back(std::move(*server));
+  }
+  for (auto &client : clients) {
+    pool.Put(addr, std::move(client));
+  }
+  ASSERT_EQ(2, pool.IdleCount(addr));
+  pool.Clear();
+  ASSERT_EQ(0, pool.IdleCount());
+}
+
+TEST(ConnectionPoolTest, Refused) {
+  // Find a port that nothing is listening on.
+  toolbelt::InetAddress addr;
+  {
+    toolbelt::TCPSocket s;
+    ASSERT_TRUE(s.Bind(toolbelt::InetAddress("localhost", 0), false).ok());
+    addr = s.BoundAddress();
+  }
+  toolbelt::ConnectionPool pool(
+      toolbelt::ConnectionPoolOptions{.connect_timeout_ns = 1000000000});
+  absl::StatusOr<toolbelt::TCPSocket> client = pool.Get(addr);
+  ASSERT_FALSE(client.ok());
+  ASSERT_EQ(0, pool.NumConnected());
+}
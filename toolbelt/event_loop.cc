@@ -0,0 +1,234 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/event_loop.h"
+#include "absl/strings/str_format.h"
+
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+namespace toolbelt {
+
+// Most events we handle in one call to the OS.
+static constexpr int kMaxEvents = 64;
+
+absl::StatusOr<EventLoop> EventLoop::Create() {
+  EventLoop loop;
+  if (absl::Status status = loop.Open(); !status.ok()) {
+    return status;
+  }
+  return loop;
+}
+
+absl::Status EventLoop::Open() {
+#if defined(__linux__)
+  int fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+  int fd = kqueue();
+#endif
+  if (fd == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Unable to create event loop: %s", strerror(errno)));
+  }
+  poll_fd_.SetFd(fd);
+  if (absl::Status status = stop_trigger_.Open(); !status.ok()) {
+    return status;
+  }
+  // The stop trigger is handled by RunOnce itself.
+  return Add(stop_trigger_.GetPollFd(), POLLIN, nullptr);
+}
+
+absl::Status EventLoop::Register(int fd, uint32_t events, bool add) {
+#if defined(__linux__)
+  struct epoll_event event = {};
+  event.events = EPOLLET | ((events & POLLIN) ? uint32_t(EPOLLIN) : 0) |
+                 ((events & POLLOUT) ? uint32_t(EPOLLOUT) : 0);
+  event.data.fd = fd;
+  int e = epoll_ctl(poll_fd_.Fd(), add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd,
+                    &event);
+#else
+  // A kqueue has a separate filter for reading and writing.  Filters for
+  // events we don't want are deleted, which may fail if they don't exist.
+  struct kevent changes[2];
+  EV_SET(&changes[0], fd, EVFILT_READ,
+         (events & POLLIN) ? (EV_ADD | EV_CLEAR) : EV_DELETE, 0, 0, nullptr);
+  EV_SET(&changes[1], fd, EVFILT_WRITE,
+         (events & POLLOUT) ? (EV_ADD | EV_CLEAR) : EV_DELETE, 0, 0, nullptr);
+  int e = 0;
+  for (struct kevent &change : changes) {
+    if (kevent(poll_fd_.Fd(), &change, 1, nullptr, 0, nullptr) == -1 &&
+        !(change.flags == EV_DELETE && errno == ENOENT)) {
+      e = -1;
+      break;
+    }
+  }
+#endif
+  if (e == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to register fd %d with event loop: %s", fd, strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status EventLoop::Add(const FileDescriptor &fd, uint32_t events,
+                            Callback callback) {
+  if (!fd.Valid()) {
+    return absl::InternalError("Cannot add invalid fd to event loop");
+  }
+  if (handlers_.find(fd.Fd()) != handlers_.end()) {
+    return absl::InternalError(
+        absl::StrFormat("Fd %d is already in the event loop", fd.Fd()));
+  }
+  if (absl::Status status = Register(fd.Fd(), events, true); !status.ok()) {
+    return status;
+  }
+  handlers_[fd.Fd()] =
+      std::make_shared<Handler>(Handler{fd, events, std::move(callback)});
+  return absl::OkStatus();
+}
+
+absl::Status EventLoop::Modify(const FileDescriptor &fd, uint32_t events) {
+  auto it = handlers_.find(fd.Fd());
+  if (it == handlers_.end()) {
+    return absl::InternalError(
+        absl::StrFormat("Fd %d is not in the event loop", fd.Fd()));
+  }
+  if (absl::Status status = Register(fd.Fd(), events, false); !status.ok()) {
+    return status;
+  }
+  it->second->events = events;
+  return absl::OkStatus();
+}
+
+absl::Status EventLoop::Remove(const FileDescriptor &fd) {
+  auto it = handlers_.find(fd.Fd());
+  if (it == handlers_.end()) {
+    return absl::InternalError(
+        absl::StrFormat("Fd %d is not in the event loop", fd.Fd()));
+  }
+#if defined(__linux__)
+  int e = epoll_ctl(poll_fd_.Fd(), EPOLL_CTL_DEL, fd.Fd(), nullptr);
+#else
+  struct kevent changes[2];
+  EV_SET(&changes[0], fd.Fd(), EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+  EV_SET(&changes[1], fd.Fd(), EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+  int e = 0;
+  for (struct kevent &change : changes) {
+    if (kevent(poll_fd_.Fd(), &change, 1, nullptr, 0, nullptr) == -1 &&
+        errno != ENOENT) {
+      e = -1;
+    }
+  }
+#endif
+  handlers_.erase(it);
+  if (e == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Unable to remove fd %d from event loop: %s", fd.Fd(),
+                        strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status EventLoop::AddTrigger(TriggerFd &trigger,
+                                   std::function<void()> callback) {
+  // Copy the trigger's poll fd as the TriggerFd itself might be moved.
+  FileDescriptor fd = trigger.GetPollFd();
+  auto shared = std::make_shared<TriggerFd>(trigger.Duplicate());
+  return Add(fd, POLLIN,
+             [shared, callback = std::move(callback)](uint32_t) {
+               shared->Clear();
+               callback();
+             });
+}
+
+absl::StatusOr<int> EventLoop::RunOnce(int timeout_ms) {
+  // Gather the ready fds and the events for them.
+  std::vector<std::pair<int, uint32_t>> ready;
+#if defined(__linux__)
+  struct epoll_event events[kMaxEvents];
+  int n = epoll_wait(poll_fd_.Fd(), events, kMaxEvents, timeout_ms);
+  if (n == -1) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    return absl::InternalError(
+        absl::StrFormat("Event loop wait failed: %s", strerror(errno)));
+  }
+  ready.reserve(n);
+  for (int i = 0; i < n; i++) {
+    uint32_t e = events[i].events;
+    int fd = events[i].data.fd;
+    ready.push_back({fd, ((e & EPOLLIN) ? POLLIN : 0) |
+                             ((e & EPOLLOUT) ? POLLOUT : 0) |
+                             ((e & EPOLLERR) ? POLLERR : 0) |
+                             ((e & EPOLLHUP) ? POLLHUP : 0)});
+  }
+#else
+  struct kevent events[kMaxEvents];
+  struct timespec timeout = {timeout_ms / 1000,
+                             (timeout_ms % 1000) * 1000000};
+  int n = kevent(poll_fd_.Fd(), nullptr, 0, events, kMaxEvents,
+                 timeout_ms < 0 ? nullptr : &timeout);
+  if (n == -1) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    return absl::InternalError(
+        absl::StrFormat("Event loop wait failed: %s", strerror(errno)));
+  }
+  ready.reserve(n);
+  for (int i = 0; i < n; i++) {
+    // Reading and writing are separate events in a kqueue.
+    uint32_t e = events[i].filter == EVFILT_READ ? POLLIN : POLLOUT;
+    if (events[i].flags & EV_EOF) {
+      e |= POLLHUP;
+    }
+    if (events[i].flags & EV_ERROR) {
+      e |= POLLERR;
+    }
+    ready.push_back({int(events[i].ident), e});
+  }
+#endif
+  for (auto &[fd, e] : ready) {
+    if (fd == stop_trigger_.GetPollFd().Fd()) {
+      stop_trigger_.Clear();
+      stopped_ = true;
+      continue;
+    }
+    auto it = handlers_.find(fd);
+    if (it == handlers_.end()) {
+      // Removed by an earlier callback.
+      continue;
+    }
+    // Hold a reference in case the callback removes the handler.
+    std::shared_ptr<Handler> handler = it->second;
+    handler->callback(e);
+  }
+  return n;
+}
+
+absl::Status EventLoop::Run(co::Coroutine *c) {
+  stopped_ = false;
+  while (!stopped_) {
+    if (c != nullptr) {
+      c->Wait(poll_fd_.Fd(), POLLIN);
+    }
+    // With a coroutine the loop's fd is ready so there's no need to wait.
+    absl::StatusOr<int> n = RunOnce(c == nullptr ? -1 : 0);
+    if (!n.ok()) {
+      return n.status();
+    }
+  }
+  return absl::OkStatus();
+}
+
+void EventLoop::Stop() { stop_trigger_.Trigger(); }
+
+} // namespace toolbelt
@@ -0,0 +1,100 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __TOOLBELT_EVENT_LOOP_H
+#define __TOOLBELT_EVENT_LOOP_H
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "coroutine.h"
+#include "toolbelt/fd.h"
+#include "toolbelt/triggerfd.h"
+#include <functional>
+#include <memory>
+#include <sys/poll.h>
+#include <unordered_map>
+
+namespace toolbelt {
+
+// An event loop that calls a function when a file descriptor is ready.
+// File descriptors are registered once rather than being passed to poll
+// each time around the loop, so the cost of waiting doesn't depend on the
+// number of file descriptors.  This uses epoll on Linux and kqueue on
+// other systems.
+//
+// Notification is edge triggered: the callback is called when the fd
+// becomes ready, not for as long as it is ready, so it must read (or write)
+// until it gets EAGAIN.  The registered fds should be nonblocking.
+//
+// The events are the same as for poll: POLLIN, POLLOUT, POLLERR and POLLHUP.
+//
+// The loop itself has a file descriptor (GetPollFd) that is readable when
+// there are events to handle, so it can be run in a coroutine and the
+// scheduler only needs to poll that single fd for all the registered ones.
+//
+// Like FileDescriptor, this is not thread safe, apart from Stop.
+class EventLoop {
+public:
+  using Callback = std::function<void(uint32_t events)>;
+
+  EventLoop() = default;
+  EventLoop(const EventLoop &) = delete;
+  EventLoop(EventLoop &&) = default;
+  EventLoop &operator=(const EventLoop &) = delete;
+  EventLoop &operator=(EventLoop &&) = default;
+  ~EventLoop() = default;
+
+  absl::Status Open();
+  static absl::StatusOr<EventLoop> Create();
+
+  // Call 'callback' when 'fd' is ready for any of 'events'.  The loop holds
+  // a reference to the fd until it's removed.
+  absl::Status Add(const FileDescriptor &fd, uint32_t events,
+                   Callback callback);
+
+  // Change the events for an fd that has been added.
+  absl::Status Modify(const FileDescriptor &fd, uint32_t events);
+
+  absl::Status Remove(const FileDescriptor &fd);
+
+  // Call 'callback' when 'trigger' is triggered.  The trigger is cleared
+  // before the callback is called.
+  absl::Status AddTrigger(TriggerFd &trigger, std::function<void()> callback);
+
+  // Wait up to 'timeout_ms' milliseconds (-1 is forever) for events and call
+  // the callbacks for them.  Returns the number of events handled.
+  absl::StatusOr<int> RunOnce(int timeout_ms = -1);
+
+  // Handle events until Stop is called.  If 'c' is not null, the coroutine
+  // waits for the loop's poll fd so that other coroutines can run.
+  absl::Status Run(co::Coroutine *c = nullptr);
+
+  // Make Run return.  This can be called from a callback or another thread.
+  void Stop();
+
+  // Number of fds registered, including the internal wakeup fd.
+  size_t NumFds() const { return handlers_.size(); }
+
+  const FileDescriptor &GetPollFd() const { return poll_fd_; }
+
+private:
+  struct Handler {
+    FileDescriptor fd;
+    uint32_t events;
+    Callback callback;
+  };
+
+  absl::Status Register(int fd, uint32_t events, bool add);
+
+  FileDescriptor poll_fd_;   // The epoll or kqueue fd.
+  TriggerFd stop_trigger_;   // Wakes up the loop for Stop.
+  bool stopped_ = false;
+  // The handlers are shared so they survive being removed while they
+  // are being called.
+  std::unordered_map<int, std::shared_ptr<Handler>> handlers_;
+};
+
+} // namespace toolbelt
+
+#endif // __TOOLBELT_EVENT_LOOP_H
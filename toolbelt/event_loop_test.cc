@@ -0,0 +1,105 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/event_loop.h"
+#include "toolbelt/pipe.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+using EventLoop = toolbelt::EventLoop;
+using Pipe = toolbelt::Pipe;
+
+TEST(EventLoopTest, ReadReady) {
+  auto loop = EventLoop::Create();
+  ASSERT_TRUE(loop.ok());
+
+  // Lots of pipes, only one of which is written to.
+  std::vector<Pipe> pipes;
+  std::vector<int> called(100);
+  for (int i = 0; i < 100; i++) {
+    auto p = Pipe::Create();
+    ASSERT_TRUE(p.ok());
+    pipes.push_back(std::move(*p));
+    ASSERT_TRUE(pipes.back().ReadFd().SetNonBlocking().ok());
+    int fd = pipes.back().ReadFd().Fd();
+    ASSERT_TRUE(loop->Add(pipes.back().ReadFd(), POLLIN,
+                          [fd, i, &called](uint32_t events) {
+                            ASSERT_TRUE(events & POLLIN);
+                            // Edge triggered, so read it all.
+                            char buf[16];
+                            while (::read(fd, buf, sizeof(buf)) > 0) {
+                            }
+                            called[i]++;
+                          })
+                    .ok());
+  }
+  ASSERT_EQ(101, loop->NumFds());
+
+  ASSERT_EQ(5, ::write(pipes[42].WriteFd().Fd(), "hello", 5));
+  absl::StatusOr<int> n = loop->RunOnce(1000);
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(1, *n);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(i == 42 ? 1 : 0, called[i]);
+  }
+
+  // Nothing more until there is more data.
+  n = loop->RunOnce(0);
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(0, *n);
+
+  // A removed fd isn't reported.
+  ASSERT_TRUE(loop->Remove(pipes[42].ReadFd()).ok());
+  ASSERT_FALSE(loop->Remove(pipes[42].ReadFd()).ok());
+  ASSERT_EQ(5, ::write(pipes[42].WriteFd().Fd(), "hello", 5));
+  n = loop->RunOnce(0);
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(0, *n);
+  ASSERT_EQ(1, called[42]);
+}
+
+TEST(EventLoopTest, WriteReady) {
+  auto loop = EventLoop::Create();
+  ASSERT_TRUE(loop.ok());
+  auto p = Pipe::Create();
+  ASSERT_TRUE(p.ok());
+
+  uint32_t ready = 0;
+  ASSERT_TRUE(loop->Add(p->WriteFd(), POLLIN,
+                        [&ready](uint32_t events) { ready |= events; })
+                  .ok());
+  ASSERT_TRUE(loop->RunOnce(0).ok());
+  ASSERT_EQ(0, ready);
+
+  // Asking for POLLOUT reports that the pipe can be written.
+  ASSERT_TRUE(loop->Modify(p->WriteFd(), POLLOUT).ok());
+  ASSERT_TRUE(loop->RunOnce(1000).ok());
+  ASSERT_TRUE(ready & POLLOUT);
+}
+
+TEST(EventLoopTest, TriggerAndStop) {
+  auto loop = EventLoop::Create();
+  ASSERT_TRUE(loop.ok());
+  auto trigger = toolbelt::TriggerFd::Create();
+  ASSERT_TRUE(trigger.ok());
+
+  int triggered = 0;
+  ASSERT_TRUE(loop->AddTrigger(*trigger, [&]() {
+                    if (++triggered == 3) {
+                      loop->Stop();
+                    } else {
+                      trigger->Trigger();
+                    }
+                  })
+                  .ok());
+  trigger->Trigger();
+  ASSERT_TRUE(loop->Run().ok());
+  ASSERT_EQ(3, triggered);
+
+  // Stop from another thread.
+  std::thread t([&loop]() { loop->Stop(); });
+  ASSERT_TRUE(loop->Run().ok());
+  t.join();
+}
@@ -1,18 +1,218 @@
 #include "toolbelt/fd.h"
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#else
+#include <dirent.h>
+#include <vector>
+#endif
+
 namespace toolbelt {
 
-// Close all open file descriptor for which the predicate returns true.
-void CloseAllFds(std::function<bool(int)> predicate) {
+// Call 'fn' for each open fd.  This lists the open fds rather than trying
+// every number below RLIMIT_NOFILE, which can be very large.  It doesn't
+// allocate memory so it can be used in a child between fork and exec.
+// Returns false if the open fds can't be listed.
+template <typename Fn> static bool ForEachOpenFd(Fn fn) {
+#if defined(__linux__)
+  int dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir == -1) {
+    return false;
+  }
+  // Use getdents64 directly as opendir allocates.
+  char buffer[4096];
+  for (;;) {
+    long n = syscall(SYS_getdents64, dir, buffer, sizeof(buffer));
+    if (n <= 0) {
+      break;
+    }
+    for (long offset = 0; offset < n;) {
+      struct linux_dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+      };
+      auto *entry = reinterpret_cast<linux_dirent64 *>(buffer + offset);
+      offset += entry->d_reclen;
+      int fd = 0;
+      const char *p = entry->d_name;
+      if (*p < '0' || *p > '9') {
+        continue; // . and ..
+      }
+      for (; *p >= '0' && *p <= '9'; p++) {
+        fd = fd * 10 + (*p - '0');
+      }
+      if (fd != dir) {
+        fn(fd);
+      }
+    }
+  }
+  close(dir);
+  return true;
+#else
+  DIR *dir = opendir("/dev/fd");
+  if (dir == nullptr) {
+    return false;
+  }
+  int dir_fd = dirfd(dir);
+  // Collect the fds first as closing them while reading /dev/fd isn't safe
+  // everywhere.
+  std::vector<int> fds;
+  while (struct dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9') {
+      int fd = atoi(entry->d_name);
+      if (fd != dir_fd) {
+        fds.push_back(fd);
+      }
+    }
+  }
+  closedir(dir);
+  for (int fd : fds) {
+    fn(fd);
+  }
+  return true;
+#endif
+}
+
+// Close the open fds for which 'predicate' returns true.
+template <typename Pred> static void CloseOpenFds(Pred predicate) {
+  if (ForEachOpenFd([&predicate](int fd) {
+        if (predicate(fd)) {
+          (void)close(fd);
+        }
+      })) {
+    return;
+  }
+  // Can't list the fds, try them all.  Any fd that F_GETFD succeeds on is
+  // open, whatever its flags.
   struct rlimit lim;
   int e = getrlimit(RLIMIT_NOFILE, &lim);
   if (e == 0) {
-    for (int fd = 0; fd < lim.rlim_cur; fd++) {
-      if (fcntl(fd, F_GETFD) == 0 && predicate(fd) ) {
-        (void)close(fd);
+    for (rlim_t fd = 0; fd < lim.rlim_cur; fd++) {
+      if (fcntl(int(fd), F_GETFD) != -1 && predicate(int(fd))) {
+        (void)close(int(fd));
+      }
+    }
+  }
+}
+
+// Close all open file descriptor for which the predicate returns true.
+void CloseAllFds(std::function<bool(int)> predicate) {
+  CloseOpenFds(predicate);
+}
+
+void CloseAllFdsExcept(absl::Span<const int> keep) {
+#if defined(__linux__) && defined(SYS_close_range)
+  // Close the gaps between the fds to keep, in order.  There are only
+  // ever a few to keep so this doesn't bother to sort them.
+  unsigned int low = 0;
+  for (;;) {
+    // The lowest fd to keep that's at or above 'low'.
+    int next = -1;
+    for (int k : keep) {
+      if (k >= 0 && unsigned(k) >= low && (next == -1 || k < next)) {
+        next = k;
+      }
+    }
+    if (next == -1 || unsigned(next) > low) {
+      unsigned int high = next == -1 ? ~0U : unsigned(next) - 1;
+      if (syscall(SYS_close_range, low, high, 0) == -1) {
+        break; // Not supported, list them instead.
+      }
+    }
+    if (next == -1) {
+      return;
+    }
+    low = unsigned(next) + 1;
+  }
+#endif
+  CloseOpenFds([keep](int fd) {
+    for (int k : keep) {
+      if (k == fd) {
+        return false;
       }
     }
+    return true;
+  });
+}
+
+// The pool of shared data is in chunks that are allocated when an fd in
+// them is first used and never freed.  Fds beyond the last chunk get
+// their shared data from the heap.
+static constexpr int kPoolChunkSize = 1024;
+static constexpr int kNumPoolChunks = 1024;
+
+template <typename SharedData> static SharedData *PoolEntry(int fd) {
+  static std::atomic<SharedData *> chunks[kNumPoolChunks];
+  std::atomic<SharedData *> &chunk = chunks[fd / kPoolChunkSize];
+  SharedData *entries = chunk.load(std::memory_order_acquire);
+  if (entries == nullptr) {
+    SharedData *new_entries = new SharedData[kPoolChunkSize];
+    if (chunk.compare_exchange_strong(entries, new_entries,
+                                      std::memory_order_acq_rel)) {
+      entries = new_entries;
+    } else {
+      // Another thread got there first.
+      delete[] new_entries;
+    }
+  }
+  return &entries[fd % kPoolChunkSize];
+}
+
+FileDescriptor::SharedData *FileDescriptor::SharedData::Claim(int fd) {
+  if (fd >= 0 && fd < kPoolChunkSize * kNumPoolChunks) {
+    SharedData *data = PoolEntry<SharedData>(fd);
+    bool in_use = false;
+    if (data->in_use.compare_exchange_strong(in_use, true,
+                                             std::memory_order_acquire)) {
+      data->fd.store(fd, std::memory_order_relaxed);
+      data->flags.store(0, std::memory_order_relaxed);
+      data->refs.store(1, std::memory_order_relaxed);
+      data->pooled = true;
+      return data;
+    }
   }
+  SharedData *data = new SharedData();
+  data->fd.store(fd, std::memory_order_relaxed);
+  data->refs.store(1, std::memory_order_relaxed);
+  return data;
 }
 
-}
\ No newline at end of file
+void FileDescriptor::SharedData::Destroy() {
+  int f = fd.exchange(-1, std::memory_order_relaxed);
+  if (f != -1) {
+    ::close(f);
+  }
+  if (pooled) {
+    // The fd is closed so the OS can reuse its number, and then so can we.
+    in_use.store(false, std::memory_order_release);
+  } else {
+    delete this;
+  }
+}
+
+uint8_t FileDescriptor::Flags() const {
+  if (data_ == nullptr) {
+    return 0;
+  }
+  uint8_t flags = data_->flags.load(std::memory_order_relaxed);
+  if ((flags & SharedData::kFlagsKnown) != 0 || !Valid()) {
+    return flags;
+  }
+  // First time, ask the OS.
+  flags = SharedData::kFlagsKnown;
+  int fl = fcntl(Fd(), F_GETFL, 0);
+  if (fl != -1 && (fl & O_NONBLOCK) != 0) {
+    flags |= SharedData::kNonBlocking;
+  }
+  int fd_flags = fcntl(Fd(), F_GETFD, 0);
+  if (fd_flags != -1 && (fd_flags & FD_CLOEXEC) != 0) {
+    flags |= SharedData::kCloseOnExec;
+  }
+  data_->flags.fetch_or(flags, std::memory_order_relaxed);
+  return data_->flags.load(std::memory_order_relaxed);
+}
+
+}
@@ -7,10 +7,13 @@
 
 #include "absl/status/status.h"
 #include "absl/strings/str_format.h"
+#include "absl/types/span.h"
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
 #include <fcntl.h>
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <iostream>
 #include <sys/poll.h>
@@ -21,8 +24,15 @@
 namespace toolbelt {
 
 // Close all open file descriptor for which the predicate returns true.
+// Only the open fds are visited (from /proc/self/fd or /dev/fd), so the
+// time taken doesn't depend on RLIMIT_NOFILE.
 void CloseAllFds(std::function<bool(int)> predicate);
 
+// Close all open file descriptors except those in 'keep'.  On Linux this
+// uses close_range.  Neither of these allocate memory on Linux so they can
+// be called in a child process between fork and exec.
+void CloseAllFdsExcept(absl::Span<const int> keep);
+
 // This represents an open file descriptor.   It counts references to the
 // OS fd and closes when all references have gone away.
 //
@@ -37,7 +47,15 @@ void CloseAllFds(std::function<bool(int)> predicate);
 // copied FileDescriptor objects around will not exhaust the OSes fd
 // limits.
 //
-// Note: this is not thread safe, because threads are evil.
+// Copying, moving and destroying FileDescriptors that refer to the same
+// OS fd in different threads is safe, as with std::shared_ptr.  Using the
+// same FileDescriptor object in more than one thread at once is not.
+//
+// The shared data comes from a pool indexed by OS fd number, so making a
+// FileDescriptor doesn't allocate memory.  The fd's nonblocking and
+// close-on-exec flags are remembered so that checking them doesn't need a
+// system call.  If you change them behind the FileDescriptor's back (with
+// fcntl on Fd()) it won't know.
 //
 // Another note: don't do this:
 // FileDescriptor fd1(123);
@@ -54,23 +72,37 @@ public:
   FileDescriptor() = default;
   // FileDescriptor initialize with an OS fd.  Takes ownership
   // of the fd and will close it when all references go away.
-  explicit FileDescriptor(int fd) : data_(std::make_shared<SharedData>(fd)) {}
+  explicit FileDescriptor(int fd) : data_(SharedData::Claim(fd)) {}
 
   // Copy constructor, increments reference on shared data.  Very cheap.
-  FileDescriptor(const FileDescriptor &f) : data_(f.data_) {}
+  FileDescriptor(const FileDescriptor &f) : data_(f.data_) {
+    if (data_ != nullptr) {
+      data_->Ref();
+    }
+  }
 
   // Move constructor, just moves a pointer, also very cheap.
   FileDescriptor(FileDescriptor &&f) : data_(f.data_) { f.data_ = nullptr; }
 
   // Assignment operator.  Copies the pointer and manipulates reference counts.
   FileDescriptor &operator=(const FileDescriptor &f) {
-    data_ = f.data_;
+    if (data_ != f.data_) {
+      if (f.data_ != nullptr) {
+        f.data_->Ref();
+      }
+      Close();
+      data_ = f.data_;
+    }
     return *this;
   }
 
   // Move operator. Just moves the shared data pointer and clears f.
   FileDescriptor &operator=(FileDescriptor &&f) {
-    data_ = std::move(f.data_);
+    if (this != &f) {
+      Close();
+      data_ = f.data_;
+      f.data_ = nullptr;
+    }
     return *this;
   }
 
@@ -78,26 +110,30 @@ public:
   ~FileDescriptor() { Close(); }
 
   // Close the OS fd (and free the shared data) if the references to go 0.
-  void Close() { data_.reset(); }
+  void Close() {
+    if (data_ != nullptr) {
+      data_->Unref();
+      data_ = nullptr;
+    }
+  }
 
   // Is the OS file descriptor open?
   bool IsOpen() const {
     struct stat st;
-    return Valid() && fstat(data_->fd, &st) == 0;
+    return Valid() && fstat(Fd(), &st) == 0;
   }
 
   // Is the OS fd a TTY?
-  bool IsATTY() const { return Valid() && isatty(data_->fd); }
+  bool IsATTY() const { return Valid() && isatty(Fd()); }
 
   // Current reference count.
-  int RefCount() const { return data_ == nullptr ? 0 : data_.use_count(); }
+  int RefCount() const {
+    return data_ == nullptr ? 0 : data_->refs.load(std::memory_order_relaxed);
+  }
 
   // Construct and return a struct pollfd suitable for use in ::poll.
   struct pollfd GetPollFd() {
-    if (data_ == nullptr) {
-      return {.fd = -1, .events = POLLIN};
-    }
-    return {.fd = data_->fd, .events = POLLIN};
+    return {.fd = Fd(), .events = POLLIN};
   }
 
   bool operator==(const FileDescriptor &fd) const {
@@ -109,10 +145,12 @@ public:
 
   // True if the FileDescriptor refers to an OS fd.  Doesn't check
   // that the OS fd is actually open, for that use IsOpen().
-  bool Valid() const { return data_ != nullptr && data_->fd != -1; }
+  bool Valid() const { return Fd() != -1; }
 
   // What's the underlying OS fd (-1 for none or closed).
-  int Fd() const { return data_ == nullptr ? -1 : data_->fd; }
+  int Fd() const {
+    return data_ == nullptr ? -1 : data_->fd.load(std::memory_order_relaxed);
+  }
 
   // Sets the OS fd.  If it's the same as the underlying OS fd, there is
   // no effect (that's not another reference to it).  Allocates new
@@ -123,7 +161,8 @@ public:
       // fd.
       return;
     }
-    data_ = std::make_shared<SharedData>(fd);
+    Close();
+    data_ = SharedData::Claim(fd);
   }
 
   void Reset() { Close(); }
@@ -131,35 +170,67 @@ public:
   // Relinguish ownership of fd.
   void Release() {
     if (data_ != nullptr) {
-      data_->fd = -1;
+      data_->fd.store(-1, std::memory_order_relaxed);
     }
-    data_.reset();
+    Close();
   }
 
+  // Close the OS fd now, even if there are other references to it.  They
+  // become invalid.
   void ForceClose() {
     if (data_ == nullptr) {
       return;
     }
-    if (data_->fd != -1) {
-      close(data_->fd);
-      data_.reset();
+    int fd = data_->fd.exchange(-1, std::memory_order_relaxed);
+    if (fd != -1) {
+      close(fd);
+      Close();
     }
   }
 
+  // The cached fd flags.
+  bool IsNonBlocking() const {
+    return (Flags() & SharedData::kNonBlocking) != 0;
+  }
+  bool IsBlocking() const { return Valid() && !IsNonBlocking(); }
+  bool IsCloseOnExec() const {
+    return (Flags() & SharedData::kCloseOnExec) != 0;
+  }
+
+  // Record the flags the fd was created with (by accept4 or socket with
+  // SOCK_NONBLOCK, say) so they never need to be asked for.
+  void SetKnownFlags(bool nonblocking, bool close_on_exec) {
+    if (data_ == nullptr) {
+      return;
+    }
+    uint8_t flags = SharedData::kFlagsKnown;
+    if (nonblocking) {
+      flags |= SharedData::kNonBlocking;
+    }
+    if (close_on_exec) {
+      flags |= SharedData::kCloseOnExec;
+    }
+    data_->flags.store(flags, std::memory_order_relaxed);
+  }
+
   absl::Status SetNonBlocking() {
     if (!Valid()) {
       return absl::InternalError("Cannot set nonblocking on an invalid fd");
     }
-    int flags = fcntl(data_->fd, F_GETFL, 0);
+    if (IsNonBlocking()) {
+      return absl::OkStatus();
+    }
+    int flags = fcntl(Fd(), F_GETFL, 0);
     if (flags == -1) {
       return absl::InternalError(absl::StrFormat(
           "Failed to set nonblocking mode on fd: %s", strerror(errno)));
     }
-    int e = fcntl(data_->fd, F_SETFL, flags | O_NONBLOCK);
+    int e = fcntl(Fd(), F_SETFL, flags | O_NONBLOCK);
     if (e == -1) {
       return absl::InternalError(absl::StrFormat(
           "Failed to set nonblocking mode on fd: %s", strerror(errno)));
     }
+    data_->flags.fetch_or(SharedData::kNonBlocking, std::memory_order_relaxed);
     return absl::OkStatus();
   }
 
@@ -167,16 +238,20 @@ public:
     if (!Valid()) {
       return absl::InternalError("Cannot set close-on-exec on an invalid fd");
     }
-    int flags = fcntl(data_->fd, F_GETFD, 0);
+    if (IsCloseOnExec()) {
+      return absl::OkStatus();
+    }
+    int flags = fcntl(Fd(), F_GETFD, 0);
     if (flags == -1) {
       return absl::InternalError(absl::StrFormat(
           "Failed to set close-on-exec mode on fd: %s", strerror(errno)));
     }
-    int e = fcntl(data_->fd, F_SETFD, flags | FD_CLOEXEC);
+    int e = fcntl(Fd(), F_SETFD, flags | FD_CLOEXEC);
     if (e == -1) {
       return absl::InternalError(absl::StrFormat(
           "Failed to set close-on-exec mode on fd: %s", strerror(errno)));
     }
+    data_->flags.fetch_or(SharedData::kCloseOnExec, std::memory_order_relaxed);
     return absl::OkStatus();
   }
 
@@ -184,19 +259,40 @@ private:
   // Reference counted OS fd, shared among all FileDescriptors with the
   // same OS fd, provided you don't create two FileDescriptors with the
   // same OS fd (that would be a mistake but there's no way to stop it).
+  //
+  // These live in a pool with an entry for each OS fd number.  If the
+  // entry for an fd is still in use (because of the mistake above, or
+  // because the fd was released or force closed while other
+  // FileDescriptors referred to it) the shared data comes from the heap
+  // instead.
   struct SharedData {
-    SharedData() = default;
-    SharedData(int f) : fd(f) {}
-    ~SharedData() {
-      if (fd != -1) {
-        ::close(fd);
+    static constexpr uint8_t kFlagsKnown = 1;
+    static constexpr uint8_t kNonBlocking = 2;
+    static constexpr uint8_t kCloseOnExec = 4;
+
+    // Get shared data for a new FileDescriptor with one reference.
+    static SharedData *Claim(int fd);
+
+    void Ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+    void Unref() {
+      if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        Destroy();
       }
     }
-    int fd = -1; // OS file descriptor.
+    // Close the fd and return the data to the pool.
+    void Destroy();
+
+    std::atomic<int> fd = -1; // OS file descriptor.
+    std::atomic<int> refs = 0;
+    std::atomic<uint8_t> flags = 0;
+    std::atomic<bool> in_use = false; // Pool entry is taken.
+    bool pooled = false;
   };
 
+  uint8_t Flags() const;
+
   // The actual shared data.  If nullptr the FileDescriptor is invalid.
-  std::shared_ptr<SharedData> data_ = nullptr;
+  SharedData *data_ = nullptr;
 };
 
 } // namespace toolbelt
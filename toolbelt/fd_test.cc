@@ -5,6 +5,9 @@
 #include "fd.h"
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <vector>
 
 using FileDescriptor = toolbelt::FileDescriptor;
 
@@ -173,3 +176,137 @@ TEST(FdTest, Reset) {
   int e = fstat(f, &st);
   ASSERT_EQ(-1, e);
 }
+
+TEST(FdTest, ReuseNumber) {
+  int f = dup(1);
+  FileDescriptor fd1(f);
+  FileDescriptor copy(fd1);
+
+  // Release it while there's another reference.  The OS will give us the
+  // same number again.
+  fd1.Release();
+  ASSERT_EQ(-1, copy.Fd());
+  close(f);
+  int f2 = dup(1);
+  ASSERT_EQ(f, f2);
+  FileDescriptor fd2(f2);
+  ASSERT_EQ(f2, fd2.Fd());
+  ASSERT_EQ(1, fd2.RefCount());
+
+  // Dropping the stale reference doesn't affect the new one.
+  copy.Close();
+  struct stat st;
+  ASSERT_EQ(0, fstat(f2, &st));
+  fd2.Close();
+  ASSERT_EQ(-1, fstat(f2, &st));
+}
+
+TEST(FdTest, ForceClose) {
+  int f = dup(1);
+  FileDescriptor fd1(f);
+  FileDescriptor fd2(fd1);
+  fd1.ForceClose();
+  ASSERT_FALSE(fd1.Valid());
+  ASSERT_FALSE(fd2.Valid());
+  struct stat st;
+  ASSERT_EQ(-1, fstat(f, &st));
+}
+
+TEST(FdTest, Flags) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  FileDescriptor r(fds[0]);
+  FileDescriptor w(fds[1]);
+  ASSERT_TRUE(r.IsBlocking());
+  ASSERT_FALSE(r.IsNonBlocking());
+  ASSERT_FALSE(r.IsCloseOnExec());
+
+  ASSERT_TRUE(r.SetNonBlocking().ok());
+  ASSERT_TRUE(r.SetCloseOnExec().ok());
+  ASSERT_TRUE(r.IsNonBlocking());
+  ASSERT_TRUE(r.IsCloseOnExec());
+  ASSERT_NE(0, fcntl(fds[0], F_GETFL) & O_NONBLOCK);
+  ASSERT_NE(0, fcntl(fds[0], F_GETFD) & FD_CLOEXEC);
+  // Copies share the flags.
+  FileDescriptor copy(r);
+  ASSERT_TRUE(copy.IsNonBlocking());
+  ASSERT_TRUE(w.IsBlocking());
+
+  // The flags are read from the OS the first time.
+  int f = dup(1);
+  ASSERT_EQ(0, fcntl(f, F_SETFL, fcntl(f, F_GETFL) | O_NONBLOCK));
+  FileDescriptor fd(f);
+  ASSERT_TRUE(fd.IsNonBlocking());
+  ASSERT_TRUE(fd.SetNonBlocking().ok());
+
+  FileDescriptor invalid;
+  ASSERT_FALSE(invalid.IsBlocking());
+  ASSERT_FALSE(invalid.IsNonBlocking());
+}
+
+TEST(FdTest, Threads) {
+  int f = dup(1);
+  FileDescriptor fd(f);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([fd]() {
+      for (int i = 0; i < 10000; i++) {
+        FileDescriptor copy(fd);
+        FileDescriptor other;
+        other = copy;
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(1, fd.RefCount());
+  struct stat st;
+  ASSERT_EQ(0, fstat(f, &st));
+}
+
+TEST(FdTest, CloseAllFds) {
+  std::vector<int> fds;
+  for (int i = 0; i < 6; i++) {
+    fds.push_back(dup(1));
+  }
+  // Close the even ones.
+  toolbelt::CloseAllFds([&fds](int fd) {
+    for (size_t i = 0; i < fds.size(); i += 2) {
+      if (fds[i] == fd) {
+        return true;
+      }
+    }
+    return false;
+  });
+  for (size_t i = 0; i < fds.size(); i++) {
+    ASSERT_EQ(i % 2 == 0, fcntl(fds[i], F_GETFD) == -1) << i;
+  }
+  for (size_t i = 1; i < fds.size(); i += 2) {
+    close(fds[i]);
+  }
+}
+
+TEST(FdTest, CloseAllFdsExcept) {
+  int a = dup(1);
+  int b = dup(1);
+  int c = dup(1);
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    // Keep stdin, stderr and b.
+    int keep[] = {0, 2, b};
+    toolbelt::CloseAllFdsExcept(keep);
+    bool ok = fcntl(0, F_GETFD) != -1 && fcntl(2, F_GETFD) != -1 &&
+              fcntl(b, F_GETFD) != -1 && fcntl(1, F_GETFD) == -1 &&
+              fcntl(a, F_GETFD) == -1 && fcntl(c, F_GETFD) == -1;
+    _exit(ok ? 0 : 1);
+  }
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(0, WEXITSTATUS(status));
+  close(a);
+  close(b);
+  close(c);
+}
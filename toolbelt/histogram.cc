@@ -0,0 +1,85 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/histogram.h"
+#include "absl/strings/str_format.h"
+#include <algorithm>
+#include <cmath>
+
+namespace toolbelt {
+
+void LatencyHistogram::Reset() {
+  for (auto &b : buckets_) {
+    b.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  min_.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Percentile(double percentile) const {
+  uint64_t count = Count();
+  if (count == 0) {
+    return 0;
+  }
+  if (percentile <= 0) {
+    return Min();
+  }
+  percentile = std::min(percentile, 100.0);
+  uint64_t rank = uint64_t(std::ceil(percentile / 100.0 * double(count)));
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      // The bucket's limit can be beyond the largest value actually seen.
+      return std::min(BucketLimit(i), Max());
+    }
+  }
+  return Max();
+}
+
+double LatencyHistogram::Mean() const {
+  uint64_t count = Count();
+  if (count == 0) {
+    return 0;
+  }
+  return double(sum_.load(std::memory_order_relaxed)) / double(count);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other) {
+  for (int i = 0; i < kNumBuckets; i++) {
+    if (uint64_t n = other.buckets_[i].load(std::memory_order_relaxed);
+        n != 0) {
+      buckets_[i].fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+  count_.fetch_add(other.Count(), std::memory_order_relaxed);
+  sum_.fetch_add(other.sum_.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+  uint64_t other_min = other.min_.load(std::memory_order_relaxed);
+  uint64_t min = min_.load(std::memory_order_relaxed);
+  while (other_min < min &&
+         !min_.compare_exchange_weak(min, other_min,
+                                     std::memory_order_relaxed)) {
+  }
+  uint64_t other_max = other.Max();
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (other_max > max &&
+         !max_.compare_exchange_weak(max, other_max,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+std::string LatencyHistogram::Summary() const {
+  return absl::StrFormat(
+      "count %d min %dns mean %.0fns p50 %dns p99 %dns p99.9 %dns max %dns",
+      Count(), Min(), Mean(), Percentile(50), Percentile(99),
+      Percentile(99.9), Max());
+}
+
+} // namespace toolbelt
@@ -0,0 +1,121 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __TOOLBELT_HISTOGRAM_H
+#define __TOOLBELT_HISTOGRAM_H
+
+#include "toolbelt/clock.h"
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+namespace toolbelt {
+
+// A histogram of latencies in nanoseconds, in the style of HdrHistogram.
+// Values below 64 have a bucket each and above that each power of 2 is
+// split into 32 buckets, so a value is known to within about 3% across
+// the whole 64 bit range.
+//
+// Record is lock free (a few relaxed atomic adds) so any number of
+// threads can record into the same histogram without affecting each
+// other much.  The statistics are read while recording continues and so
+// are only approximately consistent with each other.
+class LatencyHistogram {
+public:
+  static constexpr int kSubBucketBits = 5;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  static constexpr int kNumBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  LatencyHistogram() { Reset(); }
+  LatencyHistogram(const LatencyHistogram &) = delete;
+  LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+  void Record(uint64_t ns) {
+    buckets_[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t min = min_.load(std::memory_order_relaxed);
+    while (ns < min && !min_.compare_exchange_weak(min, ns,
+                                                   std::memory_order_relaxed)) {
+    }
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (ns > max && !max_.compare_exchange_weak(max, ns,
+                                                   std::memory_order_relaxed)) {
+    }
+  }
+
+  // The value that 'percentile' percent of the recorded values are less
+  // than or equal to, to within the bucket size.  0 if nothing has been
+  // recorded.
+  uint64_t Percentile(double percentile) const;
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t Min() const {
+    return Count() == 0 ? 0 : min_.load(std::memory_order_relaxed);
+  }
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  double Mean() const;
+
+  // Add all the values in 'other' to this one.
+  void Merge(const LatencyHistogram &other);
+
+  // Clear it.  Not atomic with respect to concurrent Records.
+  void Reset();
+
+  // Something like "count 1000 min 10ns mean 42ns p50 40ns p99 90ns
+  // p99.9 120ns max 130ns".
+  std::string Summary() const;
+
+  static int BucketIndex(uint64_t v) {
+    if (v < 2 * kSubBuckets) {
+      return int(v);
+    }
+    int shift = 63 - __builtin_clzll(v) - kSubBucketBits;
+    return shift * kSubBuckets + int(v >> shift);
+  }
+
+  // The largest value that goes in the bucket.
+  static uint64_t BucketLimit(int index) {
+    if (index < 2 * kSubBuckets) {
+      return uint64_t(index);
+    }
+    int shift = index / kSubBuckets - 1;
+    uint64_t sub = uint64_t(index % kSubBuckets + kSubBuckets);
+    return ((sub + 1) << shift) - 1;
+  }
+
+private:
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> min_;
+  std::atomic<uint64_t> max_;
+  std::atomic<uint64_t> buckets_[kNumBuckets];
+};
+
+// Records the time from construction to destruction in a histogram,
+// using the cycle counter, for timing a scope:
+//
+//   {
+//     ScopedTimer timer(send_latency);
+//     socket.SendMessage(...);
+//   }
+class ScopedTimer {
+public:
+  explicit ScopedTimer(LatencyHistogram &histogram)
+      : histogram_(histogram), start_(CycleCounter()) {}
+  ~ScopedTimer() {
+    histogram_.Record(CyclesToNanoseconds(CycleCounter() - start_));
+  }
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+  LatencyHistogram &histogram_;
+  uint64_t start_;
+};
+
+} // namespace toolbelt
+
+#endif // __TOOLBELT_HISTOGRAM_H
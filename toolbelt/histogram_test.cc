@@ -0,0 +1,120 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/histogram.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+using LatencyHistogram = toolbelt::LatencyHistogram;
+
+TEST(ClockTest, FastNow) {
+  toolbelt::CalibrateCycleCounter();
+  // FastNow keeps up with Now to within a small error.
+  for (int i = 0; i < 5; i++) {
+    uint64_t now = toolbelt::Now();
+    uint64_t fast = toolbelt::FastNow();
+    int64_t diff = int64_t(fast - now);
+    ASSERT_LT(std::abs(diff), 1000000) << i;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  uint64_t start = toolbelt::CycleCounter();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  uint64_t ns = toolbelt::CyclesToNanoseconds(toolbelt::CycleCounter() - start);
+  ASSERT_GE(ns, 45000000);
+  ASSERT_LT(ns, 500000000);
+}
+
+TEST(HistogramTest, Buckets) {
+  // Every value goes in a bucket whose limit is no less than it and the
+  // buckets are in order.  Above 64 the buckets hold more than one value.
+  int last = -1;
+  for (uint64_t v : {uint64_t(0), uint64_t(1), uint64_t(63), uint64_t(64),
+                     uint64_t(65), uint64_t(1000), uint64_t(123456789),
+                     uint64_t(1) << 40, ~uint64_t(0)}) {
+    int index = LatencyHistogram::BucketIndex(v);
+    ASSERT_GE(index, last) << v;
+    ASSERT_LT(index, LatencyHistogram::kNumBuckets) << v;
+    ASSERT_GE(LatencyHistogram::BucketLimit(index), v);
+    if (index > 0) {
+      ASSERT_LT(LatencyHistogram::BucketLimit(index - 1), v);
+    }
+    last = index;
+  }
+  ASSERT_EQ(LatencyHistogram::kNumBuckets - 1,
+            LatencyHistogram::BucketIndex(~uint64_t(0)));
+}
+
+TEST(HistogramTest, Percentiles) {
+  LatencyHistogram h;
+  ASSERT_EQ(0, h.Count());
+  ASSERT_EQ(0, h.Percentile(50));
+  ASSERT_EQ(0, h.Min());
+
+  for (uint64_t i = 1; i <= 10000; i++) {
+    h.Record(i * 100);
+  }
+  ASSERT_EQ(10000, h.Count());
+  ASSERT_EQ(100, h.Min());
+  ASSERT_EQ(1000000, h.Max());
+  ASSERT_DOUBLE_EQ(500050.0, h.Mean());
+
+  // Within the 3% resolution.
+  auto near = [](uint64_t expected, uint64_t actual) {
+    return actual >= expected && actual <= expected + expected / 32;
+  };
+  ASSERT_TRUE(near(500000, h.Percentile(50))) << h.Percentile(50);
+  ASSERT_TRUE(near(990000, h.Percentile(99))) << h.Percentile(99);
+  ASSERT_TRUE(near(999000, h.Percentile(99.9))) << h.Percentile(99.9);
+  ASSERT_EQ(1000000, h.Percentile(100));
+  ASSERT_EQ(100, h.Percentile(0));
+
+  LatencyHistogram other;
+  other.Record(5);
+  other.Record(2000000);
+  h.Merge(other);
+  ASSERT_EQ(10002, h.Count());
+  ASSERT_EQ(5, h.Min());
+  ASSERT_EQ(2000000, h.Max());
+
+  std::string summary = h.Summary();
+  ASSERT_NE(std::string::npos, summary.find("count 10002 min 5ns"))
+      << summary;
+
+  h.Reset();
+  ASSERT_EQ(0, h.Count());
+  ASSERT_EQ(0, h.Max());
+}
+
+TEST(HistogramTest, Threads) {
+  constexpr int kNumThreads = 4;
+  constexpr int kNumValues = 20000;
+  LatencyHistogram h;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&h]() {
+      for (int i = 0; i < kNumValues; i++) {
+        h.Record(i);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(kNumThreads * kNumValues, h.Count());
+  ASSERT_EQ(0, h.Min());
+  ASSERT_EQ(kNumValues - 1, h.Max());
+}
+
+TEST(HistogramTest, ScopedTimer) {
+  LatencyHistogram h;
+  for (int i = 0; i < 3; i++) {
+    toolbelt::ScopedTimer timer(h);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  ASSERT_EQ(3, h.Count());
+  ASSERT_GE(h.Min(), 1900000);
+  ASSERT_LT(h.Max(), 1000000000);
+}
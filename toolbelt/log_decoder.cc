@@ -0,0 +1,41 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Turns binary logs written by a toolbelt::Logger in binary mode into text.
+//
+// Usage: log_decoder [file...]
+//
+// With no files the log is read from standard input.  The text goes to
+// standard output, in color if that is a terminal.
+
+#include "toolbelt/logging.h"
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    absl::Status status = toolbelt::DecodeBinaryLog(stdin, stdout);
+    if (!status.ok()) {
+      fprintf(stderr, "log_decoder: %s\n", status.ToString().c_str());
+      return 1;
+    }
+    return 0;
+  }
+  int result = 0;
+  for (int i = 1; i < argc; i++) {
+    FILE *in = fopen(argv[i], "rb");
+    if (in == nullptr) {
+      fprintf(stderr, "log_decoder: %s: %s\n", argv[i], strerror(errno));
+      result = 1;
+      continue;
+    }
+    absl::Status status = toolbelt::DecodeBinaryLog(in, stdout);
+    fclose(in);
+    if (!status.ok()) {
+      fprintf(stderr, "log_decoder: %s: %s\n", argv[i],
+              status.ToString().c_str());
+      result = 1;
+    }
+  }
+  return result;
+}
@@ -5,11 +5,131 @@
 #include "logging.h"
 #include "absl/strings/str_format.h"
 #include "clock.h"
+#include "toolbelt/queue.h"
+#include <condition_variable>
+#include <ctype.h>
 #include <cstdio>
-#include <inttypes.h>
+#include <mutex>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
 
 namespace toolbelt {
 
+// The state of an asynchronous logger.  Producers fill in records in
+// place in a lock free queue and a single writer thread formats and
+// writes them.
+struct Logger::AsyncState {
+  struct Record {
+    LogLevel level;
+    uint64_t timestamp;
+    const char *format; // For BinaryLog, otherwise null.
+    uint32_t length;
+    char source[64];
+    char text[kBufferSize]; // Encoded args if there's a format.
+  };
+
+  AsyncState(size_t num_slots, LogOverflowPolicy p)
+      : queue(num_slots), policy(p) {}
+
+  TriggeredQueue<MPSCQueue<Record>> queue;
+  LogOverflowPolicy policy;
+  std::thread writer;
+
+  std::atomic<bool> stop{false};
+  alignas(kCacheLineSize) std::atomic<uint64_t> queued{0};
+  std::atomic<uint64_t> dropped{0};
+  alignas(kCacheLineSize) std::atomic<uint64_t> written{0};
+
+  // For things waiting for the writer to make progress: Flush and the
+  // kBlock policy.
+  std::mutex mutex;
+  std::condition_variable progress;
+};
+
+// Most messages written in one writev call.
+static constexpr int kMaxWriteBatch = 64;
+
+// The binary log is a sequence of records, each of which starts with a
+// uint32 length of the rest of the record and a type byte.  Numbers are in
+// host byte order.
+//
+// kHeader: magic, version byte, subsystem.
+// kFormat: uint32 id, format string.  This comes before the first message
+//          that uses it.
+// kMessage: level byte, uint64 timestamp, uint32 format id,
+//           uint16 source length, source, encoded arguments.
+enum class BinaryRecord : uint8_t {
+  kHeader,
+  kFormat,
+  kMessage,
+};
+static constexpr char kBinaryMagic[4] = {'T', 'B', 'L', 'G'};
+static constexpr uint8_t kBinaryVersion = 1;
+
+// No record is longer than a message with the longest source and a full
+// buffer of arguments.  Subsystems and formats are truncated to
+// kBufferSize so their records are shorter.
+static constexpr size_t kMaxBinaryRecord =
+    sizeof(BinaryRecord) + sizeof(uint8_t) + sizeof(uint64_t) +
+    sizeof(uint32_t) + sizeof(uint16_t) + UINT16_MAX + Logger::kBufferSize;
+
+// Text messages are logged in binary as a string with this format.
+static const char kTextFormat[] = "%s";
+
+namespace {
+// Formats timestamps as YYYY-MM-DD HH:MM:SS.nnnnnnnnn.  Breaking the time
+// down with localtime_r is slow (and takes a lock) so it's only done when
+// the second changes; otherwise only the nanoseconds are redone.
+class TimestampFormatter {
+public:
+  const char *Format(uint64_t timestamp) {
+    time_t secs = timestamp / 1000000000LL;
+    if (secs != secs_ || prefix_length_ == 0) {
+      struct tm tm;
+      prefix_length_ = strftime(buffer_, sizeof(buffer_) - 11,
+                                "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+      buffer_[prefix_length_] = '.';
+      secs_ = secs;
+    }
+    uint32_t ns = timestamp % 1000000000LL;
+    char *p = buffer_ + prefix_length_ + 10;
+    *p = '\0';
+    for (int i = 0; i < 9; i++) {
+      *--p = char('0' + ns % 10);
+      ns /= 10;
+    }
+    return buffer_;
+  }
+
+private:
+  time_t secs_ = 0;
+  size_t prefix_length_ = 0;
+  char buffer_[64];
+};
+
+// Each thread that formats messages has its own.
+thread_local TimestampFormatter timestamp_formatter;
+} // namespace
+
+static uint64_t RealTimeNow() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void Logger::SetFastClock(bool fast) {
+  fast_clock_ = fast;
+  if (fast) {
+    // Unsigned arithmetic wraps so the offset works whichever clock is ahead.
+    fast_clock_offset_ = RealTimeNow() - FastNow();
+  }
+}
+
+uint64_t Logger::TimeNow() const {
+  return fast_clock_ ? FastNow() + fast_clock_offset_ : RealTimeNow();
+}
+
 static const char *LogLevelAsString(LogLevel level) {
   switch (level) {
   case LogLevel::kVerboseDebug:
@@ -136,25 +256,28 @@ void Logger::VLog(LogLevel level, const char *fmt, va_list ap) {
   if (level < min_level_) {
     return;
   }
+  uint64_t now_ns = TimeNow();
+
+  if (async_ != nullptr) {
+    // Format straight into the queue.
+    VEnqueue(level, now_ns, "", fmt, ap);
+    if (level == LogLevel::kFatal) {
+      Flush();
+      if (abort_on_fatal_) {
+        abort();
+      }
+    }
+    return;
+  }
+
   size_t n = vsnprintf(buffer_, sizeof(buffer_), fmt, ap);
 
   // Strip final \n if present.  Refactoring from printf can leave
   // this in place.
-  if (buffer_[n - 1] == '\n') {
+  if (n > 0 && n < sizeof(buffer_) && buffer_[n - 1] == '\n') {
     buffer_[n - 1] = '\0';
   }
 
-  struct timespec now_ts;
-  clock_gettime(CLOCK_REALTIME, &now_ts);
-  uint64_t now_ns = now_ts.tv_sec * 1000000000LL + now_ts.tv_nsec;
-
-  char timebuf[64];
-  struct tm tm;
-  n = strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S",
-               localtime_r(&now_ts.tv_sec, &tm));
-  snprintf(timebuf + n, sizeof(timebuf) - n, ".%09" PRIu64,
-           now_ns % 1000000000);
-
   Log(level, now_ns, "", buffer_);
 }
 
@@ -163,41 +286,355 @@ void Logger::Log(LogLevel level, uint64_t timestamp, const std::string &source,
   if (!enabled_ || level < min_level_) {
     return;
   }
+  if (async_ != nullptr) {
+    Enqueue(level, timestamp, source, "%s", text.c_str());
+    if (level == LogLevel::kFatal) {
+      Flush();
+      if (abort_on_fatal_) {
+        abort();
+      }
+    }
+    return;
+  }
+
+  std::string message =
+      Render(level, timestamp, source, nullptr, text.data(), text.size());
+  fwrite(message.data(), 1, message.size(), output_stream_);
+
+  if (level == LogLevel::kFatal && abort_on_fatal_) {
+    abort();
+  }
+}
+
+void Logger::LogEncoded(LogLevel level, const char *fmt, const char *args,
+                        size_t length) {
+  uint64_t now_ns = TimeNow();
+  if (async_ != nullptr) {
+    PushRecord(level, [&](AsyncState::Record &record) {
+      record.level = level;
+      record.timestamp = now_ns;
+      record.format = fmt;
+      record.source[0] = '\0';
+      memcpy(record.text, args, length);
+      record.length = uint32_t(length);
+    });
+    if (level == LogLevel::kFatal) {
+      Flush();
+      if (abort_on_fatal_) {
+        abort();
+      }
+    }
+    return;
+  }
+  if (!binary_) {
+    // Through Log so that an override sees it.
+    Log(level, now_ns, "", internal::FormatLogArgs(fmt, args, length));
+    return;
+  }
+  std::string message = Render(level, now_ns, "", fmt, args, length);
+  fwrite(message.data(), 1, message.size(), output_stream_);
 
+  if (level == LogLevel::kFatal && abort_on_fatal_) {
+    abort();
+  }
+}
+
+std::string Logger::Render(LogLevel level, uint64_t timestamp,
+                           const std::string &source, const char *fmt,
+                           const char *data, size_t length) {
+  if (!binary_) {
+    return FormatMessage(level, timestamp, source,
+                         fmt == nullptr
+                             ? std::string(data, length)
+                             : internal::FormatLogArgs(fmt, data, length));
+  }
+  std::string out;
+  if (fmt != nullptr) {
+    AppendBinary(out, level, timestamp, source, fmt, data, length);
+    return out;
+  }
+  std::string args(1 + sizeof(uint32_t) + length, '\0');
+  char *end = internal::EncodeLogString(args.data(), args.data() + args.size(),
+                                        std::string_view(data, length));
+  AppendBinary(out, level, timestamp, source, kTextFormat, args.data(),
+               end - args.data());
+  return out;
+}
+
+template <typename T> static void AppendValue(std::string &out, const T &v) {
+  out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+// Start a binary record, returning where it starts.
+static size_t BeginRecord(std::string &out, BinaryRecord type) {
+  size_t start = out.size();
+  AppendValue(out, uint32_t(0));
+  AppendValue(out, type);
+  return start;
+}
+
+// Fill in the length of the record started at 'start'.
+static void EndRecord(std::string &out, size_t start) {
+  uint32_t length = uint32_t(out.size() - start - sizeof(uint32_t));
+  memcpy(out.data() + start, &length, sizeof(length));
+}
+
+void Logger::AppendBinary(std::string &out, LogLevel level, uint64_t timestamp,
+                          std::string_view source, const char *fmt,
+                          const char *args, size_t length) {
+  if (format_ids_.empty()) {
+    // First message, start with a header.
+    size_t start = BeginRecord(out, BinaryRecord::kHeader);
+    out.append(kBinaryMagic, sizeof(kBinaryMagic));
+    AppendValue(out, kBinaryVersion);
+    out.append(std::string_view(subsystem_).substr(0, kBufferSize));
+    EndRecord(out, start);
+  }
+  auto [it, inserted] = format_ids_.try_emplace(fmt, format_ids_.size());
+  if (inserted) {
+    size_t start = BeginRecord(out, BinaryRecord::kFormat);
+    AppendValue(out, it->second);
+    out.append(fmt, strnlen(fmt, kBufferSize));
+    EndRecord(out, start);
+  }
+  source = source.substr(0, UINT16_MAX);
+  size_t start = BeginRecord(out, BinaryRecord::kMessage);
+  AppendValue(out, uint8_t(level));
+  AppendValue(out, timestamp);
+  AppendValue(out, it->second);
+  AppendValue(out, uint16_t(source.size()));
+  out.append(source);
+  out.append(args, length);
+  EndRecord(out, start);
+}
+
+std::string Logger::FormatMessage(LogLevel level, uint64_t timestamp,
+                                  const std::string &source,
+                                  std::string text) {
   // Strip final \n if present.  Refactoring from printf can leave
   // this in place.
-  if (text[text.size() - 1] == '\n') {
+  if (!text.empty() && text[text.size() - 1] == '\n') {
     text = text.substr(0, text.size() - 1);
   }
 
-  char timebuf[64];
-  struct tm tm;
-  time_t secs = timestamp / 1000000000LL;
-  size_t n = strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S",
-                      localtime_r(&secs, &tm));
-  snprintf(timebuf + n, sizeof(timebuf) - n, ".%09" PRIu64,
-           timestamp % 1000000000);
+  const char *timebuf = timestamp_formatter.Format(timestamp);
 
+  std::string out;
   switch (display_mode_) {
   case LogDisplayMode::kPlain:
-    fprintf(output_stream_, "%s %s: %s: %s: %s\n", timebuf, subsystem_.c_str(),
-            LogLevelAsString(level), source.c_str(), text.c_str());
+    out = absl::StrFormat("%s %s: %s: %s: %s\n", timebuf, subsystem_,
+                          LogLevelAsString(level), source, text);
     break;
   case LogDisplayMode::kColor: {
     color::Color color = ColorForLogLevel(level);
-    fprintf(output_stream_, "%s%s %s: %s: %s: %s%s\n",
-            ColorString(color).c_str(), timebuf, subsystem_.c_str(),
-            LogLevelAsString(level), source.c_str(), text.c_str(),
-            NormalString().c_str());
+    out = absl::StrFormat("%s%s %s: %s: %s: %s%s\n", ColorString(color),
+                          timebuf, subsystem_, LogLevelAsString(level), source,
+                          text, NormalString());
     break;
   }
   default:
-    LogColumnar(timebuf, level, source, text);
+    LogColumnar(out, timebuf, level, source, text);
     break;
   }
+  return out;
+}
 
-  if (level == LogLevel::kFatal) {
-    abort();
+absl::Status Logger::SetAsync(size_t num_slots, LogOverflowPolicy policy) {
+  if (async_ != nullptr) {
+    return absl::InternalError("Logger is already asynchronous");
+  }
+  auto async = std::make_shared<AsyncState>(num_slots, policy);
+  if (absl::Status status = async->queue.Open(); !status.ok()) {
+    return status;
+  }
+  // Anything buffered in the stream has to come out before what the
+  // writer writes directly to the fd.
+  fflush(output_stream_);
+  async_ = std::move(async);
+  async_->writer = std::thread([this]() { WriterThread(); });
+  return absl::OkStatus();
+}
+
+void Logger::StopAsync() {
+  if (async_ == nullptr) {
+    return;
+  }
+  // The writer empties the queue before it looks at stop.
+  async_->stop = true;
+  async_->queue.Wake();
+  async_->writer.join();
+  async_.reset();
+}
+
+Logger::Logger(const Logger &other) { CopySettings(other); }
+
+Logger &Logger::operator=(const Logger &other) {
+  if (this != &other) {
+    StopAsync();
+    CopySettings(other);
+  }
+  return *this;
+}
+
+void Logger::CopySettings(const Logger &other) {
+  subsystem_ = other.subsystem_;
+  enabled_ = other.enabled_;
+  min_level_ = other.min_level_;
+  output_stream_ = other.output_stream_;
+  in_color_ = other.in_color_;
+  display_mode_ = other.display_mode_;
+  screen_width_ = other.screen_width_;
+  theme_ = other.theme_;
+  std::copy(std::begin(other.column_widths_), std::end(other.column_widths_),
+            std::begin(column_widths_));
+  std::copy(std::begin(other.colors_), std::end(other.colors_),
+            std::begin(colors_));
+  binary_ = other.binary_;
+  abort_on_fatal_ = other.abort_on_fatal_;
+  fast_clock_ = other.fast_clock_;
+  fast_clock_offset_ = other.fast_clock_offset_;
+  format_ids_ = other.format_ids_;
+}
+
+Logger::~Logger() { StopAsync(); }
+
+void Logger::Flush() {
+  if (async_ == nullptr) {
+    fflush(output_stream_);
+    return;
+  }
+  AsyncState &async = *async_;
+  uint64_t queued = async.queued.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(async.mutex);
+  async.progress.wait(lock, [&async, queued]() {
+    return async.written.load(std::memory_order_acquire) >= queued;
+  });
+}
+
+uint64_t Logger::DroppedMessages() const {
+  if (async_ == nullptr) {
+    return 0;
+  }
+  return async_->dropped.load(std::memory_order_relaxed);
+}
+
+void Logger::Enqueue(LogLevel level, uint64_t timestamp,
+                     const std::string &source, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  VEnqueue(level, timestamp, source, fmt, ap);
+  va_end(ap);
+}
+
+void Logger::VEnqueue(LogLevel level, uint64_t timestamp,
+                      const std::string &source, const char *fmt,
+                      va_list ap) {
+  PushRecord(level, [&](AsyncState::Record &record) {
+    record.level = level;
+    record.timestamp = timestamp;
+    record.format = nullptr;
+    snprintf(record.source, sizeof(record.source), "%s", source.c_str());
+    va_list args;
+    va_copy(args, ap);
+    int n = vsnprintf(record.text, sizeof(record.text), fmt, args);
+    va_end(args);
+    record.length =
+        n < 0 ? 0 : uint32_t(std::min(size_t(n), sizeof(record.text) - 1));
+  });
+}
+
+// Put a record in the queue, calling 'fill' to fill it in.
+template <typename Fill> void Logger::PushRecord(LogLevel level, Fill &&fill) {
+  AsyncState &async = *async_;
+
+  // Fatal messages are never dropped.
+  bool block = async.policy == LogOverflowPolicy::kBlock ||
+               level == LogLevel::kFatal;
+  while (!async.queue.TryPushWith(fill)) {
+    if (!block) {
+      async.dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    // The writer is busy so it will see the progress being waited for.  The
+    // timeout covers a notification that happens before we wait.
+    std::unique_lock<std::mutex> lock(async.mutex);
+    async.progress.wait_for(lock, std::chrono::milliseconds(1));
+  }
+  async.queued.fetch_add(1, std::memory_order_release);
+}
+
+// Write all of iov to fd.  There's nowhere to report an error.
+static void WriteFully(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = ::writev(fd, iov, iovcnt);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    while (iovcnt > 0 && size_t(n) >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = reinterpret_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+void Logger::WriterThread() {
+  AsyncState &async = *async_;
+  int fd = fileno(output_stream_);
+  std::vector<std::string> messages(kMaxWriteBatch);
+  struct iovec iov[kMaxWriteBatch];
+  uint64_t reported_dropped = 0;
+
+  for (;;) {
+    int num_records = 0;
+    while (num_records < kMaxWriteBatch &&
+           async.queue.TryPopWith([&](AsyncState::Record &record) {
+             messages[num_records] =
+                 Render(record.level, record.timestamp, record.source,
+                        record.format, record.text, record.length);
+           })) {
+      num_records++;
+    }
+    int num_messages = num_records;
+    if (num_messages == 0 && async.policy == LogOverflowPolicy::kCount) {
+      // Caught up, say how many were dropped since the last time.
+      uint64_t dropped = async.dropped.load(std::memory_order_relaxed);
+      if (dropped != reported_dropped) {
+        std::string text = absl::StrFormat("%d log messages dropped",
+                                           dropped - reported_dropped);
+        messages[num_messages++] =
+            Render(LogLevel::kWarning, TimeNow(), "", nullptr,
+                   text.data(), text.size());
+        reported_dropped = dropped;
+      }
+    }
+    if (num_messages > 0) {
+      for (int i = 0; i < num_messages; i++) {
+        iov[i] = {.iov_base = messages[i].data(),
+                  .iov_len = messages[i].size()};
+      }
+      WriteFully(fd, iov, num_messages);
+      async.written.fetch_add(num_records, std::memory_order_release);
+      {
+        std::lock_guard<std::mutex> lock(async.mutex);
+      }
+      async.progress.notify_all();
+      continue;
+    }
+
+    // Nothing to write, wait until there is.  StopAsync wakes us after
+    // setting stop so we can't miss it.
+    if (async.stop) {
+      break;
+    }
+    async.queue.Wait();
   }
 }
 
@@ -263,8 +700,9 @@ void Logger::SetTheme(LogTheme theme) {
   }
 }
 
-void Logger::LogColumnar(const char *timebuf, LogLevel level,
-                         const std::string &source, const std::string &text) {
+void Logger::LogColumnar(std::string &out, const char *timebuf,
+                         LogLevel level, const std::string &source,
+                         const std::string &text) {
   std::string subsystem = subsystem_;
   if (subsystem_.size() > 20) {
     subsystem = subsystem.substr(0, 19);
@@ -309,9 +747,9 @@ void Logger::LogColumnar(const char *timebuf, LogLevel level,
       }
     }
     // clang-format off.
-    fprintf(output_stream_, "%-*s%s%-*s%s\n", prefix_length,
+    absl::StrAppendFormat(&out, "%-*s%s%-*s%s\n", prefix_length,
             first_line ? prefix.c_str() : "",
-            color::SetColor(ColorForLogLevel(level)).c_str(), int(column_widths_[4]), segment.c_str(), color::ResetColor().c_str());
+            color::SetColor(ColorForLogLevel(level)), int(column_widths_[4]), segment, color::ResetColor());
     // clang-format on
     start += segment.size();
     if (start >= text.size()) {
@@ -329,4 +767,288 @@ void Logger::LogColumnar(const char *timebuf, LogLevel level,
   }
 }
 
+namespace internal {
+
+namespace {
+// Reads the arguments encoded by EncodeLogArgs.
+class LogArgReader {
+public:
+  LogArgReader(const char *args, size_t length)
+      : p_(args), end_(args + length) {}
+
+  struct Arg {
+    LogArgType type;
+    uint64_t bits = 0;
+    std::string_view str;
+
+    int64_t AsInt() const {
+      if (type == LogArgType::kDouble) {
+        return int64_t(AsDouble());
+      }
+      return int64_t(bits);
+    }
+    uint64_t AsUnsigned() const {
+      if (type == LogArgType::kDouble) {
+        return uint64_t(AsDouble());
+      }
+      return bits;
+    }
+    double AsDouble() const {
+      double d;
+      switch (type) {
+      case LogArgType::kDouble:
+        memcpy(&d, &bits, sizeof(d));
+        return d;
+      case LogArgType::kInt:
+        return double(int64_t(bits));
+      default:
+        return double(bits);
+      }
+    }
+  };
+
+  // Returns false if there are no more arguments.
+  bool Next(Arg &arg) {
+    if (p_ >= end_) {
+      return false;
+    }
+    arg.type = LogArgType(*p_++);
+    if (arg.type == LogArgType::kString) {
+      uint32_t length;
+      if (size_t(end_ - p_) < sizeof(length)) {
+        return false;
+      }
+      memcpy(&length, p_, sizeof(length));
+      p_ += sizeof(length);
+      if (size_t(end_ - p_) < length) {
+        return false;
+      }
+      arg.str = std::string_view(p_, length);
+      p_ += length;
+      return true;
+    }
+    if (size_t(end_ - p_) < sizeof(arg.bits)) {
+      return false;
+    }
+    memcpy(&arg.bits, p_, sizeof(arg.bits));
+    p_ += sizeof(arg.bits);
+    return true;
+  }
+
+private:
+  const char *p_;
+  const char *end_;
+};
+
+// snprintf into a std::string.
+template <typename T> void AppendPrintf(std::string &out, const char *spec, T v) {
+  int n = snprintf(nullptr, 0, spec, v);
+  if (n <= 0) {
+    return;
+  }
+  size_t size = out.size();
+  out.resize(size + n + 1);
+  snprintf(out.data() + size, n + 1, spec, v);
+  out.resize(size + n);
+}
+} // namespace
+
+std::string FormatLogArgs(const char *fmt, const char *args, size_t length) {
+  LogArgReader reader(args, length);
+  std::string out;
+  const char *p = fmt;
+  while (*p != '\0') {
+    if (*p != '%') {
+      out += *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      out += '%';
+      p += 2;
+      continue;
+    }
+    // Rebuild the conversion with the length modifier for the type of the
+    // encoded argument.
+    const char *start = p++;
+    std::string spec = "%";
+    bool missing = false;
+    LogArgReader::Arg arg;
+    while (*p != '\0' && strchr("-+ #0", *p) != nullptr) {
+      spec += *p++;
+    }
+    // Width and precision, which may be arguments themselves.
+    for (int part = 0; part < 2; part++) {
+      if (part == 1) {
+        if (*p != '.') {
+          break;
+        }
+        spec += *p++;
+      }
+      if (*p == '*') {
+        p++;
+        if (reader.Next(arg)) {
+          spec += std::to_string(arg.AsInt());
+        } else {
+          missing = true;
+        }
+      }
+      while (isdigit(*p)) {
+        spec += *p++;
+      }
+    }
+    while (*p != '\0' && strchr("hljztLq", *p) != nullptr) {
+      p++;
+    }
+    char conversion = *p;
+    if (conversion == '\0') {
+      out.append(start);
+      break;
+    }
+    p++;
+    if (missing || !reader.Next(arg)) {
+      // Not enough arguments recorded, show the conversion as it is.
+      out.append(start, p - start);
+      continue;
+    }
+    switch (conversion) {
+    case 'd':
+    case 'i':
+      AppendPrintf(out, (spec + "lld").c_str(), (long long)arg.AsInt());
+      break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+      AppendPrintf(out, (spec + "ll" + conversion).c_str(),
+                   (unsigned long long)arg.AsUnsigned());
+      break;
+    case 'c':
+      AppendPrintf(out, (spec + conversion).c_str(), int(arg.AsInt()));
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      AppendPrintf(out, (spec + conversion).c_str(), arg.AsDouble());
+      break;
+    case 's':
+      if (arg.type == LogArgType::kString) {
+        AppendPrintf(out, (spec + conversion).c_str(),
+                     std::string(arg.str).c_str());
+      } else {
+        AppendPrintf(out, (spec + "lld").c_str(), (long long)arg.AsInt());
+      }
+      break;
+    case 'p':
+      if (arg.type == LogArgType::kString) {
+        // A char * is recorded as the string it points to, not its
+        // address, so there's no pointer to show.
+        out += "%!p(string=";
+        out.append(arg.str);
+        out += ')';
+      } else {
+        AppendPrintf(out, (spec + conversion).c_str(),
+                     reinterpret_cast<void *>(uintptr_t(arg.bits)));
+      }
+      break;
+    default:
+      // %n and anything we don't know.
+      out.append(start, p - start);
+      break;
+    }
+  }
+  return out;
+}
+} // namespace internal
+
+absl::Status DecodeBinaryLog(FILE *in, FILE *out) {
+  std::unique_ptr<Logger> logger;
+  std::vector<std::string> formats;
+  std::string record;
+  for (;;) {
+    uint32_t length;
+    size_t n = fread(&length, 1, sizeof(length), in);
+    if (n == 0) {
+      break;
+    }
+    if (n != sizeof(length)) {
+      return absl::InternalError("Truncated binary log");
+    }
+    if (length == 0 || length > kMaxBinaryRecord) {
+      return absl::InternalError(
+          absl::StrFormat("Bad record length %d in binary log", length));
+    }
+    record.resize(length);
+    if (fread(record.data(), 1, length, in) != length) {
+      return absl::InternalError("Truncated binary log");
+    }
+    const char *p = record.data() + 1;
+    const char *end = record.data() + length;
+    auto read = [&p, end](auto &v) {
+      if (size_t(end - p) < sizeof(v)) {
+        return false;
+      }
+      memcpy(&v, p, sizeof(v));
+      p += sizeof(v);
+      return true;
+    };
+    switch (BinaryRecord(record[0])) {
+    case BinaryRecord::kHeader: {
+      char magic[sizeof(kBinaryMagic)];
+      uint8_t version;
+      if (!read(magic) || memcmp(magic, kBinaryMagic, sizeof(magic)) != 0 ||
+          !read(version)) {
+        return absl::InternalError("Not a binary log");
+      }
+      if (version != kBinaryVersion) {
+        return absl::InternalError(
+            absl::StrFormat("Unsupported binary log version %d", version));
+      }
+      // A new log, which may be one of several concatenated together.
+      logger = std::make_unique<Logger>(std::string(p, end - p));
+      logger->SetOutputStream(out);
+      logger->SetLogLevel(LogLevel::kVerboseDebug);
+      logger->SetAbortOnFatal(false);
+      formats.clear();
+      break;
+    }
+    case BinaryRecord::kFormat: {
+      uint32_t id;
+      if (!read(id) || id != formats.size()) {
+        return absl::InternalError("Bad format record in binary log");
+      }
+      formats.emplace_back(p, end - p);
+      break;
+    }
+    case BinaryRecord::kMessage: {
+      uint8_t level;
+      uint64_t timestamp;
+      uint32_t id;
+      uint16_t source_length;
+      if (logger == nullptr) {
+        return absl::InternalError("Binary log has no header");
+      }
+      if (!read(level) || !read(timestamp) || !read(id) ||
+          !read(source_length) || size_t(end - p) < source_length ||
+          id >= formats.size()) {
+        return absl::InternalError("Bad message record in binary log");
+      }
+      std::string source(p, source_length);
+      p += source_length;
+      logger->Log(LogLevel(level), timestamp, source,
+                  internal::FormatLogArgs(formats[id].c_str(), p, end - p));
+      break;
+    }
+    default:
+      // Something newer than us, skip it.
+      break;
+    }
+  }
+  return absl::OkStatus();
+}
+
 } // namespace toolbelt
@@ -5,13 +5,22 @@
 #ifndef __TOOLBELT_LOGGING_H
 #define __TOOLBELT_LOGGING_H
 
+#include "absl/status/status.h"
+#include "toolbelt/clock.h"
 #include "toolbelt/color.h"
+#include <algorithm>
+#include <atomic>
 #include <stdarg.h>
+#include <string.h>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 #include <cstdint>
+#include <memory>
 
 namespace toolbelt {
 
@@ -36,9 +45,105 @@ enum class LogTheme {
   kDark,
 };
 
+// What an asynchronous logger does with a message when its queue is full.
+enum class LogOverflowPolicy {
+  kDrop,  // Throw the message away.
+  kBlock, // Wait for the writer to make room.
+  kCount, // Throw it away and later log how many were thrown away.
+};
+
+namespace internal {
+// Binary encoding of the arguments to Logger::BinaryLog.  Each argument is
+// a type byte followed by the value: 8 bytes for numbers and pointers and
+// a 4 byte length followed by the characters for strings.  Anything
+// convertible to const char * is a string, so a char * given for %p is
+// shown as %!p(string=...) instead of its address.
+enum class LogArgType : uint8_t {
+  kInt,
+  kUnsigned,
+  kDouble,
+  kString,
+  kPointer,
+};
+
+// These return the end of the encoded argument, or nullptr if it doesn't
+// fit.  Strings are truncated to fit.
+inline char *EncodeLogArg(char *p, char *end, LogArgType type,
+                          const void *value, size_t size) {
+  if (size_t(end - p) < 1 + size) {
+    return nullptr;
+  }
+  *p++ = char(type);
+  memcpy(p, value, size);
+  return p + size;
+}
+
+inline char *EncodeLogString(char *p, char *end, std::string_view s) {
+  if (size_t(end - p) < 1 + sizeof(uint32_t)) {
+    return nullptr;
+  }
+  uint32_t length = uint32_t(
+      std::min(s.size(), size_t(end - p) - 1 - sizeof(uint32_t)));
+  *p++ = char(LogArgType::kString);
+  memcpy(p, &length, sizeof(length));
+  p += sizeof(length);
+  memcpy(p, s.data(), length);
+  return p + length;
+}
+
+template <typename T> char *EncodeLogArg(char *p, char *end, const T &arg) {
+  if constexpr (std::is_same_v<T, bool>) {
+    uint64_t v = arg;
+    return EncodeLogArg(p, end, LogArgType::kUnsigned, &v, sizeof(v));
+  } else if constexpr (std::is_enum_v<T>) {
+    int64_t v = int64_t(arg);
+    return EncodeLogArg(p, end, LogArgType::kInt, &v, sizeof(v));
+  } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+    int64_t v = arg;
+    return EncodeLogArg(p, end, LogArgType::kInt, &v, sizeof(v));
+  } else if constexpr (std::is_integral_v<T>) {
+    uint64_t v = arg;
+    return EncodeLogArg(p, end, LogArgType::kUnsigned, &v, sizeof(v));
+  } else if constexpr (std::is_floating_point_v<T>) {
+    double v = arg;
+    return EncodeLogArg(p, end, LogArgType::kDouble, &v, sizeof(v));
+  } else if constexpr (std::is_convertible_v<const T &, const char *>) {
+    const char *s = arg;
+    return EncodeLogString(p, end, s == nullptr ? "(null)" : s);
+  } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+    return EncodeLogString(p, end, arg);
+  } else {
+    static_assert(std::is_pointer_v<T>, "Unsupported type for BinaryLog");
+    uint64_t v = reinterpret_cast<uintptr_t>(arg);
+    return EncodeLogArg(p, end, LogArgType::kPointer, &v, sizeof(v));
+  }
+}
+
+// Encode the arguments that fit and return the end of them.
+inline char *EncodeLogArgs(char *p, char *end) { return p; }
+
+template <typename T, typename... Rest>
+char *EncodeLogArgs(char *p, char *end, const T &arg, const Rest &...rest) {
+  char *next = EncodeLogArg(p, end, arg);
+  if (next == nullptr) {
+    return p;
+  }
+  return EncodeLogArgs(next, end, rest...);
+}
+
+// Format encoded arguments using the printf style format string 'fmt'.
+std::string FormatLogArgs(const char *fmt, const char *args, size_t length);
+} // namespace internal
+
 // A logger logs timestamped messages to a FILE pointer, possibly in color.
 // Only messages that are are level above the current log level are
 // logged.
+//
+// Normally the message is written before Log returns.  In asynchronous
+// mode (see SetAsync) Log just puts the message into a queue and a
+// background thread writes it.  This takes the formatting of the timestamp
+// and the write system call off the calling thread and makes the logger
+// safe to use from multiple threads.
 class Logger {
 public:
   Logger() {
@@ -54,11 +159,21 @@ public:
     SetDisplayMode(STDIN_FILENO);
   }
   Logger(LogLevel min) : min_level_(min) {}
-  virtual ~Logger() = default;
+  // A copy has the same settings but is synchronous, since the writer
+  // thread belongs to the original.  Assigning to an asynchronous logger
+  // stops its writer first.
+  Logger(const Logger &other);
+  Logger &operator=(const Logger &other);
+  virtual ~Logger();
 
   void Enable() { enabled_ = true; }
   void Disable() { enabled_ = false; }
 
+  // True if a message at 'level' would be logged.
+  bool IsEnabled(LogLevel level) const {
+    return enabled_ && level >= min_level_;
+  }
+
   // Log a message at the given log level.  If standard error is a TTY
   // it will be in color.
   virtual void Log(LogLevel level, const char *fmt, ...);
@@ -67,6 +182,23 @@ public:
   virtual void Log(LogLevel level, uint64_t timestamp,
                    const std::string &source, std::string text);
 
+  // Log a printf style message without formatting it.  The address of the
+  // format string and the values of the arguments are recorded and the
+  // message is formatted later by the writer thread (in asynchronous
+  // mode) or offline by DecodeBinaryLog (in binary mode).  The format must
+  // be a string literal, or at least outlive the logger.  The arguments can
+  // be numbers, pointers, C strings and std::strings.
+  template <typename... Args>
+  void BinaryLog(LogLevel level, const char *fmt, const Args &...args) {
+    if (!enabled_ || level < min_level_) {
+      return;
+    }
+    char buffer[kBufferSize];
+    char *end = internal::EncodeLogArgs(buffer, buffer + sizeof(buffer),
+                                        args...);
+    LogEncoded(level, fmt, buffer, end - buffer);
+  }
+
   void SetTheme(LogTheme theme);
 
   // All logged messages with a level below the min level will be
@@ -99,15 +231,83 @@ public:
     SetDisplayMode(fileno(stream));
   }
 
-private:
+  // Switch to asynchronous mode with a queue of 'num_slots' messages.
+  // Messages longer than kBufferSize are truncated.  Set up the output
+  // stream, theme and subsystem first as they are used by the writer thread.
+  // A fatal message is always waited for and written before the program
+  // aborts, whatever the policy.  Messages from Log(level, fmt, ...) go
+  // straight to the queue, not through an overridden Log.  The logger must
+  // not be moved while in asynchronous mode.
+  absl::Status SetAsync(size_t num_slots = 256,
+                        LogOverflowPolicy policy = LogOverflowPolicy::kDrop);
+
+  // Write all queued messages and go back to synchronous mode.
+  void StopAsync();
+
+  bool IsAsync() const { return async_ != nullptr; }
+
+  // Wait until all messages logged so far have been written.
+  void Flush();
+
+  // Number of messages thrown away because the asynchronous queue was full.
+  uint64_t DroppedMessages() const;
+
+  // Write messages in a compact binary form instead of text.  The output
+  // can be turned into text by DecodeBinaryLog or the log_decoder program.
+  // Set this before SetAsync.
+  void SetBinary(bool binary) { binary_ = binary; }
+  bool IsBinary() const { return binary_; }
+
+  // Timestamp messages from the cycle counter (see FastNow in clock.h)
+  // instead of reading the real time clock for every message.  The offset
+  // to real time is measured when this is called, so the timestamps don't
+  // follow later changes to the system time.  The first call calibrates
+  // the cycle counter, which takes about 10ms.  Set this before SetAsync.
+  void SetFastClock(bool fast);
+
+  // A fatal message normally aborts the program after it is logged.
+  void SetAbortOnFatal(bool abort_on_fatal) { abort_on_fatal_ = abort_on_fatal; }
+
   static constexpr size_t kBufferSize = 4096;
 
+private:
+  struct AsyncState;
+
+  // Format a message as it is written to the output.
+  std::string FormatMessage(LogLevel level, uint64_t timestamp,
+                            const std::string &source, std::string text);
+
+  // Format a message as it is written to the output, in text or binary.  If
+  // 'fmt' is null 'data' is the text of the message, otherwise it is the
+  // encoded arguments for fmt.
+  std::string Render(LogLevel level, uint64_t timestamp,
+                     const std::string &source, const char *fmt,
+                     const char *data, size_t length);
+  void AppendBinary(std::string &out, LogLevel level, uint64_t timestamp,
+                    std::string_view source, const char *fmt,
+                    const char *args, size_t length);
+
+  // Copy everything except the asynchronous state.
+  void CopySettings(const Logger &other);
+
+  // The time for a message's timestamp, in nanoseconds since the epoch.
+  uint64_t TimeNow() const;
+
+  void LogEncoded(LogLevel level, const char *fmt, const char *args,
+                  size_t length);
+  void Enqueue(LogLevel level, uint64_t timestamp, const std::string &source,
+               const char *fmt, ...);
+  void VEnqueue(LogLevel level, uint64_t timestamp, const std::string &source,
+                const char *fmt, va_list ap);
+  template <typename Fill> void PushRecord(LogLevel level, Fill &&fill);
+  void WriterThread();
+
   // Choose a good display mode.  If we can determine the width of the
   // window, use a columnar output mode, otherwise use plain or color
   // depending on whether the output is a tty or not.
   void SetDisplayMode(int fd);
 
-  void LogColumnar(const char *timebuf, LogLevel level,
+  void LogColumnar(std::string &out, const char *timebuf, LogLevel level,
                    const std::string &source, const std::string &text);
 
   color::Color ColorForLogLevel(LogLevel level);
@@ -128,8 +328,96 @@ private:
   static constexpr int kNumColumns = 5;
   size_t column_widths_[kNumColumns];
   color::Color colors_[kNumColumns];
+
+  // Never shared with copies.  It's a shared_ptr only so that AsyncState
+  // can be incomplete here.
+  std::shared_ptr<AsyncState> async_;
+
+  bool binary_ = false;
+  bool abort_on_fatal_ = true;
+  bool fast_clock_ = false;
+  uint64_t fast_clock_offset_ = 0; // Real time minus FastNow().
+  // Ids of the format strings written to the binary output so far, only
+  // used by the thread doing the writing.
+  std::unordered_map<const char *, uint32_t> format_ids_;
 };
 
+// Read a binary log written by a Logger in binary mode from 'in' and write
+// it to 'out' as text, the same as the Logger would have written it.
+absl::Status DecodeBinaryLog(FILE *in, FILE *out);
+
+namespace internal {
+// For TOOLBELT_LOG_EVERY_N: true for the first of every n calls.
+inline bool LogEveryN(std::atomic<uint64_t> &count, uint64_t n) {
+  return count.fetch_add(1, std::memory_order_relaxed) % n == 0;
+}
+
+// For TOOLBELT_LOG_EVERY_T: true if it's at least interval_ns since it was
+// last true.  Only one of several threads calling at once gets true.
+inline bool LogEveryT(std::atomic<uint64_t> &last, uint64_t interval_ns) {
+  uint64_t now = Now();
+  uint64_t prev = last.load(std::memory_order_relaxed);
+  return (prev == 0 || now - prev >= interval_ns) &&
+         last.compare_exchange_strong(prev, now, std::memory_order_relaxed);
+}
+} // namespace internal
+
 } // namespace toolbelt
 
+// Logging macros.  Unlike calling Logger::Log directly, the arguments are
+// only evaluated if the message is going to be logged.
+//
+// Messages below TOOLBELT_MIN_LOG_LEVEL (the value of a LogLevel: 0 for
+// kVerboseDebug, 1 for kDebug and so on) are removed at compile time.
+// The level must be a constant, like toolbelt::LogLevel::kDebug.
+//
+//   TOOLBELT_LOG(logger, toolbelt::LogLevel::kDebug, "x is %d", x);
+//
+// The _EVERY_N versions log the first of every n messages from the call
+// site and the _EVERY_T versions log at most once every interval_ns
+// nanoseconds, to keep a storm of errors from flooding the log.
+#ifndef TOOLBELT_MIN_LOG_LEVEL
+#define TOOLBELT_MIN_LOG_LEVEL 0
+#endif
+
+#define TOOLBELT_LOG(logger, level, ...)                                       \
+  do {                                                                         \
+    if constexpr (int(level) >= TOOLBELT_MIN_LOG_LEVEL) {                      \
+      if ((logger).IsEnabled(level)) {                                         \
+        (logger).Log(level, __VA_ARGS__);                                      \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define TOOLBELT_BINARY_LOG(logger, level, ...)                                \
+  do {                                                                         \
+    if constexpr (int(level) >= TOOLBELT_MIN_LOG_LEVEL) {                      \
+      if ((logger).IsEnabled(level)) {                                         \
+        (logger).BinaryLog(level, __VA_ARGS__);                                \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define TOOLBELT_LOG_EVERY_N(logger, level, n, ...)                            \
+  do {                                                                         \
+    if constexpr (int(level) >= TOOLBELT_MIN_LOG_LEVEL) {                      \
+      static std::atomic<uint64_t> toolbelt_log_count{0};                      \
+      if ((logger).IsEnabled(level) &&                                         \
+          toolbelt::internal::LogEveryN(toolbelt_log_count, n)) {              \
+        (logger).Log(level, __VA_ARGS__);                                      \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define TOOLBELT_LOG_EVERY_T(logger, level, interval_ns, ...)                  \
+  do {                                                                         \
+    if constexpr (int(level) >= TOOLBELT_MIN_LOG_LEVEL) {                      \
+      static std::atomic<uint64_t> toolbelt_log_time{0};                       \
+      if ((logger).IsEnabled(level) &&                                         \
+          toolbelt::internal::LogEveryT(toolbelt_log_time, interval_ns)) {     \
+        (logger).Log(level, __VA_ARGS__);                                      \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
 #endif //  __TOOLBELT_LOGGING_H
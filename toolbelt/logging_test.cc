@@ -0,0 +1,452 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Verbose debug messages are compiled out of this test.
+#define TOOLBELT_MIN_LOG_LEVEL 1
+
+#include "toolbelt/logging.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+using Logger = toolbelt::Logger;
+using LogLevel = toolbelt::LogLevel;
+using LogOverflowPolicy = toolbelt::LogOverflowPolicy;
+
+namespace {
+std::vector<std::string> ReadLines(FILE *fp) {
+  fflush(fp);
+  rewind(fp);
+  std::vector<std::string> lines;
+  char buf[Logger::kBufferSize + 256];
+  while (fgets(buf, sizeof(buf), fp) != nullptr) {
+    lines.push_back(buf);
+  }
+  // Ready for more to be written.
+  fseek(fp, 0, SEEK_END);
+  return lines;
+}
+
+// Log from several threads at once and check everything that wasn't
+// dropped came out whole.
+void LogFromThreads(Logger &logger, int num_threads, int num_messages) {
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&logger, t, num_messages]() {
+      for (int i = 0; i < num_messages; i++) {
+        logger.Log(LogLevel::kInfo, "thread %d message %d\n", t, i);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+} // namespace
+
+TEST(LoggingTest, Sync) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  logger.Log(LogLevel::kDebug, "not logged");
+  logger.Log(LogLevel::kInfo, "hello %s", "world");
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(1, lines.size());
+  ASSERT_NE(std::string::npos, lines[0].find("test:  I: : hello world\n"));
+  fclose(fp);
+}
+
+TEST(LoggingTest, Async) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  ASSERT_TRUE(logger.SetAsync(16, LogOverflowPolicy::kBlock).ok());
+  ASSERT_TRUE(logger.IsAsync());
+  ASSERT_FALSE(logger.SetAsync().ok());
+
+  LogFromThreads(logger, 4, 1000);
+  logger.Log(LogLevel::kWarning, 1234, "source", "last");
+  logger.Flush();
+  ASSERT_EQ(0, logger.DroppedMessages());
+
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(4001, lines.size());
+  // Each thread's messages are in order.
+  std::vector<int> next(4);
+  for (int i = 0; i < 4000; i++) {
+    int t, n;
+    size_t pos = lines[i].find("thread ");
+    ASSERT_NE(std::string::npos, pos) << lines[i];
+    ASSERT_EQ(2, sscanf(lines[i].c_str() + pos, "thread %d message %d", &t, &n));
+    ASSERT_EQ(next[t], n);
+    next[t]++;
+  }
+  ASSERT_NE(std::string::npos, lines[4000].find("W: source: last\n"));
+
+  logger.StopAsync();
+  ASSERT_FALSE(logger.IsAsync());
+  logger.Log(LogLevel::kInfo, "sync again");
+  ASSERT_EQ(4002, ReadLines(fp).size());
+  fclose(fp);
+}
+
+TEST(LoggingTest, AsyncCopy) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  ASSERT_TRUE(logger.SetAsync().ok());
+
+  // A copy is synchronous and destroying it leaves the original's writer
+  // running.
+  {
+    Logger copy(logger);
+    ASSERT_FALSE(copy.IsAsync());
+    copy.Log(LogLevel::kInfo, "from copy");
+    // The writer writes to the fd, not through the stream.
+    fflush(fp);
+  }
+  ASSERT_TRUE(logger.IsAsync());
+  logger.Log(LogLevel::kInfo, "from original");
+  logger.Flush();
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(2, lines.size());
+  ASSERT_NE(std::string::npos, lines[0].find("test:  I: : from copy\n"));
+  ASSERT_NE(std::string::npos, lines[1].find("test:  I: : from original\n"));
+
+  // Assigning to an asynchronous logger stops its writer first.
+  Logger other("other");
+  other = logger;
+  ASSERT_FALSE(other.IsAsync());
+  Logger async_other("other");
+  async_other.SetOutputStream(fp);
+  ASSERT_TRUE(async_other.SetAsync().ok());
+  async_other.Log(LogLevel::kInfo, "queued");
+  async_other = other;
+  ASSERT_FALSE(async_other.IsAsync());
+  async_other.Log(LogLevel::kInfo, "assigned");
+  lines = ReadLines(fp);
+  ASSERT_EQ(4, lines.size());
+  ASSERT_NE(std::string::npos, lines[2].find("other:  I: : queued\n"));
+  ASSERT_NE(std::string::npos, lines[3].find("test:  I: : assigned\n"));
+
+  logger.StopAsync();
+  fclose(fp);
+}
+
+TEST(LoggingTest, AsyncLongMessage) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  ASSERT_TRUE(logger.SetAsync().ok());
+  std::string big(Logger::kBufferSize * 2, 'x');
+  logger.Log(LogLevel::kInfo, "%s", big.c_str());
+  logger.Flush();
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(1, lines.size());
+  ASSERT_NE(std::string::npos,
+            lines[0].find(std::string(Logger::kBufferSize - 1, 'x') + "\n"));
+  fclose(fp);
+}
+
+TEST(LoggingTest, Drop) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  ASSERT_TRUE(logger.SetAsync(2, LogOverflowPolicy::kDrop).ok());
+  LogFromThreads(logger, 4, 1000);
+  logger.Flush();
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(4000, lines.size() + logger.DroppedMessages());
+  fclose(fp);
+}
+
+TEST(LoggingTest, Count) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  ASSERT_TRUE(logger.SetAsync(2, LogOverflowPolicy::kCount).ok());
+  LogFromThreads(logger, 4, 1000);
+  uint64_t dropped = logger.DroppedMessages();
+  // Stopping writes the count of dropped messages.
+  logger.StopAsync();
+  std::vector<std::string> lines = ReadLines(fp);
+  uint64_t reported = 0;
+  size_t num_logged = 0;
+  for (auto &line : lines) {
+    unsigned long long n;
+    size_t pos = line.find("W: : ");
+    if (pos != std::string::npos &&
+        sscanf(line.c_str() + pos, "W: : %llu log messages dropped", &n) == 1) {
+      reported += n;
+    } else {
+      num_logged++;
+    }
+  }
+  ASSERT_EQ(dropped, reported);
+  ASSERT_EQ(4000, num_logged + dropped);
+  fclose(fp);
+}
+
+TEST(LoggingTest, AsyncFatal) {
+  EXPECT_DEATH(
+      {
+        Logger logger("test");
+        if (!logger.SetAsync(1, LogOverflowPolicy::kDrop).ok()) {
+          return;
+        }
+        for (int i = 0; i < 100; i++) {
+          logger.Log(LogLevel::kInfo, "filler %d", i);
+        }
+        logger.Log(LogLevel::kFatal, "fatal %d", 42);
+      },
+      "fatal 42");
+}
+
+namespace {
+template <typename... Args>
+std::string FormatBinary(const char *fmt, const Args &...args) {
+  char buffer[Logger::kBufferSize];
+  char *end =
+      toolbelt::internal::EncodeLogArgs(buffer, buffer + sizeof(buffer), args...);
+  return toolbelt::internal::FormatLogArgs(fmt, buffer, end - buffer);
+}
+
+// Strip the timestamp from a line of plain output.
+std::string WithoutTime(const std::string &line) {
+  size_t pos = line.find(' ', line.find(' ') + 1);
+  return pos == std::string::npos ? line : line.substr(pos + 1);
+}
+} // namespace
+
+TEST(LoggingTest, FormatLogArgs) {
+  ASSERT_EQ("no args", FormatBinary("no args"));
+  ASSERT_EQ("100%", FormatBinary("%d%%", 100));
+  ASSERT_EQ("-1 4294967295 ff  0x2a", FormatBinary("%d %u %x %*s%#x", -1,
+                                                   0xffffffffU, 255, 1, "", 42));
+  ASSERT_EQ("3.14 1.000000e+00 [abc  ] [  abc]",
+            FormatBinary("%.2f %e [%-5s] [%5s]", 3.14159, 1.0f, "abc",
+                         std::string("abc")));
+  ASSERT_EQ("x 1 (null)", FormatBinary("%c %d %s", 'x', true,
+                                       static_cast<const char *>(nullptr)));
+  ASSERT_EQ("1234567890123 18446744073709551615",
+            FormatBinary("%ld %llu", 1234567890123L, ~0ULL));
+  // Missing arguments are shown as they are.
+  ASSERT_EQ("1 %d %s", FormatBinary("%d %d %s", 1));
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%p", static_cast<void *>(buf));
+  ASSERT_EQ(buf, FormatBinary("%p", static_cast<void *>(buf)));
+  // A char * is recorded as a string, so it has no address to show.
+  char text[] = "text";
+  ASSERT_EQ("%!p(string=text)", FormatBinary("%p", static_cast<char *>(text)));
+}
+
+TEST(LoggingTest, BinaryLogAsText) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  logger.BinaryLog(LogLevel::kInfo, "value %d name %s", 42, std::string("foo"));
+  ASSERT_TRUE(logger.SetAsync().ok());
+  // Formatted by the writer this time.
+  logger.BinaryLog(LogLevel::kInfo, "value %d name %s", 43, "bar");
+  logger.StopAsync();
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(2, lines.size());
+  ASSERT_EQ("test:  I: : value 42 name foo\n", WithoutTime(lines[0]));
+  ASSERT_EQ("test:  I: : value 43 name bar\n", WithoutTime(lines[1]));
+  fclose(fp);
+}
+
+TEST(LoggingTest, Binary) {
+  for (bool async : {false, true}) {
+    FILE *fp = tmpfile();
+    ASSERT_NE(nullptr, fp);
+    Logger logger("binary");
+    logger.SetOutputStream(fp);
+    logger.SetBinary(true);
+    logger.SetAbortOnFatal(false);
+    if (async) {
+      ASSERT_TRUE(logger.SetAsync(16, LogOverflowPolicy::kBlock).ok());
+    }
+    for (int i = 0; i < 100; i++) {
+      logger.BinaryLog(LogLevel::kInfo, "message %d of %s", i, "many");
+      if (i % 10 == 0) {
+        logger.BinaryLog(LogLevel::kWarning, "%.1f%% done", i / 1.0);
+      }
+    }
+    logger.Log(LogLevel::kError, "text %d", 1);
+    logger.Log(LogLevel::kDebug, 1234, "source", "text with source");
+    logger.BinaryLog(LogLevel::kFatal, "fatal");
+    logger.StopAsync();
+
+    fflush(fp);
+    long binary_size = ftell(fp);
+    rewind(fp);
+    FILE *text = tmpfile();
+    ASSERT_NE(nullptr, text);
+    absl::Status status = toolbelt::DecodeBinaryLog(fp, text);
+    ASSERT_TRUE(status.ok()) << status;
+    std::vector<std::string> lines = ReadLines(text);
+    // The debug message is below the log level.
+    ASSERT_EQ(112, lines.size());
+    ASSERT_EQ("binary:  I: : message 0 of many\n", WithoutTime(lines[0]));
+    ASSERT_EQ("binary:  W: : 0.0% done\n", WithoutTime(lines[1]));
+    ASSERT_EQ("binary:  I: : message 99 of many\n", WithoutTime(lines[109]));
+    ASSERT_EQ("binary:  E: : text 1\n", WithoutTime(lines[110]));
+    ASSERT_EQ("binary:  F: : fatal\n", WithoutTime(lines[111]));
+    // The binary is smaller than the text.
+    ASSERT_LT(binary_size, ftell(text));
+    fclose(text);
+    fclose(fp);
+  }
+}
+
+TEST(LoggingTest, DecodeBadLog) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  fwrite("\x08\x00\x00\x00\x00TBLX\x01", 1, 9, fp);
+  rewind(fp);
+  ASSERT_FALSE(toolbelt::DecodeBinaryLog(fp, stdout).ok());
+  fclose(fp);
+
+  // A length that's cut short, and one too big to be a record, are
+  // rejected before anything is allocated for them.
+  fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  fwrite("\x08\x00", 1, 2, fp);
+  rewind(fp);
+  absl::Status status = toolbelt::DecodeBinaryLog(fp, stdout);
+  ASSERT_FALSE(status.ok());
+  ASSERT_NE(std::string::npos, status.message().find("Truncated"));
+  fclose(fp);
+
+  fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  fwrite("\xff\xff\xff\xff\x00", 1, 5, fp);
+  rewind(fp);
+  status = toolbelt::DecodeBinaryLog(fp, stdout);
+  ASSERT_FALSE(status.ok());
+  ASSERT_NE(std::string::npos, status.message().find("Bad record length"));
+  fclose(fp);
+}
+
+TEST(LoggingTest, Macros) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  logger.SetLogLevel(LogLevel::kVerboseDebug);
+  int evaluated = 0;
+  auto arg = [&evaluated]() { return ++evaluated; };
+
+  // Compiled out even though the logger would log it.
+  TOOLBELT_LOG(logger, LogLevel::kVerboseDebug, "verbose %d", arg());
+  ASSERT_EQ(0, evaluated);
+  TOOLBELT_LOG(logger, LogLevel::kDebug, "debug %d", arg());
+  ASSERT_EQ(1, evaluated);
+
+  // Filtered at runtime, so the argument isn't evaluated.
+  logger.SetLogLevel(LogLevel::kInfo);
+  TOOLBELT_LOG(logger, LogLevel::kDebug, "debug %d", arg());
+  TOOLBELT_BINARY_LOG(logger, LogLevel::kDebug, "debug %d", arg());
+  ASSERT_EQ(1, evaluated);
+  TOOLBELT_BINARY_LOG(logger, LogLevel::kInfo, "info %d", arg());
+  ASSERT_EQ(2, evaluated);
+
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(2, lines.size());
+  ASSERT_EQ("test:  D: : debug 1\n", WithoutTime(lines[0]));
+  ASSERT_EQ("test:  I: : info 2\n", WithoutTime(lines[1]));
+  fclose(fp);
+}
+
+TEST(LoggingTest, RateLimited) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  for (int i = 0; i < 100; i++) {
+    TOOLBELT_LOG_EVERY_N(logger, LogLevel::kError, 10, "every 10: %d", i);
+  }
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(10, lines.size());
+  ASSERT_EQ("test:  E: : every 10: 0\n", WithoutTime(lines[0]));
+  ASSERT_EQ("test:  E: : every 10: 90\n", WithoutTime(lines[9]));
+
+  // A storm lasting 50ms logs about 5 messages.
+  uint64_t start = toolbelt::Now();
+  int calls = 0;
+  while (toolbelt::Now() - start < 50000000) {
+    TOOLBELT_LOG_EVERY_T(logger, LogLevel::kError, 10000000, "every 10ms");
+    calls++;
+  }
+  size_t logged = ReadLines(fp).size() - 10;
+  ASSERT_GE(logged, 1);
+  ASSERT_LE(logged, 6);
+  ASSERT_GT(calls, logged);
+  fclose(fp);
+}
+
+TEST(LoggingTest, Timestamps) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  // Some in the same second, then the next second and back again.
+  const uint64_t base = 1700000000ULL * 1000000000ULL;
+  std::vector<uint64_t> times = {
+      base,
+      base + 1,
+      base + 999999999,
+      base + 1000000000,
+      base + 1000000042,
+      base + 5,
+      base + 3600ULL * 1000000000ULL + 100,
+  };
+  for (uint64_t t : times) {
+    logger.Log(LogLevel::kInfo, t, "", "x");
+  }
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(times.size(), lines.size());
+  for (size_t i = 0; i < times.size(); i++) {
+    time_t secs = times[i] / 1000000000;
+    struct tm tm;
+    char expected[64];
+    size_t n = strftime(expected, sizeof(expected), "%Y-%m-%d %H:%M:%S",
+                        localtime_r(&secs, &tm));
+    snprintf(expected + n, sizeof(expected) - n, ".%09llu test: ",
+             static_cast<unsigned long long>(times[i] % 1000000000));
+    ASSERT_EQ(0, lines[i].find(expected)) << lines[i];
+  }
+  fclose(fp);
+}
+
+TEST(LoggingTest, FastClock) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  Logger logger("test");
+  logger.SetOutputStream(fp);
+  logger.SetFastClock(true);
+  time_t before = time(nullptr);
+  logger.Log(LogLevel::kInfo, "fast");
+  time_t after = time(nullptr);
+  std::vector<std::string> lines = ReadLines(fp);
+  ASSERT_EQ(1, lines.size());
+  ASSERT_NE(std::string::npos, lines[0].find("test:  I: : fast\n"));
+
+  // The timestamp is the real time.
+  struct tm tm = {};
+  ASSERT_NE(nullptr, strptime(lines[0].c_str(), "%Y-%m-%d %H:%M:%S", &tm));
+  tm.tm_isdst = -1;
+  time_t secs = mktime(&tm);
+  ASSERT_LE(before - 1, secs);
+  ASSERT_GE(after + 1, secs);
+  fclose(fp);
+}
@@ -0,0 +1,144 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/multi_acceptor.h"
+#include <pthread.h>
+#include <sched.h>
+
+namespace toolbelt {
+
+// The CPUs this process may run on.
+static std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    int n = std::max(1u, std::thread::hardware_concurrency());
+    for (int cpu = 0; cpu < n; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+absl::Status MultiAcceptor::Start(const InetAddress &addr) {
+  if (!threads_.empty()) {
+    return absl::FailedPreconditionError("MultiAcceptor is already started");
+  }
+  if (absl::Status s = stop_.Open(); !s.ok()) {
+    return s;
+  }
+  std::vector<int> cpus = AllowedCpus();
+  int num_threads =
+      options_.num_threads > 0 ? options_.num_threads : int(cpus.size());
+
+  // The first listener to bind chooses the port if it's 0.
+  InetAddress bind_address = addr;
+  for (int i = 0; i < num_threads; i++) {
+    TCPSocket listener;
+    absl::Status s = listener.SetReusePort();
+    if (s.ok()) {
+      s = listener.Bind(bind_address, /*listen=*/false);
+    }
+    if (s.ok()) {
+      s = listener.Listen(options_.backlog);
+    }
+    if (s.ok()) {
+      // The acceptor coroutine waits for connections, then drains them.
+      s = listener.SetNonBlocking();
+    }
+    if (!s.ok()) {
+      listeners_.clear();
+      return s;
+    }
+#if defined(SO_INCOMING_CPU)
+    if (options_.pin_threads) {
+      // Prefer this listener for connections arriving on its CPU.  Just a
+      // hint, so errors don't matter.
+      int cpu = cpus[i % cpus.size()];
+      (void)setsockopt(listener.GetFileDescriptor().Fd(), SOL_SOCKET,
+                       SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+#endif
+    if (i == 0) {
+      bound_address_ = listener.BoundAddress();
+      bind_address = bound_address_;
+    }
+    listeners_.push_back(std::move(listener));
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    auto t = std::make_unique<Thread>();
+    int cpu = cpus[i % cpus.size()];
+    t->thread = std::thread([this, t = t.get(), i, cpu]() { Run(*t, i, cpu); });
+    threads_.push_back(std::move(t));
+  }
+  return absl::OkStatus();
+}
+
+void MultiAcceptor::Stop() {
+  if (threads_.empty()) {
+    return;
+  }
+  // All the threads see the trigger as it's never cleared.
+  stop_.Trigger();
+  for (auto &t : threads_) {
+    t->thread.join();
+  }
+  threads_.clear();
+  listeners_.clear();
+  stop_ = TriggerFd();
+}
+
+void MultiAcceptor::Run(Thread &thread, int index, int cpu) {
+#if defined(__linux__)
+  if (options_.pin_threads) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+#else
+  (void)cpu;
+#endif
+  co::CoroutineScheduler scheduler;
+  TCPSocket &listener = listeners_[index];
+  std::vector<int> fds = {listener.GetFileDescriptor().Fd(),
+                          stop_.GetPollFd().Fd()};
+
+  co::Coroutine acceptor(scheduler, [&](co::Coroutine *c) {
+    std::vector<TCPSocket> sockets;
+    for (;;) {
+      if (c->Wait(fds, POLLIN) == fds[1]) {
+        break;
+      }
+      sockets.clear();
+      absl::Status s = listener.AcceptMany(
+          sockets, options_.max_accepts_per_wakeup, options_.nonblocking);
+      if (!s.ok()) {
+        // Probably out of fds.  Back off rather than spin on the
+        // connection we can't accept.
+        c->Millisleep(1);
+        continue;
+      }
+      thread.num_accepted.fetch_add(sockets.size(), std::memory_order_relaxed);
+      for (auto &socket : sockets) {
+        handler_(std::move(socket), index, scheduler);
+      }
+    }
+    scheduler.Stop();
+  });
+  scheduler.Run();
+}
+
+} // namespace toolbelt
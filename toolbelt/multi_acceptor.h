@@ -0,0 +1,94 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __TOOLBELT_MULTI_ACCEPTOR_H
+#define __TOOLBELT_MULTI_ACCEPTOR_H
+
+#include "absl/status/status.h"
+#include "coroutine.h"
+#include "toolbelt/sockets.h"
+#include "toolbelt/triggerfd.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace toolbelt {
+
+struct MultiAcceptorOptions {
+  // Number of acceptor threads.  0 means one for each CPU we're allowed
+  // to run on.
+  int num_threads = 0;
+
+  // Pin each thread to its own CPU.
+  bool pin_threads = true;
+
+  // Length of each listener's queue of pending connections.
+  int backlog = 1024;
+
+  // Most connections taken from the queue in one wakeup.
+  size_t max_accepts_per_wakeup = 64;
+
+  // Make the accepted sockets nonblocking, for use in coroutines.
+  bool nonblocking = true;
+};
+
+// A TCP server front end that accepts on several threads at once.  Each
+// thread has its own listening socket, all bound to the same address with
+// SO_REUSEPORT, so the kernel spreads incoming connections over them and
+// the threads don't contend for a single accept queue.  Each thread runs
+// its own coroutine scheduler, pinned to a CPU, with an acceptor
+// coroutine that drains the pending connections each time it wakes.
+//
+// The handler is called on the acceptor's thread for each connection,
+// with the thread's index and scheduler so that it can start coroutines
+// to serve the connection on the same CPU.
+class MultiAcceptor {
+public:
+  using Handler = std::function<void(TCPSocket socket, int thread_index,
+                                     co::CoroutineScheduler &scheduler)>;
+
+  explicit MultiAcceptor(Handler handler, MultiAcceptorOptions options = {})
+      : handler_(std::move(handler)), options_(options) {}
+  ~MultiAcceptor() { Stop(); }
+  MultiAcceptor(const MultiAcceptor &) = delete;
+  MultiAcceptor &operator=(const MultiAcceptor &) = delete;
+
+  // Bind the listeners to 'addr' and start the threads.  If the port is 0
+  // they all get the same port, chosen by the first.
+  absl::Status Start(const InetAddress &addr);
+
+  // Stop accepting and wait for the threads to finish.  Their schedulers
+  // are stopped too, including any coroutines the handler started.
+  void Stop();
+
+  const InetAddress &BoundAddress() const { return bound_address_; }
+  int NumThreads() const { return int(listeners_.size()); }
+
+  // Number of connections accepted by a thread.
+  uint64_t NumAccepted(int thread_index) const {
+    return threads_[thread_index]->num_accepted.load(
+        std::memory_order_relaxed);
+  }
+
+private:
+  struct Thread {
+    std::thread thread;
+    std::atomic<uint64_t> num_accepted{0};
+  };
+
+  void Run(Thread &thread, int index, int cpu);
+
+  Handler handler_;
+  MultiAcceptorOptions options_;
+  InetAddress bound_address_;
+  std::vector<TCPSocket> listeners_;
+  std::vector<std::unique_ptr<Thread>> threads_;
+  TriggerFd stop_;
+};
+
+} // namespace toolbelt
+
+#endif // __TOOLBELT_MULTI_ACCEPTOR_H
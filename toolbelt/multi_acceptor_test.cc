@@ -0,0 +1,78 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/multi_acceptor.h"
+#include <gtest/gtest.h>
+#include <mutex>
+
+TEST(MultiAcceptorTest, Accept) {
+  constexpr int kNumThreads = 3;
+  constexpr int kNumConnections = 30;
+  std::mutex lock;
+  std::vector<toolbelt::TCPSocket> accepted;
+  toolbelt::MultiAcceptor acceptor(
+      [&lock, &accepted](toolbelt::TCPSocket socket, int thread_index,
+                         co::CoroutineScheduler &) {
+        ASSERT_TRUE(socket.Connected());
+        ASSERT_TRUE(socket.IsNonBlocking());
+        ASSERT_TRUE(socket.GetFileDescriptor().IsNonBlocking());
+        ASSERT_TRUE(socket.GetFileDescriptor().IsCloseOnExec());
+        char c = 'a' + thread_index;
+        ASSERT_TRUE(socket.Send(&c, 1).ok());
+        std::unique_lock<std::mutex> l(lock);
+        accepted.push_back(std::move(socket));
+      },
+      toolbelt::MultiAcceptorOptions{.num_threads = kNumThreads});
+  ASSERT_TRUE(acceptor.Start(toolbelt::InetAddress("localhost", 0)).ok());
+  ASSERT_EQ(kNumThreads, acceptor.NumThreads());
+  ASSERT_NE(0, acceptor.BoundAddress().Port());
+
+  std::vector<toolbelt::TCPSocket> clients(kNumConnections);
+  for (auto &client : clients) {
+    ASSERT_TRUE(client.Connect(acceptor.BoundAddress()).ok());
+  }
+  // Each gets a byte saying which thread accepted it.
+  for (auto &client : clients) {
+    char c;
+    absl::StatusOr<ssize_t> n = client.Receive(&c, 1);
+    ASSERT_TRUE(n.ok());
+    ASSERT_EQ(1, *n);
+    ASSERT_GE(c, 'a');
+    ASSERT_LT(c, 'a' + kNumThreads);
+  }
+  uint64_t total = 0;
+  for (int i = 0; i < kNumThreads; i++) {
+    total += acceptor.NumAccepted(i);
+  }
+  ASSERT_EQ(kNumConnections, total);
+  acceptor.Stop();
+  ASSERT_EQ(kNumConnections, accepted.size());
+}
+
+TEST(MultiAcceptorTest, AcceptMany) {
+  toolbelt::TCPSocket listener;
+  ASSERT_TRUE(listener.Bind(toolbelt::InetAddress("localhost", 0), false).ok());
+  ASSERT_TRUE(listener.Listen(20).ok());
+  ASSERT_TRUE(listener.SetNonBlocking().ok());
+
+  // Nothing pending.
+  std::vector<toolbelt::TCPSocket> sockets;
+  ASSERT_TRUE(listener.AcceptMany(sockets).ok());
+  ASSERT_TRUE(sockets.empty());
+
+  std::vector<toolbelt::TCPSocket> clients(5);
+  for (auto &client : clients) {
+    ASSERT_TRUE(client.Connect(listener.BoundAddress()).ok());
+  }
+  ASSERT_TRUE(listener.AcceptMany(sockets, 3).ok());
+  ASSERT_EQ(3, sockets.size());
+  ASSERT_TRUE(listener.AcceptMany(sockets).ok());
+  ASSERT_EQ(5, sockets.size());
+  for (auto &s : sockets) {
+    ASSERT_TRUE(s.Connected());
+    ASSERT_FALSE(s.IsNonBlocking());
+    ASSERT_TRUE(s.GetFileDescriptor().IsBlocking());
+    ASSERT_EQ(listener.BoundAddress(), s.BoundAddress());
+  }
+}
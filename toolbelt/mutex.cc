@@ -0,0 +1,98 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/mutex.h"
+#include <sched.h>
+#include <stdio.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace toolbelt {
+
+SharedMutex::SharedMutex() {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#if defined(__linux__)
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+  pthread_mutex_init(&mutex_, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+bool SharedMutex::Lock() {
+  int e = pthread_mutex_lock(&mutex_);
+#if defined(__linux__)
+  if (e == EOWNERDEAD) {
+    pthread_mutex_consistent(&mutex_);
+    return true;
+  }
+#endif
+  if (e != 0) {
+    // Only possible if the memory isn't a mutex.
+    fprintf(stderr, "Unable to lock shared mutex: %s\n", strerror(e));
+    abort();
+  }
+  return false;
+}
+
+bool SharedMutex::TryLock(bool *owner_died) {
+  int e = pthread_mutex_trylock(&mutex_);
+  bool died = false;
+#if defined(__linux__)
+  if (e == EOWNERDEAD) {
+    pthread_mutex_consistent(&mutex_);
+    died = true;
+    e = 0;
+  }
+#endif
+  if (owner_died != nullptr) {
+    *owner_died = died;
+  }
+  return e == 0;
+}
+
+// Spin this many times before waiting in the kernel.
+static constexpr int kSpinCount = 100;
+
+void FutexMutex::LockSlow() {
+  for (int i = 0; i < kSpinCount; i++) {
+    uint32_t expected = kUnlocked;
+    if (state_.load(std::memory_order_relaxed) == kUnlocked &&
+        state_.compare_exchange_weak(expected, kLocked,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed)) {
+      return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+  // Say that there's a waiter.  If it was unlocked we now hold it, but
+  // with kWaiters, which just costs an unnecessary Wake when we unlock.
+  while (state_.exchange(kWaiters, std::memory_order_acquire) != kUnlocked) {
+#if defined(__linux__)
+    // Not FUTEX_PRIVATE as the lock may be in shared memory.
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_), FUTEX_WAIT,
+            kWaiters, nullptr, nullptr, 0);
+#else
+    sched_yield();
+#endif
+  }
+}
+
+void FutexMutex::Wake() {
+#if defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_), FUTEX_WAKE, 1,
+          nullptr, nullptr, 0);
+#endif
+}
+
+} // namespace toolbelt
@@ -5,7 +5,13 @@
 #ifndef __TOOLBELT_MUTEX_H
 #define __TOOLBELT_MUTEX_H
 
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <errno.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <type_traits>
 
 namespace toolbelt {
 
@@ -14,7 +20,7 @@ class MutexLock {
 public:
   MutexLock(pthread_mutex_t *mutex) : mutex_(mutex) {
     int e = pthread_mutex_lock(mutex_);
-    #ifdef __TOOLBELT_linux__
+    #if defined(__linux__)
     if (e == EOWNERDEAD) {
       // We hit the tiny race in glibc.  There's not
       // much we can do.  The memory could be in any
@@ -55,6 +61,178 @@ public:
 private:
   pthread_rwlock_t *lock_;
 };
+
+// A mutex that can be put in shared memory and used by more than one
+// process.  On Linux it is robust: if a process dies while holding it,
+// the next Lock succeeds and tells the caller so that it can repair
+// whatever the lock protects.
+//
+// Construct it once, in the shared memory, by the process that creates
+// the memory.  The other processes just map it.
+class SharedMutex {
+public:
+  SharedMutex();
+  ~SharedMutex() { pthread_mutex_destroy(&mutex_); }
+  SharedMutex(const SharedMutex &) = delete;
+  SharedMutex &operator=(const SharedMutex &) = delete;
+
+  // Returns true if the previous owner died while holding the lock.  The
+  // lock is held either way, and has been made usable again.
+  bool Lock();
+
+  // Returns false if the lock is held by someone else.  'owner_died' is set
+  // as for Lock.
+  bool TryLock(bool *owner_died = nullptr);
+
+  void Unlock() { pthread_mutex_unlock(&mutex_); }
+
+private:
+  pthread_mutex_t mutex_;
+};
+
+// RAII for SharedMutex.
+class SharedMutexLock {
+public:
+  explicit SharedMutexLock(SharedMutex &mutex)
+      : mutex_(mutex), owner_died_(mutex.Lock()) {}
+  ~SharedMutexLock() { mutex_.Unlock(); }
+
+  // True if the lock was recovered from a process that died holding it.
+  bool OwnerDied() const { return owner_died_; }
+
+private:
+  SharedMutex &mutex_;
+  bool owner_died_;
+};
+
+// A lock in a single 32 bit word.  It spins for a short while and then
+// waits in the kernel (a futex on Linux) until it's unlocked, so an
+// uncontended lock and unlock is just two atomic operations.  It's
+// process shared, so it can go in shared memory, but isn't robust.
+class FutexMutex {
+public:
+  FutexMutex() = default;
+  FutexMutex(const FutexMutex &) = delete;
+  FutexMutex &operator=(const FutexMutex &) = delete;
+
+  void Lock() {
+    uint32_t expected = kUnlocked;
+    if (!state_.compare_exchange_strong(expected, kLocked,
+                                        std::memory_order_acquire,
+                                        std::memory_order_relaxed)) {
+      LockSlow();
+    }
+  }
+
+  bool TryLock() {
+    uint32_t expected = kUnlocked;
+    return state_.compare_exchange_strong(expected, kLocked,
+                                          std::memory_order_acquire,
+                                          std::memory_order_relaxed);
+  }
+
+  void Unlock() {
+    if (state_.exchange(kUnlocked, std::memory_order_release) == kWaiters) {
+      Wake();
+    }
+  }
+
+private:
+  static constexpr uint32_t kUnlocked = 0;
+  static constexpr uint32_t kLocked = 1;
+  static constexpr uint32_t kWaiters = 2; // Locked and someone may be waiting.
+
+  void LockSlow();
+  void Wake();
+
+  std::atomic<uint32_t> state_{kUnlocked};
+};
+
+// RAII for FutexMutex.
+class FutexMutexLock {
+public:
+  explicit FutexMutexLock(FutexMutex &mutex) : mutex_(mutex) { mutex_.Lock(); }
+  ~FutexMutexLock() { mutex_.Unlock(); }
+
+private:
+  FutexMutex &mutex_;
+};
+
+// A sequence lock holding a T, for data written by one writer and read
+// by many readers who never block it.  A reader copies the value and
+// tries again if the writer changed it during the copy, so reads are
+// cheap when writes are rare.  T must be trivially copyable.  It can be
+// put in shared memory.
+//
+// If there is more than one writer they need to use a lock between them.
+template <typename T> class SeqLock {
+public:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "SeqLock needs a trivially copyable type");
+
+  SeqLock() = default;
+  explicit SeqLock(const T &value) { Write(value); }
+
+  void Write(const T &value) {
+    uint64_t words[kNumWords] = {};
+    memcpy(words, &value, sizeof(T));
+    uint32_t seq = seq_.load(std::memory_order_relaxed);
+    // An odd sequence means a write is in progress.
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < kNumWords; i++) {
+      data_[i].store(words[i], std::memory_order_relaxed);
+    }
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  // Read the value, trying until it's not changed while being read.
+  T Read() const {
+    T value;
+    while (!TryRead(&value)) {
+      CpuRelax();
+    }
+    return value;
+  }
+
+  // Read the value once.  Returns false if a write got in the way.
+  bool TryRead(T *value) const {
+    uint32_t seq = seq_.load(std::memory_order_acquire);
+    if ((seq & 1) != 0) {
+      return false;
+    }
+    uint64_t words[kNumWords];
+    for (int i = 0; i < kNumWords; i++) {
+      words[i] = data_[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq_.load(std::memory_order_relaxed) != seq) {
+      return false;
+    }
+    memcpy(value, words, sizeof(T));
+    return true;
+  }
+
+  // Incremented by 2 for each write.
+  uint32_t Sequence() const { return seq_.load(std::memory_order_acquire); }
+
+private:
+  // The value is held as atomic words so that reading it while it's
+  // being written isn't a data race.
+  static constexpr int kNumWords = (sizeof(T) + 7) / 8;
+
+  static void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  std::atomic<uint32_t> seq_{0};
+  std::atomic<uint64_t> data_[kNumWords] = {};
+};
+
 } // namespace toolbelt
 
 #endif //  __MUTEX_H
@@ -0,0 +1,178 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/mutex.h"
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+// Anonymous shared memory that survives fork.
+template <typename T> T *MapShared() {
+  void *mem = mmap(nullptr, sizeof(T), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    abort();
+  }
+  return new (mem) T();
+}
+
+template <typename T> void UnmapShared(T *p) {
+  p->~T();
+  munmap(p, sizeof(T));
+}
+
+void WaitForChild(pid_t pid) {
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(0, WEXITSTATUS(status));
+}
+} // namespace
+
+TEST(MutexTest, SharedMutex) {
+  struct Shared {
+    toolbelt::SharedMutex mutex;
+    int value = 0;
+  };
+  Shared *shared = MapShared<Shared>();
+
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    for (int i = 0; i < 10000; i++) {
+      toolbelt::SharedMutexLock lock(shared->mutex);
+      shared->value++;
+    }
+    _exit(0);
+  }
+  for (int i = 0; i < 10000; i++) {
+    toolbelt::SharedMutexLock lock(shared->mutex);
+    ASSERT_FALSE(lock.OwnerDied());
+    shared->value++;
+  }
+  WaitForChild(pid);
+  ASSERT_EQ(20000, shared->value);
+  UnmapShared(shared);
+}
+
+#if defined(__linux__)
+TEST(MutexTest, SharedMutexOwnerDied) {
+  toolbelt::SharedMutex *mutex = MapShared<toolbelt::SharedMutex>();
+
+  // The child dies holding the lock.
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    mutex->Lock();
+    _exit(0);
+  }
+  WaitForChild(pid);
+
+  bool owner_died = false;
+  ASSERT_TRUE(mutex->TryLock(&owner_died));
+  ASSERT_TRUE(owner_died);
+  mutex->Unlock();
+
+  // It's usable again.
+  {
+    toolbelt::SharedMutexLock lock(*mutex);
+    ASSERT_FALSE(lock.OwnerDied());
+    ASSERT_FALSE(mutex->TryLock());
+  }
+  UnmapShared(mutex);
+}
+#endif
+
+TEST(MutexTest, FutexMutexThreads) {
+  constexpr int kNumThreads = 4;
+  constexpr int kNumIncrements = 20000;
+  toolbelt::FutexMutex mutex;
+  int value = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&mutex, &value]() {
+      for (int i = 0; i < kNumIncrements; i++) {
+        toolbelt::FutexMutexLock lock(mutex);
+        value++;
+        if ((i % 1000) == 0) {
+          // Hold it for a while so the others have to wait in the kernel.
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(kNumThreads * kNumIncrements, value);
+  ASSERT_TRUE(mutex.TryLock());
+  ASSERT_FALSE(mutex.TryLock());
+  mutex.Unlock();
+}
+
+TEST(MutexTest, FutexMutexProcesses) {
+  struct Shared {
+    toolbelt::FutexMutex mutex;
+    int value = 0;
+  };
+  Shared *shared = MapShared<Shared>();
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  for (int i = 0; i < 10000; i++) {
+    toolbelt::FutexMutexLock lock(shared->mutex);
+    shared->value++;
+  }
+  if (pid == 0) {
+    _exit(0);
+  }
+  WaitForChild(pid);
+  ASSERT_EQ(20000, shared->value);
+  UnmapShared(shared);
+}
+
+TEST(MutexTest, SeqLock) {
+  // The fields are written together so a reader must see them agree.
+  struct Value {
+    uint64_t a;
+    uint64_t b;
+    uint32_t c;
+  };
+  toolbelt::SeqLock<Value> lock(Value{0, 0, 0});
+  ASSERT_EQ(2, lock.Sequence());
+
+  constexpr uint64_t kNumWrites = 100000;
+  std::atomic<bool> done = false;
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 2; r++) {
+    readers.emplace_back([&lock, &done]() {
+      uint64_t last = 0;
+      while (!done) {
+        Value v = lock.Read();
+        ASSERT_EQ(v.a * 3, v.b);
+        ASSERT_EQ(uint32_t(v.a), v.c);
+        // Never goes backwards.
+        ASSERT_GE(v.a, last);
+        last = v.a;
+        std::this_thread::yield();
+      }
+    });
+  }
+  for (uint64_t i = 1; i <= kNumWrites; i++) {
+    lock.Write(Value{i, i * 3, uint32_t(i)});
+    if ((i % 100) == 0) {
+      std::this_thread::yield();
+    }
+  }
+  done = true;
+  for (auto &t : readers) {
+    t.join();
+  }
+  Value v = lock.Read();
+  ASSERT_EQ(kNumWrites, v.a);
+  ASSERT_EQ(2 + 2 * kNumWrites, lock.Sequence());
+}
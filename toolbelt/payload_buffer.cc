@@ -1,39 +1,82 @@
 #include "toolbelt/payload_buffer.h"
+#include <algorithm>
 #include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <vector>
 
 namespace toolbelt {
-static constexpr struct BitmapRunInfo {
-  int num;
-  int size;
-} bitmp_run_infos[kNumBitmapRuns] = {
-    {kRunSize1, kBitmapRunSize1},
-    {kRunSize2, kBitmapRunSize2},
-    {kRunSize3, kBitmapRunSize3},
-    {kRunSize4, kBitmapRunSize4},
-};
 
-inline int BitmapRunIndex(uint32_t n) {
-  for (size_t i = 0; i < kNumBitmapRuns; i++) {
-    if (n <= bitmp_run_infos[i].size) {
-      return i;
-    }
+static thread_local PayloadBufferStats *thread_stats = nullptr;
+
+#if defined(TOOLBELT_PAYLOAD_BUFFER_STATS)
+
+// Update a field of the thread's stats, if it has any.
+#define PB_STAT(update)                                                        \
+  do {                                                                         \
+    if (PayloadBufferStats *stats = thread_stats; stats != nullptr) {          \
+      stats->update;                                                           \
+    }                                                                          \
+  } while (0)
+#else
+#define PB_STAT(update)                                                        \
+  do {                                                                         \
+  } while (0)
+#endif
+
+PayloadBufferStats *PayloadBuffer::SetThreadStats(PayloadBufferStats *stats) {
+  PayloadBufferStats *old = thread_stats;
+  thread_stats = stats;
+  return old;
+}
+
+PayloadBufferOccupancy PayloadBuffer::Occupancy() const {
+  PayloadBufferOccupancy occ;
+  occ.full_size = full_size;
+  occ.hwm = hwm;
+  for (const FreeBlockHeader *block =
+           ToAddress<const FreeBlockHeader>(free_list);
+       block != nullptr;
+       block = ToAddress<const FreeBlockHeader>(block->next)) {
+    occ.free_blocks++;
+    occ.free_bytes += block->length;
+    occ.largest_free_block = std::max(occ.largest_free_block, block->length);
   }
-  return -1;
+  if (occ.free_bytes != 0) {
+    occ.fragmentation =
+        1.0 - double(occ.largest_free_block) / double(occ.free_bytes);
+  }
+  return occ;
 }
 
-inline int BitmapRunIndexFromEncodedSize(uint32_t n) {
+inline int BitmapRunIndexFromEncodedSize(const PayloadBuffer *pb, uint32_t n) {
   if ((n & (1U << 31)) == 0) {
     // Not a small block since the high bit is not set.
     return -1;
   }
-  n &= kBitmapRunSizeMask;
-  for (size_t i = 0; i < kNumBitmapRuns; i++) {
-    if (n <= bitmp_run_infos[i].size) {
-      return i;
-    }
+  return pb->BitmapRunIndex(DecodeSmallBlockSize(n));
+}
+
+// Bin for a free block of the given length.  The top level is the power of
+// two and the second level is given by the next kFreeBinSubdivisionShift bits.
+inline int FreeBinIndex(uint32_t length) {
+  int fl = 31 - __builtin_clz(length);
+  int sl = (length >> (fl - kFreeBinSubdivisionShift)) &
+           ((1 << kFreeBinSubdivisionShift) - 1);
+  return ((fl - kFreeBinMinShift) << kFreeBinSubdivisionShift) + sl;
+}
+
+// First bin that is guaranteed to hold blocks of at least 'length' bytes.
+// This rounds the length up to the start of the next bin.
+inline int FreeBinSearchIndex(uint32_t length) {
+  int fl = 31 - __builtin_clz(length);
+  uint64_t rounded =
+      uint64_t(length) + (1ULL << (fl - kFreeBinSubdivisionShift)) - 1;
+  if (rounded > 0xffffffffULL) {
+    return kNumFreeBins;
   }
-  return -1;
+  rounded &= ~((1ULL << (fl - kFreeBinSubdivisionShift)) - 1);
+  return FreeBinIndex(uint32_t(rounded));
 }
 
 void *PayloadBuffer::AllocateMainMessage(PayloadBuffer **self, size_t size) {
@@ -161,10 +204,18 @@ void PayloadBuffer::Dump(std::ostream &os) {
   os << "  metadata: " << metadata << " " << ToAddress(metadata) << std::endl;
   os << "  free_list: " << free_list << " " << ToAddress(free_list)
      << std::endl;
+  os << "  free_bins: " << free_bins << " " << ToAddress(free_bins)
+     << std::endl;
+  os << "  last_free: " << last_free << " " << ToAddress(last_free)
+     << std::endl;
+  if (IsMarked()) {
+    os << "  mark_start: " << mark_start << " bump: " << bump << std::endl;
+  }
   os << "  message: " << message << " " << ToAddress(message) << std::endl;
-  for (int i = 0; i < kNumBitmapRuns; i++) {
+  for (uint32_t i = 0; i < num_bitmap_runs; i++) {
     os << "  bitmaps[" << i << "]: " << bitmaps[i] << " "
-       << ToAddress(bitmaps[i]) << std::endl;
+       << ToAddress(bitmaps[i]) << " size: " << bitmap_runs[i].size
+       << " num: " << bitmap_runs[i].num << std::endl;
   }
   DumpFreeList(os);
 }
@@ -182,13 +233,384 @@ void PayloadBuffer::DumpFreeList(std::ostream &os) {
 
 void PayloadBuffer::CheckFreeList() {
   FreeBlockHeader *block = ToAddress<FreeBlockHeader>(free_list);
+  FreeBlockHeader *prev = nullptr;
+  size_t num_blocks = 0;
+  uintptr_t end = uintptr_t(this) + full_size;
   while (block != nullptr) {
     if (block->length == 0) {
       std::cerr << "Zero length free block @" << block << std::endl;
       abort();
     }
+    if (uintptr_t(block) + block->length > end) {
+      std::cerr << "Free block @" << block << " is beyond end of buffer"
+                << std::endl;
+      abort();
+    }
+    if (FreeBinsEnabled() && PrevFreeBlock(block) != prev) {
+      std::cerr << "Bad previous link in free block @" << block << std::endl;
+      abort();
+    }
+    num_blocks++;
+    prev = block;
     block = ToAddress<FreeBlockHeader>(block->next);
   }
+  if (!FreeBinsEnabled()) {
+    if (LastFreeBlock() != prev) {
+      std::cerr << "Last free block is " << LastFreeBlock() << ", should be "
+                << prev << std::endl;
+      abort();
+    }
+    return;
+  }
+  // Every free block must be in the bin for its length.
+  FreeBins *bins = Bins();
+  size_t num_binned = 0;
+  for (int i = 0; i < kNumFreeBins; i++) {
+    bool nonempty = (bins->nonempty[i / 32] & (1U << (i % 32))) != 0;
+    if (nonempty != (bins->bins[i] != 0)) {
+      std::cerr << "Free bin " << i << " has bad nonempty bit" << std::endl;
+      abort();
+    }
+    FreeBlockHeader *b = ToAddress<FreeBlockHeader>(bins->bins[i]);
+    while (b != nullptr) {
+      if (FreeBinIndex(b->length) != i) {
+        std::cerr << "Free block @" << b << " is in wrong bin " << i
+                  << std::endl;
+        abort();
+      }
+      num_binned++;
+      b = ToAddress<FreeBlockHeader>(Links(b)->bin_next);
+    }
+  }
+  if (num_binned != num_blocks) {
+    std::cerr << "Free bins hold " << num_binned << " blocks but free list has "
+              << num_blocks << std::endl;
+    abort();
+  }
+
+  // Walk the blocks in address order and check their tags.
+  BufferOffset offset = free_bins + sizeof(FreeBins);
+  BufferOffset top = BlocksTop();
+  FreeBlockHeader *last = nullptr;
+  size_t num_tagged = 0;
+  bool prev_free = false;
+  while (offset < top) {
+    uint32_t word = *ToAddress<uint32_t>(offset);
+    if ((word & kBlockInUse) != 0) {
+      if (((word & kPrevBlockFree) != 0) != prev_free) {
+        std::cerr << "Bad previous block tag in block @" << ToAddress(offset)
+                  << std::endl;
+        abort();
+      }
+      prev_free = false;
+      last = nullptr;
+      offset += sizeof(uint32_t) + (word & ~kBlockTagMask);
+      continue;
+    }
+    FreeBlockHeader *b = ToAddress<FreeBlockHeader>(offset);
+    if (prev_free) {
+      std::cerr << "Free block @" << b << " follows another" << std::endl;
+      abort();
+    }
+    if (b->length < MinFreeBlockSize() || offset + b->length > top ||
+        *ToAddress<BufferOffset>(offset + b->length - sizeof(BufferOffset)) !=
+            offset) {
+      std::cerr << "Bad end tag in free block @" << b << std::endl;
+      abort();
+    }
+    num_tagged++;
+    prev_free = true;
+    last = b;
+    offset += b->length;
+  }
+  if (offset != top) {
+    std::cerr << "Blocks end at " << offset << ", should be " << top
+              << std::endl;
+    abort();
+  }
+  if (num_tagged != num_blocks) {
+    std::cerr << "Blocks hold " << num_tagged << " free blocks but free list has "
+              << num_blocks << std::endl;
+    abort();
+  }
+  if (LastFreeBlock() != last) {
+    std::cerr << "Last free block is " << LastFreeBlock() << ", should be "
+              << last << std::endl;
+    abort();
+  }
+}
+
+FreeBlockHeader *PayloadBuffer::FindBinnedFreeBlock(uint32_t length) {
+  FreeBins *bins = Bins();
+  int index = FreeBinSearchIndex(length);
+  for (int word = index / 32; word < (kNumFreeBins + 31) / 32; word++) {
+    uint32_t bits = bins->nonempty[word];
+    if (word == index / 32) {
+      // Mask off the bins below the one we're looking for.
+      bits &= ~((1U << (index % 32)) - 1);
+    }
+    if (bits != 0) {
+      return ToAddress<FreeBlockHeader>(
+          bins->bins[word * 32 + __builtin_ctz(bits)]);
+    }
+  }
+  return nullptr;
+}
+
+FreeBlockHeader *PayloadBuffer::PrevFreeBlock(FreeBlockHeader *block) {
+  if (!FreeBinsEnabled() || block == nullptr) {
+    return nullptr;
+  }
+  return ToAddress<FreeBlockHeader>(Links(block)->prev);
+}
+
+void PayloadBuffer::AddToFreeBin(FreeBlockHeader *block) {
+  if (!FreeBinsEnabled()) {
+    return;
+  }
+  FreeBins *bins = Bins();
+  int index = FreeBinIndex(block->length);
+  FreeBlockLinks *links = Links(block);
+  links->bin_prev = 0;
+  links->bin_next = bins->bins[index];
+  FreeBlockHeader *head = ToAddress<FreeBlockHeader>(bins->bins[index]);
+  if (head != nullptr) {
+    Links(head)->bin_prev = ToOffset(block);
+  }
+  bins->bins[index] = ToOffset(block);
+  bins->nonempty[index / 32] |= 1U << (index % 32);
+}
+
+void PayloadBuffer::RemoveFromFreeBin(FreeBlockHeader *block) {
+  if (!FreeBinsEnabled()) {
+    return;
+  }
+  FreeBins *bins = Bins();
+  int index = FreeBinIndex(block->length);
+  FreeBlockLinks *links = Links(block);
+  FreeBlockHeader *bin_prev = ToAddress<FreeBlockHeader>(links->bin_prev);
+  FreeBlockHeader *bin_next = ToAddress<FreeBlockHeader>(links->bin_next);
+  if (bin_prev == nullptr) {
+    bins->bins[index] = links->bin_next;
+    if (bin_next == nullptr) {
+      bins->nonempty[index / 32] &= ~(1U << (index % 32));
+    }
+  } else {
+    Links(bin_prev)->bin_next = links->bin_next;
+  }
+  if (bin_next != nullptr) {
+    Links(bin_next)->bin_prev = links->bin_prev;
+  }
+}
+
+void PayloadBuffer::SetPrevFreeBlock(BufferOffset next, FreeBlockHeader *prev) {
+  if (!FreeBinsEnabled()) {
+    if (next == 0) {
+      last_free = ToOffset(prev);
+    }
+    return;
+  }
+  if (next != 0) {
+    Links(ToAddress<FreeBlockHeader>(next))->prev = ToOffset(prev);
+  }
+}
+
+void PayloadBuffer::FreeBlockLinked(FreeBlockHeader *block,
+                                    FreeBlockHeader *prev) {
+  SetPrevFreeBlock(block->next, block);
+  if (!FreeBinsEnabled()) {
+    return;
+  }
+  Links(block)->prev = ToOffset(prev);
+  AddToFreeBin(block);
+  SetFreeBlockTags(block);
+}
+
+void PayloadBuffer::PushFreeBlock(FreeBlockHeader *block) {
+  block->next = free_list;
+  free_list = ToOffset(block);
+  FreeBlockLinked(block, nullptr);
+}
+
+void PayloadBuffer::UnlinkFreeBlock(FreeBlockHeader *block) {
+  FreeBlockHeader *prev = PrevFreeBlock(block);
+  if (prev == nullptr) {
+    free_list = block->next;
+  } else {
+    prev->next = block->next;
+  }
+  SetPrevFreeBlock(block->next, prev);
+  RemoveFromFreeBin(block);
+}
+
+void PayloadBuffer::SetFreeBlockTags(FreeBlockHeader *block) {
+  BufferOffset start = ToOffset(block);
+  BufferOffset end = start + block->length;
+  *ToAddress<BufferOffset>(end - sizeof(BufferOffset)) = start;
+  if (end >= BlocksTop()) {
+    last_free = start;
+  } else {
+    // The block above is allocated, never another free block.
+    *ToAddress<uint32_t>(end) |= kPrevBlockFree;
+  }
+}
+
+void PayloadBuffer::ClearFreeBlockTags(FreeBlockHeader *block) {
+  BufferOffset end = ToOffset(block) + block->length;
+  if (end >= BlocksTop()) {
+    last_free = 0;
+  } else {
+    *ToAddress<uint32_t>(end) &= ~kPrevBlockFree;
+  }
+}
+
+FreeBlockHeader *PayloadBuffer::FreeBlockAt(BufferOffset offset) {
+  if (offset >= BlocksTop()) {
+    return nullptr;
+  }
+  // The length of a free block is a multiple of 4, so it doesn't have
+  // kBlockInUse set.
+  uint32_t *word = ToAddress<uint32_t>(offset);
+  if ((*word & kBlockInUse) != 0) {
+    return nullptr;
+  }
+  return reinterpret_cast<FreeBlockHeader *>(word);
+}
+
+FreeBlockHeader *PayloadBuffer::FreeBlockBelow(FreeBlockHeader *block) {
+  if ((block->length & kPrevBlockFree) == 0) {
+    return nullptr;
+  }
+  // The free block's offset is in its last word.
+  return ToAddress<FreeBlockHeader>(
+      *(reinterpret_cast<BufferOffset *>(block) - 1));
+}
+
+void PayloadBuffer::InitBitmapRuns(absl::Span<const BitmapRunConfig> configs) {
+  if (configs.empty()) {
+    configs = absl::MakeConstSpan(kDefaultBitmapRuns);
+  }
+  num_bitmap_runs = 0;
+  for (const BitmapRunConfig &config : configs) {
+    if (num_bitmap_runs == kMaxBitmapRuns) {
+      break;
+    }
+    uint32_t size = (config.size + 3) & ~3;
+    if (size == 0 || size > kMaxBitmapRunBlockSize) {
+      continue;
+    }
+    bitmap_runs[num_bitmap_runs++] = {
+        uint16_t(size), uint16_t(std::clamp(int(config.num), 1, kMaxRunSize))};
+  }
+  std::sort(bitmap_runs, bitmap_runs + num_bitmap_runs,
+            [](const BitmapRunConfig &a, const BitmapRunConfig &b) {
+              return a.size < b.size;
+            });
+  // Remove duplicate sizes, they would never be used.
+  num_bitmap_runs =
+      std::unique(bitmap_runs, bitmap_runs + num_bitmap_runs,
+                  [](const BitmapRunConfig &a, const BitmapRunConfig &b) {
+                    return a.size == b.size;
+                  }) -
+      bitmap_runs;
+  for (size_t i = 0; i < kMaxBitmapRuns; i++) {
+    if (i >= num_bitmap_runs) {
+      bitmap_runs[i] = {0, 0};
+    }
+    bitmaps[i] = 0;
+  }
+}
+
+void SizeHistogram::Add(size_t size, size_t count) {
+  if (size == 0 || size > kMaxBitmapRunBlockSize) {
+    return;
+  }
+  size_t units = (size + 3) >> 2;
+  if (counts_.size() <= units) {
+    counts_.resize(units + 1);
+  }
+  counts_[units] += count;
+}
+
+std::vector<BitmapRunConfig>
+SizeHistogram::SuggestBitmapRuns(size_t max_classes) const {
+  std::vector<BitmapRunConfig> result;
+  // Sizes (in 4 byte units) that have been seen.  Only these are worth
+  // considering as the upper bound of a class.
+  std::vector<size_t> sizes;
+  for (size_t i = 1; i < counts_.size(); i++) {
+    if (counts_[i] != 0) {
+      sizes.push_back(i);
+    }
+  }
+  max_classes = std::min(max_classes, kMaxBitmapRuns);
+  if (sizes.empty() || max_classes == 0) {
+    return result;
+  }
+  size_t n = sizes.size();
+  size_t k = std::min(max_classes, n);
+
+  // Prefix sums of count and count*size so the waste of putting sizes
+  // [i, j] into a class of size sizes[j] is computed in constant time.
+  std::vector<double> count_sum(n + 1, 0);
+  std::vector<double> bytes_sum(n + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    count_sum[i + 1] = count_sum[i] + counts_[sizes[i]];
+    bytes_sum[i + 1] = bytes_sum[i] + double(counts_[sizes[i]]) * sizes[i];
+  }
+  auto waste = [&](size_t i, size_t j) {
+    return (count_sum[j + 1] - count_sum[i]) * sizes[j] -
+           (bytes_sum[j + 1] - bytes_sum[i]);
+  };
+
+  // cost[c][j] is the least waste covering sizes [0, j] with c + 1 classes,
+  // the last of which is sizes[j].  The largest seen size always ends a
+  // class so that every sample fits.
+  constexpr double kInf = 1e300;
+  std::vector<std::vector<double>> cost(k, std::vector<double>(n, kInf));
+  std::vector<std::vector<size_t>> split(k, std::vector<size_t>(n, 0));
+  for (size_t j = 0; j < n; j++) {
+    cost[0][j] = waste(0, j);
+  }
+  for (size_t c = 1; c < k; c++) {
+    for (size_t j = c; j < n; j++) {
+      for (size_t i = c - 1; i < j; i++) {
+        double w = cost[c - 1][i] + waste(i + 1, j);
+        if (w < cost[c][j]) {
+          cost[c][j] = w;
+          split[c][j] = i;
+        }
+      }
+    }
+  }
+  size_t best = 0;
+  for (size_t c = 1; c < k; c++) {
+    if (cost[c][n - 1] < cost[best][n - 1]) {
+      best = c;
+    }
+  }
+
+  // Walk back through the splits to get the class boundaries.
+  std::vector<std::pair<size_t, size_t>> classes; // [first, last] indexes.
+  size_t j = n - 1;
+  for (int c = int(best); c >= 0; c--) {
+    size_t first = c == 0 ? 0 : split[c][j] + 1;
+    classes.push_back({first, j});
+    j = first - 1;
+  }
+  std::reverse(classes.begin(), classes.end());
+
+  double max_count = 0;
+  for (auto &[first, last] : classes) {
+    max_count = std::max(max_count, count_sum[last + 1] - count_sum[first]);
+  }
+  for (auto &[first, last] : classes) {
+    double count = count_sum[last + 1] - count_sum[first];
+    int num = int(kMaxRunSize * count / max_count);
+    result.push_back({uint16_t(sizes[last] << 2),
+                      uint16_t(std::clamp(num, 1, kMaxRunSize))});
+  }
+  return result;
 }
 
 void PayloadBuffer::InitFreeList() {
@@ -199,11 +621,21 @@ void PayloadBuffer::InitFreeList() {
         sizeof(Resizer *); // Room for resizer function for movable buffers.
     header_size += sizeof(Resizer *);
   }
+  free_bins = 0;
+  if (FreeBinsEnabled()) {
+    // The bins live immediately after the header.
+    FreeBins *bins = reinterpret_cast<FreeBins *>(end_of_header);
+    memset(bins, 0, sizeof(FreeBins));
+    free_bins = ToOffset(bins);
+    end_of_header += sizeof(FreeBins);
+    header_size += sizeof(FreeBins);
+  }
   FreeBlockHeader *f = reinterpret_cast<FreeBlockHeader *>(end_of_header);
-  f->length = full_size - header_size;
+  f->length = BlocksEnd() - header_size;
   f->next = 0;
   free_list = ToOffset(f);
   hwm = free_list;
+  FreeBlockLinked(f, nullptr);
 }
 
 uint32_t PayloadBuffer::TakeStartOfFreeBlock(FreeBlockHeader *block,
@@ -211,7 +643,8 @@ uint32_t PayloadBuffer::TakeStartOfFreeBlock(FreeBlockHeader *block,
                                              uint32_t length,
                                              FreeBlockHeader *prev) {
   uint32_t rem = block->length - length;
-  if (rem >= sizeof(FreeBlockHeader)) {
+  RemoveFromFreeBin(block);
+  if (rem >= MinFreeBlockSize()) {
     FreeBlockHeader *next =
         reinterpret_cast<FreeBlockHeader *>(uintptr_t(block) + length);
     next->length = rem;
@@ -224,7 +657,8 @@ uint32_t PayloadBuffer::TakeStartOfFreeBlock(FreeBlockHeader *block,
       // Chain to previous free block.
       prev->next = ToOffset(next);
     }
-    UpdateHWM(next + 1);
+    FreeBlockLinked(next, prev);
+    UpdateHWM(reinterpret_cast<char *>(next) + MinFreeBlockSize());
   } else {
     // We have less than sizeof(FreeBlockHeader)
     // Take whole block.
@@ -233,15 +667,23 @@ uint32_t PayloadBuffer::TakeStartOfFreeBlock(FreeBlockHeader *block,
     } else {
       prev->next = block->next;
     }
+    SetPrevFreeBlock(block->next, prev);
+    if (FreeBinsEnabled()) {
+      ClearFreeBlockTags(block);
+    }
     // Allocate whole block.
     num_bytes = block->length - sizeof(uint32_t);
+    UpdateHWM(ToOffset(block) + block->length);
     UpdateHWM(block->next + sizeof(FreeBlockHeader));
   }
   return num_bytes;
 }
 
+// Block lengths are always a multiple of 4, which leaves the bottom bits
+// of an allocated block's length word for the boundary tags.
 inline uint32_t AlignSize(uint32_t s,
                           uint32_t alignment = uint32_t(sizeof(uint64_t))) {
+  alignment = std::max(alignment, uint32_t(sizeof(uint32_t)));
   return (s + (alignment - 1)) & ~(alignment - 1);
 }
 
@@ -251,61 +693,120 @@ void *PayloadBuffer::Allocate(PayloadBuffer **buffer, uint32_t n,
   if (n == 0) {
     return nullptr;
   }
+  PB_STAT(allocations++);
+  if ((*buffer)->IsMarked()) {
+    // Everything comes from the bump allocator while marked.
+    PB_STAT(bump_allocations++);
+    void *addr = BumpAllocate(buffer, AlignSize(n, alignment), clear);
+    if (addr == nullptr) {
+      PB_STAT(failed_allocations++);
+    }
+    return addr;
+  }
   if (enable_small_block && (*buffer)->BitmapsEnabled()) {
-    int small_block_index = BitmapRunIndex(n);
+    int small_block_index = (*buffer)->BitmapRunIndex(n);
     if (small_block_index >= 0) {
-      return AllocateSmallBlock(buffer, n, small_block_index, clear);
+      PB_STAT(small_block_hits[small_block_index]++);
+      void *addr = AllocateSmallBlock(buffer, n, small_block_index, clear);
+      if (addr == nullptr) {
+        PB_STAT(failed_allocations++);
+      }
+      return addr;
     }
   }
+#if defined(TOOLBELT_PAYLOAD_BUFFER_STATS)
+  else if (int index = (*buffer)->BitmapRunIndex(n); index >= 0) {
+    PB_STAT(small_block_fallbacks[index]++);
+  }
+#endif
   n = AlignSize(n, alignment); // Aligned.
   size_t full_length = n + sizeof(uint32_t);
   FreeBlockHeader *free_block = (*buffer)->FreeList();
   FreeBlockHeader *prev = nullptr;
+  if ((*buffer)->FreeBinsEnabled()) {
+    // The block must be big enough to be put back in a bin when freed.
+    if (full_length < (*buffer)->MinFreeBlockSize()) {
+      full_length = (*buffer)->MinFreeBlockSize();
+      n = full_length - sizeof(uint32_t);
+    }
+    // The bins give us a block that is big enough without searching the
+    // free list, or nullptr if there isn't one.
+    free_block = (*buffer)->FindBinnedFreeBlock(full_length);
+    prev = (*buffer)->PrevFreeBlock(free_block);
+  }
+  FreeBlockHeader *prev_prev = nullptr;
   for (;;) {
     if (free_block == nullptr) {
       // Out of memory.  If we have a resizer we can reallocate the buffer.
       Resizer *resizer = (*buffer)->GetResizer();
       if (resizer == nullptr) {
         // Really out of memory.
+        PB_STAT(failed_allocations++);
         return nullptr;
       }
       size_t old_size = (*buffer)->full_size;
-      size_t new_size = old_size * 2;
-      while (new_size < full_length) {
-        new_size *= 2;
+      // Make sure there's room for the allocation in the new memory,
+      // even if it needs its own free block.
+      size_t new_size = (*buffer)->NextBufferSize(
+          full_length + (*buffer)->MinFreeBlockSize());
+      if (new_size == 0) {
+        PB_STAT(failed_allocations++);
+        return nullptr;
       }
 
+      // The last free block is held in the header so we don't need to
+      // search for it.  If we have been searching the free list 'prev' is
+      // the last free block and 'prev_prev' is the one before it.  The
+      // resizer will move the buffer so we keep offsets rather than
+      // addresses.
+      BufferOffset last = (*buffer)->last_free;
+      BufferOffset last_prev =
+          (*buffer)->FreeBinsEnabled()
+              ? (*buffer)->ToOffset(
+                    (*buffer)->PrevFreeBlock((*buffer)->LastFreeBlock()))
+              : (*buffer)->ToOffset(prev_prev);
+      assert((*buffer)->FreeBinsEnabled() || last == (*buffer)->ToOffset(prev));
+
       // Call the resizer.  This will move *buffer.
+      PB_STAT(resizes++);
+      PB_STAT(resize_bytes_preserved += old_size);
       (*resizer)(buffer, old_size, new_size);
 
       // Set the new size in the newly allocated bigger buffer.
       (*buffer)->full_size = new_size;
 
-      // OK, so now we have to find the end of the free list in the new block.
-      // The old pointers refer to the deallocated memory.
-      free_block = (*buffer)->FreeList();
-      prev = nullptr;
-      while (free_block != nullptr) {
-        prev = free_block;
-        free_block = (*buffer)->ToAddress<FreeBlockHeader>(free_block->next);
+      if ((*buffer)->FreeBinsEnabled()) {
+        // The new memory goes on the end of the free block at the end of
+        // the buffer, or becomes one.
+        BufferOffset old_end = BufferOffset(old_size) & ~3U;
+        free_block = (*buffer)->LastFreeBlock();
+        if (free_block != nullptr) {
+          (*buffer)->RemoveFromFreeBin(free_block);
+          free_block->length += (*buffer)->BlocksEnd() - old_end;
+          (*buffer)->AddToFreeBin(free_block);
+          (*buffer)->SetFreeBlockTags(free_block);
+        } else {
+          free_block = (*buffer)->ToAddress<FreeBlockHeader>(old_end);
+          free_block->length = (*buffer)->BlocksEnd() - old_end;
+          (*buffer)->PushFreeBlock(free_block);
+        }
+        prev = (*buffer)->PrevFreeBlock(free_block);
+        continue;
       }
 
-      // 'prev' is either nullptr, which means we had no free list, or points
-      // to the last free block header in the new buffer.
       // Expand the free list to include the new memory.
+      prev = (*buffer)->ToAddress<FreeBlockHeader>(last);
       char *start_of_new_memory = reinterpret_cast<char *>(*buffer) + old_size;
-      bool free_list_expanded = false;
-      if (prev != nullptr) {
-        char *end_of_free_list = reinterpret_cast<char *>(prev) + prev->length;
-        if (start_of_new_memory == end_of_free_list) {
-          // Last free block is right at the end of the memory, so edxpand it
-          // include the new memory.  This is likely to be true.
-          prev->length += new_size - old_size;
-          free_list_expanded = true;
-        }
-      }
-
-      if (!free_list_expanded) {
+      if (prev != nullptr &&
+          reinterpret_cast<char *>(prev) + prev->length == start_of_new_memory) {
+        // Last free block is right at the end of the memory, so expand it to
+        // include the new memory.  This is likely to be true.
+        (*buffer)->RemoveFromFreeBin(prev);
+        prev->length += new_size - old_size;
+        (*buffer)->AddToFreeBin(prev);
+        free_block = prev;
+        prev = (*buffer)->ToAddress<FreeBlockHeader>(last_prev);
+      } else {
         // Need to add a new free block to the end of the free list.
         FreeBlockHeader *new_block =
             reinterpret_cast<FreeBlockHeader *>(start_of_new_memory);
@@ -316,49 +817,303 @@ void *PayloadBuffer::Allocate(PayloadBuffer **buffer, uint32_t n,
         } else {
           prev->next = (*buffer)->ToOffset(new_block);
         }
+        (*buffer)->FreeBlockLinked(new_block, prev);
+        free_block = new_block;
       }
-      return Allocate(buffer, n, alignment, clear);
+      // 'free_block' is now big enough for the allocation so we will
+      // take it straight away.
+      continue;
     }
     if (free_block->length >= full_length) {
       // Free block is big enough.  If there's enough room for the free block
       // header, take the lower part of the free block and keep the remainder
       // in the free list.
       n = (*buffer)->TakeStartOfFreeBlock(free_block, n, full_length, prev);
-      size_t *newblock = (size_t *)free_block; // Start of new block.
-      *newblock = n;                           // Size of allocated block.
+      // Size of allocated block.  The block below a free block is never
+      // free, so that tag is clear.
+      *reinterpret_cast<uint32_t *>(free_block) =
+          n | ((*buffer)->FreeBinsEnabled() ? kBlockInUse : 0);
       void *addr =
           reinterpret_cast<void *>(uintptr_t(free_block) + sizeof(uint32_t));
       if (clear) {
         memset(addr, 0, full_length - 4);
       }
+      PB_STAT(free_list_allocations++);
       return addr;
     }
+    PB_STAT(free_blocks_searched++);
+    prev_prev = prev;
     prev = free_block;
     free_block = (*buffer)->ToAddress<FreeBlockHeader>(free_block->next);
   }
 }
 
+size_t PayloadBuffer::NextBufferSize(size_t needed) const {
+  size_t new_size = full_size;
+  switch (growth_policy) {
+  case GrowthPolicy::kDouble:
+    new_size += full_size;
+    break;
+  case GrowthPolicy::kOneAndAHalf:
+    new_size += full_size / 2;
+    break;
+  case GrowthPolicy::kFixedIncrement:
+    new_size += growth_increment;
+    break;
+  }
+  if (new_size < full_size + needed) {
+    new_size = full_size + needed;
+  }
+  // Keep the size a multiple of 8.
+  new_size = (new_size + 7) & ~size_t(7);
+  if (new_size > 0xffffffffULL) {
+    // The buffer offsets are 32 bits.
+    return 0;
+  }
+  return new_size;
+}
+
+void PayloadBuffer::Reset() {
+  message = 0;
+  metadata = 0;
+  mark_start = 0;
+  bump = 0;
+  for (size_t i = 0; i < kMaxBitmapRuns; i++) {
+    bitmaps[i] = 0;
+  }
+  InitFreeList();
+}
+
+uint32_t PayloadBuffer::WireSize() const {
+  // The last free block's header may be just above the hwm and is needed
+  // to rebuild the free list at the other end.
+  uint32_t size = hwm;
+  if (last_free != 0) {
+    size = std::max(size, last_free + MinFreeBlockSize());
+  }
+  return std::min(size, full_size);
+}
+
+PayloadBuffer::ReceiveState PayloadBuffer::BeginReceive() const {
+  ReceiveState state;
+  memcpy(state.header, this, sizeof(state.header));
+  return state;
+}
+
+bool PayloadBuffer::EndReceive(uint32_t length, const ReceiveState &state) {
+  const PayloadBuffer *original =
+      reinterpret_cast<const PayloadBuffer *>(state.header);
+  uint32_t our_size = original->full_size;
+  uint32_t sender_size = full_size;
+  bool layout_ok = IsValidMagic() && (IsMoveable() || !original->IsMoveable());
+  size_t header_size = sizeof(PayloadBuffer) +
+                       (IsMoveable() ? sizeof(Resizer *) : 0) +
+                       (FreeBinsEnabled() ? sizeof(FreeBins) : 0);
+  // Everything in use must have been received.
+  bool valid =
+      layout_ok && length >= header_size && length <= our_size &&
+      length <= sender_size && hwm >= header_size && hwm <= length &&
+      mark_start == 0 && message < hwm && metadata < hwm &&
+      num_bitmap_runs <= kMaxBitmapRuns &&
+      (free_list == 0) == (last_free == 0) &&
+      (last_free == 0 || last_free + MinFreeBlockSize() <= length) &&
+      (FreeBinsEnabled() ? free_bins == sizeof(PayloadBuffer) +
+                                            (IsMoveable() ? sizeof(Resizer *)
+                                                          : 0)
+                         : free_bins == 0);
+  if (!valid) {
+    AbortReceive(state);
+    return false;
+  }
+
+  uint32_t flags = magic & kMagicFlagsMask;
+  if (original->IsMoveable()) {
+    // Our resizer, not the sender's.
+    *reinterpret_cast<Resizer **>(this + 1) =
+        *reinterpret_cast<Resizer *const *>(original + 1);
+    magic = kMovableBufferMagic | flags;
+  } else {
+    // A movable sender's resizer slot is just unused memory to us.
+    magic = kFixedBufferMagic | flags;
+  }
+  full_size = our_size;
+
+  // Memory above the hwm is unused, but the free list describes the
+  // sender's buffer.  Make the end of the free list cover the rest of ours.
+  FreeBlockHeader *last = LastFreeBlock();
+  uint32_t last_end = last == nullptr ? 0 : last_free + last->length;
+  if (last != nullptr && last_end >= hwm) {
+    // Nothing in use above the last free block.
+    RemoveFromFreeBin(last);
+    last->length = BlocksEnd() - last_free;
+    AddToFreeBin(last);
+    if (FreeBinsEnabled()) {
+      SetFreeBlockTags(last);
+    }
+  } else {
+    // With the bins the sender's blocks end at the hwm.
+    AddFreeBlockAtEnd(FreeBinsEnabled() ? hwm : (hwm + 7) & ~7);
+  }
+  return true;
+}
+
+void PayloadBuffer::AbortReceive(const ReceiveState &state) {
+  memcpy(this, state.header, sizeof(state.header));
+  Reset();
+}
+
+BufferMark PayloadBuffer::Mark() {
+  if (IsMarked()) {
+    return {bump, hwm, message, metadata, false};
+  }
+  // Take the last free block out of the free list if it is at the end of
+  // the buffer.  Bump allocation starts at its address.
+  bump = BlocksEnd();
+  FreeBlockHeader *last = LastFreeBlock();
+  if (last != nullptr && ToOffset(last) + last->length == BlocksEnd()) {
+    if (FreeBinsEnabled()) {
+      // The block below is allocated.
+      UnlinkFreeBlock(last);
+      last_free = 0;
+    } else {
+      FreeBlockHeader *prev = nullptr;
+      for (FreeBlockHeader *b = FreeList(); b != last;
+           b = ToAddress<FreeBlockHeader>(b->next)) {
+        prev = b;
+      }
+      if (prev == nullptr) {
+        free_list = 0;
+      } else {
+        prev->next = 0;
+      }
+      last_free = ToOffset(prev);
+    }
+    bump = ToOffset(last);
+  }
+  mark_start = bump;
+  return {bump, hwm, message, metadata, true};
+}
+
+void PayloadBuffer::Rollback(const BufferMark &mark) {
+  if (FreeBinsEnabled() && bump != mark.bump) {
+    // The first block allocated since the mark says whether the block
+    // below it is free, which is now the last one.
+    last_free =
+        ToOffset(FreeBlockBelow(ToAddress<FreeBlockHeader>(mark.bump)));
+  }
+  bump = mark.bump;
+  hwm = mark.hwm;
+  message = mark.message;
+  metadata = mark.metadata;
+  if (mark.outermost) {
+    EndBumpAllocation();
+  }
+}
+
+void PayloadBuffer::Commit(const BufferMark &mark) {
+  if (mark.outermost) {
+    EndBumpAllocation();
+  }
+}
+
+void PayloadBuffer::EndBumpAllocation() {
+  BufferOffset start = bump;
+  mark_start = 0;
+  bump = 0;
+  FreeBlockHeader *last = LastFreeBlock();
+  if (last != nullptr && ToOffset(last) + last->length == start) {
+    // Something freed while marked is just below, merge with it.
+    RemoveFromFreeBin(last);
+    last->length += BlocksEnd() - start;
+    AddToFreeBin(last);
+    if (FreeBinsEnabled()) {
+      SetFreeBlockTags(last);
+    }
+  } else {
+    AddFreeBlockAtEnd(start);
+  }
+}
+
+void *PayloadBuffer::BumpAllocate(PayloadBuffer **buffer, uint32_t n,
+                                  bool clear) {
+  if (n + sizeof(uint32_t) < (*buffer)->MinFreeBlockSize()) {
+    // The block must be freeable into the free list once committed.
+    n = (*buffer)->MinFreeBlockSize() - sizeof(uint32_t);
+  }
+  size_t full_length = n + sizeof(uint32_t);
+  if ((*buffer)->bump + full_length > (*buffer)->full_size) {
+    Resizer *resizer = (*buffer)->GetResizer();
+    if (resizer == nullptr) {
+      return nullptr;
+    }
+    size_t old_size = (*buffer)->full_size;
+    size_t new_size = (*buffer)->NextBufferSize((*buffer)->bump + full_length -
+                                                old_size);
+    if (new_size == 0) {
+      return nullptr;
+    }
+    // Call the resizer.  This will move *buffer.
+    PB_STAT(resizes++);
+    PB_STAT(resize_bytes_preserved += old_size);
+    (*resizer)(buffer, old_size, new_size);
+    (*buffer)->full_size = new_size;
+  }
+  uint32_t *block = (*buffer)->ToAddress<uint32_t>((*buffer)->bump);
+  uint32_t tags = 0;
+  if ((*buffer)->FreeBinsEnabled()) {
+    // The last free block is just below the bump pointer.
+    tags = kBlockInUse | ((*buffer)->last_free != 0 ? kPrevBlockFree : 0);
+    (*buffer)->last_free = 0;
+  }
+  *block = n | tags;
+  (*buffer)->bump += full_length;
+  (*buffer)->UpdateHWM((*buffer)->bump);
+  if (clear) {
+    memset(block + 1, 0, n);
+  }
+  return block + 1;
+}
+
 std::vector<void *> PayloadBuffer::AllocateMany(PayloadBuffer **buffer,
                                                 uint32_t size, uint32_t n,
                                                 uint32_t alignment,
                                                 bool clear) {
   // Calculate space for the whole block.  This is n*aligned(size) +
   // n*sizeof(uint32_t).
-  size_t full_length = n * (AlignSize(size, alignment) + sizeof(uint32_t));
-  void *start = Allocate(buffer, full_length, 8, clear);
+  uint32_t len = AlignSize(size, alignment);
+  if ((*buffer)->FreeBinsEnabled() &&
+      len + sizeof(uint32_t) < (*buffer)->MinFreeBlockSize()) {
+    // Each block must be able to be freed into the free bins.
+    len = (*buffer)->MinFreeBlockSize() - sizeof(uint32_t);
+  }
+  size_t full_length = n * (len + sizeof(uint32_t));
+  // With the bins the chunks must be blocks of their own, not in a small
+  // block.
+  void *start = Allocate(buffer, full_length, 8, clear,
+                         !(*buffer)->FreeBinsEnabled());
   if (start == nullptr) {
     return {}; // No memory.
   }
   if (clear) {
     memset(start, 0, full_length);
   }
+  uint32_t tags = 0;
+  uint32_t spare = 0;
+  if ((*buffer)->FreeBinsEnabled()) {
+    // So that the blocks cover the buffer, the length word of the whole
+    // block becomes an empty allocated block and the last chunk takes any
+    // spare memory at the end.
+    uint32_t *whole = reinterpret_cast<uint32_t *>(start) - 1;
+    spare = (*whole & ~kBlockTagMask) - full_length;
+    *whole = (*whole & kPrevBlockFree) | kBlockInUse;
+    tags = kBlockInUse;
+  }
   // Divide the block into freeable chunks, each of which is align(size) bytes
   // long.  The length of each block is stored immediately before the block.
   std::vector<void *> blocks;
   uint32_t *p = reinterpret_cast<uint32_t *>(start);
   for (uint32_t i = 0; i < n; i++) {
-    uint32_t len = AlignSize(size, alignment);
-    p[0] = len;
+    p[0] = (i == n - 1 ? len + spare : len) | tags;
     blocks.push_back(reinterpret_cast<void *>(p + 1));
     p = reinterpret_cast<uint32_t *>(reinterpret_cast<char *>(p) + len +
                                      sizeof(uint32_t));
@@ -373,9 +1128,11 @@ void PayloadBuffer::MergeWithAboveIfPossible(FreeBlockHeader *alloc_block,
                                              size_t alloc_length) {
   uintptr_t alloc_addr = (uintptr_t)alloc_block;
   uintptr_t free_addr = (uintptr_t)free_block;
+  FreeBlockHeader *prev = PrevFreeBlock(free_block);
 
   if (alloc_addr + alloc_length == free_addr) {
     // Merge with block above.
+    RemoveFromFreeBin(free_block);
     alloc_header->next = free_block->next;
     alloc_header->length =
         alloc_length + sizeof(BufferOffset) + free_block->length;
@@ -387,15 +1144,21 @@ void PayloadBuffer::MergeWithAboveIfPossible(FreeBlockHeader *alloc_block,
     alloc_header->next = ToOffset(free_block);
     *next_ptr = ToOffset(alloc_header);
   }
+  FreeBlockLinked(alloc_header, prev);
 }
 
-static bool MergeWithBelowIfPossible(FreeBlockHeader *free_block,
+static bool MergeWithBelowIfPossible(PayloadBuffer *pb,
+                                     FreeBlockHeader *free_block,
                                      FreeBlockHeader *prev) {
   uintptr_t prev_addr = (uintptr_t)prev;
   if (prev_addr + prev->length == (uintptr_t)free_block) {
     // Lower block is adjacent.
+    pb->RemoveFromFreeBin(prev);
+    pb->RemoveFromFreeBin(free_block);
     prev->next = free_block->next;
     prev->length += free_block->length;
+    pb->SetPrevFreeBlock(prev->next, prev);
+    pb->AddToFreeBin(prev);
     return true;
   }
   return false;
@@ -405,23 +1168,80 @@ void PayloadBuffer::InsertNewFreeBlockAtEnd(FreeBlockHeader *free_block,
                                             FreeBlockHeader *prev,
                                             uint32_t length) {
   free_block->length = length;
+  if (FreeBinsEnabled()) {
+    // The list isn't in address order.
+    PushFreeBlock(free_block);
+    return;
+  }
   free_block->next = 0;
   if (prev == nullptr) {
     free_list = ToOffset(free_block);
   } else {
     prev->next = ToOffset(free_block);
   }
+  FreeBlockLinked(free_block, prev);
+}
+
+void PayloadBuffer::AddFreeBlockAtEnd(BufferOffset start) {
+  uint32_t end = BlocksEnd();
+  if (start >= end) {
+    return;
+  }
+  uint32_t length = end - start;
+  if (length >= MinFreeBlockSize()) {
+    InsertNewFreeBlockAtEnd(ToAddress<FreeBlockHeader>(start), LastFreeBlock(),
+                            length);
+  } else if (FreeBinsEnabled()) {
+    // Too small for a free block.  Keep the blocks covering the buffer with
+    // an allocated block that is never freed.
+    *ToAddress<uint32_t>(start) = (length - sizeof(uint32_t)) | kBlockInUse;
+    UpdateHWM(end);
+  }
+  // Otherwise the few bytes left at the end are lost until the next Reset.
+}
+
+void PayloadBuffer::FreeBinnedBlock(FreeBlockHeader *block, uint32_t length) {
+  // The tags say whether the neighbours are free, so they can be coalesced
+  // without searching the free list.
+  FreeBlockHeader *below = FreeBlockBelow(block);
+  FreeBlockHeader *above = FreeBlockAt(ToOffset(block) + length);
+  if (above != nullptr) {
+    UnlinkFreeBlock(above);
+    length += above->length;
+  }
+  if (below != nullptr) {
+    RemoveFromFreeBin(below);
+    below->length += length;
+    AddToFreeBin(below);
+    SetFreeBlockTags(below);
+    return;
+  }
+  block->length = length;
+  PushFreeBlock(block);
 }
 
 void PayloadBuffer::Free(void *p) {
   if (p == nullptr) {
     return;
   }
+  PB_STAT(frees++);
   // An allocated block has its length immediately before its address.
   uint32_t alloc_length =
       *(reinterpret_cast<uint32_t *>(p) - 1); // Length of allocated block.
+  if (IsBumpBlock(p)) {
+    // Bump allocated memory is only reclaimed if it's the last block.
+    uint32_t length = alloc_length & ~kBlockTagMask;
+    if (ToOffset(p) + length == bump) {
+      bump -= length + sizeof(uint32_t);
+      if (FreeBinsEnabled()) {
+        // The block below might be free, and is now the last one.
+        last_free = ToOffset(FreeBlockBelow(ToAddress<FreeBlockHeader>(bump)));
+      }
+    }
+    return;
+  }
   int small_block_index =
-      BitmapsEnabled() ? BitmapRunIndexFromEncodedSize(alloc_length) : -1;
+      BitmapsEnabled() ? BitmapRunIndexFromEncodedSize(this, alloc_length) : -1;
   if (small_block_index >= 0) {
     int bitnum = (alloc_length >> kBitmpRunBitNumShift) & kBitmapRunBitNumMask;
     int bitmap_index =
@@ -433,15 +1253,21 @@ void PayloadBuffer::Free(void *p) {
   // Point to real start of allocated block.
   FreeBlockHeader *alloc_header =
       reinterpret_cast<FreeBlockHeader *>(uintptr_t(p) - sizeof(uint32_t));
+  if (FreeBinsEnabled()) {
+    FreeBinnedBlock(alloc_header,
+                    (alloc_length & ~kBlockTagMask) + sizeof(uint32_t));
+    return;
+  }
 
   // Insert into free list by searching for the appropriate point in memory
   // sorted by address.
   FreeBlockHeader *free_block = FreeList();
   if (free_block == nullptr) {
     // No free list, this block becomes the only block.
-    alloc_header->length = alloc_length + sizeof(size_t);
+    alloc_header->length = alloc_length + sizeof(uint32_t);
     alloc_header->next = 0;
     free_list = ToOffset(alloc_header);
+    FreeBlockLinked(alloc_header, nullptr);
     return;
   }
   FreeBlockHeader *prev = nullptr;
@@ -464,7 +1290,7 @@ void PayloadBuffer::Free(void *p) {
       // immediately contiguous with the previous free block,
       // we can merge them,
       if (prev != nullptr) {
-        MergeWithBelowIfPossible(alloc_header, prev);
+        MergeWithBelowIfPossible(this, alloc_header, prev);
       }
       // We're done.
       return;
@@ -473,15 +1299,12 @@ void PayloadBuffer::Free(void *p) {
     prev = free_block;
     free_block = ToAddress<FreeBlockHeader>(free_block->next);
   }
-  // We reached the end of the free list, insert free block at end.
+  // We reached the end of the free list, insert free block at end and
+  // merge it with the one below if they are adjacent.
+  InsertNewFreeBlockAtEnd(alloc_header, prev, alloc_length + sizeof(uint32_t));
   if (prev != nullptr) {
-    if (MergeWithBelowIfPossible(alloc_header, prev)) {
-      return;
-    }
+    MergeWithBelowIfPossible(this, alloc_header, prev);
   }
-  // Can't merge, insert a new free block at end.
-  InsertNewFreeBlockAtEnd(alloc_header, prev,
-                          alloc_header->length + sizeof(BufferOffset));
 }
 
 void PayloadBuffer::ShrinkBlock(FreeBlockHeader *alloc_block,
@@ -489,13 +1312,15 @@ void PayloadBuffer::ShrinkBlock(FreeBlockHeader *alloc_block,
                                 uint32_t *len_ptr) {
   assert(new_length < orig_length);
   size_t rem = orig_length - new_length;
-  if (rem >= sizeof(FreeBlockHeader)) {
+  if (rem >= MinFreeBlockSize()) {
     // If we are freeing enough to make a free block, free it, otherwise
     // there's nothing we can do and we just keep the block the same size.
-    *len_ptr = new_length; // Change size of block.
+    uint32_t tags = FreeBinsEnabled() ? *len_ptr & kBlockTagMask : 0;
+    *len_ptr = new_length | tags; // Change size of block.
     uint32_t *newp = reinterpret_cast<uint32_t *>(
         reinterpret_cast<char *>(alloc_block) + sizeof(uint32_t) + new_length);
-    *newp = rem - sizeof(uint32_t); // Add header for free.
+    // Add header for free.
+    *newp = (rem - sizeof(uint32_t)) | (tags & kBlockInUse);
     Free(newp + 1);
   }
 }
@@ -504,16 +1329,19 @@ void PayloadBuffer::ExpandIntoFreeBlockAbove(
     FreeBlockHeader *free_block, uint32_t new_length, uint32_t len_diff,
     uint32_t free_remaining, uint32_t *len_ptr, BufferOffset *next_ptr,
     bool clear) {
-  assert(free_remaining > sizeof(FreeBlockHeader));
+  assert(free_remaining >= MinFreeBlockSize());
   FreeBlockHeader *next = ToAddress<FreeBlockHeader>(free_block->next);
+  FreeBlockHeader *prev = PrevFreeBlock(free_block);
+  RemoveFromFreeBin(free_block);
 
   // The free block has enough space.
-  *len_ptr = new_length;
+  *len_ptr = new_length | (FreeBinsEnabled() ? *len_ptr & kBlockTagMask : 0);
   FreeBlockHeader *new_block =
       reinterpret_cast<FreeBlockHeader *>(uintptr_t(free_block) + len_diff);
   new_block->length = free_remaining;
   new_block->next = ToOffset(next);
   *next_ptr = ToOffset(new_block);
+  FreeBlockLinked(new_block, prev);
   UpdateHWM(new_block);
   if (clear) {
     memset(free_block, 0, len_diff);
@@ -522,7 +1350,8 @@ void PayloadBuffer::ExpandIntoFreeBlockAbove(
 
 uint32_t *PayloadBuffer::MergeWithFreeBlockBelow(
     void *alloc_block, FreeBlockHeader *prev, FreeBlockHeader *free_block,
-    uint32_t new_length, uint32_t orig_length, bool clear) {
+    uint32_t new_length, uint32_t orig_length, bool clear,
+    uint32_t extra_length) {
   uintptr_t free_addr = (uintptr_t)free_block;
 
   BufferOffset *next_ptr;
@@ -534,15 +1363,23 @@ uint32_t *PayloadBuffer::MergeWithFreeBlockBelow(
   // Move FreeBlockHeader to end of allocated block.  This is inside
   // the combined free block and block being reallocated.
   FreeBlockHeader *next = ToAddress<FreeBlockHeader>(free_block->next);
+  uint32_t free_length =
+      free_block->length + orig_length - new_length + extra_length;
+  RemoveFromFreeBin(free_block);
+
+  // The new FreeBlockHeader may overlap the end of the old data, so
+  // move the data before we write it.  The block below a free block is
+  // never free.
+  uint32_t *len_ptr = reinterpret_cast<uint32_t *>(free_block);
+  *len_ptr = new_length | (FreeBinsEnabled() ? kBlockInUse : 0);
+  memmove(len_ptr + 1, alloc_block, orig_length);
+
   FreeBlockHeader *newb = reinterpret_cast<FreeBlockHeader *>(
       free_addr + new_length + sizeof(uint32_t));
-  newb->length = free_block->length + orig_length - new_length;
+  newb->length = free_length;
   newb->next = ToOffset(next);
   *next_ptr = ToOffset(newb);
-
-  uint32_t *len_ptr = reinterpret_cast<uint32_t *>(free_block);
-  *len_ptr = new_length;
-  memmove(len_ptr + 1, alloc_block, orig_length);
+  FreeBlockLinked(newb, prev);
   if (clear) {
     memset(reinterpret_cast<char *>(len_ptr) + 4 + orig_length, 0,
            new_length - orig_length);
@@ -550,6 +1387,33 @@ uint32_t *PayloadBuffer::MergeWithFreeBlockBelow(
   return len_ptr + 1;
 }
 
+void *PayloadBuffer::GrowBinnedBlock(void *p, uint32_t new_length,
+                                     uint32_t orig_length, bool clear) {
+  uint32_t *len_ptr = reinterpret_cast<uint32_t *>(p) - 1;
+  uint32_t diff = new_length - orig_length;
+  FreeBlockHeader *above = FreeBlockAt(ToOffset(p) + orig_length);
+  uint32_t above_length = above == nullptr ? 0 : above->length;
+  if (above_length >= diff + MinFreeBlockSize()) {
+    FreeBlockHeader *prev = PrevFreeBlock(above);
+    ExpandIntoFreeBlockAbove(above, new_length, diff, above_length - diff,
+                             len_ptr, prev == nullptr ? &free_list : &prev->next,
+                             clear);
+    return p;
+  }
+  FreeBlockHeader *below =
+      FreeBlockBelow(reinterpret_cast<FreeBlockHeader *>(len_ptr));
+  if (below == nullptr ||
+      below->length + above_length < diff + MinFreeBlockSize()) {
+    return nullptr;
+  }
+  // Move down into the free block below, taking any free block above too.
+  if (above != nullptr) {
+    UnlinkFreeBlock(above);
+  }
+  return MergeWithFreeBlockBelow(p, PrevFreeBlock(below), below, new_length,
+                                 orig_length, clear, above_length);
+}
+
 void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
                              uint32_t alignment, bool clear,
                              bool enable_small_block) {
@@ -557,24 +1421,64 @@ void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
     // No block to realloc, just call malloc.
     return Allocate(buffer, n, alignment, clear);
   }
+  PB_STAT(reallocs++);
   // The allocated block has its length immediately prior to its address.
   uint32_t *len_ptr = reinterpret_cast<uint32_t *>(p) - 1;
   uint32_t orig_length = *len_ptr;
+  if ((*buffer)->FreeBinsEnabled() && (orig_length & (1U << 31)) == 0) {
+    orig_length &= ~kBlockTagMask;
+  }
+  if ((*buffer)->IsBumpBlock(p)) {
+    BufferOffset p_offset = (*buffer)->ToOffset(p);
+    if (p_offset + orig_length == (*buffer)->bump) {
+      // Last block allocated, free it and allocate it again at the same
+      // address with the new size.
+      (*buffer)->Free(p);
+      void *newp = BumpAllocate(buffer, AlignSize(n, alignment), false);
+      if (newp == nullptr) {
+        // Still have the original block.
+        (*buffer)->bump = p_offset + orig_length;
+        if ((*buffer)->FreeBinsEnabled()) {
+          (*buffer)->last_free = 0;
+        }
+        return nullptr;
+      }
+      if (clear && n > orig_length) {
+        memset(reinterpret_cast<char *>(newp) + orig_length, 0,
+               n - orig_length);
+      }
+      return newp;
+    }
+    if (n <= orig_length) {
+      return p;
+    }
+    void *newp = BumpAllocate(buffer, AlignSize(n, alignment), false);
+    if (newp == nullptr) {
+      return nullptr;
+    }
+    p = (*buffer)->ToAddress(p_offset);
+    PB_STAT(realloc_moves++);
+    memcpy(newp, p, orig_length);
+    if (clear) {
+      memset(reinterpret_cast<char *>(newp) + orig_length, 0, n - orig_length);
+    }
+    return newp;
+  }
   if (enable_small_block && (*buffer)->BitmapsEnabled()) {
-    int small_block_index = BitmapRunIndexFromEncodedSize(orig_length);
+    int small_block_index =
+        BitmapRunIndexFromEncodedSize(*buffer, orig_length);
     if (small_block_index >= 0) {
-      int decoded_length =
-          (orig_length >> kBitmapRunSizeShift) & kBitmapRunSizeMask;
+      int decoded_length = DecodeSmallBlockSize(orig_length);
       // If the new size is in the same small block index we can just return the
       // original block.
-      if (BitmapRunIndex(n) == small_block_index) {
+      if ((*buffer)->BitmapRunIndex(n) == small_block_index) {
         int bitnum =
             (orig_length >> kBitmpRunBitNumShift) & kBitmapRunBitNumMask;
         int bitmap_index =
             (orig_length >> kBitmapRunBitMapShift) & kBitmapRunBitMapMask;
         int encoded_size = (1U << 31) | (bitmap_index << kBitmapRunBitMapShift) |
                            (bitnum << kBitmpRunBitNumShift) |
-                           (n & kBitmapRunSizeMask);
+                           EncodeSmallBlockSize(n);
 
         *len_ptr = encoded_size;
         if (clear && n > decoded_length) {
@@ -584,12 +1488,16 @@ void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
         return p;
       }
       // Need to free the old block and allocate a new one as the small block
-      // index is different.
+      // index is different.  The allocation might move the buffer.
+      BufferOffset p_offset = (*buffer)->ToOffset(p);
       void *newp = Allocate(buffer, n, alignment, false, enable_small_block);
       if (newp == NULL) {
         return NULL;
       }
-      memcpy(newp, p, decoded_length);
+      p = (*buffer)->ToAddress(p_offset);
+      PB_STAT(realloc_moves++);
+      // The new block might be smaller than the old one.
+      memcpy(newp, p, std::min(uint32_t(decoded_length), n));
       if (clear && n > decoded_length) {
         memset(reinterpret_cast<char *>(newp) + decoded_length, 0,
                n - decoded_length);
@@ -603,6 +1511,10 @@ void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
   uintptr_t alloc_addr = (uintptr_t)p;
 
   n = AlignSize(n); // Aligned.
+  if (n + sizeof(uint32_t) < (*buffer)->MinFreeBlockSize()) {
+    // Must be able to hold a free block when freed.
+    n = (*buffer)->MinFreeBlockSize() - sizeof(uint32_t);
+  }
   if (n == orig_length) {
     // Same size as current block, nothing to do.
     return p;
@@ -614,8 +1526,16 @@ void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
   }
 
   // Increasing in size.
+  if ((*buffer)->FreeBinsEnabled()) {
+    // The boundary tags find the free blocks next to this one.
+    if (void *newp = (*buffer)->GrowBinnedBlock(p, n, orig_length, clear);
+        newp != nullptr) {
+      return newp;
+    }
+  }
   // See if there's a free block immediately following allocated block.
-  FreeBlockHeader *free_block = (*buffer)->FreeList();
+  FreeBlockHeader *free_block =
+      (*buffer)->FreeBinsEnabled() ? nullptr : (*buffer)->FreeList();
   FreeBlockHeader *prev = NULL;
   FreeBlockHeader *prev_prev = NULL;
   while (free_block != NULL) {
@@ -632,7 +1552,7 @@ void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
         // There is a free block above.  See if has enough space.
         if (free_block->length > diff) {
           ssize_t freelen = free_block->length - diff;
-          if (freelen > sizeof(FreeBlockHeader)) {
+          if (freelen >= (*buffer)->MinFreeBlockSize()) {
             (*buffer)->ExpandIntoFreeBlockAbove(free_block, n, diff, freelen,
                                                 len_ptr, next_ptr, clear);
             return p;
@@ -643,7 +1563,7 @@ void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
       if (prev != NULL) {
         uintptr_t prev_addr = (uintptr_t)prev;
         if (prev_addr + prev->length == (uintptr_t)alloc_block &&
-            prev->length >= diff) {
+            prev->length >= diff + (*buffer)->MinFreeBlockSize()) {
           // Previous free block is adjacent and has enough space in it.
           // Use start of new block as new address and place FreeBlockHeader
           // at newly free part.
@@ -662,11 +1582,14 @@ void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
   // If we get here we can't reuse the existing block.  We allocate a new
   // one, copy the memory and free the old block.  We are guaranteed that
   // the new block is larger than the original one since if it was smaller
-  // we can always reuse the block.
+  // we can always reuse the block.  The allocation might move the buffer.
+  BufferOffset p_offset = (*buffer)->ToOffset(p);
   void *newp = Allocate(buffer, n, alignment, false, enable_small_block);
   if (newp == NULL) {
     return NULL;
   }
+  p = (*buffer)->ToAddress(p_offset);
+  PB_STAT(realloc_moves++);
   memcpy(newp, p, orig_length);
   if (clear) {
     memset(reinterpret_cast<char *>(newp) + orig_length, 0, n - orig_length);
@@ -675,7 +1598,7 @@ void *PayloadBuffer::Realloc(PayloadBuffer **buffer, void *p, uint32_t n,
   return newp;
 }
 bool PayloadBuffer::PrimeBitmapAllocator(PayloadBuffer **self, size_t size) {
-  int index = BitmapRunIndex(size);
+  int index = (*self)->BitmapRunIndex(size);
   if (index < 0) {
     return true;
   }
@@ -687,13 +1610,14 @@ bool PayloadBuffer::PrimeBitmapAllocator(PayloadBuffer **self, size_t size) {
     return false;
   }
   (*self)->bitmaps[index] = offset;
-  VectorHeader *hdr = (*self)->ToAddress<VectorHeader>((*self)->bitmaps[index]);
 
   BitMapRun *run = PayloadBuffer::AllocateBitMapRun(
-      self, bitmp_run_infos[index].size, bitmp_run_infos[index].num);
+      self, (*self)->bitmap_runs[index].size, (*self)->bitmap_runs[index].num);
   if (run == nullptr) {
     return false;
   }
+  // Allocating the run might have moved the buffer.
+  VectorHeader *hdr = (*self)->ToAddress<VectorHeader>((*self)->bitmaps[index]);
   // Add to the vector, this might move the vector contents but the header
   // will stay where it is.
   (*self)->VectorPush<BufferOffset>(self, hdr, (*self)->ToOffset(run), false);
@@ -723,6 +1647,7 @@ BitMapRun *PayloadBuffer::AllocateBitMapRun(PayloadBuffer **self, uint32_t size,
   // with data necessary for freeing it.
   BitMapRun *run = reinterpret_cast<BitMapRun *>(
       Allocate(self, sizeof(BitMapRun) + (size + 4) * num, 4, false, false));
+  PB_STAT(bitmap_runs++);
   if (run == nullptr) {
     return nullptr;
   }
@@ -743,8 +1668,10 @@ void *BitMapRun::Allocate(PayloadBuffer **pb, int index, uint32_t n, int size,
     }
     (*pb)->bitmaps[index] = offset;
   }
-  VectorHeader *hdr = (*pb)->ToAddress<VectorHeader>((*pb)->bitmaps[index]);
   for (;;) {
+    // Allocating a new run might have moved the buffer, so get the header
+    // each time around.
+    VectorHeader *hdr = (*pb)->ToAddress<VectorHeader>((*pb)->bitmaps[index]);
     // Go backwards through the elements as that is most likely to find a free
     // bit.
     for (int i = hdr->num_elements - 1; i >= 0; i--) {
@@ -770,7 +1697,7 @@ void *BitMapRun::Allocate(PayloadBuffer **pb, int index, uint32_t n, int size,
       // Encode the length.
       int encoded_size = (1U << 31) | (i << kBitmapRunBitMapShift) |
                          (bit << kBitmpRunBitNumShift) |
-                         (size & kBitmapRunSizeMask);
+                         EncodeSmallBlockSize(size);
       *p = encoded_size;
       if (clear) {
         memset(addr, 0, size);
@@ -783,7 +1710,8 @@ void *BitMapRun::Allocate(PayloadBuffer **pb, int index, uint32_t n, int size,
       return nullptr;
     }
     // Add to the vector, this might move the vector contents but the header
-    // will stay where it is.
+    // will stay where it is in the buffer.
+    hdr = (*pb)->ToAddress<VectorHeader>((*pb)->bitmaps[index]);
     (*pb)->VectorPush<BufferOffset>(pb, hdr, (*pb)->ToOffset(run), false);
   }
 }
@@ -803,12 +1731,208 @@ void BitMapRun::Free(PayloadBuffer *pb, int index, int bitmap_index,
 
 void *PayloadBuffer::AllocateSmallBlock(PayloadBuffer **pb, uint32_t size,
                                         int index, bool clear) {
-  return BitMapRun::Allocate(pb, index, size, bitmp_run_infos[index].size,
-                             bitmp_run_infos[index].num, clear);
+  const BitmapRunConfig &config = (*pb)->bitmap_runs[index];
+  return BitMapRun::Allocate(pb, index, size, config.size, config.num, clear);
 }
 
 void PayloadBuffer::FreeSmallBlock(PayloadBuffer *pb, int index,
                                    int bitmap_index, int bitnum) {
   BitMapRun::Free(pb, index, bitmap_index, bitnum);
 }
+// Size of the allocated block at 'offset' in 'pb'.
+static uint32_t BlockSize(const PayloadBuffer *pb, BufferOffset offset) {
+  return PayloadBuffer::DecodeSize(const_cast<BufferOffset *>(
+      pb->ToAddress<BufferOffset>(offset)));
+}
+
+BufferOffset PayloadCompactor::CopyBlock(BufferOffset block, uint32_t length,
+                                         uint32_t alignment) {
+  auto it = copies_.find(block);
+  if (it != copies_.end()) {
+    // Already copied through another reference.
+    return it->second.dest;
+  }
+  if (!ok_ || length == 0) {
+    return 0;
+  }
+  const void *from = src_->ToAddress(block);
+  if (from == nullptr || size_t(block) + length > src_->full_size) {
+    ok_ = false;
+    return 0;
+  }
+  // No small blocks so that the copy is packed in address order.
+  void *to = PayloadBuffer::Allocate(dest_, length, alignment, false,
+                                     /*enable_small_block=*/false);
+  if (to == nullptr) {
+    ok_ = false;
+    return 0;
+  }
+  memcpy(to, from, length);
+  BufferOffset dest = (*dest_)->ToOffset(to);
+  copies_[block] = {dest, length};
+  return dest;
+}
+
+BufferOffset PayloadCompactor::DestField(BufferOffset field) const {
+  // Find the copied block containing the field.
+  auto it = copies_.upper_bound(field);
+  if (it == copies_.begin()) {
+    return 0;
+  }
+  --it;
+  if (field < it->first ||
+      field + sizeof(BufferOffset) > it->first + it->second.length) {
+    return 0;
+  }
+  return it->second.dest + (field - it->first);
+}
+
+void PayloadCompactor::SetDestField(BufferOffset field, BufferOffset value) {
+  BufferOffset *p = (*dest_)->ToAddress<BufferOffset>(DestField(field));
+  if (p == nullptr) {
+    ok_ = false;
+    return;
+  }
+  *p = value;
+}
+
+void PayloadCompactor::Block(BufferOffset field) {
+  const BufferOffset *p = src_->ToAddress<BufferOffset>(field);
+  if (p == nullptr || *p == 0) {
+    return;
+  }
+  SetDestField(field, CopyBlock(*p, BlockSize(src_, *p), 4));
+}
+
+void PayloadCompactor::String(BufferOffset field) {
+  const BufferOffset *p = src_->ToAddress<StringHeader>(field);
+  if (p == nullptr || *p == 0) {
+    return;
+  }
+  const uint32_t *len = src_->ToAddress<uint32_t>(*p);
+  if (len == nullptr) {
+    ok_ = false;
+    return;
+  }
+  SetDestField(field, CopyBlock(*p, *len + sizeof(uint32_t), 4));
+}
+
+void PayloadCompactor::VectorOfSize(BufferOffset field, size_t element_size) {
+  const VectorHeader *hdr = src_->ToAddress<VectorHeader>(field);
+  if (hdr == nullptr || hdr->data == 0) {
+    return;
+  }
+  BufferOffset data = 0;
+  if (hdr->num_elements > 0) {
+    data = CopyBlock(hdr->data, hdr->num_elements * element_size, 8);
+  }
+  // An empty vector doesn't need any memory.
+  SetDestField(field + offsetof(VectorHeader, data), data);
+}
+
+void PayloadCompactor::Message(BufferOffset field,
+                               const CompactVisitor &visitor) {
+  const BufferOffset *p = src_->ToAddress<BufferOffset>(field);
+  if (p == nullptr || *p == 0) {
+    return;
+  }
+  BufferOffset msg = *p;
+  bool visited = copies_.find(msg) != copies_.end();
+  SetDestField(field, CopyBlock(msg, BlockSize(src_, msg), 8));
+  if (ok_ && !visited) {
+    visitor(*this, msg);
+  }
+}
+
+void PayloadCompactor::MessageVector(BufferOffset field,
+                                     const CompactVisitor &visitor) {
+  VectorOfSize(field, sizeof(BufferOffset));
+  const VectorHeader *hdr = src_->ToAddress<VectorHeader>(field);
+  if (hdr == nullptr || hdr->data == 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < hdr->num_elements && ok_; i++) {
+    Message(hdr->data + i * sizeof(BufferOffset), visitor);
+  }
+}
+
+bool PayloadBuffer::CompactCopy(const PayloadBuffer *src, PayloadBuffer **dest,
+                                const CompactVisitor &visitor) {
+  PayloadCompactor compactor(src, dest);
+  if (src->message != 0) {
+    BufferOffset msg =
+        compactor.CopyBlock(src->message, BlockSize(src, src->message), 8);
+    (*dest)->message = msg;
+    if (msg != 0) {
+      visitor(compactor, src->message);
+    }
+  }
+  if (src->metadata != 0) {
+    (*dest)->metadata =
+        compactor.CopyBlock(src->metadata, BlockSize(src, src->metadata), 1);
+  }
+  return compactor.Ok();
+}
+
+bool PayloadBuffer::Compact(PayloadBuffer **buffer,
+                            const CompactVisitor &visitor) {
+  PayloadBuffer *pb = *buffer;
+  if (pb->IsMarked()) {
+    return false;
+  }
+  // Make the compacted copy in a buffer with the same header layout as this
+  // one so that all the offsets are the same when we copy it back.  The
+  // copy holds no more than the data in use, so start it at that size
+  // rather than the full size of the buffer.  Blocks can be laid out a
+  // little differently in the copy, so a movable copy grows if it needs to
+  // and a fixed one is retried at the full size.
+  uint32_t size = pb->full_size;
+  uint32_t scratch_size =
+      std::min(pb->WireSize() + pb->MinFreeBlockSize(), size);
+  for (;;) {
+    char *mem = reinterpret_cast<char *>(malloc(scratch_size));
+    if (mem == nullptr) {
+      return false;
+    }
+    PayloadBuffer *copy;
+    if (pb->IsMoveable()) {
+      copy = new (mem) PayloadBuffer(
+          scratch_size,
+          Resizer([](PayloadBuffer **p, size_t, size_t new_size) {
+            *p = reinterpret_cast<PayloadBuffer *>(
+                realloc(static_cast<void *>(*p), new_size));
+          }),
+          false, pb->FreeBinsEnabled());
+    } else {
+      copy = new (mem) PayloadBuffer(scratch_size, false, pb->FreeBinsEnabled());
+    }
+    BufferOffset data_start = copy->free_list;
+    bool ok = CompactCopy(pb, &copy, visitor);
+
+    // Nothing is freed in the copy so there is at most one free block and
+    // it's at the end.
+    uint32_t data_end =
+        copy->free_list != 0 ? copy->free_list : copy->BlocksEnd();
+    ok = ok && data_end <= size;
+    if (ok) {
+      pb->Reset();
+      pb->RemoveFromFreeBin(pb->FreeList());
+      pb->free_list = 0;
+      pb->last_free = 0;
+      memcpy(reinterpret_cast<char *>(pb) + data_start,
+             reinterpret_cast<char *>(copy) + data_start,
+             data_end - data_start);
+      pb->message = copy->message;
+      pb->metadata = copy->metadata;
+      pb->hwm = std::min(copy->hwm, size);
+      pb->AddFreeBlockAtEnd(data_end);
+    }
+    copy->~PayloadBuffer();
+    free(static_cast<void *>(copy));
+    if (ok || pb->IsMoveable() || scratch_size == size) {
+      return ok;
+    }
+    scratch_size = size;
+  }
+}
 } // namespace toolbelt
@@ -1,23 +1,34 @@
 #pragma once
 
 #include "absl/types/span.h"
+#include <algorithm>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace toolbelt {
 
-constexpr uint32_t kFixedBufferMagic = 0xe5f6f1c4;
-constexpr uint32_t kMovableBufferMagic = 0xc5f6f1c4;
+// These change whenever the header layout or block encoding does, so a
+// buffer in another format isn't mistaken for one of ours.
+constexpr uint32_t kFixedBufferMagic = 0xe5f6f1c8;
+constexpr uint32_t kMovableBufferMagic = 0xc5f6f1c8;
 
 // Bottom bit is set for enabling bitmap allocator.
 constexpr uint32_t kBitMapMask = 0xfffffffe;
 constexpr uint32_t kBitMapFlag = 1;
 
+// Bit 1 is set when the free list is indexed by size bins.
+constexpr uint32_t kFreeBinsFlag = 2;
+
+// All flag bits in the magic.
+constexpr uint32_t kMagicFlagsMask = kBitMapFlag | kFreeBinsFlag;
+
 using BufferOffset = uint32_t;
 
 struct FreeBlockHeader {
@@ -25,6 +36,43 @@ struct FreeBlockHeader {
   BufferOffset next; // Absolute offset into buffer for next free block.
 };
 
+// When the free bins are enabled, each free block has these links immediately
+// after its FreeBlockHeader.  The free list (through FreeBlockHeader::next)
+// is not in address order but it is doubly linked so that a block found in
+// a bin can be removed without searching for its predecessor.  The bin
+// links chain together all free blocks in the same size bin.
+struct FreeBlockLinks {
+  BufferOffset prev;     // Previous free block in the free list.
+  BufferOffset bin_next; // Next free block in the same bin.
+  BufferOffset bin_prev; // Previous free block in the same bin.
+};
+
+// With the free bins, blocks have boundary tags so that a block being freed
+// can find its neighbours and coalesce with them without searching the free
+// list.  The blocks cover the whole buffer after the header.  The length
+// word of an allocated block has kBlockInUse set, and kPrevBlockFree if the
+// block below it is free.  The last word of a free block holds its offset.
+// Block lengths are multiples of 4 so these bits are otherwise unused.
+constexpr uint32_t kPrevBlockFree = 1;
+constexpr uint32_t kBlockInUse = 2;
+constexpr uint32_t kBlockTagMask = kPrevBlockFree | kBlockInUse;
+
+// Segregated free lists.  Free blocks are placed in a bin according to their
+// length.  Each power of two is divided into 4 linear ranges (TLSF style) so
+// that there are 4 bins for lengths 16-31, 4 for 32-63, etc.  A search
+// rounds the requested length up to the start of the next bin, so any block
+// in that bin or a higher one is big enough and no list walk is needed.  A
+// bitmap of non-empty bins makes finding the first usable bin O(1).
+inline constexpr int kFreeBinMinShift = 4; // Smallest bin holds 16 bytes.
+inline constexpr int kFreeBinSubdivisionShift = 2;
+inline constexpr int kNumFreeBins = (32 - kFreeBinMinShift)
+                                    << kFreeBinSubdivisionShift;
+
+struct FreeBins {
+  uint32_t nonempty[(kNumFreeBins + 31) / 32]; // Bit set if bin has blocks.
+  BufferOffset bins[kNumFreeBins];             // First free block in bin.
+};
+
 // The 'data' member refers to a block of allocated memory in the
 // buffer.  Since it's been allocated using Allocate, the preceding
 // 4 bytes contains the length of the block in bytes (little endian).
@@ -61,6 +109,15 @@ using StringHeader = BufferOffset;
 using Resizer =
     std::function<void(PayloadBuffer **, size_t old_size, size_t new_size)>;
 
+// How a resizable buffer grows when it runs out of memory.  The buffer
+// always grows by at least enough to hold the allocation that caused
+// the resize.
+enum class GrowthPolicy : uint8_t {
+  kDouble,         // Double the size of the buffer (the default).
+  kOneAndAHalf,    // Grow the buffer by half its size.
+  kFixedIncrement, // Grow by a fixed number of bytes.  Good for big buffers.
+};
+
 // BitMap allocator.  In order to reduce fragmentation and speed up allocation
 // of small blocks, we use a bitmap allocator for a fixed number of small block
 // sizes.  Each BitMapRun refers to a run of blocks of the same size.  It
@@ -71,7 +128,7 @@ using Resizer =
 
 struct BitMapRun {
   uint32_t bits; // Bit per chunk.
-  uint8_t size;  // Size of each chunk.
+  uint16_t size; // Size of each chunk.
   uint8_t num;   // Number of chunks in run.
   uint8_t free;  // Number of free chunks.
   // The memory for the run is immediately after the BitMapRun.
@@ -86,6 +143,12 @@ struct BitMapRun {
 // Default bitmap allocator runs.
 inline constexpr size_t kNumBitmapRuns = 4;
 
+// Maximum number of bitmap allocator runs a buffer can be configured with.
+inline constexpr size_t kMaxBitmapRuns = 8;
+
+// Maximum number of blocks in a run (one bit per block in BitMapRun::bits).
+inline constexpr int kMaxRunSize = 32;
+
 // Run size for each block size.   This is the size of the run, that is, how
 // many individual blocks are in a run.  There is a limit of 32 since we use an
 // unsigned int for the bitmap.  A whole run is allocated at once so there is
@@ -104,6 +167,21 @@ inline constexpr int kBitmapRunSize2 = 32;
 inline constexpr int kBitmapRunSize3 = 64;
 inline constexpr int kBitmapRunSize4 = 128;
 
+// Block size and number of blocks per run for one bitmap run size class.
+// The size classes used by a buffer are held in its header so that any
+// process can decode it.
+struct BitmapRunConfig {
+  uint16_t size; // Size of each block, a multiple of 4 up to 1020.
+  uint16_t num;  // Number of blocks per run, up to kMaxRunSize.
+};
+
+inline constexpr BitmapRunConfig kDefaultBitmapRuns[kNumBitmapRuns] = {
+    {kBitmapRunSize1, kRunSize1},
+    {kBitmapRunSize2, kRunSize2},
+    {kBitmapRunSize3, kRunSize3},
+    {kBitmapRunSize4, kRunSize4},
+};
+
 // In order to allow free to work without searching, we use the 4 bytes
 // preceding the allocated block in the run to store the size of the block, the
 // index into the BitMapRun vector and the bit number in the bitmap.  In order
@@ -112,18 +190,126 @@ inline constexpr int kBitmapRunSize4 = 128;
 // 1. Bit 31 set
 // 2. Bits 30-26 (5 bits) contain the bit number into the bitmap.
 // 3. Bits 25-8 (18 bits) contain the index into the vector of bitmap runs.
-// 3. Bits 7-0 (8 bits) contain the size of the block.
+// 3. Bits 7-0 (8 bits) contain the size of the block in units of 4 bytes.
 
 // Shifts for size encoding for small blocks.
 inline constexpr int kBitmpRunBitNumShift = 26;
 inline constexpr int kBitmapRunBitMapShift = 8;
 inline constexpr int kBitmapRunSizeShift = 0;
+inline constexpr int kBitmapRunSizeUnitShift = 2; // Size is in 4 byte units.
 
 // Masks
 inline constexpr uint32_t kBitmapRunBitNumMask = 0x1f;
 inline constexpr uint32_t kBitmapRunBitMapMask = 0x3ffff;
 inline constexpr uint32_t kBitmapRunSizeMask = 0xff;
 
+// Largest block size we can encode for a small block.
+inline constexpr int kMaxBitmapRunBlockSize = kBitmapRunSizeMask
+                                              << kBitmapRunSizeUnitShift;
+
+inline uint32_t EncodeSmallBlockSize(uint32_t size) {
+  return ((size + (1 << kBitmapRunSizeUnitShift) - 1) >>
+          kBitmapRunSizeUnitShift) &
+         kBitmapRunSizeMask;
+}
+
+inline uint32_t DecodeSmallBlockSize(uint32_t encoded) {
+  return ((encoded >> kBitmapRunSizeShift) & kBitmapRunSizeMask)
+         << kBitmapRunSizeUnitShift;
+}
+
+// Collects a histogram of allocation sizes (for example the string, vector
+// and submessage sizes from a sample of real messages) and suggests bitmap
+// run size classes that will waste the least memory for them.
+class SizeHistogram {
+public:
+  void Add(size_t size, size_t count = 1);
+  void Clear() { counts_.clear(); }
+
+  // Suggest up to 'max_classes' size classes.  The sizes are chosen to
+  // minimize the memory wasted by rounding each sample up to the size of
+  // its class; sizes too big for a small block are ignored.  The number of
+  // blocks in a run is proportional to how often the class is used, with
+  // the most used class getting the maximum of kMaxRunSize.
+  std::vector<BitmapRunConfig>
+  SuggestBitmapRuns(size_t max_classes = kNumBitmapRuns) const;
+
+private:
+  // Count of samples for each size in 4 byte units.
+  std::vector<size_t> counts_;
+};
+
+class PayloadCompactor;
+
+// Called by compaction for each message that is copied.  'msg' is the
+// offset of the message in the source buffer.  The function tells the
+// compactor about each field in the message that refers to other memory in
+// the buffer.
+using CompactVisitor =
+    std::function<void(PayloadCompactor &compactor, BufferOffset msg)>;
+
+// Allocation state saved by PayloadBuffer::Mark.
+struct BufferMark {
+  BufferOffset bump;     // Bump allocation point at the time of the mark.
+  uint32_t hwm;          // hwm at the time of the mark.
+  BufferOffset message;  // Message at the time of the mark.
+  BufferOffset metadata; // Metadata at the time of the mark.
+  bool outermost;        // This mark started bump allocation.
+};
+
+// Allocator statistics.  Counting is compiled in only when
+// TOOLBELT_PAYLOAD_BUFFER_STATS is defined (for example with
+// --copt=-DTOOLBELT_PAYLOAD_BUFFER_STATS) and then only for threads that
+// have given PayloadBuffer::SetThreadStats somewhere to count into, so
+// that normal builds pay nothing and stats builds pay a thread local load
+// and a test per event.  The counts are for all the buffers used by the
+// thread.  It's a plain struct so it can be copied out and exported.
+#if defined(TOOLBELT_PAYLOAD_BUFFER_STATS)
+inline constexpr bool kPayloadBufferStats = true;
+#else
+inline constexpr bool kPayloadBufferStats = false;
+#endif
+
+struct PayloadBufferStats {
+  uint64_t allocations = 0;        // Calls to Allocate.
+  uint64_t failed_allocations = 0; // Allocations that returned nullptr.
+  uint64_t frees = 0;
+  uint64_t reallocs = 0;
+  uint64_t realloc_moves = 0; // Reallocs that had to copy to a new block.
+
+  // Allocations for each bitmap run size class (in the order of the
+  // buffer's bitmap_runs) that were served by the bitmap allocator, and
+  // those that were small enough but went to the free list because the
+  // bitmap allocator was disabled for them.  The fallbacks include the
+  // allocator's own small allocations.
+  uint64_t small_block_hits[kMaxBitmapRuns] = {};
+  uint64_t small_block_fallbacks[kMaxBitmapRuns] = {};
+  uint64_t bitmap_runs = 0; // Runs allocated for the bitmap allocator.
+
+  uint64_t free_list_allocations = 0; // Allocations from the free list.
+  uint64_t free_blocks_searched = 0;  // Blocks passed over by first fit.
+  uint64_t bump_allocations = 0;      // Allocations while marked.
+
+  uint64_t resizes = 0; // Times the buffer was grown.
+  // Bytes the resizer was asked to preserve.  How many it actually copied
+  // depends on the resizer: realloc can often grow in place.
+  uint64_t resize_bytes_preserved = 0;
+
+  void Clear() { *this = PayloadBufferStats(); }
+};
+
+// A snapshot of how full a buffer is, from PayloadBuffer::Occupancy.
+struct PayloadBufferOccupancy {
+  uint32_t full_size = 0;
+  uint32_t hwm = 0;
+  uint32_t free_blocks = 0;        // Length of the free list.
+  uint64_t free_bytes = 0;         // Total length of the free blocks.
+  uint32_t largest_free_block = 0; // Length of the longest one.
+  // 1 - largest_free_block / free_bytes: 0 when all the free memory is in
+  // one block, approaching 1 when it's in many small pieces.
+  double fragmentation = 0;
+};
+
 // This is a buffer that holds the contents of a message.
 // It is located at the first address of the actual buffer with the
 // reset of the buffer memory following it.
@@ -134,18 +320,38 @@ struct PayloadBuffer {
   uint32_t hwm;           // Offset one beyond the highest used.
   uint32_t full_size;     // Full size of buffer.
   BufferOffset free_list; // Heap free list.
+  BufferOffset free_bins; // Offset to FreeBins, 0 if not binned.
+  BufferOffset last_free; // Last block in free list, with bins the one at
+                          // the end of the buffer.
+  BufferOffset mark_start; // Start of bump allocation, 0 if not marked.
+  BufferOffset bump;       // Next bump allocation.
   BufferOffset metadata;  // Offset to message metadata.
+  GrowthPolicy growth_policy; // How to grow a resizable buffer.
+  uint8_t num_bitmap_runs;    // Number of bitmap run size classes.
+  uint32_t growth_increment;  // Amount to grow for kFixedIncrement.
+  BitmapRunConfig bitmap_runs[kMaxBitmapRuns]; // Size classes, by size.
   BufferOffset
-      bitmaps[kNumBitmapRuns]; // Offset to VectorHeader for BitMapRun offsets.
+      bitmaps[kMaxBitmapRuns]; // Offset to VectorHeader for BitMapRun offsets.
 
   // Initialize a new PayloadBuffer at this with a message of the
   // given size.  This is a fixed size buffer.
-  PayloadBuffer(uint32_t size, bool bitmap_allocator = true)
-      : magic(kFixedBufferMagic | (bitmap_allocator ? kBitMapFlag : 0)),
-        message(0), hwm(0), full_size(size), metadata(0) {
-    for (int i = 0; i < kNumBitmapRuns; i++) {
-      bitmaps[i] = 0;
-    }
+  //
+  // If binned_free_list is true, the free list is also indexed by size bins,
+  // which makes allocation from a fragmented free list constant time, at the
+  // expense of a larger minimum block size and some room in the buffer for
+  // the bins.
+  //
+  // The size classes for the bitmap allocator can be given in
+  // 'bitmap_run_configs'.  If empty the default classes are used.
+  PayloadBuffer(uint32_t size, bool bitmap_allocator = true,
+                bool binned_free_list = false,
+                absl::Span<const BitmapRunConfig> bitmap_run_configs = {})
+      : magic(kFixedBufferMagic | (bitmap_allocator ? kBitMapFlag : 0) |
+              (binned_free_list ? kFreeBinsFlag : 0)),
+        message(0), hwm(0), full_size(size), mark_start(0), bump(0),
+        metadata(0),
+        growth_policy(GrowthPolicy::kDouble), growth_increment(0) {
+    InitBitmapRuns(bitmap_run_configs);
     InitFreeList();
   }
 
@@ -159,12 +365,15 @@ struct PayloadBuffer {
   // This implies that you need to destruct the payload buffer to avoid
   // a memory leak.  This is only necessary for resizable buffers.  Fixed
   // size buffers don't need to be destructed.
-  PayloadBuffer(uint32_t initial_size, Resizer r, bool bitmap_allocator = true)
-      : magic(kMovableBufferMagic | (bitmap_allocator ? kBitMapFlag : 0)),
-        message(0), hwm(0), full_size(initial_size), metadata(0) {
-    for (int i = 0; i < kNumBitmapRuns; i++) {
-      bitmaps[i] = 0;
-    }
+  PayloadBuffer(uint32_t initial_size, Resizer r, bool bitmap_allocator = true,
+                bool binned_free_list = false,
+                absl::Span<const BitmapRunConfig> bitmap_run_configs = {})
+      : magic(kMovableBufferMagic | (bitmap_allocator ? kBitMapFlag : 0) |
+              (binned_free_list ? kFreeBinsFlag : 0)),
+        message(0), hwm(0), full_size(initial_size), mark_start(0), bump(0),
+        metadata(0),
+        growth_policy(GrowthPolicy::kDouble), growth_increment(0) {
+    InitBitmapRuns(bitmap_run_configs);
     InitFreeList();
     SetResizer(std::move(r));
   }
@@ -178,6 +387,17 @@ struct PayloadBuffer {
   }
 
   bool BitmapsEnabled() const { return (magic & kBitMapFlag) != 0; }
+  bool FreeBinsEnabled() const { return (magic & kFreeBinsFlag) != 0; }
+
+  // The smallest free block we can hold in the free list.  This is also
+  // the smallest block the free list allocator will hand out since any
+  // allocated block must be able to hold a free block header when freed.
+  uint32_t MinFreeBlockSize() const {
+    return FreeBinsEnabled() ? sizeof(FreeBlockHeader) +
+                                   sizeof(FreeBlockLinks) +
+                                   sizeof(BufferOffset)
+                             : sizeof(FreeBlockHeader);
+  }
 
   void SetResizer(Resizer r) {
     // Place a pointer to the resizer function in the buffer just after the
@@ -196,6 +416,90 @@ struct PayloadBuffer {
 
   size_t Size() const { return size_t(hwm); }
 
+  // Set the way the buffer grows when it is resized.  The increment is
+  // only used for GrowthPolicy::kFixedIncrement.
+  void SetGrowthPolicy(GrowthPolicy policy, uint32_t increment = 0) {
+    growth_policy = policy;
+    growth_increment = increment;
+  }
+
+  // Size the buffer will be resized to in order to get at least 'needed'
+  // more bytes, according to the growth policy.  Returns 0 if the buffer
+  // can't get that big.
+  size_t NextBufferSize(size_t needed) const;
+
+  // Put the buffer back into the state it was in when it was constructed,
+  // keeping its current size, allocator options and resizer.  Only the
+  // header and free list are touched, not the rest of the memory.
+  void Reset();
+
+  // Count allocator events for this thread into 'stats', or stop counting
+  // if it's nullptr.  Returns the previous one.  Nothing is counted unless
+  // kPayloadBufferStats is true.
+  static PayloadBufferStats *SetThreadStats(PayloadBufferStats *stats);
+
+  // Walks the free list, so the cost is proportional to its length.
+  PayloadBufferOccupancy Occupancy() const;
+
+  // Sending a buffer to another process.  The sender sends the first
+  // WireSize() bytes of the buffer, which is everything in use.  The
+  // receiver needs a buffer of at least that size.  It calls BeginReceive,
+  // writes the bytes over the buffer and then calls EndReceive, which
+  // checks that they are a buffer and turns it back into one of its own
+  // size, with its own resizer.  If they aren't a buffer, EndReceive puts
+  // the original header back, resets the buffer and returns false.
+  // The receiver's buffer must be the same kind (fixed or movable) as the
+  // sender's, although a movable buffer can be received into a fixed one.
+  //
+  // Only the header is checked.  The offsets in the message aren't, so
+  // the sender must be trusted.
+  struct ReceiveState;
+  uint32_t WireSize() const;
+  ReceiveState BeginReceive() const;
+  bool EndReceive(uint32_t length, const ReceiveState &state);
+  // Give up on a receive, leaving the buffer reset.
+  void AbortReceive(const ReceiveState &state);
+
+  // Marks allow a partially built message to be abandoned cheaply.  While
+  // a mark is active, memory is allocated by bumping a pointer through the
+  // memory at the end of the buffer instead of from the free list, and
+  // small blocks are not used.  Rollback discards everything allocated
+  // since the mark and restores the message, metadata and hwm.  Memory
+  // allocated before the mark is not restored, so anything in it that
+  // was changed to refer to memory allocated since the mark must not be
+  // used after a rollback.  Commit keeps it all; memory freed while marked
+  // is only reclaimed if it was the last allocation.  Marks nest and must
+  // be rolled back or committed in reverse order.  Both end bump
+  // allocation when the outermost mark is released.
+  //
+  // Only the free block at the end of the buffer is available to bump
+  // allocation, and free blocks elsewhere are not used.  A movable buffer
+  // grows when that runs out, but in a fixed size buffer every allocation
+  // fails while marked if the end of the buffer is in use, however much
+  // free memory there is below it.  Compact or Reset a fixed buffer before
+  // marking it if that matters.
+  BufferMark Mark();
+  void Rollback(const BufferMark &mark);
+  void Commit(const BufferMark &mark);
+  bool IsMarked() const { return mark_start != 0; }
+
+  // Copy the main message and metadata from 'src' into '*dest' with all
+  // the live memory packed together, so that dest->Size() is as small as it
+  // can be.  '*dest' should be a newly constructed buffer.  'visitor' is
+  // called for the main message and describes the fields that refer
+  // to other blocks (see PayloadCompactor).  Memory that isn't reachable
+  // through those fields is not copied.  Returns false if '*dest' is out
+  // of memory.
+  static bool CompactCopy(const PayloadBuffer *src, PayloadBuffer **dest,
+                          const CompactVisitor &visitor);
+
+  // Compact the buffer in place by making a compact copy and copying it
+  // back over the buffer.  The free memory is all at the end afterwards.
+  // Any pointers or offsets into the buffer held outside of it are invalid.
+  // Returns false and leaves the buffer unchanged if the compacted
+  // message doesn't fit.
+  static bool Compact(PayloadBuffer **buffer, const CompactVisitor &visitor);
+
   // Allocate space for the main message in the buffer and set the
   // 'message' field to its offset.
   static void *AllocateMainMessage(PayloadBuffer **self, size_t size);
@@ -230,9 +534,26 @@ struct PayloadBuffer {
   static uint32_t DecodeSize(BufferOffset* addr) {
     uint32_t *p = reinterpret_cast<uint32_t *>(addr) - 1;
     if ((*p & (1U << 31)) == 0) {
-      return *p;
+      return *p & ~kBlockTagMask;
+    }
+    return DecodeSmallBlockSize(*p);
+  }
+
+  // Set up the bitmap run size classes.  The configs are sorted by size,
+  // sizes are rounded up to a multiple of 4 and the number of blocks
+  // in a run is limited to kMaxRunSize.  Only the first kMaxBitmapRuns
+  // configs are used.  Empty means use the default classes.
+  void InitBitmapRuns(absl::Span<const BitmapRunConfig> configs);
+
+  // Index of the bitmap run size class for an allocation of n bytes, or -1
+  // if it is too big for a small block.
+  int BitmapRunIndex(uint32_t n) const {
+    for (uint32_t i = 0; i < num_bitmap_runs; i++) {
+      if (n <= bitmap_runs[i].size) {
+        return i;
+      }
     }
-    return *p & kBitmapRunSizeMask;
+    return -1;
   }
 
   template <typename MessageType>
@@ -267,10 +588,35 @@ struct PayloadBuffer {
   template <typename T> void Set(BufferOffset offset, T v);
   template <typename T> T &Get(BufferOffset offset);
 
+  // Accessors for a buffer that is validated once.  See below.
+  template <bool Checked> class BasicView;
+#ifdef NDEBUG
+  using View = BasicView<false>;
+#else
+  using View = BasicView<true>;
+#endif
+
   template <typename T>
   static void VectorPush(PayloadBuffer **self, VectorHeader *hdr, T v,
                          bool enable_small_block = true);
 
+  // Append all of 'values' to the vector with a single reservation and copy.
+  // Returns the address of the first appended element, or nullptr if
+  // the memory can't be allocated.  If 'values' is empty this is the end
+  // of the vector.  A vector with no memory yet gets its initial
+  // allocation, so nullptr always means out of memory.
+  template <typename T>
+  static T *VectorAppend(PayloadBuffer **self, VectorHeader *hdr,
+                         absl::Span<const T> values,
+                         bool enable_small_block = true);
+
+  // Add an element to the end of the vector without assigning it and
+  // return its address for the caller to fill in.  Returns nullptr if the
+  // memory can't be allocated.
+  template <typename T>
+  static T *VectorPushUninitialized(PayloadBuffer **self, VectorHeader *hdr,
+                                    bool enable_small_block = true);
+
   template <typename T>
   static void VectorReserve(PayloadBuffer **self, VectorHeader *hdr, size_t n,
                             bool enable_small_block = true);
@@ -310,6 +656,9 @@ struct PayloadBuffer {
 
   void InitFreeList();
   FreeBlockHeader *FreeList() { return ToAddress<FreeBlockHeader>(free_list); }
+  FreeBlockHeader *LastFreeBlock() {
+    return ToAddress<FreeBlockHeader>(last_free);
+  }
 
   // Allocate some memory in the buffer.  The buffer might move.
   static void *Allocate(PayloadBuffer **buffer, uint32_t n, uint32_t alignment,
@@ -333,11 +682,11 @@ struct PayloadBuffer {
                                           bool clear = true);
 
   bool IsValidMagic() const {
-    uint32_t m = magic & kBitMapMask;
+    uint32_t m = magic & ~kMagicFlagsMask;
     return m == kFixedBufferMagic || m == kMovableBufferMagic;
   }
   bool IsMoveable() const {
-    return (magic & kBitMapMask) == kMovableBufferMagic;
+    return (magic & ~kMagicFlagsMask) == kMovableBufferMagic;
   }
 
   bool IsValidAddress(const void *addr, size_t size) const {
@@ -414,6 +763,9 @@ struct PayloadBuffer {
 
   void InsertNewFreeBlockAtEnd(FreeBlockHeader *free_block,
                                FreeBlockHeader *prev, uint32_t length);
+  // Give the memory from 'start' to the end of the buffer to the free
+  // list, if there's enough of it for a free block.
+  void AddFreeBlockAtEnd(BufferOffset start);
 
   void MergeWithAboveIfPossible(FreeBlockHeader *alloc_block,
                                 FreeBlockHeader *alloc_header,
@@ -423,10 +775,12 @@ struct PayloadBuffer {
   void ShrinkBlock(FreeBlockHeader *alloc_block, uint32_t orig_length,
                    uint32_t new_length, uint32_t *len_ptr);
 
+  // 'extra_length' is the length of a free block just above the
+  // allocated one that has already been taken out of the free list.
   uint32_t *MergeWithFreeBlockBelow(void *alloc_block, FreeBlockHeader *prev,
                                     FreeBlockHeader *free_block,
                                     uint32_t new_length, uint32_t orig_length,
-                                    bool clear);
+                                    bool clear, uint32_t extra_length = 0);
 
   void ExpandIntoFreeBlockAbove(FreeBlockHeader *free_block,
                                 uint32_t new_length, uint32_t len_diff,
@@ -435,6 +789,63 @@ struct PayloadBuffer {
   uint32_t TakeStartOfFreeBlock(FreeBlockHeader *block, uint32_t num_bytes,
                                 uint32_t full_length, FreeBlockHeader *prev);
 
+  // Free and grow blocks using the boundary tags.  Only with the bins.
+  void FreeBinnedBlock(FreeBlockHeader *block, uint32_t length);
+  void *GrowBinnedBlock(void *p, uint32_t new_length, uint32_t orig_length,
+                        bool clear);
+
+  // Free list maintenance.  Apart from keeping track of the last free block,
+  // these are all no-ops if the free bins are not enabled.
+  FreeBins *Bins() { return ToAddress<FreeBins>(free_bins); }
+  FreeBlockLinks *Links(FreeBlockHeader *block) {
+    return reinterpret_cast<FreeBlockLinks *>(block + 1);
+  }
+  // Find a free block with at least 'length' bytes using the bins.
+  FreeBlockHeader *FindBinnedFreeBlock(uint32_t length);
+  // Previous free block in the free list.  Only available with bins.
+  FreeBlockHeader *PrevFreeBlock(FreeBlockHeader *block);
+  void AddToFreeBin(FreeBlockHeader *block);
+  void RemoveFromFreeBin(FreeBlockHeader *block);
+  // Set the previous free block of the block at offset 'next'.  If 'next'
+  // is 0, 'prev' is the last free block.  With the bins the last block in
+  // the list isn't tracked, last_free is the one at the end of the buffer.
+  void SetPrevFreeBlock(BufferOffset next, FreeBlockHeader *prev);
+  // Called when 'block' has been linked into the free list after 'prev' and
+  // its length is set.  Sets up the reverse links, puts it in a bin and sets
+  // its boundary tags.
+  void FreeBlockLinked(FreeBlockHeader *block, FreeBlockHeader *prev);
+  // Put 'block', with its length set, at the head of the free list.
+  void PushFreeBlock(FreeBlockHeader *block);
+  // Take 'block' out of the free list and its bin.
+  void UnlinkFreeBlock(FreeBlockHeader *block);
+
+  // Boundary tags, only with the bins.  The blocks end at BlocksEnd, or at
+  // the bump pointer while marked.
+  uint32_t BlocksEnd() const {
+    return FreeBinsEnabled() ? full_size & ~3U : full_size;
+  }
+  BufferOffset BlocksTop() const { return IsMarked() ? bump : BlocksEnd(); }
+  // Write the tags for a free block whose length has been set.
+  void SetFreeBlockTags(FreeBlockHeader *block);
+  // Clear the tags for a free block that has been allocated in full.
+  void ClearFreeBlockTags(FreeBlockHeader *block);
+  // The free block starting at 'offset', or nullptr if that block is
+  // allocated or there isn't one.
+  FreeBlockHeader *FreeBlockAt(BufferOffset offset);
+  // The free block just below 'block', or nullptr if it isn't free.
+  FreeBlockHeader *FreeBlockBelow(FreeBlockHeader *block);
+
+  // Bump allocation while a mark is active.  The buffer might move.
+  static void *BumpAllocate(PayloadBuffer **buffer, uint32_t n, bool clear);
+  // True if 'block' was allocated since the outermost mark.
+  bool IsBumpBlock(const void *block) const {
+    return IsMarked() && reinterpret_cast<const char *>(block) >=
+                             reinterpret_cast<const char *>(this) + mark_start;
+  }
+  // Give the memory beyond the bump pointer back to the free list and stop
+  // bump allocation.
+  void EndBumpAllocation();
+
   void UpdateHWM(void *p) { UpdateHWM(ToOffset(p)); }
 
   void UpdateHWM(BufferOffset off) {
@@ -444,6 +855,187 @@ struct PayloadBuffer {
   }
   static BitMapRun *AllocateBitMapRun(PayloadBuffer **self, uint32_t size,
                                       uint32_t num);
+
+  // Add 'n' uninitialized elements to the end of a vector and return the
+  // address of the first of them.  The memory grows geometrically so that
+  // repeated appends are amortized constant time.  If the buffer moves
+  // and 'hdr' is inside it, 'hdr' is updated.
+  template <typename T>
+  static T *VectorExtend(PayloadBuffer **self, VectorHeader *&hdr, size_t n,
+                         bool enable_small_block);
+};
+
+// The header of a buffer, including the resizer, saved by BeginReceive.
+struct PayloadBuffer::ReceiveState {
+  alignas(PayloadBuffer) char header[sizeof(PayloadBuffer) + sizeof(Resizer *)];
+};
+
+// A View is a handle on a PayloadBuffer from a trusted source.  The
+// buffer's header is validated once when the View is created and after that
+// the accessors convert offsets to addresses without checking the magic or
+// the bounds of the buffer.  Use this when reading messages that have
+// already been validated, for example by the producer in the same pipeline.
+//
+// In debug builds (NDEBUG not defined) View uses the checked PayloadBuffer
+// functions.  BasicView<true> and BasicView<false> can be used to choose.
+//
+// The buffer can't be resized while a View is in use since the View holds
+// its address.
+template <bool Checked> class PayloadBuffer::BasicView {
+public:
+  static constexpr bool kChecked = Checked;
+
+  explicit BasicView(PayloadBuffer *pb)
+      : pb_(pb != nullptr && pb->IsValidMagic() ? pb : nullptr),
+        base_(reinterpret_cast<char *>(pb_)) {}
+
+  bool Valid() const { return pb_ != nullptr; }
+  PayloadBuffer *Buffer() const { return pb_; }
+
+  // Offset 0 is nullptr, as it is for PayloadBuffer::ToAddress.
+  template <typename T = void> T *ToAddress(BufferOffset offset) const {
+    if constexpr (kChecked) {
+      return pb_->ToAddress<T>(offset);
+    }
+    if (offset == 0) {
+      return nullptr;
+    }
+    return reinterpret_cast<T *>(base_ + offset);
+  }
+
+  // nullptr is offset 0.
+  template <typename T = void> BufferOffset ToOffset(const T *addr) const {
+    if constexpr (kChecked) {
+      return pb_->ToOffset(addr);
+    }
+    if (addr == nullptr) {
+      return 0;
+    }
+    return reinterpret_cast<const char *>(addr) - base_;
+  }
+
+  template <typename T> T &Get(BufferOffset offset) const {
+    return *ToAddress<T>(offset);
+  }
+
+  template <typename T> void Set(BufferOffset offset, T v) const {
+    *ToAddress<T>(offset) = v;
+  }
+
+  // The index is not checked against the size of the vector.
+  template <typename T> T VectorGet(const VectorHeader *hdr, size_t index) const {
+    if constexpr (kChecked) {
+      return pb_->VectorGet<T>(hdr, index);
+    }
+    return ToAddress<const T>(hdr->data)[index];
+  }
+
+  template <typename T> const T *VectorData(const VectorHeader *hdr) const {
+    if (hdr->data == 0) {
+      return nullptr;
+    }
+    return ToAddress<const T>(hdr->data);
+  }
+
+  // 'header_offset' is the offset into the buffer StringHeader.
+  std::string_view GetStringView(BufferOffset header_offset) const {
+    if constexpr (kChecked) {
+      return pb_->GetStringView(header_offset);
+    }
+    BufferOffset str = *ToAddress<const StringHeader>(header_offset);
+    if (str == 0) {
+      return {};
+    }
+    const uint32_t *p = ToAddress<const uint32_t>(str);
+    return std::string_view(reinterpret_cast<const char *>(p + 1), *p);
+  }
+
+  std::string GetString(BufferOffset header_offset) const {
+    return std::string(GetStringView(header_offset));
+  }
+
+  size_t StringSize(BufferOffset header_offset) const {
+    return GetStringView(header_offset).size();
+  }
+
+  // nullptr if the string is not set.
+  const char *StringData(BufferOffset header_offset) const {
+    if constexpr (kChecked) {
+      return pb_->StringData(header_offset);
+    }
+    return GetStringView(header_offset).data();
+  }
+
+private:
+  PayloadBuffer *pb_;
+  char *base_;
+};
+
+// Copies blocks from one buffer to another for PayloadBuffer::CompactCopy.
+// Blocks are copied into the destination in the order they are visited.
+// Each function takes the offset in the source buffer of a field in a
+// block that has already been copied; the block the field refers to is
+// copied and the field in the copy is changed to refer to the new block.
+// A block referred to by more than one field is only copied once.
+//
+// For example, for a message with a string at offset 0, a vector of
+// uint32_t at offset 4 and a submessage at offset 12:
+//
+//   auto visit_sub = [](PayloadCompactor &c, BufferOffset msg) {...};
+//   auto visit = [&](PayloadCompactor &c, BufferOffset msg) {
+//     c.String(msg);
+//     c.Vector<uint32_t>(msg + 4);
+//     c.Message(msg + 12, visit_sub);
+//   };
+class PayloadCompactor {
+public:
+  PayloadCompactor(const PayloadBuffer *src, PayloadBuffer **dest)
+      : src_(src), dest_(dest) {}
+
+  // A block with no references in it (its size is taken from the block).
+  void Block(BufferOffset field);
+
+  // A field holding a StringHeader.
+  void String(BufferOffset field);
+
+  // A field holding a VectorHeader for trivially copyable elements.  Only
+  // the elements in use are copied, not the spare capacity.
+  template <typename T> void Vector(BufferOffset field) {
+    VectorOfSize(field, sizeof(T));
+  }
+
+  // A field holding the offset of a message described by 'visitor'.
+  void Message(BufferOffset field, const CompactVisitor &visitor);
+
+  // A field holding a VectorHeader for a vector of offsets of messages
+  // described by 'visitor'.
+  void MessageVector(BufferOffset field, const CompactVisitor &visitor);
+
+  // False once the destination has run out of memory.
+  bool Ok() const { return ok_; }
+
+  // Copy a whole block from the source, returning its offset in the
+  // destination, or 0 if it can't be allocated.  'length' is the
+  // number of bytes to copy; the block is only that big in the copy.
+  BufferOffset CopyBlock(BufferOffset block, uint32_t length,
+                         uint32_t alignment);
+
+private:
+  struct Copy {
+    BufferOffset dest; // Offset of the copy in the destination.
+    uint32_t length;   // Length of the copy.
+  };
+
+  // Offset in the destination of a field at 'field' in the source.
+  // The field must be in a block that has been copied.
+  BufferOffset DestField(BufferOffset field) const;
+  void SetDestField(BufferOffset field, BufferOffset value);
+  void VectorOfSize(BufferOffset field, size_t element_size);
+
+  const PayloadBuffer *src_;
+  PayloadBuffer **dest_;
+  std::map<BufferOffset, Copy> copies_; // Source offset to copy.
+  bool ok_ = true;
 };
 
 template <>
@@ -463,45 +1055,89 @@ template <typename T> inline T &PayloadBuffer::Get(BufferOffset offset) {
 }
 
 template <typename T>
-inline void PayloadBuffer::VectorPush(PayloadBuffer **self, VectorHeader *hdr,
-                                      T v, bool enable_small_block) {
+inline T *PayloadBuffer::VectorExtend(PayloadBuffer **self, VectorHeader *&hdr,
+                                      size_t n, bool enable_small_block) {
   // hdr points to a VectorHeader:
   // uint32_t num_elements;     - number of elements in the vector
   // BufferOffset data;         - BufferOffset to vector contents
   // The vector contents is allocated in the buffer.  It is preceded
   // by the block size (in bytes).
-  uint32_t total_size = hdr->num_elements * sizeof(T);
+  //
+  // The header might be in the buffer, which can move if it is resized.
+  BufferOffset hdr_offset = (*self)->ToOffset(hdr);
+  size_t needed = (hdr->num_elements + n) * sizeof(T);
+  void *vecp = nullptr;
   if (hdr->data == 0) {
-    // The vector is empty, allocate it with a default size of 2 and 8 byte
-    // alignment.
-    void *vecp = Allocate(self, 2 * sizeof(T), 8, true, enable_small_block);
-    hdr->data = (*self)->ToOffset(vecp);
+    // The vector is empty, allocate it with a minimum of 2 elements and 8
+    // byte alignment.
+    vecp = Allocate(self, std::max(needed, 2 * sizeof(T)), 8, false,
+                    enable_small_block);
   } else {
     // Vector has some values in it.  Retrieve the total size from
-    // the allocated block header (before the start of the memory)
+    // the allocated block header (before the start of the memory).  The
+    // block may be bigger than asked for since block sizes are rounded.
     uint32_t *block = (*self)->ToAddress<uint32_t>(hdr->data);
     uint32_t current_size = DecodeSize(block);
-    if (current_size == total_size) {
-      // Need to double the size of the memory.
-      void *vecp = Realloc(self, block, 2 * hdr->num_elements * sizeof(T), 8,
-                           true, enable_small_block);
-      hdr->data = (*self)->ToOffset(vecp);
+    if (current_size >= needed) {
+      T *addr = (*self)->ToAddress<T>(hdr->data) + hdr->num_elements;
+      hdr->num_elements += n;
+      return addr;
     }
+    // No room, at least double the size of the memory.  There's no need
+    // to clear it as the caller will overwrite it.
+    vecp = Realloc(self, block, std::max(needed, size_t(current_size) * 2), 8,
+                   false, enable_small_block);
+  }
+  if (vecp == nullptr) {
+    return nullptr;
+  }
+  if (hdr_offset != 0) {
+    hdr = (*self)->ToAddress<VectorHeader>(hdr_offset);
+  }
+  hdr->data = (*self)->ToOffset(vecp);
+  T *addr = reinterpret_cast<T *>(vecp) + hdr->num_elements;
+  hdr->num_elements += n;
+  return addr;
+}
+
+template <typename T>
+inline void PayloadBuffer::VectorPush(PayloadBuffer **self, VectorHeader *hdr,
+                                      T v, bool enable_small_block) {
+  T *valuep = VectorExtend<T>(self, hdr, 1, enable_small_block);
+  if (valuep != nullptr) {
+    *valuep = v;
   }
-  // Get address of next location in vector.
-  T *valuep = (*self)->ToAddress<T>(hdr->data) + hdr->num_elements;
-  // Assign value.
-  *valuep = v;
-  // Increment the number of elements.
-  hdr->num_elements++;
+}
+
+template <typename T>
+inline T *PayloadBuffer::VectorPushUninitialized(PayloadBuffer **self,
+                                                 VectorHeader *hdr,
+                                                 bool enable_small_block) {
+  return VectorExtend<T>(self, hdr, 1, enable_small_block);
+}
+
+template <typename T>
+inline T *PayloadBuffer::VectorAppend(PayloadBuffer **self, VectorHeader *hdr,
+                                      absl::Span<const T> values,
+                                      bool enable_small_block) {
+  T *addr = VectorExtend<T>(self, hdr, values.size(), enable_small_block);
+  if (addr != nullptr && !values.empty()) {
+    memcpy(addr, values.data(), values.size() * sizeof(T));
+  }
+  return addr;
 }
 
 template <typename T>
 inline void PayloadBuffer::VectorReserve(PayloadBuffer **self,
                                          VectorHeader *hdr, size_t n,
                                          bool enable_small_block) {
+  // The header might be in the buffer, which can move if it is resized.
+  BufferOffset hdr_offset = (*self)->ToOffset(hdr);
   if (hdr->data == 0) {
     void *vecp = Allocate(self, n * sizeof(T), 8, false, enable_small_block);
+    if (hdr_offset != 0) {
+      hdr = (*self)->ToAddress<VectorHeader>(hdr_offset);
+    }
     hdr->data = (*self)->ToOffset(vecp);
   } else {
     // Vector has some values in it.  Retrieve the total size from
@@ -512,6 +1148,9 @@ inline void PayloadBuffer::VectorReserve(PayloadBuffer **self,
       // Need to expand the memory to the size given.
       void *vecp =
           Realloc(self, block, n * sizeof(T), 8, false, enable_small_block);
+      if (hdr_offset != 0) {
+        hdr = (*self)->ToAddress<VectorHeader>(hdr_offset);
+      }
       hdr->data = (*self)->ToOffset(vecp);
     }
   }
@@ -520,8 +1159,14 @@ inline void PayloadBuffer::VectorReserve(PayloadBuffer **self,
 template <typename T>
 inline void PayloadBuffer::VectorResize(PayloadBuffer **self, VectorHeader *hdr,
                                         size_t n) {
+  // The header might be in the buffer, which can move if it is resized.
+  BufferOffset hdr_offset = (*self)->ToOffset(hdr);
+  size_t old_n = hdr->num_elements;
   if (hdr->data == 0) {
-    void *vecp = Allocate(self, n * sizeof(T), 8);
+    void *vecp = Allocate(self, n * sizeof(T), 8, false);
+    if (hdr_offset != 0) {
+      hdr = (*self)->ToAddress<VectorHeader>(hdr_offset);
+    }
     hdr->data = (*self)->ToOffset(vecp);
   } else {
     // Vector has some values in it.  Retrieve the total size from
@@ -530,10 +1175,19 @@ inline void PayloadBuffer::VectorResize(PayloadBuffer **self, VectorHeader *hdr,
     uint32_t current_size = DecodeSize(block);
     if (current_size < n * sizeof(T)) {
       // Need to expand the memory to the size given.
-      void *vecp = Realloc(self, block, n * sizeof(T), 8);
+      void *vecp = Realloc(self, block, n * sizeof(T), 8, false);
+      if (hdr_offset != 0) {
+        hdr = (*self)->ToAddress<VectorHeader>(hdr_offset);
+      }
       hdr->data = (*self)->ToOffset(vecp);
     }
   }
+  // Pushes don't clear the spare capacity, so the new elements might
+  // not be zero yet.
+  if (n > old_n && hdr->data != 0) {
+    memset((*self)->ToAddress<T>(hdr->data) + old_n, 0,
+           (n - old_n) * sizeof(T));
+  }
   hdr->num_elements = n;
 }
 
@@ -493,6 +493,119 @@ TEST(BufferTest, VectorExpandMore) {
   free(buffer);
 }
 
+TEST(BufferTest, VectorAppend) {
+  char *buffer = (char *)malloc(256);
+  int resizes = 0;
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(
+      256, [&resizes](PayloadBuffer **p, size_t old_size, size_t new_size) {
+        *p = reinterpret_cast<PayloadBuffer *>(realloc(*p, new_size));
+        resizes++;
+      });
+
+  // The header is in the buffer, which will move as the vector grows.
+  PayloadBuffer::AllocateMainMessage(&pb, sizeof(VectorHeader));
+
+  std::vector<uint32_t> values(100000);
+  for (size_t i = 0; i < values.size(); i++) {
+    values[i] = i + 1;
+  }
+  // Appending nothing to an empty vector gives the end of it, not nullptr.
+  uint32_t *addr = PayloadBuffer::VectorAppend<uint32_t>(
+      &pb, pb->ToAddress<VectorHeader>(pb->message), {});
+  ASSERT_NE(nullptr, addr);
+  ASSERT_EQ(0, pb->ToAddress<VectorHeader>(pb->message)->num_elements);
+
+  addr = PayloadBuffer::VectorAppend<uint32_t>(
+      &pb, pb->ToAddress<VectorHeader>(pb->message),
+      absl::MakeConstSpan(values).subspan(0, 3));
+  ASSERT_NE(nullptr, addr);
+  ASSERT_EQ(1, addr[0]);
+  uint32_t *end = PayloadBuffer::VectorAppend<uint32_t>(
+      &pb, pb->ToAddress<VectorHeader>(pb->message), {});
+  ASSERT_EQ(addr + 3, end);
+  addr = PayloadBuffer::VectorAppend<uint32_t>(
+      &pb, pb->ToAddress<VectorHeader>(pb->message),
+      absl::MakeConstSpan(values).subspan(3));
+  ASSERT_NE(nullptr, addr);
+  ASSERT_EQ(4, addr[0]);
+  ASSERT_LT(0, resizes);
+
+  for (int i = 0; i < 100; i++) {
+    uint32_t *v = PayloadBuffer::VectorPushUninitialized<uint32_t>(
+        &pb, pb->ToAddress<VectorHeader>(pb->message));
+    ASSERT_NE(nullptr, v);
+    *v = values.size() + i + 1;
+  }
+  VectorHeader *hdr = pb->ToAddress<VectorHeader>(pb->message);
+  ASSERT_EQ(values.size() + 100, hdr->num_elements);
+  for (size_t i = 0; i < hdr->num_elements; i++) {
+    ASSERT_EQ(i + 1, pb->VectorGet<uint32_t>(hdr, i));
+  }
+  pb->CheckFreeList();
+
+  // Pushing one at a time grows geometrically so the number of
+  // reallocations is logarithmic.
+  PayloadBuffer::VectorClear<uint32_t>(&pb, hdr);
+  uint32_t moves = 0;
+  BufferOffset data = 0;
+  for (int i = 0; i < 10000; i++) {
+    PayloadBuffer::VectorPush<uint32_t>(
+        &pb, pb->ToAddress<VectorHeader>(pb->message), i);
+    hdr = pb->ToAddress<VectorHeader>(pb->message);
+    if (hdr->data != data) {
+      moves++;
+      data = hdr->data;
+    }
+  }
+  ASSERT_GT(20, moves);
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_EQ(i, pb->VectorGet<uint32_t>(hdr, i));
+  }
+
+  // Don't free 'buffer' as it has already been freed by the call to realloc.
+  delete pb;
+}
+
+TEST(BufferTest, VectorResizeZeroes) {
+  char *buffer = (char *)malloc(4096);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(4096, false);
+
+  // Leave some garbage in the free memory.
+  std::vector<void *> blocks;
+  for (int i = 0; i < 10; i++) {
+    void *p = PayloadBuffer::Allocate(&pb, 100, 8, false);
+    ASSERT_NE(nullptr, p);
+    memset(p, 0xab, 100);
+    blocks.push_back(p);
+  }
+  for (void *p : blocks) {
+    pb->Free(p);
+  }
+
+  PayloadBuffer::AllocateMainMessage(&pb, sizeof(VectorHeader));
+  VectorHeader *hdr = pb->ToAddress<VectorHeader>(pb->message);
+  for (int i = 0; i < 5; i++) {
+    PayloadBuffer::VectorPush<uint32_t>(&pb, hdr, i + 1);
+  }
+  // Growing into the capacity left by the pushes gives zeros.
+  uint32_t capacity =
+      PayloadBuffer::DecodeSize(pb->ToAddress<BufferOffset>(hdr->data)) /
+      sizeof(uint32_t);
+  ASSERT_LT(5, capacity);
+  PayloadBuffer::VectorResize<uint32_t>(&pb, hdr, capacity);
+  ASSERT_EQ(capacity, hdr->num_elements);
+  for (uint32_t i = 0; i < capacity; i++) {
+    ASSERT_EQ(i < 5 ? i + 1 : 0, pb->VectorGet<uint32_t>(hdr, i));
+  }
+
+  // And so does growing beyond it.
+  PayloadBuffer::VectorResize<uint32_t>(&pb, hdr, capacity * 4);
+  for (uint32_t i = 5; i < capacity * 4; i++) {
+    ASSERT_EQ(0, pb->VectorGet<uint32_t>(hdr, i));
+  }
+  free(buffer);
+}
+
 TEST(BufferTest, Resizeable) {
   char *buffer = (char *)malloc(512);
   bool resized = false;
@@ -527,6 +640,853 @@ TEST(BufferTest, Resizeable) {
   delete pb;
 }
 
+TEST(BufferTest, BinnedSimple) {
+  char *buffer = (char *)malloc(8192);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(8192, true, true);
+  ASSERT_TRUE(pb->FreeBinsEnabled());
+  pb->CheckFreeList();
+
+  void *addr1 = PayloadBuffer::Allocate(&pb, 200, 8);
+  ASSERT_NE(nullptr, addr1);
+  void *addr2 = PayloadBuffer::Allocate(&pb, 300, 8);
+  ASSERT_NE(nullptr, addr2);
+  void *addr3 = PayloadBuffer::Allocate(&pb, 400, 8);
+  ASSERT_NE(nullptr, addr3);
+  pb->CheckFreeList();
+
+  // Free the middle one and allocate something that fits in the hole.
+  pb->Free(addr2);
+  pb->CheckFreeList();
+  void *addr4 = PayloadBuffer::Allocate(&pb, 150, 8);
+  ASSERT_EQ(addr2, addr4);
+  pb->CheckFreeList();
+
+  // Free everything and we should be back to a single free block.
+  pb->Free(addr1);
+  pb->Free(addr3);
+  pb->Free(addr4);
+  pb->CheckFreeList();
+  ASSERT_EQ(0, pb->FreeList()->next);
+  pb->Dump(std::cout);
+  free(buffer);
+}
+
+TEST(BufferTest, BinnedFragmented) {
+  constexpr size_t kSize = 1024 * 1024;
+  char *buffer = (char *)malloc(kSize);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(kSize, true, true);
+
+  // Allocate a mix of sizes, free half of them at random then reallocate,
+  // checking that the free list and bins stay consistent and the contents
+  // of the blocks are preserved.
+  srand(1234);
+  struct Block {
+    void *addr;
+    size_t size;
+    char fill;
+  };
+  std::vector<Block> blocks;
+  for (int i = 0; i < 1000; i++) {
+    size_t size = (rand() % 1000) + 1;
+    void *addr = PayloadBuffer::Allocate(&pb, size, 8, false);
+    ASSERT_NE(nullptr, addr);
+    char fill = char(i);
+    memset(addr, fill, size);
+    blocks.push_back({addr, size, fill});
+  }
+  pb->CheckFreeList();
+
+  for (int iter = 0; iter < 5000; iter++) {
+    Block &b = blocks[rand() % blocks.size()];
+    switch (rand() % 3) {
+    case 0:
+      pb->Free(b.addr);
+      b.size = (rand() % 1000) + 1;
+      b.addr = PayloadBuffer::Allocate(&pb, b.size, 8, false);
+      break;
+    case 1:
+    case 2: {
+      size_t size = (rand() % 1000) + 1;
+      b.addr = PayloadBuffer::Realloc(&pb, b.addr, size, 8, false);
+      for (size_t j = 0; j < std::min(size, b.size); j++) {
+        ASSERT_EQ(b.fill, reinterpret_cast<char *>(b.addr)[j]);
+      }
+      b.size = size;
+      break;
+    }
+    }
+    ASSERT_NE(nullptr, b.addr);
+    memset(b.addr, b.fill, b.size);
+    pb->CheckFreeList();
+  }
+  for (auto &b : blocks) {
+    for (size_t j = 0; j < b.size; j++) {
+      ASSERT_EQ(b.fill, reinterpret_cast<char *>(b.addr)[j]);
+    }
+    pb->Free(b.addr);
+  }
+  pb->CheckFreeList();
+  free(buffer);
+}
+
+TEST(BufferTest, BinnedCoalesce) {
+  char *buffer = (char *)malloc(4096);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(4096, false, true);
+  toolbelt::FreeBlockHeader *all = pb->FreeList();
+  uint32_t all_length = all->length;
+
+  // Whatever order the blocks are freed in, they merge back into one.
+  for (int order = 0; order < 3; order++) {
+    void *blocks[3];
+    for (auto &b : blocks) {
+      b = PayloadBuffer::Allocate(&pb, 100, 8, false);
+      ASSERT_NE(nullptr, b);
+    }
+    int first = order;
+    pb->Free(blocks[first]);
+    pb->CheckFreeList();
+    pb->Free(blocks[(first + 2) % 3]);
+    pb->CheckFreeList();
+    pb->Free(blocks[(first + 1) % 3]);
+    pb->CheckFreeList();
+    ASSERT_EQ(all, pb->FreeList());
+    ASSERT_EQ(0, pb->FreeList()->next);
+    ASSERT_EQ(all_length, pb->FreeList()->length);
+  }
+
+  // Growing a block with free blocks on both sides moves it down and takes
+  // both of them.
+  void *a = PayloadBuffer::Allocate(&pb, 100, 8, false);
+  void *b = PayloadBuffer::Allocate(&pb, 100, 8, false);
+  void *c = PayloadBuffer::Allocate(&pb, 100, 8, false);
+  void *d = PayloadBuffer::Allocate(&pb, 100, 8, false);
+  memset(b, 0x5a, 100);
+  pb->Free(a);
+  pb->Free(c);
+  pb->CheckFreeList();
+  void *newb = PayloadBuffer::Realloc(&pb, b, 250, 8, false);
+  ASSERT_EQ(a, newb);
+  pb->CheckFreeList();
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(char(0x5a), reinterpret_cast<char *>(newb)[i]);
+  }
+  pb->Free(newb);
+  pb->Free(d);
+  pb->CheckFreeList();
+  ASSERT_EQ(all_length, pb->FreeList()->length);
+  free(buffer);
+}
+
+TEST(BufferTest, BinnedResizeable) {
+  char *buffer = (char *)malloc(1024);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(
+      1024,
+      [](PayloadBuffer **p, size_t old_size, size_t new_size) {
+        *p = reinterpret_cast<PayloadBuffer *>(realloc(*p, new_size));
+      },
+      true, true);
+
+  std::vector<void *> blocks;
+  for (int i = 0; i < 100; i++) {
+    void *addr = PayloadBuffer::Allocate(&pb, 200, 8);
+    ASSERT_NE(nullptr, addr);
+    blocks.push_back(pb->ToAddress(pb->ToOffset(addr)));
+  }
+  pb->CheckFreeList();
+  ASSERT_GT(pb->full_size, 100 * 200);
+  delete pb;
+}
+
+TEST(BufferTest, GrowthPolicy) {
+  struct Policy {
+    toolbelt::GrowthPolicy policy;
+    uint32_t increment;
+    size_t expected_size; // Size after first resize.
+  };
+  for (auto &p : {Policy{toolbelt::GrowthPolicy::kDouble, 0, 2048},
+                  Policy{toolbelt::GrowthPolicy::kOneAndAHalf, 0, 1536},
+                  Policy{toolbelt::GrowthPolicy::kFixedIncrement, 4096, 5120}}) {
+    for (bool binned : {false, true}) {
+      char *buffer = (char *)malloc(1024);
+      std::vector<size_t> sizes;
+      PayloadBuffer *pb = new (buffer) PayloadBuffer(
+          1024,
+          [&sizes](PayloadBuffer **p, size_t old_size, size_t new_size) {
+            *p = reinterpret_cast<PayloadBuffer *>(realloc(*p, new_size));
+            sizes.push_back(new_size);
+          },
+          true, binned);
+      pb->SetGrowthPolicy(p.policy, p.increment);
+
+      // Fill the buffer with 200 byte blocks, keeping a running pattern in
+      // them so we can check that resizing preserves the contents.
+      std::vector<BufferOffset> blocks;
+      for (int i = 0; i < 100; i++) {
+        void *addr = PayloadBuffer::Allocate(&pb, 200, 8, false);
+        ASSERT_NE(nullptr, addr);
+        memset(addr, i, 200);
+        blocks.push_back(pb->ToOffset(addr));
+        pb->CheckFreeList();
+      }
+      ASSERT_FALSE(sizes.empty());
+      ASSERT_EQ(p.expected_size, sizes[0]);
+      for (int i = 0; i < 100; i++) {
+        char *addr = pb->ToAddress<char>(blocks[i]);
+        for (int j = 0; j < 200; j++) {
+          ASSERT_EQ(char(i), addr[j]);
+        }
+      }
+
+      // An allocation bigger than the growth still fits.
+      size_t num_resizes = sizes.size();
+      void *big = PayloadBuffer::Allocate(&pb, pb->full_size * 4, 8, false);
+      ASSERT_NE(nullptr, big);
+      ASSERT_EQ(num_resizes + 1, sizes.size());
+      pb->CheckFreeList();
+      delete pb;
+    }
+  }
+}
+
+// Compares the first-fit free list against the binned free list when the
+// free list is heavily fragmented.
+TEST(BufferTest, FragmentedPerformance) {
+  constexpr int kSize = 4 * 1024 * 1024;
+
+  for (bool binned : {false, true}) {
+    char *buffer = (char *)malloc(kSize);
+    PayloadBuffer *pb = new (buffer) PayloadBuffer(kSize, true, binned);
+
+    // Fragment the free list by allocating blocks and freeing every other
+    // one.  The holes are too small for the allocations that follow.
+    std::vector<void *> blocks;
+    for (int i = 0; i < 5000; i++) {
+      blocks.push_back(PayloadBuffer::Allocate(&pb, 200, 8, false));
+    }
+    for (size_t i = 0; i < blocks.size(); i += 2) {
+      pb->Free(blocks[i]);
+    }
+
+    uint64_t start = toolbelt::Now();
+    for (int i = 0; i < 1000; i++) {
+      void *addr = PayloadBuffer::Allocate(&pb, 1000, 8, false);
+      ASSERT_NE(nullptr, addr);
+    }
+    uint64_t end = toolbelt::Now();
+    pb->CheckFreeList();
+    std::cout << (binned ? "Binned" : "First fit")
+              << " allocator: " << (end - start) / 1000 << " ns/allocation"
+              << std::endl;
+
+    // Free the rest of the small blocks from the top down, each of which
+    // merges with the free blocks on both sides.
+    start = toolbelt::Now();
+    for (size_t i = blocks.size(); i >= 2; i -= 2) {
+      pb->Free(blocks[i - 1]);
+    }
+    end = toolbelt::Now();
+    pb->CheckFreeList();
+    std::cout << (binned ? "Binned" : "First fit")
+              << " allocator: " << (end - start) / (blocks.size() / 2)
+              << " ns/free" << std::endl;
+    free(buffer);
+  }
+}
+
+TEST(BufferTest, BitmapRunConfigs) {
+  // Out of order, unaligned and oversized configs are normalized.
+  const toolbelt::BitmapRunConfig configs[] = {
+      {256, 4}, {22, 40}, {48, 0}, {2000, 8}};
+  char *buffer = (char *)malloc(32768);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(32768, true, false, configs);
+  ASSERT_EQ(3, pb->num_bitmap_runs);
+  ASSERT_EQ(24, pb->bitmap_runs[0].size);
+  ASSERT_EQ(32, pb->bitmap_runs[0].num);
+  ASSERT_EQ(48, pb->bitmap_runs[1].size);
+  ASSERT_EQ(1, pb->bitmap_runs[1].num);
+  ASSERT_EQ(256, pb->bitmap_runs[2].size);
+  ASSERT_EQ(4, pb->bitmap_runs[2].num);
+
+  ASSERT_EQ(0, pb->BitmapRunIndex(1));
+  ASSERT_EQ(0, pb->BitmapRunIndex(24));
+  ASSERT_EQ(1, pb->BitmapRunIndex(25));
+  ASSERT_EQ(2, pb->BitmapRunIndex(200));
+  ASSERT_EQ(-1, pb->BitmapRunIndex(257));
+
+  // Allocate from each class and check the encoded size decodes to the
+  // class size and that blocks don't overlap.
+  std::vector<std::pair<char *, uint32_t>> blocks;
+  for (uint32_t size : {20, 24, 40, 200, 256}) {
+    for (int i = 0; i < 40; i++) {
+      char *addr = reinterpret_cast<char *>(
+          PayloadBuffer::Allocate(&pb, size, 4, false));
+      ASSERT_NE(nullptr, addr);
+      uint32_t *sizep = reinterpret_cast<uint32_t *>(addr) - 1;
+      ASSERT_TRUE((*sizep & (1U << 31)) != 0);
+      ASSERT_EQ(
+          pb->bitmap_runs[pb->BitmapRunIndex(size)].size,
+          PayloadBuffer::DecodeSize(reinterpret_cast<BufferOffset *>(addr)));
+      memset(addr, blocks.size() & 0xff, size);
+      blocks.push_back({addr, size});
+    }
+  }
+  for (size_t i = 0; i < blocks.size(); i++) {
+    for (uint32_t j = 0; j < blocks[i].second; j++) {
+      ASSERT_EQ(char(i & 0xff), blocks[i].first[j]);
+    }
+  }
+  // Realloc within the same class keeps the block.
+  char *p = blocks[0].first;
+  ASSERT_EQ(p, PayloadBuffer::Realloc(&pb, p, 23, 4, false));
+  ASSERT_EQ(24, PayloadBuffer::DecodeSize(reinterpret_cast<BufferOffset *>(p)));
+  for (auto &block : blocks) {
+    pb->Free(block.first);
+  }
+  pb->CheckFreeList();
+  free(buffer);
+}
+
+TEST(BufferTest, SizeHistogram) {
+  toolbelt::SizeHistogram hist;
+  ASSERT_TRUE(hist.SuggestBitmapRuns().empty());
+
+  // Three clusters of sizes, plus some that are too big for small blocks.
+  hist.Add(10, 100);
+  hist.Add(12, 100);
+  hist.Add(40, 50);
+  hist.Add(42, 50);
+  hist.Add(300, 25);
+  hist.Add(5000, 1000);
+
+  std::vector<toolbelt::BitmapRunConfig> runs = hist.SuggestBitmapRuns(3);
+  ASSERT_EQ(3, runs.size());
+  ASSERT_EQ(12, runs[0].size);
+  ASSERT_EQ(32, runs[0].num);
+  ASSERT_EQ(44, runs[1].size);
+  ASSERT_EQ(16, runs[1].num);
+  ASSERT_EQ(300, runs[2].size);
+  ASSERT_EQ(4, runs[2].num);
+
+  // With more classes than sizes, each size gets its own class.  10 and 12
+  // are the same size when rounded to 4 bytes.
+  runs = hist.SuggestBitmapRuns(8);
+  ASSERT_EQ(4, runs.size());
+  ASSERT_EQ(12, runs[0].size);
+  ASSERT_EQ(40, runs[1].size);
+  ASSERT_EQ(44, runs[2].size);
+  ASSERT_EQ(300, runs[3].size);
+
+  // With one class, everything goes in the largest.
+  runs = hist.SuggestBitmapRuns(1);
+  ASSERT_EQ(1, runs.size());
+  ASSERT_EQ(300, runs[0].size);
+  ASSERT_EQ(32, runs[0].num);
+
+  // The suggestion can be used to make a buffer.
+  runs = hist.SuggestBitmapRuns(3);
+  char *buffer = (char *)malloc(4096);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(4096, true, false, runs);
+  ASSERT_EQ(3, pb->num_bitmap_runs);
+  ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 42, 4, false));
+  free(buffer);
+}
+
+template <bool Checked> void TestView() {
+  char *buffer = (char *)malloc(4096);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(4096);
+
+  // Message with a uint64_t, a string and a vector of uint32_t.
+  PayloadBuffer::AllocateMainMessage(&pb, 32);
+  BufferOffset msg = pb->message;
+  pb->Set<uint64_t>(msg, 0x1234567890);
+  PayloadBuffer::SetString(&pb, std::string("foobar"), msg + 8);
+  VectorHeader *hdr = pb->ToAddress<VectorHeader>(msg + 16);
+  for (uint32_t i = 0; i < 10; i++) {
+    PayloadBuffer::VectorPush<uint32_t>(&pb, hdr, i * 3);
+  }
+
+  PayloadBuffer::BasicView<Checked> view(pb);
+  ASSERT_TRUE(view.Valid());
+  ASSERT_EQ(pb, view.Buffer());
+  ASSERT_EQ(0x1234567890, view.template Get<uint64_t>(msg));
+  ASSERT_EQ("foobar", view.GetStringView(msg + 8));
+  ASSERT_EQ("foobar", view.GetString(msg + 8));
+  ASSERT_EQ(6, view.StringSize(msg + 8));
+  ASSERT_EQ(pb->StringData(msg + 8), view.StringData(msg + 8));
+  // An unset string is empty.
+  ASSERT_EQ("", view.GetStringView(msg + 24));
+  ASSERT_EQ(nullptr, view.StringData(msg + 24));
+
+  hdr = view.template ToAddress<VectorHeader>(msg + 16);
+  ASSERT_EQ(pb->ToAddress<VectorHeader>(msg + 16), hdr);
+  ASSERT_EQ(msg + 16, view.ToOffset(hdr));
+  const uint32_t *data = view.template VectorData<uint32_t>(hdr);
+  ASSERT_NE(nullptr, data);
+  for (uint32_t i = 0; i < hdr->num_elements; i++) {
+    ASSERT_EQ(i * 3, view.template VectorGet<uint32_t>(hdr, i));
+    ASSERT_EQ(i * 3, data[i]);
+  }
+
+  // Offset 0 and nullptr correspond, checked or not.
+  ASSERT_EQ(nullptr, view.ToAddress(0));
+  ASSERT_EQ(nullptr, view.template ToAddress<uint32_t>(0));
+  ASSERT_EQ(0, view.ToOffset(static_cast<const void *>(nullptr)));
+
+  view.template Set<uint64_t>(msg, 42);
+  ASSERT_EQ(42, pb->Get<uint64_t>(msg));
+
+  // A buffer with a bad magic gives an invalid view.
+  pb->magic = 0;
+  ASSERT_FALSE(PayloadBuffer::BasicView<Checked>(pb).Valid());
+  ASSERT_FALSE(PayloadBuffer::BasicView<Checked>(nullptr).Valid());
+  free(buffer);
+}
+
+TEST(BufferTest, View) {
+  TestView<true>();
+  TestView<false>();
+}
+
+TEST(BufferTest, OldFormatRejected) {
+  // The magic before the free bins and boundary tags.
+  constexpr uint32_t kOldFixedMagic = 0xe5f6f1c4;
+  alignas(8) char sender_mem[1024];
+  PayloadBuffer *sender = new (sender_mem) PayloadBuffer(sizeof(sender_mem));
+  sender->magic = kOldFixedMagic | (sender->magic & toolbelt::kMagicFlagsMask);
+  ASSERT_FALSE(sender->IsValidMagic());
+  ASSERT_FALSE(PayloadBuffer::View(sender).Valid());
+
+  // Receiving it is refused and leaves the buffer as it was.
+  alignas(8) char mem[1024];
+  PayloadBuffer *pb = new (mem) PayloadBuffer(sizeof(mem));
+  PayloadBuffer::ReceiveState state = pb->BeginReceive();
+  memcpy(mem, sender_mem, sender->hwm);
+  ASSERT_FALSE(pb->EndReceive(sender->hwm, state));
+  ASSERT_TRUE(pb->IsValidMagic());
+  ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 100, 8));
+}
+
+TEST(BufferTest, FreeAtEndOfFreeList) {
+  for (bool binned : {false, true}) {
+    // Fill the buffer so that there is no free block at the end.
+    char *buffer = (char *)malloc(4096);
+    PayloadBuffer *pb = new (buffer) PayloadBuffer(4096, false, binned);
+    std::vector<void *> blocks;
+    for (;;) {
+      void *p = PayloadBuffer::Allocate(&pb, 100, 4, false);
+      if (p == nullptr) {
+        break;
+      }
+      memset(p, 0xee, 100);
+      blocks.push_back(p);
+    }
+    ASSERT_LT(4, blocks.size());
+    // Take what's left.
+    while (pb->FreeList() != nullptr) {
+      uint32_t length = pb->MinFreeBlockSize() - 4;
+      void *p = PayloadBuffer::Allocate(&pb, length, 4, false);
+      ASSERT_NE(nullptr, p);
+      memset(p, 0xee, length);
+      blocks.push_back(p);
+    }
+    // Free a block in the middle and then the last two, which are above
+    // all the free blocks.
+    pb->Free(blocks[1]);
+    pb->Free(blocks[blocks.size() - 2]);
+    pb->CheckFreeList();
+    pb->Free(blocks[blocks.size() - 1]);
+    pb->CheckFreeList();
+    for (size_t i = 2; i < blocks.size() - 2; i++) {
+      for (int j = 0; j < 4; j++) {
+        ASSERT_EQ(char(0xee), reinterpret_cast<char *>(blocks[i])[j]);
+      }
+    }
+    // The last two merged into one.
+    toolbelt::FreeBlockHeader *last = pb->LastFreeBlock();
+    ASSERT_EQ(reinterpret_cast<char *>(blocks[blocks.size() - 2]) - 4,
+              reinterpret_cast<char *>(last));
+    ASSERT_EQ(4096, pb->last_free + last->length);
+    if (!binned) {
+      // With the bins the free list isn't in address order.
+      ASSERT_EQ(0, last->next);
+    }
+    ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 64, 4, false));
+    pb->CheckFreeList();
+    free(buffer);
+  }
+}
+
+TEST(BufferTest, Reset) {
+  for (bool binned : {false, true}) {
+    char *buffer = (char *)malloc(4096);
+    PayloadBuffer *pb = new (buffer) PayloadBuffer(4096, true, binned);
+    uint32_t fresh_hwm = pb->hwm;
+    BufferOffset fresh_free_list = pb->free_list;
+
+    for (int i = 0; i < 10; i++) {
+      PayloadBuffer::AllocateMainMessage(&pb, 32);
+      ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 100, 8));
+      ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 10, 8));
+      ASSERT_NE(fresh_hwm, pb->hwm);
+
+      pb->Reset();
+      ASSERT_EQ(0, pb->message);
+      ASSERT_EQ(fresh_hwm, pb->hwm);
+      ASSERT_EQ(fresh_free_list, pb->free_list);
+      ASSERT_EQ(pb->free_list, pb->last_free);
+      ASSERT_EQ(0, pb->bitmaps[0]);
+      ASSERT_TRUE(pb->BitmapsEnabled());
+      ASSERT_EQ(binned, pb->FreeBinsEnabled());
+      pb->CheckFreeList();
+    }
+    free(buffer);
+  }
+}
+
+TEST(BufferTest, MarkRollback) {
+  for (bool binned : {false, true}) {
+    char *buffer = (char *)malloc(4096);
+    PayloadBuffer *pb = new (buffer) PayloadBuffer(4096, true, binned);
+    void *keep = PayloadBuffer::Allocate(&pb, 200, 8);
+    ASSERT_NE(nullptr, keep);
+    memset(keep, 0xaa, 200);
+    uint32_t hwm = pb->hwm;
+
+    toolbelt::BufferMark mark = pb->Mark();
+    ASSERT_TRUE(pb->IsMarked());
+    ASSERT_TRUE(mark.outermost);
+
+    // Build a message with a string and a vector.
+    PayloadBuffer::AllocateMainMessage(&pb, 32);
+    BufferOffset msg = pb->message;
+    PayloadBuffer::SetString(&pb, std::string("foobar"), msg);
+    PayloadBuffer::SetString(&pb, std::string("this is the new string"), msg);
+    VectorHeader *hdr = pb->ToAddress<VectorHeader>(msg + 8);
+    for (int i = 0; i < 100; i++) {
+      PayloadBuffer::VectorPush<uint32_t>(&pb, hdr, i);
+    }
+    ASSERT_EQ("this is the new string", pb->GetString(msg));
+    for (int i = 0; i < 100; i++) {
+      ASSERT_EQ(i, pb->VectorGet<uint32_t>(hdr, i));
+    }
+
+    toolbelt::BufferMark inner = pb->Mark();
+    ASSERT_FALSE(inner.outermost);
+    ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 500, 8));
+    pb->Rollback(inner);
+    ASSERT_TRUE(pb->IsMarked());
+    ASSERT_EQ(inner.bump, pb->bump);
+
+    // Free the last block and allocate it again, it's reused.
+    void *p = PayloadBuffer::Allocate(&pb, 64, 8);
+    pb->Free(p);
+    ASSERT_EQ(p, PayloadBuffer::Allocate(&pb, 64, 8));
+    ASSERT_LT(hwm, pb->hwm);
+
+    // Abandon it.
+    pb->Rollback(mark);
+    ASSERT_FALSE(pb->IsMarked());
+    ASSERT_EQ(hwm, pb->hwm);
+    ASSERT_EQ(0, pb->message);
+    pb->CheckFreeList();
+    // The free list is back to one block at the end.
+    ASSERT_EQ(pb->free_list, pb->last_free);
+    ASSERT_EQ(4096, pb->free_list + pb->FreeList()->length);
+    for (int i = 0; i < 200; i++) {
+      ASSERT_EQ(char(0xaa), reinterpret_cast<char *>(keep)[i]);
+    }
+
+    // Now build it again and keep it.
+    mark = pb->Mark();
+    PayloadBuffer::AllocateMainMessage(&pb, 32);
+    msg = pb->message;
+    PayloadBuffer::SetString(&pb, std::string("this is the new string"), msg);
+    void *q = PayloadBuffer::Allocate(&pb, 300, 8);
+    ASSERT_NE(nullptr, q);
+    pb->Commit(mark);
+    ASSERT_FALSE(pb->IsMarked());
+    ASSERT_EQ("this is the new string", pb->GetString(msg));
+    pb->CheckFreeList();
+
+    // Committed blocks can be freed normally.
+    pb->Free(q);
+    pb->Free(keep);
+    pb->CheckFreeList();
+    ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 1000, 8));
+    ASSERT_EQ("this is the new string", pb->GetString(msg));
+    pb->CheckFreeList();
+    free(buffer);
+  }
+}
+
+TEST(BufferTest, MarkResizeable) {
+  for (bool binned : {false, true}) {
+    char *buffer = (char *)malloc(1024);
+    int resizes = 0;
+    PayloadBuffer *pb = new (buffer) PayloadBuffer(
+        1024,
+        [&resizes](PayloadBuffer **p, size_t old_size, size_t new_size) {
+          *p = reinterpret_cast<PayloadBuffer *>(realloc(*p, new_size));
+          resizes++;
+        },
+        true, binned);
+    PayloadBuffer::AllocateMainMessage(&pb, sizeof(VectorHeader));
+    toolbelt::BufferMark mark = pb->Mark();
+    for (uint32_t i = 0; i < 1000; i++) {
+      PayloadBuffer::VectorPush<uint32_t>(
+          &pb, pb->ToAddress<VectorHeader>(pb->message), i);
+    }
+    ASSERT_LT(0, resizes);
+    VectorHeader *hdr = pb->ToAddress<VectorHeader>(pb->message);
+    for (uint32_t i = 0; i < 1000; i++) {
+      ASSERT_EQ(i, pb->VectorGet<uint32_t>(hdr, i));
+    }
+    pb->Rollback(mark);
+    pb->CheckFreeList();
+    ASSERT_EQ(pb->full_size, pb->last_free + pb->LastFreeBlock()->length);
+
+    // The new memory is reused without another resize.
+    int old_resizes = resizes;
+    ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 2000, 8));
+    ASSERT_EQ(old_resizes, resizes);
+    pb->CheckFreeList();
+    delete pb;
+  }
+}
+
+struct CompactInner {
+  toolbelt::StringHeader text;
+  uint32_t value;
+};
+
+struct CompactOuter {
+  toolbelt::StringHeader name;
+  VectorHeader values;
+  BufferOffset inner;
+  VectorHeader children;
+};
+
+static void CheckCompactMessage(PayloadBuffer *pb) {
+  BufferOffset msg = pb->message;
+  ASSERT_NE(0, msg);
+  ASSERT_EQ(std::string(190, 'c'),
+            pb->GetString(pb->ToAddress<toolbelt::StringHeader>(
+                msg + offsetof(CompactOuter, name))));
+  VectorHeader *values =
+      pb->ToAddress<VectorHeader>(msg + offsetof(CompactOuter, values));
+  ASSERT_EQ(100, values->num_elements);
+  for (uint32_t i = 0; i < 100; i++) {
+    ASSERT_EQ(i * 3, pb->VectorGet<uint32_t>(values, i));
+  }
+  BufferOffset inner =
+      pb->Get<BufferOffset>(msg + offsetof(CompactOuter, inner));
+  ASSERT_EQ("inner", pb->GetString(pb->ToAddress<toolbelt::StringHeader>(
+                         inner + offsetof(CompactInner, text))));
+  ASSERT_EQ(42, pb->Get<uint32_t>(inner + offsetof(CompactInner, value)));
+
+  VectorHeader *children =
+      pb->ToAddress<VectorHeader>(msg + offsetof(CompactOuter, children));
+  ASSERT_EQ(3, children->num_elements);
+  for (uint32_t i = 0; i < 2; i++) {
+    BufferOffset child = pb->VectorGet<BufferOffset>(children, i);
+    ASSERT_EQ("child" + std::to_string(i),
+              pb->GetString(pb->ToAddress<toolbelt::StringHeader>(
+                  child + offsetof(CompactInner, text))));
+  }
+  // The third child is the same message as 'inner'.
+  ASSERT_EQ(inner, pb->VectorGet<BufferOffset>(children, 2));
+
+  ASSERT_STREQ("metadata", pb->ToAddress<const char>(pb->metadata));
+}
+
+TEST(BufferTest, Compact) {
+  for (bool moveable : {false, true}) {
+    for (bool binned : {false, true}) {
+      char *buffer = (char *)malloc(16384);
+      PayloadBuffer *pb;
+      int resizes = 0;
+      if (moveable) {
+        pb = new (buffer) PayloadBuffer(
+            1024,
+            [&resizes](PayloadBuffer **p, size_t old_size, size_t new_size) {
+              *p = reinterpret_cast<PayloadBuffer *>(realloc(*p, new_size));
+              resizes++;
+            },
+            true, binned);
+      } else {
+        pb = new (buffer) PayloadBuffer(16384, true, binned);
+      }
+      PayloadBuffer::AllocateMainMessage(&pb, sizeof(CompactOuter));
+      BufferOffset msg = pb->message;
+
+      // Make a mess of the buffer: strings replaced by longer ones,
+      // vectors that grow, unreachable allocations and holes.
+      std::vector<BufferOffset> junk;
+      for (int i = 0; i < 20; i++) {
+        PayloadBuffer::SetString(&pb, std::string(i * 10, 'a' + i % 26),
+                                 msg + offsetof(CompactOuter, name));
+        void *p = PayloadBuffer::Allocate(&pb, 40 + i, 8);
+        ASSERT_NE(nullptr, p);
+        junk.push_back(pb->ToOffset(p));
+      }
+      for (size_t i = 0; i < junk.size(); i += 2) {
+        pb->Free(pb->ToAddress(junk[i]));
+      }
+      PayloadBuffer::SetString(&pb, std::string(190, 'c'),
+                               msg + offsetof(CompactOuter, name));
+      for (uint32_t i = 0; i < 100; i++) {
+        PayloadBuffer::VectorPush<uint32_t>(
+            &pb,
+            pb->ToAddress<VectorHeader>(msg + offsetof(CompactOuter, values)),
+            i * 3);
+      }
+      PayloadBuffer::NewMessage<CompactInner>(
+          &pb, sizeof(CompactInner), msg + offsetof(CompactOuter, inner));
+      BufferOffset inner =
+          pb->Get<BufferOffset>(msg + offsetof(CompactOuter, inner));
+      PayloadBuffer::SetString(&pb, std::string("inner"),
+                               inner + offsetof(CompactInner, text));
+      pb->Set<uint32_t>(inner + offsetof(CompactInner, value), 42);
+      for (int i = 0; i < 2; i++) {
+        void *child = PayloadBuffer::Allocate(&pb, sizeof(CompactInner), 8);
+        BufferOffset child_offset = pb->ToOffset(child);
+        PayloadBuffer::SetString(&pb, "child" + std::to_string(i),
+                                 child_offset + offsetof(CompactInner, text));
+        PayloadBuffer::VectorPush<BufferOffset>(
+            &pb,
+            pb->ToAddress<VectorHeader>(msg + offsetof(CompactOuter, children)),
+            child_offset);
+      }
+      PayloadBuffer::VectorPush<BufferOffset>(
+          &pb,
+          pb->ToAddress<VectorHeader>(msg + offsetof(CompactOuter, children)),
+          inner);
+      PayloadBuffer::AllocateMetadata(&pb, (void *)"metadata", 9);
+      ASSERT_NO_FATAL_FAILURE(CheckCompactMessage(pb));
+      ASSERT_EQ(moveable, resizes > 0);
+
+      auto visit_inner = [](toolbelt::PayloadCompactor &c, BufferOffset m) {
+        c.String(m + offsetof(CompactInner, text));
+      };
+      auto visit = [&](toolbelt::PayloadCompactor &c, BufferOffset m) {
+        c.String(m + offsetof(CompactOuter, name));
+        c.Vector<uint32_t>(m + offsetof(CompactOuter, values));
+        c.Message(m + offsetof(CompactOuter, inner), visit_inner);
+        c.MessageVector(m + offsetof(CompactOuter, children), visit_inner);
+      };
+
+      // Compact into another buffer.
+      char *dest_buffer = (char *)malloc(16384);
+      PayloadBuffer *dest =
+          new (dest_buffer) PayloadBuffer(16384, true, binned);
+      ASSERT_TRUE(PayloadBuffer::CompactCopy(pb, &dest, visit));
+      ASSERT_NO_FATAL_FAILURE(CheckCompactMessage(dest));
+      dest->CheckFreeList();
+      ASSERT_LT(dest->Size(), pb->Size());
+
+      // Compact in place.
+      size_t old_size = pb->Size();
+      ASSERT_TRUE(PayloadBuffer::Compact(&pb, visit));
+      ASSERT_NO_FATAL_FAILURE(CheckCompactMessage(pb));
+      pb->CheckFreeList();
+      ASSERT_LT(pb->Size(), old_size);
+      if (!moveable) {
+        ASSERT_EQ(dest->Size(), pb->Size());
+      }
+
+      // The buffer is still usable.  The message has moved.
+      msg = pb->message;
+      PayloadBuffer::SetString(&pb, std::string(190, 'c'),
+                               msg + offsetof(CompactOuter, name));
+      ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 100, 8));
+      ASSERT_NE(nullptr, PayloadBuffer::Allocate(&pb, 10, 8));
+      pb->CheckFreeList();
+      ASSERT_NO_FATAL_FAILURE(CheckCompactMessage(pb));
+
+      free(dest_buffer);
+      if (moveable) {
+        delete pb;
+      } else {
+        free(buffer);
+      }
+    }
+  }
+}
+
+TEST(BufferTest, Occupancy) {
+  char *buffer = (char *)malloc(8192);
+  PayloadBuffer *pb = new (buffer) PayloadBuffer(8192, false);
+  toolbelt::PayloadBufferOccupancy occ = pb->Occupancy();
+  ASSERT_EQ(8192, occ.full_size);
+  ASSERT_EQ(1, occ.free_blocks);
+  ASSERT_EQ(occ.free_bytes, occ.largest_free_block);
+  ASSERT_EQ(0, occ.fragmentation);
+
+  // Free every other block to fragment the free list.
+  std::vector<void *> blocks;
+  for (int i = 0; i < 10; i++) {
+    blocks.push_back(PayloadBuffer::Allocate(&pb, 200, 8));
+  }
+  for (int i = 0; i < 10; i += 2) {
+    pb->Free(blocks[i]);
+  }
+  occ = pb->Occupancy();
+  ASSERT_EQ(6, occ.free_blocks);
+  ASSERT_GT(occ.fragmentation, 0);
+  ASSERT_LT(occ.fragmentation, 1);
+  ASSERT_GT(occ.free_bytes, occ.largest_free_block);
+  free(buffer);
+}
+
+TEST(BufferTest, Stats) {
+  toolbelt::PayloadBufferStats stats;
+  ASSERT_EQ(nullptr, PayloadBuffer::SetThreadStats(&stats));
+
+  PayloadBuffer *pb = new (malloc(256)) PayloadBuffer(
+      256, Resizer([](PayloadBuffer **p, size_t, size_t new_size) {
+        *p = reinterpret_cast<PayloadBuffer *>(realloc(*p, new_size));
+      }));
+  // Each allocation might move the buffer, so hold on to offsets.
+  void *p = PayloadBuffer::Allocate(&pb, 10, 4);
+  toolbelt::BufferOffset small = pb->ToOffset(p);
+  p = PayloadBuffer::Allocate(&pb, 1000, 8);
+  toolbelt::BufferOffset big = pb->ToOffset(p);
+  p = PayloadBuffer::Allocate(&pb, 10, 4, true, false);
+  toolbelt::BufferOffset fallback = pb->ToOffset(p);
+  p = pb->ToAddress(big);
+  ASSERT_NE(nullptr, PayloadBuffer::Realloc(&pb, p, 4000, 8));
+  pb->Free(pb->ToAddress(small));
+  pb->Free(pb->ToAddress(fallback));
+
+  // Stop counting.
+  ASSERT_EQ(&stats, PayloadBuffer::SetThreadStats(nullptr));
+  PayloadBuffer::Allocate(&pb, 100, 8);
+
+  if (!toolbelt::kPayloadBufferStats) {
+    ASSERT_EQ(0, stats.allocations);
+  } else {
+    ASSERT_EQ(1, stats.small_block_hits[0]);
+    ASSERT_GE(stats.small_block_fallbacks[0], 1);
+    ASSERT_EQ(1, stats.bitmap_runs);
+    ASSERT_EQ(1, stats.reallocs);
+    ASSERT_GE(stats.resizes, 1);
+    ASSERT_GE(stats.resize_bytes_preserved, 256);
+    // The small block, the run for it, big, fallback and any new block for
+    // the realloc, and the allocator's own bookkeeping.
+    ASSERT_GE(stats.allocations, 4 + stats.realloc_moves);
+    ASSERT_GE(stats.frees, 2 + stats.realloc_moves);
+    ASSERT_EQ(0, stats.failed_allocations);
+    ASSERT_EQ(0, stats.bump_allocations);
+    // Everything came from one or the other.
+    ASSERT_EQ(stats.allocations,
+              stats.small_block_hits[0] + stats.free_list_allocations);
+  }
+  stats.Clear();
+  ASSERT_EQ(0, stats.allocations);
+  pb->~PayloadBuffer();
+  free(pb);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
 
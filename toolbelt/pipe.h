@@ -53,6 +53,9 @@ private:
 // NB: This can only be used when the sender and receiver are in the same
 // process and will error out if you try to send it across the process
 // boundary.
+//
+// This costs a system call for each read and write.  SharedPtrQueue in
+// queue.h does the same job without them.
 template <typename T> class SharedPtrPipe : public Pipe {
 public:
   static absl::StatusOr<SharedPtrPipe<T>> Create() {
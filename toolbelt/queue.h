@@ -0,0 +1,428 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __TOOLBELT_QUEUE_H
+#define __TOOLBELT_QUEUE_H
+
+#include "absl/status/status.h"
+#include "absl/types/span.h"
+#include "coroutine.h"
+#include "toolbelt/triggerfd.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+namespace toolbelt {
+
+// Lock free bounded queues for passing objects between threads in the same
+// process.  The capacity is rounded up to a power of 2 (at least 2).  A push
+// fails if the queue is full and a pop fails if it is empty; they never
+// block.  Use a TriggeredQueue if the consumer needs to wait for something
+// to arrive.
+//
+// The head and tail are in different cache lines so that the producer and
+// consumer don't fight over them.
+//
+// The objects are moved into and out of the queue.  T must be default
+// constructible and move assignable.
+
+inline constexpr size_t kCacheLineSize = 64;
+
+namespace internal {
+inline size_t QueueCapacity(size_t capacity) {
+  // An MPSCQueue needs at least 2 slots to tell full from empty.
+  size_t n = 2;
+  while (n < capacity) {
+    n <<= 1;
+  }
+  return n;
+}
+} // namespace internal
+
+// A queue with a single producer thread and a single consumer thread.
+template <typename T> class SPSCQueue {
+public:
+  using value_type = T;
+
+  explicit SPSCQueue(size_t capacity)
+      : capacity_(internal::QueueCapacity(capacity)), mask_(capacity_ - 1),
+        slots_(new T[capacity_]) {}
+  SPSCQueue(const SPSCQueue &) = delete;
+  SPSCQueue &operator=(const SPSCQueue &) = delete;
+
+  bool TryPush(T value) {
+    return TryPushWith([&value](T &slot) { slot = std::move(value); });
+  }
+
+  // Fill the next slot in place by calling fill(T&), for when T is big.
+  template <typename F> bool TryPushWith(F &&fill) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ == capacity_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ == capacity_) {
+        return false;
+      }
+    }
+    fill(slots_[tail & mask_]);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Moves as many of 'values' as will fit into the queue and returns how
+  // many that was.  The tail is only updated once.
+  size_t TryPushBatch(absl::Span<T> values) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (capacity_ - (tail - head_cache_) < values.size()) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+    }
+    size_t n = std::min(values.size(), capacity_ - (tail - head_cache_));
+    for (size_t i = 0; i < n; i++) {
+      slots_[(tail + i) & mask_] = std::move(values[i]);
+    }
+    if (n > 0) {
+      tail_.store(tail + n, std::memory_order_release);
+    }
+    return n;
+  }
+
+  std::optional<T> TryPop() {
+    std::optional<T> value;
+    // Leave an empty object behind so that nothing is kept alive by the
+    // queue.
+    TryPopWith([&value](T &slot) { value = std::exchange(slot, T()); });
+    return value;
+  }
+
+  // Call consume(T&) on the value at the head in place and then pop it.
+  template <typename F> bool TryPopWith(F &&consume) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) {
+        return false;
+      }
+    }
+    consume(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pops up to values.size() objects into 'values' and returns how many.
+  size_t TryPopBatch(absl::Span<T> values) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (tail_cache_ - head < values.size()) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+    }
+    size_t n = std::min(values.size(), tail_cache_ - head);
+    for (size_t i = 0; i < n; i++) {
+      values[i] = std::exchange(slots_[(head + i) & mask_], T());
+    }
+    if (n > 0) {
+      head_.store(head + n, std::memory_order_release);
+    }
+    return n;
+  }
+
+  // These are only approximate if the other thread is using the queue.
+  size_t Size() const {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+  bool Empty() const { return Size() == 0; }
+  size_t Capacity() const { return capacity_; }
+
+private:
+  const size_t capacity_;
+  const size_t mask_;
+  std::unique_ptr<T[]> slots_;
+
+  // Written by the consumer.
+  alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0; // Consumer's copy of tail_.
+
+  // Written by the producer.
+  alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+  size_t head_cache_ = 0; // Producer's copy of head_.
+};
+
+// A queue with any number of producer threads and a single consumer thread.
+// Each slot has a sequence number that says whether it is full or empty
+// for the current lap around the queue, so producers only need to agree
+// on the tail.
+template <typename T> class MPSCQueue {
+public:
+  using value_type = T;
+
+  explicit MPSCQueue(size_t capacity)
+      : capacity_(internal::QueueCapacity(capacity)), mask_(capacity_ - 1),
+        slots_(new Slot[capacity_]) {
+    for (size_t i = 0; i < capacity_; i++) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  MPSCQueue(const MPSCQueue &) = delete;
+  MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+  bool TryPush(T value) {
+    return TryPushWith([&value](T &slot) { slot = std::move(value); });
+  }
+
+  // Fill the next slot in place by calling fill(T&), for when T is big.
+  template <typename F> bool TryPushWith(F &&fill) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+      slot = &slots_[tail & mask_];
+      size_t seq = slot->sequence.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(seq) - intptr_t(tail);
+      if (diff == 0) {
+        // Slot is empty, try to claim it.
+        if (tail_.compare_exchange_weak(tail, tail + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // Slot still has the value from the last lap: full.
+        return false;
+      } else {
+        // Another producer got there first.
+        tail = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    fill(slot->value);
+    slot->sequence.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Moves as many of 'values' as will fit into the queue and returns how
+  // many that was.  The slots are claimed with a single update of the
+  // tail so the values are contiguous in the queue.
+  size_t TryPushBatch(absl::Span<T> values) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t n;
+    for (;;) {
+      // The consumer empties slots in order so if it has got to 'head' then
+      // all slots before head + capacity are free.
+      size_t head = head_.load(std::memory_order_acquire);
+      if (intptr_t(tail - head) < 0) {
+        // The consumer has moved past our copy of the tail.
+        tail = tail_.load(std::memory_order_relaxed);
+        continue;
+      }
+      n = std::min(values.size(), capacity_ - (tail - head));
+      if (n == 0) {
+        return 0;
+      }
+      if (tail_.compare_exchange_weak(tail, tail + n,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    }
+    for (size_t i = 0; i < n; i++) {
+      Slot &slot = slots_[(tail + i) & mask_];
+      slot.value = std::move(values[i]);
+      slot.sequence.store(tail + i + 1, std::memory_order_release);
+    }
+    return n;
+  }
+
+  std::optional<T> TryPop() {
+    std::optional<T> value;
+    TryPopWith([&value](T &slot) { value = std::exchange(slot, T()); });
+    return value;
+  }
+
+  // Call consume(T&) on the value at the head in place and then pop it.
+  template <typename F> bool TryPopWith(F &&consume) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    Slot &slot = slots_[head & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+      return false;
+    }
+    consume(slot.value);
+    slot.sequence.store(head + capacity_, std::memory_order_release);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pops up to values.size() objects into 'values' and returns how many.
+  size_t TryPopBatch(absl::Span<T> values) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t n = 0;
+    while (n < values.size()) {
+      Slot &slot = slots_[(head + n) & mask_];
+      if (slot.sequence.load(std::memory_order_acquire) != head + n + 1) {
+        break;
+      }
+      values[n] = std::exchange(slot.value, T());
+      slot.sequence.store(head + n + capacity_, std::memory_order_release);
+      n++;
+    }
+    if (n > 0) {
+      head_.store(head + n, std::memory_order_release);
+    }
+    return n;
+  }
+
+  // These are only approximate if other threads are using the queue.
+  // Slots that have been claimed by a producer but not yet filled are
+  // counted.
+  size_t Size() const {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+  bool Empty() const { return Size() == 0; }
+  size_t Capacity() const { return capacity_; }
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  const size_t capacity_;
+  const size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+
+  // Written by the consumer.
+  alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+
+  // Written by the producers.
+  alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+};
+
+// A queue whose consumer can wait for it to be non-empty.  The wait is on a
+// TriggerFd, so it can be done in a coroutine or by polling GetPollFd
+// along with other fds.  Producers only trigger the fd when the consumer
+// is waiting, so while the consumer is keeping up nothing goes through the
+// kernel.
+//
+// 'Queue' is SPSCQueue<T> or MPSCQueue<T>.
+template <typename Queue> class TriggeredQueue {
+public:
+  using value_type = typename Queue::value_type;
+
+  explicit TriggeredQueue(size_t capacity) : queue_(capacity) {}
+
+  absl::Status Open() { return trigger_.Open(); }
+
+  bool TryPush(value_type value) {
+    if (!queue_.TryPush(std::move(value))) {
+      return false;
+    }
+    WakeConsumer();
+    return true;
+  }
+
+  template <typename F> bool TryPushWith(F &&fill) {
+    if (!queue_.TryPushWith(std::forward<F>(fill))) {
+      return false;
+    }
+    WakeConsumer();
+    return true;
+  }
+
+  size_t TryPushBatch(absl::Span<value_type> values) {
+    size_t n = queue_.TryPushBatch(values);
+    if (n > 0) {
+      WakeConsumer();
+    }
+    return n;
+  }
+
+  std::optional<value_type> TryPop() { return queue_.TryPop(); }
+
+  template <typename F> bool TryPopWith(F &&consume) {
+    return queue_.TryPopWith(std::forward<F>(consume));
+  }
+
+  size_t TryPopBatch(absl::Span<value_type> values) {
+    return queue_.TryPopBatch(values);
+  }
+
+  // Wait until there is something in the queue and pop it.  If 'c' is not
+  // null the coroutine waits, otherwise the thread does.
+  value_type Pop(co::Coroutine *c = nullptr) {
+    for (;;) {
+      if (std::optional<value_type> value = queue_.TryPop()) {
+        return std::move(*value);
+      }
+      Wait(c);
+    }
+  }
+
+  // Wait until there is something in the queue and pop up to values.size()
+  // objects.  Returns how many were popped.
+  size_t PopBatch(absl::Span<value_type> values, co::Coroutine *c = nullptr) {
+    if (values.empty()) {
+      return 0;
+    }
+    for (;;) {
+      if (size_t n = queue_.TryPopBatch(values); n > 0) {
+        return n;
+      }
+      Wait(c);
+    }
+  }
+
+  size_t Size() const { return queue_.Size(); }
+  bool Empty() const { return queue_.Empty(); }
+  size_t Capacity() const { return queue_.Capacity(); }
+
+  // This is readable when the consumer should look at the queue again.
+  FileDescriptor &GetPollFd() { return trigger_.GetPollFd(); }
+
+  // Wait until the queue might not be empty or Wake is called.  This can
+  // return with the queue empty, so check it again.
+  void Wait(co::Coroutine *c = nullptr) {
+    waiting_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!queue_.Empty()) {
+      // Something arrived before the producer could see we were waiting.
+      waiting_.store(false, std::memory_order_relaxed);
+      return;
+    }
+    if (c != nullptr) {
+      c->Wait(trigger_.GetPollFd().Fd(), POLLIN);
+    } else {
+      struct pollfd fd = {.fd = trigger_.GetPollFd().Fd(), .events = POLLIN};
+      ::poll(&fd, 1, -1);
+    }
+    trigger_.Clear();
+  }
+
+  // Wake the consumer for something other than a push.  If it isn't waiting
+  // its next Wait returns at once.
+  void Wake() { trigger_.Trigger(); }
+
+private:
+  void WakeConsumer() {
+    // Pairs with the fence in Wait: either the consumer sees what we
+    // pushed or we see that it's waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_.load(std::memory_order_relaxed) &&
+        waiting_.exchange(false, std::memory_order_relaxed)) {
+      trigger_.Trigger();
+    }
+  }
+
+  Queue queue_;
+  TriggerFd trigger_;
+  alignas(kCacheLineSize) std::atomic<bool> waiting_{false};
+};
+
+// An in-process replacement for SharedPtrPipe.  The pointers are moved
+// through a queue instead of being written to a pipe, so there are no
+// system calls unless the consumer has to wait.
+template <typename T>
+using SharedPtrQueue = TriggeredQueue<MPSCQueue<std::shared_ptr<T>>>;
+
+} // namespace toolbelt
+
+#endif // __TOOLBELT_QUEUE_H
@@ -0,0 +1,223 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/queue.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+template <typename T> using SPSCQueue = toolbelt::SPSCQueue<T>;
+template <typename T> using MPSCQueue = toolbelt::MPSCQueue<T>;
+template <typename T> using SharedPtrQueue = toolbelt::SharedPtrQueue<T>;
+
+template <typename Q> class QueueTest : public ::testing::Test {};
+using QueueTypes = ::testing::Types<SPSCQueue<int>, MPSCQueue<int>>;
+TYPED_TEST_SUITE(QueueTest, QueueTypes);
+
+TYPED_TEST(QueueTest, PushPop) {
+  TypeParam q(5);
+  ASSERT_EQ(8, q.Capacity());
+  ASSERT_TRUE(q.Empty());
+  ASSERT_FALSE(q.TryPop());
+
+  // Go round a few times.
+  for (int lap = 0; lap < 3; lap++) {
+    for (int i = 0; i < 8; i++) {
+      ASSERT_TRUE(q.TryPush(i));
+    }
+    ASSERT_FALSE(q.TryPush(8));
+    ASSERT_EQ(8, q.Size());
+    for (int i = 0; i < 8; i++) {
+      std::optional<int> v = q.TryPop();
+      ASSERT_TRUE(v);
+      ASSERT_EQ(i, *v);
+    }
+    ASSERT_FALSE(q.TryPop());
+  }
+
+  TypeParam small(1);
+  ASSERT_EQ(2, small.Capacity());
+  ASSERT_TRUE(small.TryPush(1));
+  ASSERT_TRUE(small.TryPush(2));
+  ASSERT_FALSE(small.TryPush(3));
+  ASSERT_EQ(1, *small.TryPop());
+  ASSERT_EQ(2, *small.TryPop());
+}
+
+TYPED_TEST(QueueTest, Batch) {
+  TypeParam q(16);
+  std::vector<int> in(10);
+  for (int i = 0; i < 10; i++) {
+    in[i] = i;
+  }
+  ASSERT_EQ(10, q.TryPushBatch(absl::MakeSpan(in)));
+  // Only 6 more fit.
+  ASSERT_EQ(6, q.TryPushBatch(absl::MakeSpan(in)));
+  ASSERT_EQ(0, q.TryPushBatch(absl::MakeSpan(in)));
+
+  std::vector<int> out(12);
+  ASSERT_EQ(12, q.TryPopBatch(absl::MakeSpan(out)));
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(i, out[i]);
+  }
+  ASSERT_EQ(0, out[10]);
+  ASSERT_EQ(1, out[11]);
+  ASSERT_EQ(4, q.TryPopBatch(absl::MakeSpan(out)));
+  ASSERT_EQ(0, q.TryPopBatch(absl::MakeSpan(out)));
+}
+
+TYPED_TEST(QueueTest, Threads) {
+  constexpr int kNumValues = 200000;
+  TypeParam q(1024);
+  std::thread producer([&q]() {
+    int i = 0;
+    while (i < kNumValues) {
+      if ((i % 3) == 0) {
+        // Mix in some batches.
+        int values[7];
+        int n = std::min(7, kNumValues - i);
+        for (int j = 0; j < n; j++) {
+          values[j] = i + j;
+        }
+        size_t pushed = q.TryPushBatch(absl::MakeSpan(values, n));
+        if (pushed == 0) {
+          std::this_thread::yield();
+        }
+        i += pushed;
+      } else if (q.TryPush(i)) {
+        i++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+  int next = 0;
+  while (next < kNumValues) {
+    if (std::optional<int> v = q.TryPop()) {
+      ASSERT_EQ(next, *v);
+      next++;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  ASSERT_TRUE(q.Empty());
+}
+
+TEST(MPSCQueueTest, ManyProducers) {
+  constexpr int kNumProducers = 4;
+  constexpr int kNumValues = 50000;
+  MPSCQueue<int> q(256);
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kNumProducers; p++) {
+    producers.emplace_back([&q, p]() {
+      int i = 0;
+      while (i < kNumValues) {
+        int values[2] = {p * kNumValues + i, p * kNumValues + i + 1};
+        size_t pushed = (i % 4) == 0
+                            ? q.TryPushBatch(absl::MakeSpan(
+                                  values, std::min(2, kNumValues - i)))
+                            : q.TryPush(values[0]);
+        if (pushed == 0) {
+          std::this_thread::yield();
+        }
+        i += pushed;
+      }
+    });
+  }
+  // The values from each producer arrive in order.
+  std::vector<int> next(kNumProducers);
+  int received = 0;
+  while (received < kNumProducers * kNumValues) {
+    int values[16];
+    size_t n = q.TryPopBatch(absl::MakeSpan(values));
+    if (n == 0) {
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < n; i++) {
+      int p = values[i] / kNumValues;
+      ASSERT_EQ(next[p], values[i] % kNumValues);
+      next[p]++;
+    }
+    received += n;
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+  ASSERT_TRUE(q.Empty());
+}
+
+TEST(SharedPtrQueueTest, WriteAndRead) {
+  SharedPtrQueue<int> q(16);
+  ASSERT_TRUE(q.Open().ok());
+
+  auto p = std::make_shared<int>(42);
+  ASSERT_TRUE(q.TryPush(p));
+  ASSERT_EQ(2, p.use_count());
+
+  std::shared_ptr<int> r = q.Pop();
+  ASSERT_EQ(42, *r);
+  // The queue doesn't hold on to it.
+  ASSERT_EQ(2, p.use_count());
+  r.reset();
+  ASSERT_EQ(1, p.use_count());
+}
+
+TEST(SharedPtrQueueTest, Wait) {
+  constexpr int kNumProducers = 3;
+  constexpr int kNumValues = 20000;
+  SharedPtrQueue<int> q(64);
+  ASSERT_TRUE(q.Open().ok());
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kNumProducers; p++) {
+    producers.emplace_back([&q]() {
+      for (int i = 0; i < kNumValues; i++) {
+        auto v = std::make_shared<int>(i);
+        while (!q.TryPush(v)) {
+          std::this_thread::yield();
+        }
+        if ((i % 1000) == 0) {
+          // Let the consumer run dry and wait.
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+    });
+  }
+  int64_t total = 0;
+  int received = 0;
+  while (received < kNumProducers * kNumValues) {
+    std::shared_ptr<int> values[8];
+    size_t n = q.PopBatch(absl::MakeSpan(values));
+    ASSERT_GT(n, 0);
+    for (size_t i = 0; i < n; i++) {
+      total += *values[i];
+    }
+    received += n;
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+  ASSERT_EQ(int64_t(kNumProducers) * kNumValues * (kNumValues - 1) / 2, total);
+}
+
+TEST(TriggeredQueueTest, Wake) {
+  toolbelt::TriggeredQueue<MPSCQueue<int>> q(4);
+  ASSERT_TRUE(q.Open().ok());
+
+  ASSERT_TRUE(q.TryPushWith([](int &v) { v = 7; }));
+  int value = 0;
+  ASSERT_TRUE(q.TryPopWith([&value](int &v) { value = v; }));
+  ASSERT_EQ(7, value);
+  ASSERT_FALSE(q.TryPopWith([](int &) {}));
+
+  // Wake makes Wait return even though nothing was pushed.
+  std::thread waker([&q]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    q.Wake();
+  });
+  q.Wait();
+  waker.join();
+  ASSERT_TRUE(q.Empty());
+}
@@ -0,0 +1,281 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/shared_buffer.h"
+#include "absl/strings/str_format.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace toolbelt {
+
+// The shared memory starts with this, followed by the PayloadBuffer.
+// The head and tail are in separate cache lines as they are written by
+// different processes.
+struct SharedBufferControl {
+  static constexpr uint32_t kMagic = 0x53484d42; // SHMB
+  static constexpr size_t kNumSlots = 128;
+
+  struct Slot {
+    BufferOffset message;
+    uint32_t size;
+    uint64_t mapped_size; // Size of the shared memory for this message.
+  };
+
+  uint32_t magic = kMagic;
+  alignas(64) std::atomic<uint64_t> head{0}; // Next sequence to publish.
+  alignas(64) std::atomic<uint64_t> tail{0}; // Next sequence to consume.
+  // The trigger coalescing flag, so the producer only writes the trigger
+  // fd when the consumer isn't already due to wake up.
+  alignas(64) std::atomic<uint32_t> trigger_armed{0};
+  alignas(64) Slot slots[kNumSlots];
+};
+
+// The buffer starts a page in so that it's well aligned.
+static constexpr size_t kControlSize = 4096;
+static_assert(sizeof(SharedBufferControl) <= kControlSize);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+static int CreateSharedMemory() {
+#if defined(__linux__)
+  return memfd_create("payload_buffer", MFD_CLOEXEC);
+#else
+  // No memfd, use an unlinked POSIX shared memory object.
+  std::string name = absl::StrFormat("/payload_buffer.%d.%p", getpid(),
+                                     static_cast<void *>(&name));
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd != -1) {
+    shm_unlink(name.c_str());
+  }
+  return fd;
+#endif
+}
+
+absl::StatusOr<std::unique_ptr<SharedBufferProducer>>
+SharedBufferProducer::Create(uint32_t initial_size, bool binned_free_list) {
+  std::unique_ptr<SharedBufferProducer> p(new SharedBufferProducer());
+  int fd = CreateSharedMemory();
+  if (fd == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to create shared memory: %s", strerror(errno)));
+  }
+  p->shm_fd_.SetFd(fd);
+  size_t size = kControlSize + initial_size;
+  if (ftruncate(fd, size) == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to set size of shared memory: %s", strerror(errno)));
+  }
+  void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    return absl::InternalError(
+        absl::StrFormat("Unable to map shared memory: %s", strerror(errno)));
+  }
+  p->base_ = reinterpret_cast<char *>(mem);
+  p->mapped_size_ = size;
+  new (p->base_) SharedBufferControl();
+
+  if (absl::Status status = p->trigger_.Open(); !status.ok()) {
+    return status;
+  }
+  p->trigger_.EnableCoalescing(&p->Control()->trigger_armed);
+
+  // The producer is on the heap so the resizer can refer to it.
+  SharedBufferProducer *producer = p.get();
+  p->buffer_ = new (p->base_ + kControlSize) PayloadBuffer(
+      initial_size,
+      [producer](PayloadBuffer **buffer, size_t old_size, size_t new_size) {
+        producer->Remap(buffer, new_size);
+      },
+      true, binned_free_list);
+  return p;
+}
+
+SharedBufferProducer::~SharedBufferProducer() {
+  if (buffer_ != nullptr) {
+    buffer_->~PayloadBuffer();
+  }
+  if (base_ != nullptr) {
+    munmap(base_, mapped_size_);
+  }
+}
+
+void SharedBufferProducer::Remap(PayloadBuffer **buffer, size_t new_size) {
+  // Make the shared memory bigger and map it again.  The contents are in the
+  // shared memory so they don't need to be copied.
+  size_t size = kControlSize + new_size;
+  if (ftruncate(shm_fd_.Fd(), size) == -1) {
+    // The resizer has no way to fail.
+    fprintf(stderr, "Unable to grow shared memory to %zd bytes: %s\n", size,
+            strerror(errno));
+    abort();
+  }
+#if defined(__linux__)
+  void *mem = mremap(base_, mapped_size_, size, MREMAP_MAYMOVE);
+#else
+  munmap(base_, mapped_size_);
+  void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   shm_fd_.Fd(), 0);
+#endif
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Unable to remap shared memory to %zd bytes: %s\n", size,
+            strerror(errno));
+    abort();
+  }
+  base_ = reinterpret_cast<char *>(mem);
+  mapped_size_ = size;
+  buffer_ = reinterpret_cast<PayloadBuffer *>(base_ + kControlSize);
+  *buffer = buffer_;
+  trigger_.EnableCoalescing(&Control()->trigger_armed);
+}
+
+absl::Status SharedBufferProducer::SendTo(UnixSocket &socket,
+                                          co::Coroutine *c) {
+  std::vector<FileDescriptor> fds = {shm_fd_, trigger_.GetPollFd(),
+                                     trigger_.GetTriggerFd()};
+  return socket.SendFds(fds, c);
+}
+
+absl::StatusOr<uint64_t> SharedBufferProducer::Publish(BufferOffset message) {
+  SharedBufferControl *control = Control();
+  uint64_t head = control->head.load(std::memory_order_relaxed);
+  uint64_t tail = control->tail.load(std::memory_order_acquire);
+  if (head - tail == SharedBufferControl::kNumSlots) {
+    return absl::ResourceExhaustedError(
+        "Too many messages waiting for shared buffer consumer");
+  }
+  SharedBufferControl::Slot &slot =
+      control->slots[head % SharedBufferControl::kNumSlots];
+  slot.message = message;
+  slot.size = uint32_t(buffer_->Size());
+  slot.mapped_size = mapped_size_;
+  control->head.store(head + 1, std::memory_order_release);
+  trigger_.Trigger();
+  return head;
+}
+
+bool SharedBufferProducer::Consumed(uint64_t seq) const {
+  return Control()->tail.load(std::memory_order_acquire) > seq;
+}
+
+absl::StatusOr<std::unique_ptr<SharedBufferConsumer>>
+SharedBufferConsumer::Receive(UnixSocket &socket, co::Coroutine *c) {
+  std::vector<FileDescriptor> fds;
+  if (absl::Status status = socket.ReceiveFds(fds, c); !status.ok()) {
+    return status;
+  }
+  if (fds.size() != 3) {
+    return absl::InternalError(absl::StrFormat(
+        "Expected 3 fds for shared buffer, got %d", fds.size()));
+  }
+  std::unique_ptr<SharedBufferConsumer> consumer(new SharedBufferConsumer());
+  consumer->shm_fd_ = std::move(fds[0]);
+  consumer->trigger_.SetPollFd(std::move(fds[1]));
+  consumer->trigger_.SetTriggerFd(std::move(fds[2]));
+
+  struct stat st;
+  if (fstat(consumer->shm_fd_.Fd(), &st) == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to get size of shared memory: %s", strerror(errno)));
+  }
+  if (size_t(st.st_size) <= kControlSize) {
+    return absl::InternalError("Shared memory is too small");
+  }
+  // The control block is mapped separately so that we can write the tail.
+  void *control = mmap(nullptr, kControlSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, consumer->shm_fd_.Fd(), 0);
+  if (control == MAP_FAILED) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to map shared buffer control: %s", strerror(errno)));
+  }
+  consumer->control_ = reinterpret_cast<SharedBufferControl *>(control);
+  consumer->trigger_.EnableCoalescing(&consumer->control_->trigger_armed);
+  if (absl::Status status = consumer->Map(st.st_size); !status.ok()) {
+    return status;
+  }
+  if (consumer->Control()->magic != SharedBufferControl::kMagic ||
+      !consumer->buffer_->IsValidMagic()) {
+    return absl::InternalError("Shared memory is not a shared buffer");
+  }
+  return consumer;
+}
+
+SharedBufferConsumer::~SharedBufferConsumer() {
+  if (control_ != nullptr) {
+    munmap(control_, kControlSize);
+  }
+  if (base_ != nullptr) {
+    munmap(const_cast<char *>(base_), mapped_size_);
+  }
+}
+
+absl::Status SharedBufferConsumer::Map(size_t size) {
+  if (base_ != nullptr) {
+    munmap(const_cast<char *>(base_), mapped_size_);
+    base_ = nullptr;
+  }
+  void *mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, shm_fd_.Fd(), 0);
+  if (mem == MAP_FAILED) {
+    return absl::InternalError(
+        absl::StrFormat("Unable to map shared memory: %s", strerror(errno)));
+  }
+  base_ = reinterpret_cast<char *>(mem);
+  mapped_size_ = size;
+  buffer_ = reinterpret_cast<const PayloadBuffer *>(base_ + kControlSize);
+  return absl::OkStatus();
+}
+
+absl::StatusOr<SharedBufferMessage> SharedBufferConsumer::TryNext() {
+  SharedBufferControl *control = Control();
+  uint64_t tail = control->tail.load(std::memory_order_relaxed);
+  uint64_t head = control->head.load(std::memory_order_acquire);
+  if (tail == head) {
+    return absl::UnavailableError("No message available");
+  }
+  const SharedBufferControl::Slot &slot =
+      control->slots[tail % SharedBufferControl::kNumSlots];
+  SharedBufferMessage msg = {tail, slot.message, slot.size};
+  if (slot.mapped_size > mapped_size_) {
+    // The producer has made the buffer bigger.
+    if (absl::Status status = Map(slot.mapped_size); !status.ok()) {
+      return status;
+    }
+  }
+  return msg;
+}
+
+absl::StatusOr<SharedBufferMessage>
+SharedBufferConsumer::Next(co::Coroutine *c) {
+  for (;;) {
+    absl::StatusOr<SharedBufferMessage> msg = TryNext();
+    if (msg.ok() || !absl::IsUnavailable(msg.status())) {
+      return msg;
+    }
+    // Clear the trigger and check again before waiting so that we don't miss
+    // a message published in between.
+    trigger_.Clear();
+    msg = TryNext();
+    if (msg.ok() || !absl::IsUnavailable(msg.status())) {
+      return msg;
+    }
+    if (c != nullptr) {
+      c->Wait(trigger_.GetPollFd().Fd(), POLLIN);
+    } else {
+      struct pollfd fd = {.fd = trigger_.GetPollFd().Fd(), .events = POLLIN};
+      ::poll(&fd, 1, -1);
+    }
+  }
+}
+
+void SharedBufferConsumer::Release() {
+  SharedBufferControl *control = Control();
+  uint64_t tail = control->tail.load(std::memory_order_relaxed);
+  if (tail != control->head.load(std::memory_order_acquire)) {
+    control->tail.store(tail + 1, std::memory_order_release);
+  }
+}
+
+} // namespace toolbelt
@@ -0,0 +1,124 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __TOOLBELT_SHARED_BUFFER_H
+#define __TOOLBELT_SHARED_BUFFER_H
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "coroutine.h"
+#include "toolbelt/fd.h"
+#include "toolbelt/payload_buffer.h"
+#include "toolbelt/sockets.h"
+#include "toolbelt/triggerfd.h"
+#include <memory>
+
+namespace toolbelt {
+
+// A zero copy channel for messages in a PayloadBuffer between processes.
+//
+// The producer creates a PayloadBuffer in shared memory (a memfd on Linux)
+// and sends the fd for it once, over a UnixSocket, to the consumer who
+// maps the same memory read only.  After that, messages are built in the
+// buffer and published by offset.  The notifications are held in a small
+// ring in the shared memory and the consumer is woken by a TriggerFd, so
+// nothing is copied and nothing but the trigger goes through the kernel.
+//
+// The buffer is resizable.  When it grows, the shared memory is made
+// bigger and remapped rather than copied, and the consumer remaps when it
+// sees a message that is beyond what it has mapped.
+//
+// The producer must not change or free a message until the consumer has
+// finished with it (see SharedBufferProducer::Consumed).
+
+struct SharedBufferControl;
+
+// A message published by the producer.
+struct SharedBufferMessage {
+  uint64_t sequence;    // Sequence number, starting at 0.
+  BufferOffset message; // Offset of the message in the buffer.
+  uint32_t size;        // Size of the buffer when it was published.
+};
+
+class SharedBufferProducer {
+public:
+  // Create a buffer with the given initial size (which doesn't include
+  // the notification ring).
+  static absl::StatusOr<std::unique_ptr<SharedBufferProducer>>
+  Create(uint32_t initial_size, bool binned_free_list = false);
+
+  ~SharedBufferProducer();
+
+  // The buffer, for PayloadBuffer::Allocate and friends.  It moves when it
+  // grows.
+  PayloadBuffer **Buffer() { return &buffer_; }
+
+  // Send the fds for the shared memory and trigger to the consumer.
+  absl::Status SendTo(UnixSocket &socket, co::Coroutine *c = nullptr);
+
+  // Tell the consumer about the message at 'message' in the buffer.  Returns
+  // the message's sequence number, or an error if the consumer is too
+  // far behind.
+  absl::StatusOr<uint64_t> Publish(BufferOffset message);
+
+  // True once the consumer has released the message with sequence 'seq'.
+  bool Consumed(uint64_t seq) const;
+
+private:
+  SharedBufferProducer() = default;
+  void Remap(PayloadBuffer **buffer, size_t new_size);
+  SharedBufferControl *Control() const {
+    return reinterpret_cast<SharedBufferControl *>(base_);
+  }
+
+  FileDescriptor shm_fd_;
+  TriggerFd trigger_;
+  char *base_ = nullptr; // Start of the mapped memory.
+  size_t mapped_size_ = 0;
+  PayloadBuffer *buffer_ = nullptr;
+};
+
+class SharedBufferConsumer {
+public:
+  // Receive the fds sent by SharedBufferProducer::SendTo and map the
+  // shared memory.
+  static absl::StatusOr<std::unique_ptr<SharedBufferConsumer>>
+  Receive(UnixSocket &socket, co::Coroutine *c = nullptr);
+
+  ~SharedBufferConsumer();
+
+  // Wait for the next message.  The message can be read in place in
+  // Buffer() until Release is called.  Calling Next again before Release
+  // returns the same message.
+  absl::StatusOr<SharedBufferMessage> Next(co::Coroutine *c = nullptr);
+
+  // Get the next message if there is one, without waiting.
+  absl::StatusOr<SharedBufferMessage> TryNext();
+
+  // Finished with the message returned by Next.
+  void Release();
+
+  // The buffer, which is read only.  It moves if the producer has made it
+  // bigger.
+  const PayloadBuffer *Buffer() const { return buffer_; }
+
+  // The fd to poll for messages.
+  const FileDescriptor &GetPollFd() { return trigger_.GetPollFd(); }
+
+private:
+  SharedBufferConsumer() = default;
+  absl::Status Map(size_t size);
+  SharedBufferControl *Control() const { return control_; }
+
+  FileDescriptor shm_fd_;
+  TriggerFd trigger_;
+  SharedBufferControl *control_ = nullptr; // Writable mapping of the control.
+  const char *base_ = nullptr;             // Read only mapping of it all.
+  size_t mapped_size_ = 0;
+  const PayloadBuffer *buffer_ = nullptr;
+};
+
+} // namespace toolbelt
+
+#endif // __TOOLBELT_SHARED_BUFFER_H
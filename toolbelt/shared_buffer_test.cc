@@ -0,0 +1,138 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/shared_buffer.h"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <thread>
+
+using PayloadBuffer = toolbelt::PayloadBuffer;
+using BufferOffset = toolbelt::BufferOffset;
+
+namespace {
+std::pair<toolbelt::UnixSocket, toolbelt::UnixSocket> SocketPair() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    abort();
+  }
+  return {toolbelt::UnixSocket(fds[0], true),
+          toolbelt::UnixSocket(fds[1], true)};
+}
+
+// A message is just the offset of a string.
+BufferOffset NewMessage(PayloadBuffer **pb, const std::string &s) {
+  void *msg = PayloadBuffer::Allocate(pb, sizeof(BufferOffset), 4);
+  BufferOffset offset = (*pb)->ToOffset(msg);
+  PayloadBuffer::SetString(pb, s, offset);
+  return offset;
+}
+
+struct Channel {
+  std::unique_ptr<toolbelt::SharedBufferProducer> producer;
+  std::unique_ptr<toolbelt::SharedBufferConsumer> consumer;
+};
+
+void OpenChannel(Channel &channel, uint32_t size) {
+  auto [a, b] = SocketPair();
+  auto producer = toolbelt::SharedBufferProducer::Create(size);
+  ASSERT_TRUE(producer.ok()) << producer.status();
+  ASSERT_TRUE((*producer)->SendTo(a).ok());
+  auto consumer = toolbelt::SharedBufferConsumer::Receive(b);
+  ASSERT_TRUE(consumer.ok()) << consumer.status();
+  channel.producer = std::move(*producer);
+  channel.consumer = std::move(*consumer);
+}
+} // namespace
+
+TEST(SharedBufferTest, PublishAndGrow) {
+  Channel channel;
+  ASSERT_NO_FATAL_FAILURE(OpenChannel(channel, 4096));
+  auto &producer = channel.producer;
+  auto &consumer = channel.consumer;
+
+  absl::StatusOr<toolbelt::SharedBufferMessage> none = consumer->TryNext();
+  ASSERT_TRUE(absl::IsUnavailable(none.status()));
+
+  // Each message is bigger than the last so the buffer has to grow.
+  for (int i = 0; i < 10; i++) {
+    std::string s(1000 * (i + 1), 'a' + i);
+    BufferOffset offset = NewMessage(producer->Buffer(), s);
+    absl::StatusOr<uint64_t> seq = producer->Publish(offset);
+    ASSERT_TRUE(seq.ok()) << seq.status();
+    ASSERT_EQ(i, *seq);
+    ASSERT_FALSE(producer->Consumed(*seq));
+
+    absl::StatusOr<toolbelt::SharedBufferMessage> msg = consumer->Next();
+    ASSERT_TRUE(msg.ok()) << msg.status();
+    ASSERT_EQ(*seq, msg->sequence);
+    ASSERT_EQ(offset, msg->message);
+    ASSERT_EQ(s, consumer->Buffer()->GetString(msg->message));
+    consumer->Release();
+    ASSERT_TRUE(producer->Consumed(*seq));
+  }
+  ASSERT_GT((*producer->Buffer())->Size(), 4096 * 10);
+  none = consumer->TryNext();
+  ASSERT_TRUE(absl::IsUnavailable(none.status()));
+}
+
+TEST(SharedBufferTest, Backlog) {
+  Channel channel;
+  ASSERT_NO_FATAL_FAILURE(OpenChannel(channel, 4096));
+  auto &producer = channel.producer;
+  auto &consumer = channel.consumer;
+
+  std::vector<BufferOffset> offsets;
+  int num_published = 0;
+  for (;;) {
+    BufferOffset offset =
+        NewMessage(producer->Buffer(), std::to_string(num_published));
+    absl::StatusOr<uint64_t> seq = producer->Publish(offset);
+    if (!seq.ok()) {
+      // The ring is full.
+      ASSERT_TRUE(absl::IsResourceExhausted(seq.status()));
+      break;
+    }
+    offsets.push_back(offset);
+    num_published++;
+  }
+  ASSERT_GT(num_published, 0);
+  for (int i = 0; i < num_published; i++) {
+    absl::StatusOr<toolbelt::SharedBufferMessage> msg = consumer->TryNext();
+    ASSERT_TRUE(msg.ok()) << msg.status();
+    ASSERT_EQ(i, msg->sequence);
+    ASSERT_EQ(std::to_string(i), consumer->Buffer()->GetString(msg->message));
+    consumer->Release();
+  }
+  ASSERT_TRUE(producer->Consumed(num_published - 1));
+}
+
+TEST(SharedBufferTest, Wait) {
+  Channel channel;
+  ASSERT_NO_FATAL_FAILURE(OpenChannel(channel, 4096));
+  constexpr int kNumMessages = 100;
+
+  std::thread consumer([&channel]() {
+    for (int i = 0; i < kNumMessages; i++) {
+      absl::StatusOr<toolbelt::SharedBufferMessage> msg =
+          channel.consumer->Next();
+      ASSERT_TRUE(msg.ok()) << msg.status();
+      ASSERT_EQ(i, msg->sequence);
+      ASSERT_EQ(std::string(i, 'x'),
+                channel.consumer->Buffer()->GetString(msg->message));
+      channel.consumer->Release();
+    }
+  });
+  for (int i = 0; i < kNumMessages; i++) {
+    BufferOffset offset =
+        NewMessage(channel.producer->Buffer(), std::string(i, 'x'));
+    absl::StatusOr<uint64_t> seq = channel.producer->Publish(offset);
+    ASSERT_TRUE(seq.ok()) << seq.status();
+    // The buffer might move when the next message is made, so wait for the
+    // consumer to finish with this one.
+    while (!channel.producer->Consumed(*seq)) {
+      std::this_thread::yield();
+    }
+  }
+  consumer.join();
+}
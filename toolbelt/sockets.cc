@@ -5,13 +5,23 @@
 #include "sockets.h"
 
 #include <arpa/inet.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <fcntl.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#else
+#include <sys/uio.h>
+#endif
+
 #include <algorithm>
 #include <iostream>
 #include <string>
@@ -115,6 +125,35 @@ static ssize_t ReceiveFully(co::Coroutine *c, int fd, size_t length,
   return length;
 }
 
+// Receive whatever is available, up to 'buflen' bytes, waiting for at least
+// one byte.  If the socket is nonblocking we try the receive before waiting
+// as there is likely to be data already there.
+static ssize_t ReceiveSome(co::Coroutine *c, int fd, char *buffer,
+                           size_t buflen, bool blocking) {
+  for (;;) {
+    if (c != nullptr && blocking) {
+      c->Wait(fd, POLLIN);
+    }
+    ssize_t n = ::recv(fd, buffer, buflen, 0);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (c == nullptr) {
+          return -1; // Prevent infinite loop for non-coroutine.
+        }
+        if (!blocking) {
+          c->Wait(fd, POLLIN);
+        }
+        continue;
+      }
+      return -1;
+    }
+    return n;
+  }
+}
+
 static ssize_t SendFully(co::Coroutine *c, int fd, const char *buffer,
                          size_t length, bool blocking) {
   size_t remaining = length;
@@ -157,6 +196,57 @@ static ssize_t SendFully(co::Coroutine *c, int fd, const char *buffer,
   return length;
 }
 
+// Send all the data in 'iov', which is modified as it is sent.  Partial
+// sends and EAGAIN are handled the same way as SendFully.
+static ssize_t SendFullyV(co::Coroutine *c, int fd, iovec *iov, int iovcnt,
+                          bool blocking) {
+  size_t length = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+  size_t remaining = length;
+  while (remaining > 0) {
+    if (c != nullptr && blocking) {
+      c->Wait(fd, POLLOUT);
+    }
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = std::min(iovcnt, IOV_MAX);
+    ssize_t n = ::sendmsg(fd, &msg, 0);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (c == nullptr) {
+          return -1; // Prevent infinite loop for non-coroutine.
+        }
+        if (!blocking) {
+          c->Wait(fd, POLLOUT);
+        }
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      // EOF on write.
+      return -1;
+    }
+    remaining -= n;
+    // Skip over what has been sent.
+    while (iovcnt > 0 && size_t(n) >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (n > 0) {
+      iov->iov_base = reinterpret_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return length;
+}
+
 absl::StatusOr<ssize_t> Socket::Receive(char *buffer, size_t buflen,
                                         co::Coroutine *c) {
   if (!Connected()) {
@@ -190,6 +280,19 @@ absl::StatusOr<ssize_t> Socket::ReceiveMessage(char *buffer, size_t buflen,
   if (!Connected()) {
     return absl::InternalError("Socket is not connected");
   }
+  if (receive_buffer_ != nullptr) {
+    absl::StatusOr<absl::Span<const char>> msg = ReceiveBufferedMessage(c);
+    if (!msg.ok()) {
+      return msg.status();
+    }
+    if (msg->size() > buflen) {
+      return absl::InternalError(
+          absl::StrFormat("Message of length %d is too big for buffer of %d",
+                          msg->size(), buflen));
+    }
+    memcpy(buffer, msg->data(), msg->size());
+    return msg->size();
+  }
   // Although the send is done using a single send to the socket by
   // prefixing it with the length, we can't use that trick for receiving.
   // We cannot avoid doing 2 receives:
@@ -223,6 +326,13 @@ Socket::ReceiveVariableLengthMessage(co::Coroutine *c) {
   if (!Connected()) {
     return absl::InternalError("Socket is not connected");
   }
+  if (receive_buffer_ != nullptr) {
+    absl::StatusOr<absl::Span<const char>> msg = ReceiveBufferedMessage(c);
+    if (!msg.ok()) {
+      return msg.status();
+    }
+    return std::vector<char>(msg->begin(), msg->end());
+  }
   // Although the send is done using a single send to the socket by
   // prefixing it with the length, we can't use that trick for receiving.
   // We cannot avoid doing 2 receives:
@@ -272,6 +382,492 @@ absl::StatusOr<ssize_t> Socket::SendMessage(char *buffer, size_t length,
   return n;
 }
 
+absl::Status Socket::ReceiveExactly(char *buffer, size_t length,
+                                    co::Coroutine *c) {
+  size_t offset = 0;
+  if (receive_buffer_ != nullptr) {
+    ReceiveBuffer &buf = *receive_buffer_;
+    offset = std::min(length, buf.end - buf.start);
+    memcpy(buffer, buf.data.data() + buf.start, offset);
+    buf.start += offset;
+  }
+  if (offset == length) {
+    return absl::OkStatus();
+  }
+  ssize_t n = ReceiveFully(c, fd_.Fd(), length - offset, buffer + offset,
+                           length - offset);
+  if (n == 0) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to read socket %d: socket closed", fd_.Fd()));
+  }
+  if (n == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Failed to read data from socket %d: %s", fd_.Fd(), strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<ssize_t> Socket::SendPayloadBuffer(const PayloadBuffer *buffer,
+                                                  co::Coroutine *c) {
+  iovec iov = {const_cast<PayloadBuffer *>(buffer), buffer->WireSize()};
+  return SendMessageV(absl::MakeConstSpan(&iov, 1), c);
+}
+
+absl::Status Socket::ReceivePayloadBuffer(PayloadBuffer **buffer,
+                                          co::Coroutine *c,
+                                          const PayloadReceiveOptions &options) {
+  if (!Connected()) {
+    return absl::InternalError("Socket is not connected");
+  }
+  char lenbuf[4];
+  if (absl::Status s = ReceiveExactly(lenbuf, sizeof(lenbuf), c); !s.ok()) {
+    return s;
+  }
+  uint32_t length;
+  memcpy(&length, lenbuf, sizeof(length));
+  length = ntohl(length);
+
+  // Check the length before allocating anything.
+  if (length < sizeof(PayloadBuffer)) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Length %d is too short for a PayloadBuffer", length));
+  }
+  if (length > options.max_length) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("PayloadBuffer of length %d is longer than the "
+                        "maximum of %d",
+                        length, options.max_length));
+  }
+  if ((*buffer)->full_size < length) {
+    Resizer *resizer = (*buffer)->GetResizer();
+    size_t old_size = (*buffer)->full_size;
+    size_t new_size =
+        resizer == nullptr ? 0 : (*buffer)->NextBufferSize(length - old_size);
+    if (new_size == 0) {
+      return absl::ResourceExhaustedError(absl::StrFormat(
+          "PayloadBuffer of length %d is too big for buffer of %d", length,
+          old_size));
+    }
+    (*resizer)(buffer, old_size, new_size);
+    (*buffer)->full_size = new_size;
+  }
+
+  PayloadBuffer::ReceiveState state = (*buffer)->BeginReceive();
+  char *dest = reinterpret_cast<char *>(*buffer);
+  size_t chunk_size = options.chunk_size == 0 ? length : options.chunk_size;
+  for (size_t received = 0; received < length;) {
+    size_t chunk = std::min(chunk_size, length - received);
+    if (absl::Status s = ReceiveExactly(dest + received, chunk, c); !s.ok()) {
+      (*buffer)->AbortReceive(state);
+      return s;
+    }
+    received += chunk;
+    if (options.progress) {
+      options.progress(received, length);
+    }
+  }
+  if (!(*buffer)->EndReceive(length, state)) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Received %d bytes that are not a PayloadBuffer",
+                        length));
+  }
+  return absl::OkStatus();
+}
+
+void Socket::SetReceiveBuffer(size_t size, size_t max_message_size) {
+  if (receive_buffer_ == nullptr) {
+    receive_buffer_ = std::make_shared<ReceiveBuffer>();
+  }
+  receive_buffer_->max_message_size = max_message_size;
+  // Any data already received is kept.
+  receive_buffer_->data.resize(std::max(size, receive_buffer_->end));
+}
+
+absl::StatusOr<absl::Span<const char>>
+Socket::ReceiveBufferedMessage(co::Coroutine *c) {
+  if (!Connected()) {
+    return absl::InternalError("Socket is not connected");
+  }
+  if (receive_buffer_ == nullptr) {
+    SetReceiveBuffer();
+  }
+  ReceiveBuffer &buf = *receive_buffer_;
+  for (;;) {
+    size_t available = buf.end - buf.start;
+    size_t needed = sizeof(int32_t);
+    if (available >= sizeof(int32_t)) {
+      uint32_t length;
+      memcpy(&length, buf.data.data() + buf.start, sizeof(length));
+      length = ntohl(length);
+      if (length > buf.max_message_size) {
+        return absl::InvalidArgumentError(
+            absl::StrFormat("Message of length %d on socket %d is longer than "
+                            "the maximum of %d",
+                            length, fd_.Fd(), buf.max_message_size));
+      }
+      needed += length;
+      if (available >= needed) {
+        // A whole message is in the buffer.
+        absl::Span<const char> msg(
+            buf.data.data() + buf.start + sizeof(int32_t),
+            needed - sizeof(int32_t));
+        buf.start += needed;
+        return msg;
+      }
+    }
+    // Need to receive more.  Make room for the rest of the message at
+    // the end of the buffer.  The previously returned message is no longer
+    // needed so we can move the partial message down to the start.
+    if (available == 0) {
+      buf.start = buf.end = 0;
+    } else if (buf.start + needed > buf.data.size()) {
+      memmove(buf.data.data(), buf.data.data() + buf.start, available);
+      buf.start = 0;
+      buf.end = available;
+    }
+    if (needed > buf.data.size()) {
+      buf.data.resize(needed);
+    }
+    ssize_t n = ReceiveSome(c, fd_.Fd(), buf.data.data() + buf.end,
+                            buf.data.size() - buf.end, IsBlocking());
+    if (n == 0) {
+      return absl::InternalError(
+          absl::StrFormat("Failed to read socket %d: socket closed", fd_.Fd()));
+    }
+    if (n == -1) {
+      return absl::InternalError(absl::StrFormat(
+          "Failed to read data from socket %d: %s", fd_.Fd(), strerror(errno)));
+    }
+    buf.end += n;
+  }
+}
+
+absl::StatusOr<ssize_t> Socket::SendMessageV(absl::Span<const iovec> iov,
+                                             co::Coroutine *c) {
+  if (!Connected()) {
+    return absl::InternalError("Socket is not connected");
+  }
+  std::vector<iovec> vec;
+  vec.reserve(iov.size() + 1);
+  size_t length = 0;
+  for (const iovec &v : iov) {
+    length += v.iov_len;
+  }
+  int32_t lenbuf = htonl(length);
+  vec.push_back({&lenbuf, sizeof(lenbuf)});
+  vec.insert(vec.end(), iov.begin(), iov.end());
+
+  ssize_t n = SendFullyV(c, fd_.Fd(), vec.data(), vec.size(), IsBlocking());
+  if (n == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to write to socket: %s", strerror(errno)));
+  }
+  return n;
+}
+
+absl::StatusOr<ssize_t>
+Socket::SendMessages(absl::Span<const absl::Span<const char>> messages,
+                     co::Coroutine *c) {
+  if (!Connected()) {
+    return absl::InternalError("Socket is not connected");
+  }
+  // Each message is its length followed by its data.
+  std::vector<int32_t> lengths(messages.size());
+  std::vector<iovec> vec;
+  vec.reserve(messages.size() * 2);
+  for (size_t i = 0; i < messages.size(); i++) {
+    lengths[i] = htonl(messages[i].size());
+    vec.push_back({&lengths[i], sizeof(int32_t)});
+    if (!messages[i].empty()) {
+      vec.push_back(
+          {const_cast<char *>(messages[i].data()), messages[i].size()});
+    }
+  }
+  ssize_t n = SendFullyV(c, fd_.Fd(), vec.data(), vec.size(), IsBlocking());
+  if (n == -1) {
+    return absl::InternalError(
+        absl::StrFormat("Failed to write to socket: %s", strerror(errno)));
+  }
+  return n;
+}
+
+// Wait for the socket to be writable after an EAGAIN.  Returns false if there
+// is no coroutine to wait in.
+static bool WaitForWrite(co::Coroutine *c, int fd) {
+  if (c == nullptr) {
+    return false; // Prevent infinite loop for non-coroutine.
+  }
+  c->Wait(fd, POLLOUT);
+  return true;
+}
+
+absl::StatusOr<ssize_t> Socket::SendFile(const FileDescriptor &file,
+                                         off_t offset, size_t length,
+                                         co::Coroutine *c) {
+  if (!Connected()) {
+    return absl::InternalError("Socket is not connected");
+  }
+  size_t remaining = length;
+  while (remaining > 0) {
+    if (c != nullptr && IsBlocking()) {
+      c->Wait(fd_.Fd(), POLLOUT);
+    }
+#if defined(__linux__)
+    ssize_t n = ::sendfile(fd_.Fd(), file.Fd(), &offset, remaining);
+#else
+    // The BSD sendfile says how much was sent even if it fails with EAGAIN.
+    off_t len = remaining;
+    ssize_t n = ::sendfile(file.Fd(), fd_.Fd(), offset, &len, nullptr, 0);
+    if (n == 0 || (errno == EAGAIN && len > 0)) {
+      n = len;
+      offset += len;
+    }
+#endif
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          WaitForWrite(c, fd_.Fd())) {
+        continue;
+      }
+      return absl::InternalError(absl::StrFormat(
+          "Failed to send file to socket: %s", strerror(errno)));
+    }
+    if (n == 0) {
+      // End of file.
+      break;
+    }
+    remaining -= n;
+  }
+  return length - remaining;
+}
+
+absl::StatusOr<ssize_t> Socket::Splice(const FileDescriptor &fd, size_t length,
+                                       Pipe &pipe, co::Coroutine *c) {
+  if (!Connected()) {
+    return absl::InternalError("Socket is not connected");
+  }
+#if defined(__linux__)
+  size_t remaining = length;
+  while (remaining > 0) {
+    // Into the pipe from the source.
+    if (c != nullptr) {
+      c->Wait(fd.Fd(), POLLIN);
+    }
+    ssize_t n = ::splice(fd.Fd(), nullptr, pipe.WriteFd().Fd(), nullptr,
+                         remaining, SPLICE_F_MOVE);
+    if (n == -1) {
+      if (errno == EINTR || (c != nullptr && errno == EAGAIN)) {
+        continue;
+      }
+      return absl::InternalError(
+          absl::StrFormat("Failed to splice into pipe: %s", strerror(errno)));
+    }
+    if (n == 0) {
+      break;
+    }
+    // Out of the pipe to the socket.
+    ssize_t in_pipe = n;
+    while (in_pipe > 0) {
+      if (c != nullptr && IsBlocking()) {
+        c->Wait(fd_.Fd(), POLLOUT);
+      }
+      ssize_t m = ::splice(pipe.ReadFd().Fd(), nullptr, fd_.Fd(), nullptr,
+                           in_pipe, SPLICE_F_MOVE);
+      if (m == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+            WaitForWrite(c, fd_.Fd())) {
+          continue;
+        }
+        return absl::InternalError(absl::StrFormat(
+            "Failed to splice into socket: %s", strerror(errno)));
+      }
+      in_pipe -= m;
+    }
+    remaining -= n;
+  }
+  return length - remaining;
+#else
+  return absl::UnimplementedError("Splice is only available on Linux");
+#endif
+}
+
+absl::Status Socket::SetZeroCopy() {
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+  int one = 1;
+  if (setsockopt(fd_.Fd(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to set SO_ZEROCOPY on socket: %s", strerror(errno)));
+  }
+  zero_copy_ = std::make_shared<ZeroCopyState>();
+  return absl::OkStatus();
+#else
+  return absl::UnimplementedError("Zero copy send is not available");
+#endif
+}
+
+absl::StatusOr<uint32_t> Socket::SendZeroCopy(const char *buffer,
+                                              size_t length,
+                                              co::Coroutine *c) {
+  if (!Connected()) {
+    return absl::InternalError("Socket is not connected");
+  }
+  if (zero_copy_ == nullptr) {
+    return absl::InternalError("Zero copy is not enabled on socket");
+  }
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+  // Each successful send gets the next id.  The whole buffer is complete
+  // when the last one is.
+  uint32_t id = zero_copy_->next;
+  size_t offset = 0;
+  while (offset < length) {
+    if (c != nullptr && IsBlocking()) {
+      c->Wait(fd_.Fd(), POLLOUT);
+    }
+    ssize_t n = ::send(fd_.Fd(), buffer + offset, length - offset,
+                       MSG_ZEROCOPY);
+    if (n == -1) {
+      // Draining the completions below changes errno.
+      int e = errno;
+      if (e == EINTR) {
+        continue;
+      }
+      if (e == EAGAIN || e == EWOULDBLOCK || e == ENOBUFS) {
+        // ENOBUFS means too much memory is pinned for unfinished sends.
+        if (e == ENOBUFS) {
+          (void)ProcessZeroCopyCompletions();
+        }
+        if (WaitForWrite(c, fd_.Fd())) {
+          continue;
+        }
+      }
+      return absl::InternalError(absl::StrFormat(
+          "Failed to send zero copy to socket: %s", strerror(e)));
+    }
+    id = zero_copy_->next++;
+    offset += n;
+  }
+  return id;
+#else
+  return absl::UnimplementedError("Zero copy send is not available");
+#endif
+}
+
+absl::Status Socket::ProcessZeroCopyCompletions() {
+  if (zero_copy_ == nullptr) {
+    return absl::InternalError("Zero copy is not enabled on socket");
+  }
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+  for (;;) {
+    char control[128];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = ::recvmsg(fd_.Fd(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return absl::OkStatus();
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return absl::InternalError(absl::StrFormat(
+          "Failed to read zero copy completions: %s", strerror(errno)));
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      const struct sock_extended_err *err =
+          reinterpret_cast<const struct sock_extended_err *>(CMSG_DATA(cm));
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // Sends ee_info to ee_data (inclusive) are complete.
+      uint32_t end = err->ee_data + 1;
+      if (int32_t(end - zero_copy_->completed) > 0) {
+        zero_copy_->completed = end;
+      }
+    }
+  }
+#else
+  return absl::UnimplementedError("Zero copy send is not available");
+#endif
+}
+
+// Connect 'fd' to 'addr'.  If there's a coroutine or a timeout the connect
+// is done without blocking: the coroutine (or poll) waits for the
+// connection to complete.  Otherwise a nonblocking socket returns at once,
+// with EINPROGRESS in the error if the connection is still being made,
+// so that an event loop can wait for it.  'what' describes the address
+// for errors.
+static absl::Status ConnectFd(FileDescriptor &fd, bool is_nonblocking,
+                              const struct sockaddr *addr, socklen_t addrlen,
+                              const std::string &what, co::Coroutine *c,
+                              uint64_t timeout_ns) {
+  bool wait = c != nullptr || timeout_ns != 0;
+  int flags = 0;
+  if (wait && !is_nonblocking) {
+    // Nonblocking just for the connect.
+    flags = fcntl(fd.Fd(), F_GETFL, 0);
+    if (flags == -1 || fcntl(fd.Fd(), F_SETFL, flags | O_NONBLOCK) == -1) {
+      return absl::InternalError(absl::StrFormat(
+          "Failed to set nonblocking mode for connect: %s", strerror(errno)));
+    }
+  }
+  auto restore = [&]() {
+    if (wait && !is_nonblocking) {
+      (void)fcntl(fd.Fd(), F_SETFL, flags);
+    }
+  };
+
+  int e = ::connect(fd.Fd(), addr, addrlen);
+  if (e == 0) {
+    restore();
+    return absl::OkStatus();
+  }
+  if (!wait || errno != EINPROGRESS) {
+    restore();
+    return absl::InternalError(absl::StrFormat(
+        "Failed to connect socket to %s: %s", what, strerror(errno)));
+  }
+
+  // Wait for the socket to become writable.
+  bool timed_out;
+  if (c != nullptr) {
+    timed_out = c->Wait(fd.Fd(), POLLOUT, timeout_ns) == -1;
+  } else {
+    struct pollfd p = {.fd = fd.Fd(), .events = POLLOUT};
+    int timeout_ms =
+        timeout_ns == 0 ? -1 : int((timeout_ns + 999999) / 1000000);
+    int n;
+    while ((n = ::poll(&p, 1, timeout_ms)) == -1 && errno == EINTR) {
+    }
+    timed_out = n == 0;
+  }
+  restore();
+  if (timed_out) {
+    return absl::DeadlineExceededError(
+        absl::StrFormat("Timed out connecting socket to %s", what));
+  }
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd.Fd(), SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+    err = errno;
+  }
+  if (err != 0) {
+    return absl::InternalError(absl::StrFormat(
+        "Failed to connect socket to %s: %s", what, strerror(err)));
+  }
+  return absl::OkStatus();
+}
+
 // Unix Domain socket.
 UnixSocket::UnixSocket() : Socket(socket(AF_UNIX, SOCK_STREAM, 0)) {}
 
@@ -326,17 +922,18 @@ absl::StatusOr<UnixSocket> UnixSocket::Accept(co::Coroutine *c) {
   return UnixSocket(new_fd, /*connected=*/true);
 }
 
-absl::Status UnixSocket::Connect(const std::string &pathname) {
+absl::Status UnixSocket::Connect(const std::string &pathname,
+                                 co::Coroutine *c, uint64_t timeout_ns) {
   if (!fd_.Valid()) {
     return absl::InternalError("UnixSocket is not valid");
   }
   struct sockaddr_un addr = BuildUnixSocketName(pathname);
 
-  int e = ::connect(fd_.Fd(), reinterpret_cast<const sockaddr *>(&addr),
-                    sizeof(addr));
-  if (e == -1) {
-    return absl::InternalError(absl::StrFormat(
-        "Failed to connect unix socket to %s: %s", pathname, strerror(errno)));
+  if (absl::Status status = ConnectFd(
+          fd_, is_nonblocking_, reinterpret_cast<const sockaddr *>(&addr),
+          sizeof(addr), "unix socket " + pathname, c, timeout_ns);
+      !status.ok()) {
+    return status;
   }
   connected_ = true;
   return absl::OkStatus();
@@ -456,20 +1053,20 @@ absl::Status UnixSocket::ReceiveFds(std::vector<FileDescriptor> &fds,
 }
 
 // Network socket.
-absl::Status NetworkSocket::Connect(const InetAddress &addr) {
+absl::Status NetworkSocket::Connect(const InetAddress &addr,
+                                    co::Coroutine *c, uint64_t timeout_ns) {
   if (!fd_.Valid()) {
     return absl::InternalError("Socket is not valid");
   }
   if (!addr.Valid()) {
     return absl::InternalError("Bad InetAddress");
   }
-  int e = ::connect(fd_.Fd(),
+  if (absl::Status status =
+          ConnectFd(fd_, is_nonblocking_,
                     reinterpret_cast<const sockaddr *>(&addr.GetAddress()),
-                    addr.GetLength());
-  if (e == -1) {
-    return absl::InternalError(
-        absl::StrFormat("Failed to connect socket to %s: %s",
-                        addr.ToString().c_str(), strerror(errno)));
+                    addr.GetLength(), addr.ToString(), c, timeout_ns);
+      !status.ok()) {
+    return status;
   }
   connected_ = true;
   return absl::OkStatus();
@@ -528,6 +1125,66 @@ absl::Status TCPSocket::Bind(const InetAddress &addr, bool listen) {
   return absl::OkStatus();
 }
 
+absl::Status TCPSocket::SetNoDelay(bool enable) {
+  int val = enable ? 1 : 0;
+  if (setsockopt(fd_.Fd(), IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) != 0) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to set TCP_NODELAY on socket: %s", strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TCPSocket::SetKeepAlive(int idle_secs, int interval_secs,
+                                     int count) {
+  int val = 1;
+  if (setsockopt(fd_.Fd(), SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) != 0) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to set SO_KEEPALIVE on socket: %s", strerror(errno)));
+  }
+#if defined(__linux__)
+  constexpr int kIdleOption = TCP_KEEPIDLE;
+#else
+  constexpr int kIdleOption = TCP_KEEPALIVE;
+#endif
+  if (setsockopt(fd_.Fd(), IPPROTO_TCP, kIdleOption, &idle_secs,
+                 sizeof(idle_secs)) != 0 ||
+      setsockopt(fd_.Fd(), IPPROTO_TCP, TCP_KEEPINTVL, &interval_secs,
+                 sizeof(interval_secs)) != 0 ||
+      setsockopt(fd_.Fd(), IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) !=
+          0) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to set keepalive parameters on socket: %s", strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TCPSocket::SetFastOpen(int queue_length) {
+#if defined(TCP_FASTOPEN)
+  if (setsockopt(fd_.Fd(), IPPROTO_TCP, TCP_FASTOPEN, &queue_length,
+                 sizeof(queue_length)) != 0) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to set TCP_FASTOPEN on socket: %s", strerror(errno)));
+  }
+  return absl::OkStatus();
+#else
+  return absl::UnimplementedError("TCP_FASTOPEN is not supported");
+#endif
+}
+
+absl::Status TCPSocket::SetFastOpenConnect() {
+#if defined(TCP_FASTOPEN_CONNECT)
+  int val = 1;
+  if (setsockopt(fd_.Fd(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &val,
+                 sizeof(val)) != 0) {
+    return absl::InternalError(absl::StrFormat(
+        "Unable to set TCP_FASTOPEN_CONNECT on socket: %s", strerror(errno)));
+  }
+  return absl::OkStatus();
+#else
+  return absl::UnimplementedError("TCP_FASTOPEN_CONNECT is not supported");
+#endif
+}
+
 absl::StatusOr<TCPSocket> TCPSocket::Accept(co::Coroutine *c) {
   if (!fd_.Valid()) {
     return absl::InternalError("Socket is not valid");
@@ -553,6 +1210,84 @@ absl::StatusOr<TCPSocket> TCPSocket::Accept(co::Coroutine *c) {
   return new_socket;
 }
 
+absl::Status TCPSocket::AcceptMany(std::vector<TCPSocket> &sockets,
+                                   size_t max, bool nonblocking,
+                                   co::Coroutine *c) {
+  if (!fd_.Valid()) {
+    return absl::InternalError("Socket is not valid");
+  }
+  if (c != nullptr) {
+    c->Wait(fd_.Fd(), POLLIN);
+  }
+  // If the listener is bound to a particular address that's the local
+  // address of every connection, otherwise we need to ask.
+  bool bound_to_any =
+      bound_address_.GetAddress().sin_addr.s_addr == htonl(INADDR_ANY);
+  // Only connections accepted count against 'max', not retries.
+  size_t accepted = 0;
+  while (accepted < max) {
+    if (accepted > 0 && !is_nonblocking_) {
+      // Don't block for the ones after the first.
+      struct pollfd p = {.fd = fd_.Fd(), .events = POLLIN};
+      if (::poll(&p, 1, 0) != 1) {
+        break;
+      }
+    }
+    struct sockaddr_in sender;
+    socklen_t sock_len = sizeof(sender);
+#if defined(__linux__)
+    int new_fd = ::accept4(
+        fd_.Fd(), reinterpret_cast<struct sockaddr *>(&sender), &sock_len,
+        SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+#else
+    int new_fd = ::accept(
+        fd_.Fd(), reinterpret_cast<struct sockaddr *>(&sender), &sock_len);
+#endif
+    if (new_fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK || accepted > 0) {
+        // Nothing more pending, or report it next time.
+        break;
+      }
+      return absl::InternalError(
+          absl::StrFormat("Failed to accept connection: %s", strerror(errno)));
+    }
+    TCPSocket new_socket(new_fd, /*connected=*/true);
+#if defined(__linux__)
+    new_socket.fd_.SetKnownFlags(nonblocking, /*close_on_exec=*/true);
+#else
+    (void)new_socket.fd_.SetCloseOnExec();
+    if (nonblocking) {
+      (void)new_socket.fd_.SetNonBlocking();
+    }
+#endif
+    new_socket.is_nonblocking_ = nonblocking;
+    if (bound_to_any) {
+      struct sockaddr_in bound;
+      socklen_t len = sizeof(bound);
+      if (getsockname(new_fd, reinterpret_cast<struct sockaddr *>(&bound),
+                      &len) == 0) {
+        new_socket.bound_address_.SetAddress(bound);
+      }
+    } else {
+      new_socket.bound_address_ = bound_address_;
+    }
+    sockets.push_back(std::move(new_socket));
+    accepted++;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TCPSocket::Listen(int backlog) {
+  if (::listen(fd_.Fd(), backlog) == -1) {
+    return absl::InternalError(absl::StrFormat(
+        "Failed to listen on TCP socket: %s", strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
 // UDP socket
 UDPSocket::UDPSocket() : NetworkSocket(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) {}
 
@@ -691,4 +1426,125 @@ absl::StatusOr<ssize_t> UDPSocket::ReceiveFrom(InetAddress &sender,
   sender = {sender_addr};
   return n;
 }
+
+DatagramBatch::DatagramBatch(size_t max_datagrams, size_t max_datagram_size)
+    : max_datagram_size_(max_datagram_size),
+      buffer_(max_datagrams * max_datagram_size), lengths_(max_datagrams),
+      addrs_(max_datagrams), iovecs_(max_datagrams) {
+#if defined(__linux__)
+  msgs_.resize(max_datagrams);
+#endif
+}
+
+bool DatagramBatch::Add(const InetAddress &addr, const void *data,
+                        size_t length) {
+  if (size_ == Capacity() || length > max_datagram_size_) {
+    return false;
+  }
+  memcpy(buffer_.data() + size_ * max_datagram_size_, data, length);
+  lengths_[size_] = length;
+  addrs_[size_] = addr.GetAddress();
+  size_++;
+  return true;
+}
+
+void DatagramBatch::PrepareHeaders(size_t n, size_t length) {
+  for (size_t i = 0; i < n; i++) {
+    iovecs_[i] = {buffer_.data() + i * max_datagram_size_,
+                  length == 0 ? lengths_[i] : length};
+#if defined(__linux__)
+    msgs_[i] = {};
+    msgs_[i].msg_hdr.msg_name = &addrs_[i];
+    msgs_[i].msg_hdr.msg_namelen = sizeof(addrs_[i]);
+    msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+#endif
+  }
+}
+
+absl::StatusOr<size_t> UDPSocket::ReceiveBatch(DatagramBatch &batch,
+                                               co::Coroutine *c) {
+  batch.Clear();
+  if (batch.Capacity() == 0) {
+    return 0;
+  }
+  batch.PrepareHeaders(batch.Capacity(), batch.MaxDatagramSize());
+  for (;;) {
+    if (c != nullptr) {
+      c->Wait(fd_.Fd(), POLLIN);
+    }
+#if defined(__linux__)
+    // Wait for the first datagram and take whatever else is there.
+    int n = recvmmsg(fd_.Fd(), batch.msgs_.data(), batch.Capacity(),
+                     MSG_WAITFORONE, nullptr);
+    if (n == -1) {
+      if (errno == EINTR || (c != nullptr && errno == EAGAIN)) {
+        continue;
+      }
+      return absl::InternalError(absl::StrFormat(
+          "Unable to receive UDP datagrams: %s", strerror(errno)));
+    }
+    for (int i = 0; i < n; i++) {
+      batch.lengths_[i] =
+          std::min(size_t(batch.msgs_[i].msg_len), batch.MaxDatagramSize());
+    }
+    batch.size_ = n;
+#else
+    // No recvmmsg, receive one at a time without blocking after the first.
+    size_t n = 0;
+    while (n < batch.Capacity()) {
+      socklen_t addr_length = sizeof(batch.addrs_[n]);
+      ssize_t len = recvfrom(
+          fd_.Fd(), batch.iovecs_[n].iov_base, batch.MaxDatagramSize(),
+          n == 0 ? 0 : MSG_DONTWAIT,
+          reinterpret_cast<struct sockaddr *>(&batch.addrs_[n]), &addr_length);
+      if (len == -1) {
+        if (n > 0) {
+          break;
+        }
+        if (errno == EINTR || (c != nullptr && errno == EAGAIN)) {
+          continue;
+        }
+        return absl::InternalError(absl::StrFormat(
+            "Unable to receive UDP datagrams: %s", strerror(errno)));
+      }
+      batch.lengths_[n++] = size_t(len);
+    }
+    batch.size_ = n;
+#endif
+    return batch.Size();
+  }
+}
+
+absl::Status UDPSocket::SendBatch(DatagramBatch &batch, co::Coroutine *c) {
+  batch.PrepareHeaders(batch.Size(), 0);
+  size_t sent = 0;
+  while (sent < batch.Size()) {
+    if (c != nullptr) {
+      c->Wait(fd_.Fd(), POLLOUT);
+    }
+#if defined(__linux__)
+    int n = sendmmsg(fd_.Fd(), batch.msgs_.data() + sent, batch.Size() - sent,
+                     0);
+#else
+    InetAddress addr = batch.Address(sent);
+    int n = ::sendto(fd_.Fd(), batch.iovecs_[sent].iov_base,
+                     batch.iovecs_[sent].iov_len, 0,
+                     reinterpret_cast<const sockaddr *>(&addr.GetAddress()),
+                     addr.GetLength()) == -1
+                ? -1
+                : 1;
+#endif
+    if (n == -1) {
+      if (errno == EINTR || (c != nullptr && errno == EAGAIN)) {
+        continue;
+      }
+      return absl::InternalError(
+          absl::StrFormat("Unable to send UDP datagram to %s: %s",
+                          batch.Address(sent).ToString(), strerror(errno)));
+    }
+    sent += n;
+  }
+  return absl::OkStatus();
+}
 } // namespace toolbelt
@@ -6,14 +6,20 @@
 #define __TOOLBELT_SOCKETS_H
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/types/span.h"
 #include "coroutine.h"
 #include "fd.h"
+#include "payload_buffer.h"
+#include "pipe.h"
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <netinet/in.h>
 #include <string>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <vector>
@@ -77,6 +83,21 @@ template <typename H> inline H AbslHashValue(H h, const InetAddress &a) {
       std::move(h), reinterpret_cast<const char *>(&a.addr_), sizeof(a.addr_));
 }
 
+// Options for Socket::ReceivePayloadBuffer.
+struct PayloadReceiveOptions {
+  // Longest buffer accepted.  The length is checked before the buffer is
+  // grown so a bad length can't make us allocate a huge buffer.
+  size_t max_length = 256 * 1024 * 1024;
+
+  // The buffer is received in chunks of this size, with 'progress' called
+  // after each one.  0 means all at once.
+  size_t chunk_size = 1024 * 1024;
+
+  // Called with the number of bytes received so far and the total.  A
+  // coroutine receiving a big buffer can yield here to let others run.
+  std::function<void(size_t received, size_t total)> progress;
+};
+
 // This is a general socket initialized with a file descriptor.  Subclasses
 // implement the different socket types.
 class Socket {
@@ -85,13 +106,20 @@ public:
   explicit Socket(int fd, bool connected = false)
       : fd_(fd), connected_(connected) {}
   Socket(const Socket &s) = default;
-  Socket(Socket &&s) : fd_(std::move(s.fd_)), connected_(s.connected_) {
+  Socket(Socket &&s)
+      : fd_(std::move(s.fd_)), connected_(s.connected_),
+        is_nonblocking_(s.is_nonblocking_),
+        receive_buffer_(std::move(s.receive_buffer_)),
+        zero_copy_(std::move(s.zero_copy_)) {
     s.connected_ = false;
   }
   Socket &operator=(const Socket &s) = default;
   Socket &operator=(Socket &&s) {
     fd_ = std::move(s.fd_);
     connected_ = s.connected_;
+    is_nonblocking_ = s.is_nonblocking_;
+    receive_buffer_ = std::move(s.receive_buffer_);
+    zero_copy_ = std::move(s.zero_copy_);
     s.connected_ = false;
     return *this;
   }
@@ -100,6 +128,8 @@ public:
   void Close() {
     fd_.Close();
     connected_ = false;
+    receive_buffer_.reset();
+    zero_copy_.reset();
   }
   bool Connected() const { return fd_.Valid() && connected_; }
 
@@ -125,6 +155,96 @@ public:
   absl::StatusOr<ssize_t> SendMessage(char *buffer, size_t length,
                                       co::Coroutine *c = nullptr);
 
+  // Send a length-delimited message made up of the fragments in 'iov'.
+  // The length prefix is sent from a separate buffer so there's no need
+  // for room in front of the data, and the whole message is sent with a
+  // single sendmsg if the socket will take it.  Returns the number of bytes
+  // sent, including the 4 byte length.
+  absl::StatusOr<ssize_t> SendMessageV(absl::Span<const iovec> iov,
+                                       co::Coroutine *c = nullptr);
+
+  // Send a batch of length-delimited messages with as few sendmsg calls as
+  // possible.  Returns the total number of bytes sent, including the
+  // lengths.
+  absl::StatusOr<ssize_t>
+  SendMessages(absl::Span<const absl::Span<const char>> messages,
+               co::Coroutine *c = nullptr);
+
+  // Send a PayloadBuffer as a length-delimited message.  The buffer's
+  // WireSize() bytes are sent straight from its memory.
+  absl::StatusOr<ssize_t> SendPayloadBuffer(const PayloadBuffer *buffer,
+                                            co::Coroutine *c = nullptr);
+
+  // Receive a PayloadBuffer sent by SendPayloadBuffer directly into
+  // '*buffer', with no copy through another buffer.  If '*buffer' is too
+  // small it is grown using its resizer (it must be movable then) and
+  // '*buffer' is updated.  On success '*buffer' holds the sender's
+  // message, keeping its own size and resizer.  If the length is bad, or
+  // what arrives isn't a PayloadBuffer, an error is returned and the
+  // buffer is reset.  After an error the stream is out of step and the
+  // socket should be closed.
+  absl::Status ReceivePayloadBuffer(PayloadBuffer **buffer,
+                                    co::Coroutine *c = nullptr,
+                                    const PayloadReceiveOptions &options = {});
+
+  // Buffered receive of length-delimited messages.  Rather than two
+  // receives per message, as much as is available is read into a buffer
+  // held by the socket and messages are taken from that, so a single
+  // receive can deliver several messages.  The buffer grows to hold the
+  // largest message received, up to 'max_message_size': a longer message
+  // is an error, so a bad length from the peer can't make us allocate a
+  // huge buffer.  Once enabled, ReceiveMessage and
+  // ReceiveVariableLengthMessage also read through the buffer.
+  static constexpr size_t kDefaultReceiveBufferSize = 64 * 1024;
+  static constexpr size_t kDefaultMaxMessageSize = 256 * 1024 * 1024;
+  void SetReceiveBuffer(size_t size = kDefaultReceiveBufferSize,
+                        size_t max_message_size = kDefaultMaxMessageSize);
+  bool HasReceiveBuffer() const { return receive_buffer_ != nullptr; }
+
+  // Receive the next length-delimited message through the receive buffer,
+  // which is enabled with the default size if necessary.  The span refers to
+  // the message in the buffer and is valid until the next receive on the
+  // socket.
+  absl::StatusOr<absl::Span<const char>>
+  ReceiveBufferedMessage(co::Coroutine *c = nullptr);
+
+  // Send 'length' bytes of 'file' starting at 'offset' without copying
+  // them through user space, using sendfile.
+  absl::StatusOr<ssize_t> SendFile(const FileDescriptor &file, off_t offset,
+                                   size_t length, co::Coroutine *c = nullptr);
+
+  // Send 'length' bytes read from 'fd', which can be anything that can be
+  // read (a pipe or another socket for example), by splicing it through
+  // 'pipe'.  The data doesn't pass through user space.  The pipe should be
+  // empty and is reusable afterwards.  Only available on Linux.
+  absl::StatusOr<ssize_t> Splice(const FileDescriptor &fd, size_t length,
+                                 Pipe &pipe, co::Coroutine *c = nullptr);
+
+  // Zero copy send using MSG_ZEROCOPY, for large buffers on TCP and UDP
+  // sockets on Linux.  The kernel sends directly from the caller's memory
+  // so the buffer must not be changed or freed until the send is complete.
+  // SendZeroCopy returns an id for the send and ZeroCopyComplete(id) is true
+  // when the kernel has finished with the buffer.  Completions are collected
+  // by ProcessZeroCopyCompletions, which doesn't block; the socket's fd
+  // has POLLERR set when there are completions to collect.
+  absl::Status SetZeroCopy();
+  absl::StatusOr<uint32_t> SendZeroCopy(const char *buffer, size_t length,
+                                        co::Coroutine *c = nullptr);
+  absl::Status ProcessZeroCopyCompletions();
+  bool ZeroCopyComplete(uint32_t id) const {
+    // The ids wrap around.
+    return zero_copy_ != nullptr &&
+           int32_t(zero_copy_->completed - id) > 0;
+  }
+
+  // Number of bytes received into the buffer that have not been returned
+  // in a message yet.
+  size_t BufferedBytes() const {
+    return receive_buffer_ == nullptr
+               ? 0
+               : receive_buffer_->end - receive_buffer_->start;
+  }
+
   absl::Status SetNonBlocking() {
     if (absl::Status s = fd_.SetNonBlocking(); !s.ok()) {
       return s;
@@ -141,9 +261,29 @@ public:
   bool IsBlocking() const { return !is_nonblocking_; }
 
 protected:
+  // Receive exactly 'length' bytes, taking any already in the receive
+  // buffer first.
+  absl::Status ReceiveExactly(char *buffer, size_t length, co::Coroutine *c);
+
+  struct ReceiveBuffer {
+    std::vector<char> data;
+    size_t start = 0; // First byte not yet returned.
+    size_t end = 0;   // End of data received.
+    size_t max_message_size = kDefaultMaxMessageSize;
+  };
+
+  // The kernel numbers each MSG_ZEROCOPY send on a socket starting at 0.
+  struct ZeroCopyState {
+    uint32_t next = 0;      // Id of the next send.
+    uint32_t completed = 0; // All sends before this are complete.
+  };
+
   FileDescriptor fd_;
   bool connected_ = false;
   bool is_nonblocking_ = false;
+  // Shared by copies of the socket, like the file descriptor.
+  std::shared_ptr<ReceiveBuffer> receive_buffer_;
+  std::shared_ptr<ZeroCopyState> zero_copy_;
 };
 
 // A Unix Domain socket bound to a pathname.  Depending on the OS, this
@@ -160,7 +300,14 @@ public:
   ~UnixSocket() = default;
 
   absl::Status Bind(const std::string &pathname, bool listen);
-  absl::Status Connect(const std::string &pathname);
+  // Connect to the socket bound to 'pathname'.  With a coroutine or a
+  // timeout the connect doesn't block: the coroutine waits until it
+  // completes.  A timeout of 0 means no timeout.  If the timeout expires a
+  // DeadlineExceeded error is returned.  Without either, a nonblocking
+  // socket doesn't wait: the error has EINPROGRESS while the connection
+  // is still being made, and the socket becomes writable when it's done.
+  absl::Status Connect(const std::string &pathname,
+                       co::Coroutine *c = nullptr, uint64_t timeout_ns = 0);
 
   absl::StatusOr<UnixSocket> Accept(co::Coroutine *c = nullptr);
 
@@ -184,7 +331,10 @@ public:
   ~NetworkSocket() = default;
   NetworkSocket &operator=(const NetworkSocket &s) = default;
 
-  absl::Status Connect(const InetAddress &addr);
+  // Connect to 'addr'.  The coroutine and timeout are as for
+  // UnixSocket::Connect.
+  absl::Status Connect(const InetAddress &addr, co::Coroutine *c = nullptr,
+                       uint64_t timeout_ns = 0);
 
   const InetAddress &BoundAddress() { return bound_address_; }
 
@@ -195,6 +345,55 @@ protected:
   InetAddress bound_address_;
 };
 
+// Preallocated storage for a batch of datagrams, each with an address,
+// for UDPSocket::ReceiveBatch and UDPSocket::SendBatch.  Reuse the batch for
+// each call to avoid allocation.
+class DatagramBatch {
+public:
+  DatagramBatch(size_t max_datagrams, size_t max_datagram_size);
+  DatagramBatch(const DatagramBatch &) = delete;
+  DatagramBatch(DatagramBatch &&) = default;
+  DatagramBatch &operator=(const DatagramBatch &) = delete;
+  DatagramBatch &operator=(DatagramBatch &&) = default;
+
+  size_t Capacity() const { return lengths_.size(); }
+  size_t MaxDatagramSize() const { return max_datagram_size_; }
+
+  // Number of datagrams in the batch.
+  size_t Size() const { return size_; }
+  bool Empty() const { return size_ == 0; }
+  void Clear() { size_ = 0; }
+
+  // The data in datagram 'i' and the address it was received from or is
+  // to be sent to.
+  absl::Span<const char> Datagram(size_t i) const {
+    return absl::Span<const char>(
+        buffer_.data() + i * max_datagram_size_, lengths_[i]);
+  }
+  InetAddress Address(size_t i) const { return InetAddress(addrs_[i]); }
+
+  // Add a datagram to be sent to 'addr'.  The data is copied.  Returns false
+  // if the batch is full or the datagram is too big.
+  bool Add(const InetAddress &addr, const void *data, size_t length);
+
+private:
+  friend class UDPSocket;
+
+  // Set up the message headers for 'n' datagrams of 'length' bytes.  If
+  // 'length' is 0 the datagrams' own lengths are used.
+  void PrepareHeaders(size_t n, size_t length);
+
+  size_t max_datagram_size_;
+  size_t size_ = 0;
+  std::vector<char> buffer_;
+  std::vector<size_t> lengths_;
+  std::vector<sockaddr_in> addrs_;
+  std::vector<iovec> iovecs_;
+#if defined(__linux__)
+  std::vector<mmsghdr> msgs_;
+#endif
+};
+
 // A socket that uses the UDP datagram protocol.
 class UDPSocket : public NetworkSocket {
 public:
@@ -220,6 +419,17 @@ public:
   absl::StatusOr<ssize_t> ReceiveFrom(InetAddress &sender, void *buffer,
                                       size_t buflen,
                                       co::Coroutine *c = nullptr);
+
+  // Receive up to batch.Capacity() datagrams, waiting for the first one.
+  // Datagrams that are longer than batch.MaxDatagramSize() are truncated.
+  // On Linux this is a single recvmmsg call.  Returns the number received,
+  // which is also batch.Size().
+  absl::StatusOr<size_t> ReceiveBatch(DatagramBatch &batch,
+                                      co::Coroutine *c = nullptr);
+
+  // Send all the datagrams in the batch to their addresses, using sendmmsg
+  // on Linux.
+  absl::Status SendBatch(DatagramBatch &batch, co::Coroutine *c = nullptr);
   absl::Status SetBroadcast();
   absl::Status SetMulticastLoop();
 };
@@ -238,6 +448,36 @@ public:
   absl::Status Bind(const InetAddress &addr, bool listen);
 
   absl::StatusOr<TCPSocket> Accept(co::Coroutine *c = nullptr);
+
+  // Accept up to 'max' pending connections, appending them to 'sockets'.
+  // This waits (in the coroutine if there is one) until a connection is
+  // pending, unless the socket is nonblocking, and then takes whatever
+  // else is queued without waiting, so a busy listener gets through its
+  // backlog in one wakeup.  The new sockets are close-on-exec, and
+  // nonblocking if 'nonblocking' is set, without any more system calls.
+  absl::Status AcceptMany(std::vector<TCPSocket> &sockets, size_t max = 64,
+                          bool nonblocking = false,
+                          co::Coroutine *c = nullptr);
+
+  // Set the length of the queue of pending connections on a bound socket.
+  // Bind with 'listen' set uses a short queue.
+  absl::Status Listen(int backlog);
+
+  // Disable (or enable) Nagle's algorithm.
+  absl::Status SetNoDelay(bool enable = true);
+
+  // Send keepalive probes after 'idle_secs' seconds of idleness, every
+  // 'interval_secs' seconds, and drop the connection after 'count'
+  // unanswered probes.
+  absl::Status SetKeepAlive(int idle_secs = 60, int interval_secs = 10,
+                            int count = 5);
+
+  // TCP Fast Open lets data be sent with the SYN on a repeat connection.
+  // On a listening socket, SetFastOpen accepts it, with up to
+  // 'queue_length' pending.  On a client, call SetFastOpenConnect before
+  // Connect and the connection is made with the first send.
+  absl::Status SetFastOpen(int queue_length = 16);
+  absl::Status SetFastOpenConnect();
 };
 } // namespace toolbelt
 
@@ -3,6 +3,7 @@
 #include <cstring>
 #include <gtest/gtest.h>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 namespace {
@@ -107,3 +108,412 @@ TEST(SocketsTest, UDPSocket_SendAndReceiveMulticast) {
         }
     }
 }
+
+namespace {
+// A connected pair of unix sockets.
+std::pair<toolbelt::UnixSocket, toolbelt::UnixSocket> SocketPair() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    abort();
+  }
+  return {toolbelt::UnixSocket(fds[0], true),
+          toolbelt::UnixSocket(fds[1], true)};
+}
+
+void SendString(toolbelt::Socket &socket, const std::string &s) {
+  // SendMessage needs 4 bytes before the data for the length.
+  std::vector<char> buffer(s.size() + sizeof(int32_t));
+  memcpy(buffer.data() + sizeof(int32_t), s.data(), s.size());
+  ASSERT_TRUE(
+      socket.SendMessage(buffer.data() + sizeof(int32_t), s.size()).ok());
+}
+}
+
+TEST(SocketsTest, BufferedReceive) {
+  auto [sender, receiver] = SocketPair();
+  std::vector<std::string> messages;
+  for (int i = 0; i < 20; i++) {
+    messages.push_back(std::string(i * 7, 'a' + i));
+    SendString(sender, messages.back());
+  }
+  // Start with a buffer that's too small for some of the messages.
+  receiver.SetReceiveBuffer(32);
+  for (auto &m : messages) {
+    absl::StatusOr<absl::Span<const char>> msg =
+        receiver.ReceiveBufferedMessage();
+    ASSERT_TRUE(msg.ok()) << msg.status();
+    ASSERT_EQ(m, std::string(msg->data(), msg->size()));
+  }
+  ASSERT_EQ(0, receiver.BufferedBytes());
+
+  // Several messages arrive in one receive.
+  receiver.SetReceiveBuffer(1024);
+  for (int i = 0; i < 3; i++) {
+    SendString(sender, TEST_DATA.data());
+  }
+  absl::StatusOr<absl::Span<const char>> msg =
+      receiver.ReceiveBufferedMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ(TEST_DATA, std::string_view(msg->data(), msg->size()));
+  ASSERT_EQ(2 * (TEST_DATA.size() + sizeof(int32_t)), receiver.BufferedBytes());
+
+  // The other receive functions use the buffer too.
+  char buffer[256];
+  absl::StatusOr<ssize_t> n = receiver.ReceiveMessage(buffer, sizeof(buffer));
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(TEST_DATA, std::string_view(buffer, *n));
+  absl::StatusOr<std::vector<char>> v = receiver.ReceiveVariableLengthMessage();
+  ASSERT_TRUE(v.ok());
+  ASSERT_EQ(TEST_DATA, std::string_view(v->data(), v->size()));
+
+  sender.Close();
+  ASSERT_FALSE(receiver.ReceiveBufferedMessage().ok());
+}
+
+TEST(SocketsTest, BufferedReceiveTooLong) {
+  auto [sender, receiver] = SocketPair();
+  receiver.SetReceiveBuffer(32, 100);
+  SendString(sender, std::string(100, 'a'));
+  absl::StatusOr<absl::Span<const char>> msg =
+      receiver.ReceiveBufferedMessage();
+  ASSERT_TRUE(msg.ok()) << msg.status();
+  ASSERT_EQ(100, msg->size());
+
+  // A length that's too long is rejected without growing the buffer.
+  uint32_t length = htonl(0xfffffff0);
+  ASSERT_EQ(sizeof(length),
+            ::send(sender.GetFileDescriptor().Fd(), &length, sizeof(length), 0));
+  msg = receiver.ReceiveBufferedMessage();
+  ASSERT_FALSE(msg.ok());
+  ASSERT_TRUE(absl::IsInvalidArgument(msg.status())) << msg.status();
+}
+
+TEST(SocketsTest, BufferedReceiveNonBlocking) {
+  auto [sender, receiver] = SocketPair();
+  ASSERT_TRUE(receiver.SetNonBlocking().ok());
+  // Nothing there and no coroutine to wait in.
+  ASSERT_FALSE(receiver.ReceiveBufferedMessage().ok());
+
+  SendString(sender, "hello");
+  absl::StatusOr<absl::Span<const char>> msg =
+      receiver.ReceiveBufferedMessage();
+  ASSERT_TRUE(msg.ok());
+  ASSERT_EQ("hello", std::string_view(msg->data(), msg->size()));
+}
+
+TEST(SocketsTest, SendMessageV) {
+  auto [sender, receiver] = SocketPair();
+  std::string a = "The quick brown fox ";
+  std::string b = "jumped over ";
+  std::string c = "the lazy dog.";
+  iovec iov[] = {
+      {a.data(), a.size()}, {b.data(), b.size()}, {c.data(), c.size()}};
+  absl::StatusOr<ssize_t> n = sender.SendMessageV(iov);
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(TEST_DATA.size() + sizeof(int32_t), *n);
+
+  char buffer[256];
+  n = receiver.ReceiveMessage(buffer, sizeof(buffer));
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(TEST_DATA, std::string_view(buffer, *n));
+}
+
+TEST(SocketsTest, SendMessages) {
+  auto [sender, receiver] = SocketPair();
+  // Enough data to fill the socket so the sends are partial.
+  std::vector<std::string> data;
+  for (int i = 0; i < 2000; i++) {
+    data.push_back(std::string(i % 1000, 'a' + i % 26));
+  }
+  std::vector<absl::Span<const char>> messages(data.begin(), data.end());
+
+  std::thread t([&sender = sender, &messages]() {
+    absl::StatusOr<ssize_t> n = sender.SendMessages(messages);
+    ASSERT_TRUE(n.ok());
+  });
+  for (auto &d : data) {
+    absl::StatusOr<absl::Span<const char>> msg =
+        receiver.ReceiveBufferedMessage();
+    ASSERT_TRUE(msg.ok());
+    ASSERT_EQ(d, std::string(msg->data(), msg->size()));
+  }
+  t.join();
+}
+
+TEST(SocketsTest, UDPSocket_Batch) {
+  UnusedPort port;
+  auto sender = toolbelt::UDPSocket();
+  auto receiver = toolbelt::UDPSocket();
+
+  ASSERT_TRUE(receiver.SetReusePort().ok());
+  ASSERT_TRUE(receiver.Bind(toolbelt::InetAddress("localhost", port)).ok());
+  ASSERT_TRUE(sender.Bind(toolbelt::InetAddress("localhost", 0)).ok());
+
+  toolbelt::InetAddress sendto_address("localhost", port);
+  toolbelt::DatagramBatch send_batch(10, 64);
+  for (int i = 0; i < 10; i++) {
+    std::string s = std::to_string(i) + std::string(TEST_DATA);
+    ASSERT_TRUE(send_batch.Add(sendto_address, s.data(), s.size()));
+  }
+  ASSERT_FALSE(send_batch.Add(sendto_address, "full", 4));
+  ASSERT_TRUE(sender.SendBatch(send_batch).ok());
+
+  // Receive into smaller batches so it takes more than one.
+  toolbelt::DatagramBatch batch(4, 64);
+  int received = 0;
+  while (received < 10) {
+    absl::StatusOr<size_t> n = receiver.ReceiveBatch(batch);
+    ASSERT_TRUE(n.ok()) << n.status();
+    ASSERT_LT(0, *n);
+    ASSERT_GE(4, *n);
+    for (size_t i = 0; i < batch.Size(); i++) {
+      std::string expected = std::to_string(received) + std::string(TEST_DATA);
+      ASSERT_EQ(expected, std::string(batch.Datagram(i).data(),
+                                      batch.Datagram(i).size()));
+      ASSERT_EQ(sender.BoundAddress().Port(), batch.Address(i).Port());
+      received++;
+    }
+  }
+}
+
+TEST(SocketsTest, ConnectTimeout) {
+  toolbelt::TCPSocket listener;
+  ASSERT_TRUE(listener.Bind(toolbelt::InetAddress("localhost", 0), true).ok());
+
+  // Connect without blocking, the socket is left blocking.
+  toolbelt::TCPSocket client;
+  ASSERT_TRUE(client.Connect(listener.BoundAddress(), nullptr, 1000000000).ok());
+  ASSERT_TRUE(client.Connected());
+  ASSERT_FALSE(client.GetFileDescriptor().IsNonBlocking());
+  ASSERT_TRUE(client.SetNoDelay().ok());
+  ASSERT_TRUE(client.SetKeepAlive(30, 5, 3).ok());
+
+  // A nonblocking socket without a timeout doesn't wait for the
+  // connection, it's left in progress if it isn't made at once.
+  toolbelt::TCPSocket nonblocking;
+  ASSERT_TRUE(nonblocking.SetNonBlocking().ok());
+  absl::Status nb = nonblocking.Connect(listener.BoundAddress());
+  if (!nb.ok()) {
+    ASSERT_NE(std::string::npos, nb.message().find(strerror(EINPROGRESS)))
+        << nb;
+  }
+  ASSERT_TRUE(nonblocking.IsNonBlocking());
+  struct pollfd p = {.fd = nonblocking.GetFileDescriptor().Fd(),
+                     .events = POLLOUT};
+  ASSERT_EQ(1, ::poll(&p, 1, 1000));
+
+  // With a timeout it waits.
+  toolbelt::TCPSocket nonblocking_timeout;
+  ASSERT_TRUE(nonblocking_timeout.SetNonBlocking().ok());
+  ASSERT_TRUE(
+      nonblocking_timeout.Connect(listener.BoundAddress(), nullptr, 1000000000)
+          .ok());
+  ASSERT_TRUE(nonblocking_timeout.Connected());
+
+  // Refused.
+  toolbelt::InetAddress addr;
+  {
+    toolbelt::TCPSocket s;
+    ASSERT_TRUE(s.Bind(toolbelt::InetAddress("localhost", 0), false).ok());
+    addr = s.BoundAddress();
+  }
+  toolbelt::TCPSocket refused;
+  absl::Status status = refused.Connect(addr, nullptr, 1000000000);
+  ASSERT_FALSE(status.ok());
+  ASSERT_FALSE(absl::IsDeadlineExceeded(status));
+}
+
+TEST(SocketsTest, PayloadBuffer) {
+  toolbelt::TCPSocket listener;
+  ASSERT_TRUE(listener.Bind(toolbelt::InetAddress("localhost", 0), true).ok());
+  toolbelt::TCPSocket sender;
+  ASSERT_TRUE(sender.Connect(listener.BoundAddress()).ok());
+  absl::StatusOr<toolbelt::TCPSocket> receiver = listener.Accept();
+  ASSERT_TRUE(receiver.ok());
+
+  toolbelt::Resizer resizer = [](toolbelt::PayloadBuffer **p, size_t,
+                                 size_t new_size) {
+    *p = reinterpret_cast<toolbelt::PayloadBuffer *>(realloc(*p, new_size));
+  };
+  struct Message {
+    toolbelt::BufferOffset str;
+    uint32_t value;
+  };
+
+  // A big message that needs several chunks and a resize at the other end.
+  std::string data(3 * 1024 * 1024 + 17, 'p');
+  toolbelt::PayloadBuffer *out = new (malloc(4096))
+      toolbelt::PayloadBuffer(4096, resizer);
+  Message *msg = reinterpret_cast<Message *>(
+      toolbelt::PayloadBuffer::AllocateMainMessage(&out, sizeof(Message)));
+  msg->value = 1234;
+  toolbelt::PayloadBuffer::SetString(&out, data.data(), data.size(),
+                                     out->message);
+  std::thread t([&sender, out]() {
+    ASSERT_TRUE(sender.SendPayloadBuffer(out).ok());
+  });
+
+  toolbelt::PayloadBuffer *in = new (malloc(1024))
+      toolbelt::PayloadBuffer(1024, resizer);
+  std::vector<size_t> progress;
+  toolbelt::PayloadReceiveOptions options;
+  options.progress = [&progress](size_t received, size_t total) {
+    progress.push_back(received);
+  };
+  absl::Status s = receiver->ReceivePayloadBuffer(&in, nullptr, options);
+  t.join();
+  ASSERT_TRUE(s.ok()) << s;
+  ASSERT_EQ(4, progress.size());
+  ASSERT_EQ(out->WireSize(), progress.back());
+  ASSERT_TRUE(in->IsMoveable());
+  ASSERT_GE(in->full_size, out->WireSize());
+  msg = in->ToAddress<Message>(in->message);
+  ASSERT_EQ(1234, msg->value);
+  ASSERT_EQ(data, in->GetString(in->message));
+
+  // It's a working buffer, with its own resizer.
+  void *more = toolbelt::PayloadBuffer::Allocate(&in, 8 * 1024 * 1024, 8);
+  ASSERT_NE(nullptr, more);
+  ASSERT_EQ(1234, in->ToAddress<Message>(in->message)->value);
+
+  // Into a fixed size buffer.
+  out->Reset();
+  msg = reinterpret_cast<Message *>(
+      toolbelt::PayloadBuffer::AllocateMainMessage(&out, sizeof(Message)));
+  msg->value = 42;
+  ASSERT_TRUE(sender.SendPayloadBuffer(out).ok());
+  alignas(8) char fixed_mem[2048];
+  toolbelt::PayloadBuffer *fixed =
+      new (fixed_mem) toolbelt::PayloadBuffer(sizeof(fixed_mem));
+  s = receiver->ReceivePayloadBuffer(&fixed);
+  ASSERT_TRUE(s.ok()) << s;
+  ASSERT_FALSE(fixed->IsMoveable());
+  ASSERT_EQ(sizeof(fixed_mem), fixed->full_size);
+  ASSERT_EQ(42, fixed->ToAddress<Message>(fixed->message)->value);
+  ASSERT_NE(nullptr, toolbelt::PayloadBuffer::Allocate(&fixed, 1000, 8));
+
+  // Too big for a fixed buffer.
+  toolbelt::PayloadBuffer::SetString(&out, data.data(), 4000, out->message);
+  ASSERT_TRUE(sender.SendPayloadBuffer(out).ok());
+  fixed = new (fixed_mem) toolbelt::PayloadBuffer(sizeof(fixed_mem));
+  s = receiver->ReceivePayloadBuffer(&fixed);
+  ASSERT_TRUE(absl::IsResourceExhausted(s)) << s;
+
+  in->~PayloadBuffer();
+  free(in);
+  out->~PayloadBuffer();
+  free(out);
+}
+
+TEST(SocketsTest, PayloadBufferBadLength) {
+  toolbelt::TCPSocket listener;
+  ASSERT_TRUE(listener.Bind(toolbelt::InetAddress("localhost", 0), true).ok());
+  toolbelt::TCPSocket sender;
+  ASSERT_TRUE(sender.Connect(listener.BoundAddress()).ok());
+  absl::StatusOr<toolbelt::TCPSocket> receiver = listener.Accept();
+  ASSERT_TRUE(receiver.ok());
+
+  alignas(8) char mem[1024];
+  toolbelt::PayloadBuffer *pb = new (mem) toolbelt::PayloadBuffer(sizeof(mem));
+
+  // The length is rejected before anything else is read.
+  uint32_t length = htonl(0x7fffffff);
+  ASSERT_TRUE(sender.Send(reinterpret_cast<char *>(&length), 4).ok());
+  absl::Status s = receiver->ReceivePayloadBuffer(&pb);
+  ASSERT_TRUE(absl::IsInvalidArgument(s)) << s;
+  length = htonl(4);
+  ASSERT_TRUE(sender.Send(reinterpret_cast<char *>(&length), 4).ok());
+  s = receiver->ReceivePayloadBuffer(&pb);
+  ASSERT_TRUE(absl::IsInvalidArgument(s)) << s;
+
+  // Something that isn't a PayloadBuffer.
+  std::vector<iovec> iov;
+  std::string junk(500, 'j');
+  iov.push_back({junk.data(), junk.size()});
+  ASSERT_TRUE(sender.SendMessageV(iov).ok());
+  s = receiver->ReceivePayloadBuffer(&pb);
+  ASSERT_TRUE(absl::IsInvalidArgument(s)) << s;
+  // The buffer is still usable.
+  ASSERT_TRUE(pb->IsValidMagic());
+  ASSERT_EQ(sizeof(mem), pb->full_size);
+  ASSERT_NE(nullptr, toolbelt::PayloadBuffer::Allocate(&pb, 100, 8));
+}
+
+TEST(SocketsTest, SendFile) {
+  auto [sender, receiver] = SocketPair();
+  char name[] = "/tmp/sendfileXXXXXX";
+  int fd = mkstemp(name);
+  ASSERT_NE(-1, fd);
+  unlink(name);
+  toolbelt::FileDescriptor file(fd);
+  std::string data;
+  for (int i = 0; i < 1000; i++) {
+    data += std::to_string(i);
+  }
+  ASSERT_EQ(data.size(), ::write(fd, data.data(), data.size()));
+
+  absl::StatusOr<ssize_t> n = sender.SendFile(file, 10, data.size() - 10);
+  ASSERT_TRUE(n.ok()) << n.status();
+  ASSERT_EQ(data.size() - 10, *n);
+
+  std::vector<char> buffer(data.size() - 10);
+  n = receiver.Receive(buffer.data(), buffer.size());
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(data.substr(10), std::string(buffer.data(), buffer.size()));
+
+  // Asking for more than there is sends what there is.
+  n = sender.SendFile(file, data.size() - 5, 100);
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(5, *n);
+}
+
+#if defined(__linux__)
+TEST(SocketsTest, Splice) {
+  auto [sender, receiver] = SocketPair();
+  auto source = toolbelt::Pipe::Create();
+  ASSERT_TRUE(source.ok());
+  auto pipe = toolbelt::Pipe::Create();
+  ASSERT_TRUE(pipe.ok());
+
+  ASSERT_EQ(TEST_DATA.size(), ::write(source->WriteFd().Fd(), TEST_DATA.data(),
+                                      TEST_DATA.size()));
+  absl::StatusOr<ssize_t> n =
+      sender.Splice(source->ReadFd(), TEST_DATA.size(), *pipe);
+  ASSERT_TRUE(n.ok()) << n.status();
+  ASSERT_EQ(TEST_DATA.size(), *n);
+
+  std::vector<char> buffer(TEST_DATA.size());
+  n = receiver.Receive(buffer.data(), buffer.size());
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(TEST_DATA, std::string_view(buffer.data(), buffer.size()));
+}
+
+TEST(SocketsTest, ZeroCopy) {
+  toolbelt::TCPSocket listener;
+  ASSERT_TRUE(listener.Bind(toolbelt::InetAddress("localhost", 0), true).ok());
+  toolbelt::TCPSocket sender;
+  ASSERT_TRUE(sender.Connect(listener.BoundAddress()).ok());
+  absl::StatusOr<toolbelt::TCPSocket> receiver = listener.Accept();
+  ASSERT_TRUE(receiver.ok());
+
+  ASSERT_FALSE(sender.SendZeroCopy(TEST_DATA.data(), TEST_DATA.size()).ok());
+  ASSERT_TRUE(sender.SetZeroCopy().ok());
+
+  std::string data(100000, 'z');
+  absl::StatusOr<uint32_t> id = sender.SendZeroCopy(data.data(), data.size());
+  ASSERT_TRUE(id.ok()) << id.status();
+
+  std::vector<char> buffer(data.size());
+  absl::StatusOr<ssize_t> n = receiver->Receive(buffer.data(), buffer.size());
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(data, std::string(buffer.data(), buffer.size()));
+
+  // The completion arrives once the data has been received.
+  for (int i = 0; i < 1000 && !sender.ZeroCopyComplete(*id); i++) {
+    ASSERT_TRUE(sender.ProcessZeroCopyCompletions().ok());
+    usleep(1000);
+  }
+  ASSERT_TRUE(sender.ZeroCopyComplete(*id));
+  ASSERT_FALSE(sender.ZeroCopyComplete(*id + 1));
+}
+#endif
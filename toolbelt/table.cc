@@ -3,10 +3,35 @@
 // See LICENSE file for licensing information.
 
 #include "toolbelt/table.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
-#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <string_view>
 
 namespace toolbelt {
+
+// Values that don't parse sort before all others.  NaN isn't ordered so
+// it is treated as one of these.
+static constexpr int64_t kNoInt = std::numeric_limits<int64_t>::min();
+static constexpr double kNoDouble = -std::numeric_limits<double>::infinity();
+
+static double SortableDouble(double v) { return std::isnan(v) ? kNoDouble : v; }
+
+// Append data to out, left justified in a field of the given width.  Data
+// that is too wide is truncated.
+static void AppendField(std::string &out, std::string_view data,
+                        size_t width) {
+  if (data.size() > width) {
+    data = data.substr(0, width - 1);
+  }
+  out.append(data);
+  out.append(width - data.size(), ' ');
+}
+
 Table::Table(
     const std::vector<std::string> titles, ssize_t sort_column,
     std::function<bool(const std::string &, const std::string &)> comp) {
@@ -18,11 +43,40 @@ Table::Table(
 
 Table::~Table() {}
 
-void Table::AddRow() {
-  for (auto &col : cols_) {
-    col.cells.push_back({});
+void Table::SetColumnType(size_t col, ColumnType type, int precision) {
+  Column &c = cols_[col];
+  c.type = type;
+  c.precision = precision;
+  c.ints.clear();
+  c.doubles.clear();
+  for (size_t row = 0; row < c.cells.size(); row++) {
+    ParseValue(c, row);
   }
-  ++num_rows_;
+  if (col == sort_column_) {
+    sorted_ = false;
+  }
+}
+
+void Table::SortBy(
+    size_t column,
+    std::function<bool(const std::string &, const std::string &)> comp) {
+  sort_column_ = column;
+  sorter_ = std::move(comp);
+  sorted_ = false;
+}
+
+void Table::SetSortDescending(bool descending) {
+  descending_ = descending;
+  sorted_ = false;
+}
+
+void Table::SetTopN(size_t n) {
+  top_n_ = n;
+  sorted_ = false;
+}
+
+void Table::AddRow() {
+  FinishRow();
 }
 
 void Table::AddRow(const std::vector<std::string> cells) {
@@ -30,7 +84,64 @@ void Table::AddRow(const std::vector<std::string> cells) {
 }
 
 void Table::SetCell(size_t col, Cell &&cell) {
-  cols_[col].cells[num_rows_ - 1] = std::move(cell);
+  UpdateCell(num_rows_ - 1, col, std::move(cell));
+}
+
+void Table::SetIntCell(size_t col, int64_t value, color::Color color) {
+  UpdateIntCell(num_rows_ - 1, col, value, color);
+}
+
+void Table::SetDoubleCell(size_t col, double value, color::Color color) {
+  UpdateDoubleCell(num_rows_ - 1, col, value, color);
+}
+
+void Table::UpdateCell(size_t row, size_t col, Cell &&cell) {
+  StoreCell(row, col, std::move(cell));
+  ParseValue(cols_[col], row);
+}
+
+void Table::UpdateIntCell(size_t row, size_t col, int64_t value,
+                          color::Color color) {
+  StoreCell(row, col, {.data = absl::StrCat(value), .color = color});
+  Column &c = cols_[col];
+  switch (c.type) {
+  case ColumnType::kInt64:
+    c.ints[row] = value;
+    break;
+  case ColumnType::kDouble:
+    c.doubles[row] = double(value);
+    break;
+  case ColumnType::kString:
+    break;
+  }
+}
+
+void Table::UpdateDoubleCell(size_t row, size_t col, double value,
+                             color::Color color) {
+  Column &c = cols_[col];
+  StoreCell(row, col,
+            {.data = absl::StrFormat("%.*f", c.precision, value),
+             .color = color});
+  switch (c.type) {
+  case ColumnType::kInt64:
+    ParseValue(c, row);
+    break;
+  case ColumnType::kDouble:
+    c.doubles[row] = SortableDouble(value);
+    break;
+  case ColumnType::kString:
+    break;
+  }
+}
+
+void Table::StoreCell(size_t row, size_t col, Cell &&cell) {
+  Column &c = cols_[col];
+  RemoveWidth(c, c.cells[row].data.size());
+  c.cells[row] = std::move(cell);
+  AddWidth(c, c.cells[row].data.size());
+  if (col == sort_column_) {
+    sorted_ = false;
+  }
 }
 
 void Table::AddRow(const std::vector<std::string> cells, color::Color color) {
@@ -42,7 +153,7 @@ void Table::AddRow(const std::vector<std::string> cells, color::Color color) {
     AddCell(index, {.data = cell, .color = color});
     index++;
   }
-  ++num_rows_;
+  FinishRow();
 }
 
 void Table::AddRowWithColors(const std::vector<Cell> cells) {
@@ -54,14 +165,84 @@ void Table::AddRowWithColors(const std::vector<Cell> cells) {
     AddCell(index, cell);
     index++;
   }
-  ++num_rows_;
+  FinishRow();
 }
 
 void Table::AddCell(size_t col, const Cell &cell) {
-  cols_[col].cells.push_back(cell);
+  Column &c = cols_[col];
+  c.cells.push_back(cell);
+  AddWidth(c, cell.data.size());
+  ParseValue(c, c.cells.size() - 1);
+}
+
+// Fill in any cells missing from the new row and add it to the sort order.
+void Table::FinishRow() {
+  for (size_t col = 0; col < cols_.size(); col++) {
+    if (cols_[col].cells.size() == size_t(num_rows_)) {
+      AddCell(col, {});
+    }
+  }
+  order_.push_back(uint32_t(num_rows_));
+  ++num_rows_;
+  sorted_ = false;
+}
+
+void Table::ParseValue(Column &col, size_t row) {
+  const std::string &data = col.cells[row].data;
+  switch (col.type) {
+  case ColumnType::kInt64: {
+    int64_t v;
+    if (!absl::SimpleAtoi(data, &v)) {
+      v = kNoInt;
+    }
+    if (row == col.ints.size()) {
+      col.ints.push_back(v);
+    } else {
+      col.ints[row] = v;
+    }
+    break;
+  }
+  case ColumnType::kDouble: {
+    double v;
+    if (!absl::SimpleAtod(data, &v)) {
+      v = kNoDouble;
+    }
+    v = SortableDouble(v);
+    if (row == col.doubles.size()) {
+      col.doubles.push_back(v);
+    } else {
+      col.doubles[row] = v;
+    }
+    break;
+  }
+  case ColumnType::kString:
+    break;
+  }
+}
+
+void Table::AddWidth(Column &col, size_t width) {
+  if (width >= col.width_counts.size()) {
+    col.width_counts.resize(width + 1);
+  }
+  col.width_counts[width]++;
+  col.max_width = std::max(col.max_width, width);
+}
+
+void Table::RemoveWidth(Column &col, size_t width) {
+  col.width_counts[width]--;
+  // If that was the last of the widest cells, find the next widest.
+  while (col.max_width > 0 && col.width_counts[col.max_width] == 0) {
+    col.max_width--;
+  }
 }
 
 void Table::Print(int width, std::ostream &os) {
+  std::string out = Format(width);
+  os.write(out.data(), out.size());
+  os.flush();
+}
+
+std::string Table::Format(int width) {
   if (width == 0) {
     width = 80;
   }
@@ -69,100 +250,106 @@ void Table::Print(int width, std::ostream &os) {
 
   // Calculate the widths for each column.
   Render(width);
+  Sort();
 
-  // Print titles.
+  size_t num_rows = num_rows_;
+  if (top_n_ != 0 && top_n_ < num_rows) {
+    num_rows = top_n_;
+  }
+  size_t line_width = std::max(width, 0);
+  std::string out;
+  out.reserve((line_width + 1) * (num_rows + 2) +
+              num_rows * cols_.size() * 16);
+
+  // Titles.
   for (auto &col : cols_) {
-    std::string title = col.title;
-    if (title.size() > col.width) {
-      title = title.substr(0, col.width - 1);
-    }
-    os << std::left << std::setw(col.width) << std::setfill(' ') << title;
+    AppendField(out, col.title, col.width);
   }
-  os << std::endl;
-  // Print separator line.
-  os << std::setw(width) << std::setfill('-') << "" << std::endl;
+  out += '\n';
+  // Separator line.
+  out.append(line_width, '-');
+  out += '\n';
 
-  // Print each row.
-  for (size_t i = 0; i < num_rows_; i++) {
+  // Rows in sort order.
+  for (size_t i = 0; i < num_rows; i++) {
+    uint32_t row = order_[i];
     for (auto &col : cols_) {
-      std::string data = col.cells[i].data;
-      if (data.size() > col.width) {
-        // Truncate if too wide.
-        data = data.substr(0, col.width - 1);
-      }
-      os << std::left << color::SetColor(col.cells[i].color)
-         << std::setw(col.width) << std::setfill(' ') << data
-         << color::ResetColor();
+      const Cell &cell = col.cells[row];
+      out += color::SetColor(cell.color);
+      AppendField(out, cell.data, col.width);
+      out += color::ResetColor();
     }
-    os << std::endl;
+    out += '\n';
   }
+  return out;
 }
 
 void Table::Clear() {
   for (auto &col : cols_) {
     col.cells.clear();
+    col.ints.clear();
+    col.doubles.clear();
+    col.width_counts.clear();
+    col.max_width = 0;
   }
+  order_.clear();
   num_rows_ = 0;
+  sorted_ = false;
 }
 
 void Table::Render(int width) {
-  std::vector<size_t> max_widths(cols_.size());
-  for (size_t i = 0; i < num_rows_; i++) {
-    int col_index = 0;
-    for (auto &col : cols_) {
-      if (col.cells[i].data.size() > max_widths[col_index]) {
-        max_widths[col_index] = col.cells[i].data.size();
-      }
-      col_index++;
-    }
+  if (cols_.empty()) {
+    return;
   }
   size_t total_width = 0;
-  for (size_t w : max_widths) {
-    total_width += w;
+  for (auto &col : cols_) {
+    total_width += col.max_width;
   }
   // Pad the column widths out to the width we have.
-  ssize_t padding = width - total_width;
-  padding /= cols_.size();
-  int index = 0;
+  ssize_t padding = width - ssize_t(total_width);
+  padding /= ssize_t(cols_.size());
   for (auto &col : cols_) {
-    col.width = max_widths[index] + padding;
-    index++;
+    col.width = std::max<ssize_t>(col.max_width + padding, 1);
   }
-  Sort();
+}
+
+bool Table::Less(uint32_t a, uint32_t b) const {
+  const Column &col = cols_[sort_column_];
+  if (descending_) {
+    std::swap(a, b);
+  }
+  if (sorter_ != nullptr) {
+    return sorter_(col.cells[a].data, col.cells[b].data);
+  }
+  switch (col.type) {
+  case ColumnType::kInt64:
+    return col.ints[a] < col.ints[b];
+  case ColumnType::kDouble:
+    return col.doubles[a] < col.doubles[b];
+  case ColumnType::kString:
+    break;
+  }
+  return col.cells[a].data < col.cells[b].data;
 }
 
 void Table::Sort() {
-  if (sort_column_ == -1 || sort_column_ >= cols_.size()) {
+  if (sorted_) {
     return;
   }
-  struct Index {
-    size_t row;
-    std::string data;
-  };
-  std::vector<Index> index(num_rows_);
-  for (size_t i = 0; i < num_rows_; i++) {
-    index[i] = {.row = i, .data = cols_[sort_column_].cells[i].data};
-  }
-  std::sort(index.begin(), index.end(), [this](const Index &a, const Index &b) {
-    return sorter_(a.data, b.data);
-  });
-  // Now we have the index in the correct order, reorder the table cells.
-  // We do this my moving all the cells into a new vector of columns in
-  // the order specified by the index.  We then use the sorted vector
-  // as the new columns in the table.
-  std::vector<Column> sorted;
-  sorted.reserve(cols_.size());
-  for (auto &col : cols_) {
-    sorted.push_back({.title = col.title, .width = col.width});
+  sorted_ = true;
+  // The rows are never moved, we just reorder their numbers.  Starting
+  // from the order they were added keeps equal rows in that order.
+  std::iota(order_.begin(), order_.end(), 0);
+  if (sort_column_ >= cols_.size()) {
+    return;
   }
-  for (auto &i : index) {
-    // i.row contains the row number for the next row to be inserted
-    // into the new sorted table.
-    for (size_t col = 0; col < cols_.size(); col++) {
-      sorted[col].cells.push_back(std::move(cols_[col].cells[i.row]));
-    }
+  auto less = [this](uint32_t a, uint32_t b) { return Less(a, b); };
+  if (top_n_ != 0 && top_n_ < order_.size()) {
+    std::partial_sort(order_.begin(), order_.begin() + top_n_, order_.end(),
+                      less);
+  } else {
+    std::stable_sort(order_.begin(), order_.end(), less);
   }
-  cols_ = std::move(sorted);
 }
 
-} // namespace toolbelt
\ No newline at end of file
+} // namespace toolbelt
@@ -6,6 +6,7 @@
 
 #include "toolbelt/color.h"
 
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <string>
@@ -13,6 +14,11 @@
 
 namespace toolbelt {
 
+// A table of rows and columns printed to fit a terminal width and sorted
+// by one of the columns.  The data is held by column and rows are never
+// moved around: sorting just reorders an index of row numbers.  Column
+// widths are maintained as cells are changed so a table that is updated
+// and reprinted (like a 'top' display) only pays for the cells that changed.
 class Table {
 public:
   struct Cell {
@@ -20,39 +26,82 @@ public:
     color::Color color;
   };
 
+  // The type of the values in a column.  A numeric column sorts by the
+  // numeric value rather than by the string.
+  enum class ColumnType {
+    kString,
+    kInt64,
+    kDouble,
+  };
+
   Table(const std::vector<std::string> titles, ssize_t sort_column = 0,
         std::function<bool(const std::string &, const std::string &)> comp =
             nullptr);
   ~Table();
 
+  // Set the type of a column.  Existing cells in the column are parsed for
+  // their values; those that don't parse as numbers sort first.  The
+  // precision is the number of decimal places for doubles set using
+  // SetDoubleCell.
+  void SetColumnType(size_t col, ColumnType type, int precision = 2);
+
   void AddRow(const std::vector<std::string> cells);
   void AddRow(const std::vector<std::string> cells, color::Color color);
   void AddRowWithColors(const std::vector<Cell> cells);
   void AddRow();
-  void SetCell(size_t col, Cell &&cell);
 
+  // These set a cell in the last row added.
+  void SetCell(size_t col, Cell &&cell);
+  void SetIntCell(size_t col, int64_t value,
+                  color::Color color = {.mod = color::kNormal,
+                                        .fixed = color::FixedColor::kNotSet});
+  void SetDoubleCell(size_t col, double value,
+                     color::Color color = {.mod = color::kNormal,
+                                           .fixed =
+                                               color::FixedColor::kNotSet});
+
+  // These update a cell in any row.  Rows are numbered in the order they
+  // were added, regardless of sorting.
+  void UpdateCell(size_t row, size_t col, Cell &&cell);
+  void UpdateIntCell(size_t row, size_t col, int64_t value,
+                     color::Color color = {.mod = color::kNormal,
+                                           .fixed =
+                                               color::FixedColor::kNotSet});
+  void UpdateDoubleCell(size_t row, size_t col, double value,
+                        color::Color color = {
+                            .mod = color::kNormal,
+                            .fixed = color::FixedColor::kNotSet});
+
+  size_t NumRows() const { return num_rows_; }
+
+  // Print the table.  The whole table is formatted into a single buffer
+  // and written to the stream in one call.
   void Print(int width, std::ostream &os);
+
+  // Format the table as Print does and return it.
+  std::string Format(int width);
+
   void Clear();
 
   // Sort data using the comparison function, which must correspond to that
-  // needed by std::sort.
+  // needed by std::sort.  If there is no comparison function, numeric
+  // columns are compared by value, others by string.
   void
   SortBy(size_t column,
-         std::function<bool(const std::string &, const std::string &)> comp) {
-    sort_column_ = column;
-    if (comp == nullptr) {
-      // Sort by string.
-      sorter_ = [](const std::string &a, const std::string &b) -> bool {
-        return a < b;
-      };
-    } else {
-      sorter_ = std::move(comp);
-    }
-  }
+         std::function<bool(const std::string &, const std::string &)> comp);
 
-  // Sort data using the column.  Comparison is done by string comparison.
+  // Sort data using the column.  Comparison is done by the column type.
   void SortBy(size_t column) { SortBy(column, nullptr); }
 
+  // Reverse the sort order.
+  void SetSortDescending(bool descending);
+
+  // Only print the first n rows in sort order.  Only those rows are
+  // sorted, using a partial sort, so unlike a full sort equal rows are not
+  // guaranteed to stay in the order they were added.  0 means print all
+  // rows.
+  void SetTopN(size_t n);
+
   static Cell MakeCell(std::string data,
                 color::Color color = {.mod = color::kNormal,
                                       .fixed = color::FixedColor::kNotSet}) {
@@ -63,19 +112,42 @@ private:
   struct Column {
     std::string title;
     int width;
+    ColumnType type = ColumnType::kString;
+    int precision = 2;
     std::vector<Cell> cells;
+    // Numeric values for the cells, by type.  Empty for string columns.
+    std::vector<int64_t> ints;
+    std::vector<double> doubles;
+    // Number of cells of each data width, so we know the maximum width
+    // without looking at all the cells.
+    std::vector<uint32_t> width_counts;
+    size_t max_width = 0;
   };
 
   void Render(int width);
   void Sort();
+  bool Less(uint32_t a, uint32_t b) const;
 
   void AddCell(size_t col, const Cell &cell);
+  void FinishRow();
+  void StoreCell(size_t row, size_t col, Cell &&cell);
+  void ParseValue(Column &col, size_t row);
+
+  static void AddWidth(Column &col, size_t width);
+  static void RemoveWidth(Column &col, size_t width);
 
   std::vector<Column> cols_;
   int num_rows_ = 0;
 
   size_t sort_column_;
   std::function<bool(const std::string &, const std::string &)> sorter_;
+  bool descending_ = false;
+  size_t top_n_ = 0;
+
+  // Row numbers in sort order.  Only valid when sorted_ is true.  For a
+  // top-N table only the first top_n_ entries are in order.
+  std::vector<uint32_t> order_;
+  bool sorted_ = false;
 };
 
 } // namespace toolbelt
@@ -102,4 +102,109 @@ TEST(FdTest, EightBit) {
   table.SetCell(1, Table::MakeCell("online", color::Make8Bit(82)));
   table.SetCell(2, Table::MakeCell("offline", color::Make8Bit(33)));
   table.Print(win.ws_col, std::cout);
-}
\ No newline at end of file
+}
+namespace {
+// The rows of a formatted table, without the title and separator lines.
+std::vector<std::string> Rows(const std::string &s) {
+  std::vector<std::string> rows;
+  size_t start = 0;
+  int line = 0;
+  while (start < s.size()) {
+    size_t end = s.find('\n', start);
+    if (line++ >= 2) {
+      rows.push_back(s.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return rows;
+}
+
+// The first field of each row, skipping any color escape.
+std::vector<std::string> Names(const std::string &s) {
+  std::vector<std::string> names;
+  for (auto &row : Rows(s)) {
+    size_t start = row[0] == '\033' ? row.find('m') + 1 : 0;
+    names.push_back(row.substr(start, row.find(' ', start) - start));
+  }
+  return names;
+}
+} // namespace
+
+TEST(TableTest, TypedSort) {
+  Table table({"name", "pid", "cpu"}, 1);
+  table.SetColumnType(1, Table::ColumnType::kInt64);
+  table.SetColumnType(2, Table::ColumnType::kDouble, 1);
+
+  table.AddRow({"init", "1", "0.1"});
+  table.AddRow({"big", "1000", "12.5"});
+  table.AddRow({"small", "20", "2"});
+  table.AddRow({"bad", "x", "y"});
+  ASSERT_EQ(std::vector<std::string>({"bad", "init", "small", "big"}),
+            Names(table.Format(80)));
+
+  // Descending by cpu.
+  table.SortBy(2);
+  table.SetSortDescending(true);
+  ASSERT_EQ(std::vector<std::string>({"big", "small", "init", "bad"}),
+            Names(table.Format(80)));
+
+  // A string comparator still works on a typed column.
+  table.SortBy(1, [](const std::string &a, const std::string &b) {
+    return a < b;
+  });
+  table.SetSortDescending(false);
+  ASSERT_EQ(std::vector<std::string>({"init", "big", "small", "bad"}),
+            Names(table.Format(80)));
+}
+
+TEST(TableTest, TopN) {
+  Table table({"name", "value"}, 1);
+  table.SetColumnType(1, Table::ColumnType::kInt64);
+  table.SetSortDescending(true);
+  for (int i = 0; i < 100; i++) {
+    table.AddRow();
+    table.SetCell(0, Table::MakeCell(absl::StrFormat("r%d", i)));
+    table.SetIntCell(1, (i * 37) % 100);
+  }
+  table.SetTopN(3);
+  ASSERT_EQ(100, table.NumRows());
+  // 37 * 73 % 100 == 1, so 99 is row 27, 98 is row 54, 97 is row 81.
+  ASSERT_EQ(std::vector<std::string>({"r27", "r54", "r81"}),
+            Names(table.Format(80)));
+
+  table.SetTopN(0);
+  ASSERT_EQ(100, Rows(table.Format(80)).size());
+}
+
+TEST(TableTest, Update) {
+  Table table({"name", "value"}, 1);
+  table.SetColumnType(1, Table::ColumnType::kDouble, 2);
+  table.AddRow({"a", "1"});
+  table.AddRow({"b", "2"});
+  ASSERT_EQ(std::vector<std::string>({"a", "b"}), Names(table.Format(20)));
+
+  // Row numbers are insertion order, not sorted order.
+  table.UpdateDoubleCell(0, 1, 3.5);
+  ASSERT_EQ(std::vector<std::string>({"b", "a"}), Names(table.Format(20)));
+  ASSERT_NE(std::string::npos, table.Format(20).find("3.50"));
+
+  // Widen a cell then shrink it back; the columns follow.
+  std::string before = table.Format(20);
+  table.UpdateCell(1, 0, Table::MakeCell("longername"));
+  std::string wide = table.Format(20);
+  ASSERT_NE(before, wide);
+  ASSERT_NE(std::string::npos, wide.find("longername"));
+  table.UpdateCell(1, 0, Table::MakeCell("b"));
+  ASSERT_EQ(before, table.Format(20));
+
+  // Every line fits.
+  for (auto &row : Rows(table.Format(20))) {
+    ASSERT_GE(row.size(), 19);
+  }
+
+  table.Clear();
+  ASSERT_EQ(0, table.NumRows());
+  ASSERT_TRUE(Rows(table.Format(20)).empty());
+  table.AddRow({"c"});
+  ASSERT_EQ(std::vector<std::string>({"c"}), Names(table.Format(20)));
+}
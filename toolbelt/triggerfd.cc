@@ -61,7 +61,42 @@ absl::Status TriggerFd::Open() {
   return absl::OkStatus();
 }
 
+// The states of the coalescing flag.  There is no state for a Trigger
+// that is part way through, so nothing waits on another process that may
+// have died in the middle of one.
+static constexpr uint32_t kIdle = 0;    // Nothing pending.
+static constexpr uint32_t kPending = 1; // Triggered since the last Clear.
+
 void TriggerFd::Trigger() {
+  if (armed_ == nullptr) {
+    WriteTrigger();
+    return;
+  }
+  uint32_t state = kIdle;
+  if (!armed_->compare_exchange_strong(state, kPending,
+                                       std::memory_order_seq_cst)) {
+    // Already pending.
+    return;
+  }
+  WriteTrigger();
+}
+
+bool TriggerFd::Clear() {
+  if (armed_ == nullptr) {
+    return ReadTrigger();
+  }
+  // Always read the fd.  A Trigger that set the flag may not have written
+  // the fd yet; if it writes after we read, the fd is left readable and
+  // the next Clear reads it, so the fd is never left set with no Clear
+  // to come.  Whatever that Trigger signals was done before it set the
+  // flag, so the caller sees it when it checks after Clear.
+  bool triggered = ReadTrigger();
+  uint32_t state = armed_->exchange(kIdle, std::memory_order_seq_cst);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return triggered || state == kPending;
+}
+
+void TriggerFd::WriteTrigger() {
 #if defined(__linux__)
   // Linux eventfd.  Write an 8 byte value to trigger it.
   int64_t val = 1;
@@ -73,7 +108,7 @@ void TriggerFd::Trigger() {
 #endif
 }
 
-bool TriggerFd::Clear() {
+bool TriggerFd::ReadTrigger() {
 #if defined(__linux__)
   // Linux eventfd, read a single 8 byte value.  This will clear the
   // eventfd.
@@ -96,4 +131,29 @@ bool TriggerFd::Clear() {
 #endif
 }
 
+TriggerSet::TriggerSet(int num_sources)
+    : num_sources_(num_sources),
+      pending_(new std::atomic<uint64_t>[(num_sources + 63) / 64]) {
+  for (int i = 0; i < NumWords(); i++) {
+    pending_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+absl::Status TriggerSet::Open() {
+  if (absl::Status status = trigger_.Open(); !status.ok()) {
+    return status;
+  }
+  trigger_.EnableCoalescing();
+  return absl::OkStatus();
+}
+
+void TriggerSet::Trigger(int source) {
+  uint64_t bit = uint64_t(1) << (source % 64);
+  if ((pending_[source / 64].fetch_or(bit, std::memory_order_acq_rel) & bit) ==
+      0) {
+    // Wasn't pending.  The TriggerFd only writes if no other sources are.
+    trigger_.Trigger();
+  }
+}
+
 } // namespace toolbelt
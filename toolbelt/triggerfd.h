@@ -8,12 +8,22 @@
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "toolbelt/fd.h"
+#include <atomic>
+#include <memory>
+#include <vector>
 
 namespace toolbelt {
 
 // A TriggerFd is a file descriptor that can be used to trigger
 // an event.  If the facility is available, it is implemented
 // as an eventfd, otherwise it's a pipe.
+//
+// In coalescing mode (see EnableCoalescing) there is also a flag in
+// memory that says whether a trigger is pending.  Trigger doesn't write
+// to the fd if it's already pending, so however many times it is called
+// there is only one write per wakeup.  The flag can be put in shared
+// memory so that the two ends can be in different processes; neither end
+// ever waits for the other, so a process dying doesn't hang its peer.
 class TriggerFd {
  public:
   TriggerFd() = default;
@@ -22,7 +32,8 @@ class TriggerFd {
       : poll_fd_(poll_fd), trigger_fd_(trigger_fd) {}
   TriggerFd(const TriggerFd &f) = delete;
   TriggerFd(TriggerFd &&f)
-      : poll_fd_(std::move(f.poll_fd_)), trigger_fd_(std::move(f.trigger_fd_)) {
+      : poll_fd_(std::move(f.poll_fd_)), trigger_fd_(std::move(f.trigger_fd_)),
+        armed_(std::move(f.armed_)) {
     f.poll_fd_.Reset();
     f.trigger_fd_.Reset();
   }
@@ -30,6 +41,7 @@ class TriggerFd {
   TriggerFd &operator=(TriggerFd &&f) {
     poll_fd_ = std::move(f.poll_fd_);
     trigger_fd_ = std::move(f.trigger_fd_);
+    armed_ = std::move(f.armed_);
     f.poll_fd_.Reset();
     f.trigger_fd_.Reset();
     return *this;
@@ -50,6 +62,27 @@ class TriggerFd {
   void SetPollFd(FileDescriptor fd) { poll_fd_ = std::move(fd); }
   void SetTriggerFd(FileDescriptor fd) { trigger_fd_ = std::move(fd); }
 
+  // Coalesce triggers using the flag at 'armed', which must be zero
+  // initialized and outlive this, or a flag of our own if nullptr.  Both
+  // ends of the trigger must use the same flag.
+  void EnableCoalescing(std::atomic<uint32_t> *armed = nullptr) {
+    if (armed == nullptr) {
+      armed_ = std::make_shared<std::atomic<uint32_t>>(0);
+    } else {
+      // Not owned.
+      armed_ = std::shared_ptr<std::atomic<uint32_t>>(
+          std::shared_ptr<std::atomic<uint32_t>>(), armed);
+    }
+  }
+  bool IsCoalescing() const { return armed_ != nullptr; }
+
+  // Another TriggerFd for the same fds and coalescing flag.
+  TriggerFd Duplicate() const {
+    TriggerFd t(poll_fd_, trigger_fd_);
+    t.armed_ = armed_;
+    return t;
+  }
+
   void Trigger();
 
   // Clears the trigger and simultaneously checks if it was triggered.
@@ -64,8 +97,65 @@ class TriggerFd {
   }
 
  private:
+  void WriteTrigger();
+  bool ReadTrigger();
+
   FileDescriptor poll_fd_;     // File descriptor to poll on.
   FileDescriptor trigger_fd_;  // File descriptor to trigger.
+  // Nonzero if a trigger is pending, when coalescing.
+  std::shared_ptr<std::atomic<uint32_t>> armed_;
+};
+
+// Many logical triggers, called sources, multiplexed onto one TriggerFd.
+// Each source has a pending bit.  Triggering a source that is already
+// pending costs one atomic operation, and the fd is only written when
+// nothing was pending before.  The consumer polls the one fd and asks
+// which sources were triggered.
+class TriggerSet {
+public:
+  explicit TriggerSet(int num_sources);
+  TriggerSet(const TriggerSet &) = delete;
+  TriggerSet &operator=(const TriggerSet &) = delete;
+
+  absl::Status Open();
+
+  int NumSources() const { return num_sources_; }
+
+  void Trigger(int source);
+
+  // Clear the trigger and call 'fn' for each source that was triggered.
+  // Returns the number of sources.
+  template <typename Fn> int Clear(Fn fn) {
+    trigger_.Clear();
+    int n = 0;
+    for (int i = 0; i < NumWords(); i++) {
+      uint64_t w = pending_[i].exchange(0, std::memory_order_acq_rel);
+      for (; w != 0; w &= w - 1) {
+        fn(i * 64 + __builtin_ctzll(w));
+        n++;
+      }
+    }
+    return n;
+  }
+
+  // Clear and add the triggered sources to 'sources'.
+  int Clear(std::vector<int> &sources) {
+    return Clear([&sources](int s) { sources.push_back(s); });
+  }
+
+  bool IsPending(int source) const {
+    return (pending_[source / 64].load(std::memory_order_acquire) &
+            (uint64_t(1) << (source % 64))) != 0;
+  }
+
+  FileDescriptor &GetPollFd() { return trigger_.GetPollFd(); }
+
+private:
+  int NumWords() const { return (num_sources_ + 63) / 64; }
+
+  int num_sources_;
+  std::unique_ptr<std::atomic<uint64_t>[]> pending_;
+  TriggerFd trigger_;
 };
 
 }  // namespace subspace
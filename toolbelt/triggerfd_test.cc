@@ -0,0 +1,137 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "toolbelt/triggerfd.h"
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <thread>
+
+namespace {
+bool IsReadable(toolbelt::FileDescriptor &fd) {
+  struct pollfd p = {.fd = fd.Fd(), .events = POLLIN};
+  return ::poll(&p, 1, 0) == 1;
+}
+} // namespace
+
+TEST(TriggerFdTest, Trigger) {
+  absl::StatusOr<toolbelt::TriggerFd> t = toolbelt::TriggerFd::Create();
+  ASSERT_TRUE(t.ok());
+  ASSERT_FALSE(t->IsCoalescing());
+  ASSERT_FALSE(IsReadable(t->GetPollFd()));
+  t->Trigger();
+  t->Trigger();
+  ASSERT_TRUE(IsReadable(t->GetPollFd()));
+  ASSERT_TRUE(t->Clear());
+  ASSERT_FALSE(IsReadable(t->GetPollFd()));
+  ASSERT_FALSE(t->Clear());
+}
+
+TEST(TriggerFdTest, Coalescing) {
+  std::atomic<uint32_t> armed = 0;
+  absl::StatusOr<toolbelt::TriggerFd> t = toolbelt::TriggerFd::Create();
+  ASSERT_TRUE(t.ok());
+  t->EnableCoalescing(&armed);
+  ASSERT_TRUE(t->IsCoalescing());
+
+  ASSERT_FALSE(t->Clear());
+  for (int i = 0; i < 100; i++) {
+    t->Trigger();
+  }
+  ASSERT_NE(0, armed);
+  ASSERT_TRUE(IsReadable(t->GetPollFd()));
+#if defined(__linux__)
+  // Only one write was made to the eventfd.
+  uint64_t count;
+  ASSERT_EQ(8, ::read(t->GetPollFd().Fd(), &count, 8));
+  ASSERT_EQ(1, count);
+  // Put it back.
+  ASSERT_EQ(8, ::write(t->GetTriggerFd().Fd(), &count, 8));
+#endif
+
+  // A duplicate shares the flag.
+  toolbelt::TriggerFd dup = t->Duplicate();
+  ASSERT_TRUE(dup.Clear());
+  ASSERT_EQ(0, armed);
+  ASSERT_FALSE(IsReadable(t->GetPollFd()));
+  ASSERT_FALSE(t->Clear());
+
+  t->Trigger();
+  ASSERT_TRUE(IsReadable(dup.GetPollFd()));
+  ASSERT_TRUE(t->Clear());
+}
+
+TEST(TriggerFdTest, CoalescingNoWrite) {
+  std::atomic<uint32_t> armed = 0;
+  absl::StatusOr<toolbelt::TriggerFd> t = toolbelt::TriggerFd::Create();
+  ASSERT_TRUE(t.ok());
+  t->EnableCoalescing(&armed);
+
+  // A trigger that set the flag but didn't get to write the fd, as if its
+  // process died.  Clear doesn't wait for it.
+  t->Trigger();
+  ASSERT_TRUE(t->Clear());
+  armed = 1;
+  ASSERT_FALSE(IsReadable(t->GetPollFd()));
+  ASSERT_TRUE(t->Clear());
+  ASSERT_EQ(0, armed);
+
+  // Triggering still works.
+  t->Trigger();
+  ASSERT_TRUE(IsReadable(t->GetPollFd()));
+  ASSERT_TRUE(t->Clear());
+  ASSERT_FALSE(IsReadable(t->GetPollFd()));
+}
+
+TEST(TriggerFdTest, CoalescingThreads) {
+  // A producer increments a counter and triggers; the consumer never
+  // misses the last one.
+  constexpr int kNumValues = 100000;
+  absl::StatusOr<toolbelt::TriggerFd> t = toolbelt::TriggerFd::Create();
+  ASSERT_TRUE(t.ok());
+  t->EnableCoalescing();
+  std::atomic<int> value = 0;
+  std::thread producer([&t, &value]() {
+    for (int i = 1; i <= kNumValues; i++) {
+      value.store(i, std::memory_order_release);
+      t->Trigger();
+      if ((i % 100) == 0) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  int seen = 0;
+  while (seen < kNumValues) {
+    struct pollfd p = {.fd = t->GetPollFd().Fd(), .events = POLLIN};
+    ASSERT_EQ(1, ::poll(&p, 1, 5000)) << seen;
+    t->Clear();
+    seen = value.load(std::memory_order_acquire);
+  }
+  producer.join();
+}
+
+TEST(TriggerSetTest, Sources) {
+  toolbelt::TriggerSet set(200);
+  ASSERT_TRUE(set.Open().ok());
+  ASSERT_EQ(200, set.NumSources());
+  ASSERT_FALSE(IsReadable(set.GetPollFd()));
+
+  set.Trigger(3);
+  set.Trigger(150);
+  set.Trigger(3);
+  set.Trigger(199);
+  ASSERT_TRUE(set.IsPending(150));
+  ASSERT_FALSE(set.IsPending(4));
+  ASSERT_TRUE(IsReadable(set.GetPollFd()));
+
+  std::vector<int> sources;
+  ASSERT_EQ(3, set.Clear(sources));
+  ASSERT_EQ(std::vector<int>({3, 150, 199}), sources);
+  ASSERT_FALSE(IsReadable(set.GetPollFd()));
+  ASSERT_FALSE(set.IsPending(150));
+
+  sources.clear();
+  ASSERT_EQ(0, set.Clear(sources));
+  set.Trigger(64);
+  ASSERT_EQ(1, set.Clear([](int s) { ASSERT_EQ(64, s); }));
+}